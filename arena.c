@@ -0,0 +1,144 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mach/vm_statistics.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+#include "log.h"
+
+#define SUPERPAGE_SIZE (2 * 1024 * 1024)
+
+// The free buffers of one size, linked through their first bytes
+struct arena_class {
+  size_t len;
+  void *free;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  uint8_t *base; // NULL without --buffer-memory
+  size_t size;
+  size_t used;
+  size_t in_use;
+  uint64_t fallbacks;
+  size_t page_size;
+  bool superpages;
+  bool locked;
+  struct arena_class classes[ARENA_MAX_CLASSES];
+  size_t class_count;
+} arena = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static size_t round_up(size_t n, size_t unit) { return (n + unit - 1) / unit * unit; }
+
+int arena_init(size_t size, bool lock) {
+  arena.page_size = (size_t)getpagesize();
+  void *map = MAP_FAILED;
+#ifdef VM_FLAGS_SUPERPAGE_SIZE_2MB
+  // Only on Intel; Apple silicon has 16 KiB pages but no superpages.
+  map = mmap(NULL, round_up(size, SUPERPAGE_SIZE), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON,
+             VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
+  if (map != MAP_FAILED) {
+    size = round_up(size, SUPERPAGE_SIZE);
+    arena.superpages = true;
+  }
+#endif
+  if (map == MAP_FAILED) {
+    size = round_up(size, arena.page_size);
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (map == MAP_FAILED) {
+      ERRORN("mmap");
+      return -1;
+    }
+  }
+  if (lock) {
+    if (mlock(map, size) == -1) {
+      ERRORF("Failed to lock %zu bytes of buffer memory: %s", size, strerror(errno));
+      munmap(map, size);
+      return -1;
+    }
+    arena.locked = true;
+  }
+  arena.base = map;
+  arena.size = size;
+  INFOF("Buffer memory: %zu KiB%s%s", size / 1024, arena.superpages ? ", superpages" : "",
+        arena.locked ? ", locked" : "");
+  return 0;
+}
+
+static struct arena_class *arena_class(size_t len) {
+  for (size_t i = 0; i < arena.class_count; i++) {
+    if (arena.classes[i].len == len)
+      return &arena.classes[i];
+  }
+  if (arena.class_count == ARENA_MAX_CLASSES)
+    return NULL;
+  struct arena_class *c = &arena.classes[arena.class_count++];
+  c->len = len;
+  c->free = NULL;
+  return c;
+}
+
+void *arena_alloc(size_t len) {
+  void *buf = NULL;
+  if (arena.base == NULL)
+    goto fallback;
+  len = round_up(len, arena.page_size);
+  pthread_mutex_lock(&arena.lock);
+  struct arena_class *c = arena_class(len);
+  if (c != NULL && c->free != NULL) {
+    buf = c->free;
+    memcpy(&c->free, buf, sizeof(void *));
+  } else if (c != NULL && arena.size - arena.used >= len) {
+    buf = arena.base + arena.used;
+    arena.used += len;
+  } else {
+    arena.fallbacks++;
+  }
+  if (buf != NULL)
+    arena.in_use += len;
+  pthread_mutex_unlock(&arena.lock);
+  if (buf != NULL)
+    return buf;
+fallback:
+  if (posix_memalign(&buf, (size_t)getpagesize(), len) != 0) {
+    ERRORN("posix_memalign");
+    return NULL;
+  }
+  return buf;
+}
+
+void arena_free(void *buf, size_t len) {
+  if (buf == NULL)
+    return;
+  if (arena.base == NULL || (uint8_t *)buf < arena.base ||
+      (uint8_t *)buf >= arena.base + arena.size) {
+    free(buf);
+    return;
+  }
+  len = round_up(len, arena.page_size);
+  pthread_mutex_lock(&arena.lock);
+  // The class exists: buf was carved for it.
+  struct arena_class *c = arena_class(len);
+  memcpy(buf, &c->free, sizeof(void *));
+  c->free = buf;
+  arena.in_use -= len;
+  pthread_mutex_unlock(&arena.lock);
+}
+
+void arena_get_stats(struct arena_stats *stats) {
+  pthread_mutex_lock(&arena.lock);
+  stats->size = arena.size;
+  stats->used = arena.used;
+  stats->in_use = arena.in_use;
+  stats->fallbacks = arena.fallbacks;
+  stats->superpages = arena.superpages;
+  stats->locked = arena.locked;
+  pthread_mutex_unlock(&arena.lock);
+}
@@ -0,0 +1,40 @@
+#ifndef SOCKET_VMNET_ARENA_H
+#define SOCKET_VMNET_ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Packet buffer memory (--buffer-memory): one page-aligned region, mapped at
+// startup with superpages where the hardware allows, from which the receive
+// and transmit buffers, the egress rings, and the vmnet batches are carved.
+// Freed buffers are kept for the next allocation of the same size, so the
+// region only ever grows into pages that stay mapped: the hot path neither
+// calls malloc nor takes page faults once warm. Without it, or once it is
+// full, the buffers come from malloc.
+
+// Distinct buffer sizes; a size beyond them is served by malloc.
+#define ARENA_MAX_CLASSES 16
+
+struct arena_stats {
+  size_t size;        // 0 without --buffer-memory
+  size_t used;        // carved from the region, including the free buffers
+  size_t in_use;      // allocated now
+  uint64_t fallbacks; // allocations served by malloc
+  bool superpages;
+  bool locked;
+};
+
+// Maps a region of size bytes. With lock, every page is wired, and faulted in
+// now. Returns -1 on error.
+int arena_init(size_t size, bool lock);
+
+// Returns a page-aligned buffer of len bytes, or NULL on error. Thread-safe.
+void *arena_alloc(size_t len);
+
+// Frees buf, of len bytes as allocated. buf may be NULL. Thread-safe.
+void arena_free(void *buf, size_t len);
+
+void arena_get_stats(struct arena_stats *stats);
+
+#endif /* SOCKET_VMNET_ARENA_H */
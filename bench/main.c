@@ -0,0 +1,670 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <libproc.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../tools/common.h"
+
+// Load generator for socket_vmnet: every connection pretends to be a VM with
+// its own MAC address, and sends frames to the next connection. This measures
+// the VM-to-VM path of the daemon without running any VM.
+//
+// With -g, the path toward vmnet is measured instead: the first connection
+// pings the gateway (the host), while the others send UDP to it as fast as
+// they can, so that the ping latency shows how the daemon shares vmnet.
+//
+// With -R, the VM-to-VM path is measured at several rates in turn, showing the
+// frames per second against the latency, e.g., to see what --coalesce costs.
+//
+// With -C, the connections are opened all at once instead, and every new one
+// sends a single frame to the first one: the delay until it arrives shows how
+// fast the daemon accepts a burst of VMs.
+
+#define ETHERTYPE_BENCH 0x88B5 // IEEE 802 local experimental
+#define BENCH_MAGIC 0x424E4348 // "BNCH"
+
+struct bench_payload {
+  uint32_t magic;
+  uint32_t sender;
+  uint64_t seq;
+  uint64_t sent_ns;
+};
+
+#define FRAME_MIN_LEN (14 + sizeof(struct bench_payload))
+
+#define ETHERTYPE_ARP 0x0806
+#define ETHERTYPE_IP 0x0800
+#define ARP_FRAME_LEN (14 + 28)
+#define IP_HDR_LEN 20
+#define ICMP_HDR_LEN 8
+#define UDP_HDR_LEN 8
+#define UDP_DISCARD_PORT 9
+// Ethernet, IPv4, ICMP or UDP, then the payload
+#define GATEWAY_FRAME_MIN_LEN (14 + IP_HDR_LEN + 8 + sizeof(struct bench_payload))
+
+struct peer {
+  int fd;
+  int index;
+  uint8_t mac[6];
+  struct in_addr addr; // with -g
+  pthread_mutex_t write_lock; // the receiver answers ARP requests with -g
+  pthread_t sender, receiver;
+  uint64_t sent;
+  _Atomic uint64_t received;
+};
+
+static struct {
+  int count;
+  int seconds;
+  size_t frame_size;
+  long rate;
+  struct peer *peers;
+  struct hist latency;
+  atomic_bool stop;
+  // -g: ping the gateway from the first connection, under the load of the
+  // others
+  bool gateway_mode;
+  struct in_addr gateway;
+  struct in_addr first_addr;
+  int dscp; // of the pings
+  uint8_t gateway_mac[6];
+  atomic_bool gateway_resolved;
+  // -C: measure accepting the connections; -p: the memory and the page faults
+  // of the daemon
+  bool connect_mode;
+  pid_t daemon_pid;
+  // -R: the rates to measure in turn, comma-separated
+  char *sweep_rates;
+} bench = {
+    .count = 2,
+    .seconds = 10,
+    .frame_size = 1514,
+};
+
+static void build_frame(uint8_t *buf, const uint8_t *dest, const uint8_t *src) {
+  memcpy(buf, dest, 6);
+  memcpy(buf + 6, src, 6);
+  buf[12] = ETHERTYPE_BENCH >> 8;
+  buf[13] = ETHERTYPE_BENCH & 0xFF;
+}
+
+static uint16_t ip_checksum(const uint8_t *data, size_t len) {
+  uint32_t sum = 0;
+  for (size_t i = 0; i + 1 < len; i += 2)
+    sum += (uint32_t)(data[i] << 8 | data[i + 1]);
+  if (len % 2 != 0)
+    sum += (uint32_t)(data[len - 1] << 8);
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return (uint16_t)~sum;
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v & 0xFF;
+}
+
+// Builds an Ethernet frame carrying an IPv4 packet of len bytes in total,
+// without the checksum of the payload.
+static void build_ipv4(uint8_t *frame, const struct peer *peer, uint8_t proto, uint8_t dscp,
+                       size_t len) {
+  memcpy(frame, bench.gateway_mac, 6);
+  memcpy(frame + 6, peer->mac, 6);
+  put16(frame + 12, ETHERTYPE_IP);
+  uint8_t *ip = frame + 14;
+  memset(ip, 0, IP_HDR_LEN);
+  ip[0] = 0x45;
+  ip[1] = (uint8_t)(dscp << 2);
+  put16(ip + 2, (uint16_t)(len - 14));
+  ip[8] = 64; // TTL
+  ip[9] = proto;
+  memcpy(ip + 12, &peer->addr, 4);
+  memcpy(ip + 16, &bench.gateway, 4);
+  put16(ip + 10, ip_checksum(ip, IP_HDR_LEN));
+}
+
+static void build_arp(uint8_t *frame, uint16_t op, const uint8_t *src_mac, struct in_addr src_ip,
+                      const uint8_t *dst_mac, struct in_addr dst_ip) {
+  static const uint8_t broadcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+  memcpy(frame, op == 1 ? broadcast : dst_mac, 6);
+  memcpy(frame + 6, src_mac, 6);
+  put16(frame + 12, ETHERTYPE_ARP);
+  uint8_t *arp = frame + 14;
+  put16(arp, 1);                // Ethernet
+  put16(arp + 2, ETHERTYPE_IP); // IPv4
+  arp[4] = 6;
+  arp[5] = 4;
+  put16(arp + 6, op);
+  memcpy(arp + 8, src_mac, 6);
+  memcpy(arp + 14, &src_ip, 4);
+  memcpy(arp + 18, dst_mac, 6);
+  memcpy(arp + 24, &dst_ip, 4);
+}
+
+static int send_frame(struct peer *peer, const uint8_t *frame, size_t len) {
+  pthread_mutex_lock(&peer->write_lock);
+  int ret = write_frame(peer->fd, frame, len);
+  pthread_mutex_unlock(&peer->write_lock);
+  return ret;
+}
+
+static void *sender_main(void *arg) {
+  struct peer *peer = arg;
+  struct peer *dest = &bench.peers[(peer->index + 1) % bench.count];
+  static const uint8_t unknown[6] = {0x02, 0xBE, 0xEF, 0xFF, 0xFF, 0xFF};
+  uint8_t frame[MAX_FRAME_LEN] = {0};
+  size_t len = bench.frame_size;
+  // The payload follows the ICMP or UDP header in gateway mode.
+  size_t payload_off = 14;
+  bool probe = bench.gateway_mode && peer->index == 0;
+  if (probe) {
+    len = GATEWAY_FRAME_MIN_LEN;
+    payload_off = 14 + IP_HDR_LEN + ICMP_HDR_LEN;
+    build_ipv4(frame, peer, IPPROTO_ICMP, bench.dscp, len);
+    frame[payload_off - ICMP_HDR_LEN] = 8; // echo request
+    put16(frame + payload_off - 4, (uint16_t)peer->index);
+  } else if (bench.gateway_mode) {
+    payload_off = 14 + IP_HDR_LEN + UDP_HDR_LEN;
+    build_ipv4(frame, peer, IPPROTO_UDP, 0, len);
+    uint8_t *udp = frame + payload_off - UDP_HDR_LEN;
+    put16(udp, UDP_DISCARD_PORT);
+    put16(udp + 2, UDP_DISCARD_PORT);
+    put16(udp + 4, (uint16_t)(len - payload_off + UDP_HDR_LEN));
+    // No UDP checksum
+  } else {
+    // A single connection sends to an unknown address, i.e., to vmnet.
+    build_frame(frame, bench.count > 1 ? dest->mac : unknown, peer->mac);
+  }
+  // In gateway mode, only the pings are paced.
+  long rate = bench.gateway_mode && !probe ? 0 : bench.rate;
+  uint64_t interval_ns = rate > 0 ? 1000000000 / rate : 0;
+  uint64_t next = hist_now();
+  while (!atomic_load(&bench.stop)) {
+    if (interval_ns > 0) {
+      uint64_t now = hist_now();
+      if (now < next) {
+        struct timespec ts = {.tv_sec = 0, .tv_nsec = next - now};
+        nanosleep(&ts, NULL);
+      }
+      next += interval_ns;
+    }
+    struct bench_payload payload = {
+        .magic = BENCH_MAGIC,
+        .sender = peer->index,
+        .seq = peer->sent,
+        .sent_ns = hist_now(),
+    };
+    memcpy(frame + payload_off, &payload, sizeof(payload));
+    if (probe) {
+      uint8_t *icmp = frame + payload_off - ICMP_HDR_LEN;
+      put16(icmp + 6, (uint16_t)peer->sent);
+      put16(icmp + 2, 0);
+      put16(icmp + 2, ip_checksum(icmp, len - (payload_off - ICMP_HDR_LEN)));
+    }
+    if (send_frame(peer, frame, len) < 0) {
+      perror("write");
+      break;
+    }
+    peer->sent++;
+  }
+  return NULL;
+}
+
+// Handles a frame received in gateway mode: ARP, and the ping replies.
+static void on_gateway_frame(struct peer *peer, const uint8_t *frame, uint32_t len) {
+  uint16_t type = (uint16_t)(frame[12] << 8 | frame[13]);
+  if (type == ETHERTYPE_ARP && len >= ARP_FRAME_LEN) {
+    const uint8_t *arp = frame + 14;
+    uint16_t op = (uint16_t)(arp[6] << 8 | arp[7]);
+    struct in_addr sender, target;
+    memcpy(&sender, arp + 14, 4);
+    memcpy(&target, arp + 24, 4);
+    if (op == 2 && sender.s_addr == bench.gateway.s_addr &&
+        !atomic_load(&bench.gateway_resolved)) {
+      memcpy(bench.gateway_mac, arp + 8, 6);
+      atomic_store(&bench.gateway_resolved, true);
+    } else if (op == 1 && target.s_addr == peer->addr.s_addr) {
+      uint8_t reply[ARP_FRAME_LEN];
+      build_arp(reply, 2, peer->mac, peer->addr, arp + 8, sender);
+      send_frame(peer, reply, sizeof(reply));
+    }
+    return;
+  }
+  size_t payload_off = 14 + IP_HDR_LEN + ICMP_HDR_LEN;
+  if (type != ETHERTYPE_IP || len < GATEWAY_FRAME_MIN_LEN || frame[14] != 0x45 ||
+      frame[14 + 9] != IPPROTO_ICMP || frame[14 + IP_HDR_LEN] != 0) // echo reply
+    return;
+  struct bench_payload payload;
+  memcpy(&payload, frame + payload_off, sizeof(payload));
+  if (payload.magic != BENCH_MAGIC)
+    return;
+  atomic_fetch_add_explicit(&peer->received, 1, memory_order_relaxed);
+  hist_record(&bench.latency, hist_now() - payload.sent_ns);
+}
+
+static void *receiver_main(void *arg) {
+  struct peer *peer = arg;
+  uint8_t frame[MAX_FRAME_LEN];
+  for (;;) {
+    uint32_t header_be;
+    if (read_all(peer->fd, &header_be, 4) < 0)
+      break;
+    uint32_t len = ntohl(header_be);
+    if (len > MAX_FRAME_LEN || read_all(peer->fd, frame, len) < 0)
+      break;
+    if (bench.gateway_mode) {
+      on_gateway_frame(peer, frame, len);
+      continue;
+    }
+    // Ignore the traffic of the host, and the address announcements.
+    struct bench_payload payload;
+    if (len < FRAME_MIN_LEN || frame[12] != ETHERTYPE_BENCH >> 8 ||
+        frame[13] != (ETHERTYPE_BENCH & 0xFF) || (frame[0] & 0x01) != 0)
+      continue;
+    memcpy(&payload, frame + 14, sizeof(payload));
+    if (payload.magic != BENCH_MAGIC)
+      continue;
+    atomic_fetch_add_explicit(&peer->received, 1, memory_order_relaxed);
+    hist_record(&bench.latency, hist_now() - payload.sent_ns);
+  }
+  return NULL;
+}
+
+// Connects like connect_socket, retrying while the backlog of the daemon is
+// full. Counts the retries in *refused.
+static int connect_retry(const char *socket_path, uint64_t *refused) {
+  struct sockaddr_un addr = {0};
+  addr.sun_family = PF_LOCAL;
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+  uint64_t deadline = hist_now() + 10 * 1000000000ULL;
+  for (;;) {
+    int fd = socket(PF_LOCAL, SOCK_STREAM, 0);
+    if (fd < 0) {
+      perror("socket");
+      return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+      return fd;
+    int err = errno;
+    close(fd);
+    if ((err != ECONNREFUSED && err != EAGAIN) || hist_now() > deadline) {
+      fprintf(stderr, "Failed to connect to \"%s\": %s\n", socket_path, strerror(err));
+      return -1;
+    }
+    (*refused)++;
+    usleep(1000);
+  }
+}
+
+// Reads the task info of the daemon. Returns false if unknown.
+static bool daemon_task_info(struct proc_taskinfo *ti) {
+  return bench.daemon_pid > 0 &&
+         proc_pidinfo(bench.daemon_pid, PROC_PIDTASKINFO, 0, ti, sizeof(*ti)) == sizeof(*ti);
+}
+
+// Returns the resident size of the daemon in bytes, or 0 if unknown.
+static uint64_t daemon_resident_size(void) {
+  struct proc_taskinfo ti;
+  return daemon_task_info(&ti) ? ti.pti_resident_size : 0;
+}
+
+// Prints the page faults of the daemon since before, frames being the frames
+// sent meanwhile.
+static void print_daemon_faults(const struct proc_taskinfo *before, uint64_t frames) {
+  struct proc_taskinfo after;
+  if (!daemon_task_info(&after)) {
+    printf("faults:   unknown, run as root\n");
+    return;
+  }
+  int32_t faults = after.pti_faults - before->pti_faults;
+  printf("faults:   %d page faults, %d page-ins, %.1f faults per million frames\n", faults,
+         after.pti_pageins - before->pti_pageins, frames > 0 ? faults * 1e6 / frames : 0.0);
+}
+
+static void raise_nofile_limit(rlim_t want) {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < want) {
+    rl.rlim_cur = want < rl.rlim_max ? want : rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+static int connect_main(const char *socket_path) {
+  raise_nofile_limit((rlim_t)bench.count + 64);
+  struct proc_taskinfo task_before;
+  bool task_known = daemon_task_info(&task_before);
+  uint64_t rss_before = task_known ? task_before.pti_resident_size : 0;
+  struct hist connect_latency = {0};
+  uint64_t refused = 0;
+
+  // The first connection receives a frame from every other one.
+  struct peer *first = &bench.peers[0];
+  first->fd = connect_socket(socket_path);
+  if (first->fd < 0)
+    return EXIT_FAILURE;
+  static const uint8_t broadcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+  uint8_t frame[FRAME_MIN_LEN] = {0};
+  build_frame(frame, broadcast, first->mac);
+  if (send_frame(first, frame, sizeof(frame)) < 0) {
+    perror("write");
+    return EXIT_FAILURE;
+  }
+  pthread_create(&first->receiver, NULL, receiver_main, first);
+  usleep(200 * 1000);
+
+  uint64_t start = hist_now();
+  for (int i = 1; i < bench.count; i++) {
+    struct peer *peer = &bench.peers[i];
+    uint64_t connect_start = hist_now();
+    peer->fd = connect_retry(socket_path, &refused);
+    if (peer->fd < 0)
+      return EXIT_FAILURE;
+    hist_record(&connect_latency, hist_now() - connect_start);
+    struct bench_payload payload = {
+        .magic = BENCH_MAGIC,
+        .sender = i,
+        .sent_ns = connect_start,
+    };
+    build_frame(frame, first->mac, peer->mac);
+    memcpy(frame + 14, &payload, sizeof(payload));
+    if (send_frame(peer, frame, sizeof(frame)) < 0) {
+      perror("write");
+      return EXIT_FAILURE;
+    }
+  }
+  double connect_time = (hist_now() - start) / 1e9;
+  uint64_t expected = bench.count - 1;
+  uint64_t deadline = hist_now() + 10 * 1000000000ULL;
+  while (atomic_load(&first->received) < expected && hist_now() < deadline)
+    usleep(1000);
+  double served_time = (hist_now() - start) / 1e9;
+  uint64_t served = atomic_load(&first->received);
+  uint64_t rss_after = daemon_resident_size();
+
+  printf("connections: %d, connected in %.3f s, %llu refused and retried\n", bench.count,
+         connect_time, (unsigned long long)refused);
+  print_latency("connect:", &connect_latency);
+  printf("served:   %llu of %llu in %.3f s\n", (unsigned long long)served,
+         (unsigned long long)expected, served_time);
+  print_latency("accept:", &bench.latency);
+  if (rss_before > 0 && rss_after > 0) {
+    printf("memory:   %llu KiB before, %llu KiB after, %.1f KiB per connection\n",
+           (unsigned long long)rss_before / 1024, (unsigned long long)rss_after / 1024,
+           ((double)rss_after - (double)rss_before) / 1024 / bench.count);
+  } else if (bench.daemon_pid > 0) {
+    printf("memory:   unknown, run as root\n");
+  }
+  if (task_known)
+    print_daemon_faults(&task_before, bench.count);
+
+  shutdown(first->fd, SHUT_RDWR);
+  pthread_join(first->receiver, NULL);
+  for (int i = 0; i < bench.count; i++)
+    close(bench.peers[i].fd);
+  return served == expected ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Runs the senders for bench.seconds at each rate of -R in turn.
+static void sweep_main(void) {
+  printf("connections: %d, frame size: %zu bytes, time: %d s per rate\n", bench.count,
+         bench.frame_size, bench.seconds);
+  printf("%10s %12s %12s %10s %10s %10s %10s\n", "rate", "sent/s", "received/s", "p50_us",
+         "p90_us", "p99_us", "max_us");
+  char *save = NULL;
+  for (char *tok = strtok_r(bench.sweep_rates, ",", &save); tok != NULL;
+       tok = strtok_r(NULL, ",", &save)) {
+    bench.rate = atol(tok);
+    hist_reset(&bench.latency);
+    for (int i = 0; i < bench.count; i++) {
+      bench.peers[i].sent = 0;
+      atomic_store(&bench.peers[i].received, 0);
+    }
+    atomic_store(&bench.stop, false);
+    uint64_t start = hist_now();
+    for (int i = 0; i < bench.count; i++)
+      pthread_create(&bench.peers[i].sender, NULL, sender_main, &bench.peers[i]);
+    sleep(bench.seconds);
+    atomic_store(&bench.stop, true);
+    for (int i = 0; i < bench.count; i++)
+      pthread_join(bench.peers[i].sender, NULL);
+    double elapsed = (hist_now() - start) / 1e9;
+    // Let the frames in flight arrive, before the next rate.
+    usleep(500 * 1000);
+    uint64_t sent = 0, received = 0;
+    for (int i = 0; i < bench.count; i++) {
+      sent += bench.peers[i].sent;
+      received += atomic_load(&bench.peers[i].received);
+    }
+    char rate[24];
+    if (bench.rate > 0)
+      snprintf(rate, sizeof(rate), "%ld", bench.rate);
+    else
+      snprintf(rate, sizeof(rate), "unlimited");
+    struct hist_summary latency;
+    hist_summarize(&bench.latency, &latency);
+    printf("%10s %12.0f %12.0f %10.1f %10.1f %10.1f %10.1f\n", rate, sent / elapsed,
+           received / elapsed, latency.p50 / 1e3, latency.p90 / 1e3, latency.p99 / 1e3,
+           latency.max / 1e3);
+    fflush(stdout);
+  }
+}
+
+static void print_usage(const char *argv0) {
+  printf("Usage: %s [OPTION]... SOCKET\n", argv0);
+  printf("Load generator for socket_vmnet, measuring the VM-to-VM path.\n");
+  printf("\n");
+  printf("-g GATEWAY  measure the path to vmnet instead: the first connection pings "
+         "GATEWAY at RATE,\n");
+  printf("            the others send UDP to it as fast as possible\n");
+  printf("-a ADDRESS  IPv4 address of the first connection with -g, the next ones follow\n");
+  printf("            (default: GATEWAY + 100)\n");
+  printf("-d DSCP     DSCP of the pings, e.g., 46 for EF (default: 0)\n");
+  printf("-C          measure accepting the connections instead: open them all at once, "
+         "and time\n");
+  printf("            the first frame of each one\n");
+  printf("-p PID      report the page faults of the socket_vmnet process PID, and its memory "
+         "with -C\n");
+  printf("            (requires root)\n");
+  printf("-c COUNT    number of connections (default: 2)\n");
+  printf("-t SECONDS  time in seconds to transmit for (default: 10)\n");
+  printf("-s SIZE     frame size in bytes (default: 1514)\n");
+  printf("-r RATE     frames per second per connection, 0 for unlimited (default: 0)\n");
+  printf("-R RATES    measure at each of the comma-separated RATES in turn, e.g., "
+         "\"1000,10000,0\"\n");
+  printf("-h          display this help and exit\n");
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "c:t:s:r:R:g:a:d:Cp:h")) != -1) {
+    switch (opt) {
+    case 'c':
+      bench.count = atoi(optarg);
+      break;
+    case 't':
+      bench.seconds = atoi(optarg);
+      break;
+    case 's':
+      bench.frame_size = strtoul(optarg, NULL, 10);
+      break;
+    case 'r':
+      bench.rate = atol(optarg);
+      break;
+    case 'R':
+      bench.sweep_rates = optarg;
+      break;
+    case 'g':
+      if (inet_pton(AF_INET, optarg, &bench.gateway) != 1) {
+        fprintf(stderr, "Invalid gateway \"%s\"\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      bench.gateway_mode = true;
+      break;
+    case 'a':
+      if (inet_pton(AF_INET, optarg, &bench.first_addr) != 1) {
+        fprintf(stderr, "Invalid address \"%s\"\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'd':
+      bench.dscp = atoi(optarg);
+      break;
+    case 'C':
+      bench.connect_mode = true;
+      break;
+    case 'p':
+      bench.daemon_pid = atoi(optarg);
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      exit(EXIT_SUCCESS);
+    default:
+      print_usage(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (argc - optind != 1 || bench.count < 1 || bench.seconds < 1 ||
+      bench.frame_size < FRAME_MIN_LEN || bench.frame_size > MAX_FRAME_LEN ||
+      (bench.gateway_mode && bench.frame_size < GATEWAY_FRAME_MIN_LEN) || bench.dscp < 0 ||
+      bench.dscp > 63 ||
+      (bench.sweep_rates != NULL &&
+       (bench.gateway_mode || bench.connect_mode || bench.count < 2))) {
+    print_usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  const char *socket_path = argv[optind];
+  if (bench.gateway_mode && bench.first_addr.s_addr == 0)
+    bench.first_addr.s_addr = htonl(ntohl(bench.gateway.s_addr) + 100);
+  if (bench.gateway_mode && bench.rate == 0)
+    bench.rate = 1000;
+
+  bench.peers = calloc(bench.count, sizeof(*bench.peers));
+  if (bench.peers == NULL) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < bench.count; i++) {
+    struct peer *peer = &bench.peers[i];
+    peer->index = i;
+    pthread_mutex_init(&peer->write_lock, NULL);
+    uint8_t mac[6] = {0x02, 0xBE, 0xEF, 0x00, (uint8_t)(i >> 8), (uint8_t)i};
+    memcpy(peer->mac, mac, 6);
+    peer->addr.s_addr = htonl(ntohl(bench.first_addr.s_addr) + i);
+    peer->fd = -1;
+  }
+  if (bench.connect_mode) {
+    int rc = connect_main(socket_path);
+    free(bench.peers);
+    return rc;
+  }
+
+  for (int i = 0; i < bench.count; i++) {
+    struct peer *peer = &bench.peers[i];
+    peer->fd = connect_socket(socket_path);
+    if (peer->fd < 0)
+      exit(EXIT_FAILURE);
+  }
+
+  // Announce the addresses so that the daemon does not flood.
+  static const uint8_t broadcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+  for (int i = 0; i < bench.count; i++) {
+    uint8_t frame[FRAME_MIN_LEN] = {0};
+    build_frame(frame, broadcast, bench.peers[i].mac);
+    if (send_frame(&bench.peers[i], frame, sizeof(frame)) < 0) {
+      perror("write");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (int i = 0; i < bench.count; i++)
+    pthread_create(&bench.peers[i].receiver, NULL, receiver_main, &bench.peers[i]);
+  usleep(200 * 1000);
+
+  if (bench.gateway_mode) {
+    static const uint8_t zero[6] = {0};
+    uint8_t frame[ARP_FRAME_LEN];
+    build_arp(frame, 1, bench.peers[0].mac, bench.peers[0].addr, zero, bench.gateway);
+    for (int i = 0; i < 20 && !atomic_load(&bench.gateway_resolved); i++) {
+      if (i % 5 == 0 && send_frame(&bench.peers[0], frame, sizeof(frame)) < 0) {
+        perror("write");
+        exit(EXIT_FAILURE);
+      }
+      usleep(100 * 1000);
+    }
+    if (!atomic_load(&bench.gateway_resolved)) {
+      fprintf(stderr, "No ARP reply from the gateway %s\n", inet_ntoa(bench.gateway));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (bench.sweep_rates != NULL) {
+    sweep_main();
+    for (int i = 0; i < bench.count; i++) {
+      shutdown(bench.peers[i].fd, SHUT_RDWR);
+      pthread_join(bench.peers[i].receiver, NULL);
+      close(bench.peers[i].fd);
+    }
+    free(bench.peers);
+    return 0;
+  }
+
+  struct proc_taskinfo task_before;
+  bool task_known = daemon_task_info(&task_before);
+  uint64_t start = hist_now();
+  for (int i = 0; i < bench.count; i++)
+    pthread_create(&bench.peers[i].sender, NULL, sender_main, &bench.peers[i]);
+  sleep(bench.seconds);
+  atomic_store(&bench.stop, true);
+  for (int i = 0; i < bench.count; i++)
+    pthread_join(bench.peers[i].sender, NULL);
+  double elapsed = (hist_now() - start) / 1e9;
+  // Let the frames in flight arrive.
+  usleep(500 * 1000);
+  for (int i = 0; i < bench.count; i++) {
+    shutdown(bench.peers[i].fd, SHUT_RDWR);
+    pthread_join(bench.peers[i].receiver, NULL);
+    close(bench.peers[i].fd);
+  }
+
+  uint64_t sent = 0, received = 0;
+  for (int i = 0; i < bench.count; i++) {
+    sent += bench.peers[i].sent;
+    received += bench.peers[i].received;
+  }
+  double bits = 8.0 * bench.frame_size;
+  printf("connections: %d, frame size: %zu bytes, time: %.1f s\n", bench.count, bench.frame_size,
+         elapsed);
+  printf("sent:     %llu frames, %.0f frames/s, %.2f Gbits/s\n", (unsigned long long)sent,
+         sent / elapsed, sent * bits / elapsed / 1e9);
+  if (bench.gateway_mode) {
+    uint64_t pings = bench.peers[0].sent;
+    printf("pings:    %llu sent, %llu replies, DSCP %d\n", (unsigned long long)pings,
+           (unsigned long long)received, bench.dscp);
+    printf("load:     %llu frames, %.2f Gbits/s\n", (unsigned long long)(sent - pings),
+           (sent - pings) * bits / elapsed / 1e9);
+    print_latency("rtt:", &bench.latency);
+  } else if (bench.count > 1) {
+    printf("received: %llu frames, %.0f frames/s, %.2f Gbits/s\n", (unsigned long long)received,
+           received / elapsed, received * bits / elapsed / 1e9);
+    printf("dropped:  %llu frames\n", (unsigned long long)(sent - received));
+    print_latency("latency:", &bench.latency);
+  }
+  if (task_known)
+    print_daemon_faults(&task_before, sent);
+  else if (bench.daemon_pid > 0)
+    printf("faults:   unknown, run as root\n");
+  free(bench.peers);
+  return 0;
+}
@@ -0,0 +1,360 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "ether.h"
+#include "log.h"
+
+#ifndef VERSION
+#define VERSION "UNKNOWN"
+#endif
+
+// The ring uses at most this much memory, whatever the snaplen.
+#define CAPTURE_RING_BYTES (32 * 1024 * 1024)
+#define CAPTURE_RING_MIN_SLOTS 64
+#define CAPTURE_RING_MAX_SLOTS 4096
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4D
+#define PCAPNG_OPT_ENDOFOPT 0
+#define PCAPNG_OPT_SHB_USERAPPL 4
+#define PCAPNG_OPT_IF_NAME 2
+#define PCAPNG_LINKTYPE_ETHERNET 1
+
+// Bounded MPSC queue (Vyukov): a producer claims a slot by advancing head,
+// and publishes it by setting seq to its position + 1. The writer releases it
+// for the next lap by setting seq to its position + slot_count.
+struct capture_slot {
+  _Atomic size_t seq;
+  uint32_t source;
+  int fd;
+  uint16_t vlan;
+  uint32_t caplen;
+  uint32_t len;
+  uint64_t timestamp_us;
+  uint8_t data[];
+};
+
+struct capture {
+  struct capture_filter filter;
+  uint32_t snaplen;
+  size_t slot_size;
+  size_t slot_count; // a power of 2
+  uint8_t *slots;
+  _Atomic size_t head;
+  size_t tail; // only touched by the writer
+  _Atomic uint64_t captured;
+  _Atomic uint64_t dropped;
+  atomic_bool stopping;
+  FILE *fp;
+  pthread_t writer;
+  // pcapng interface ids of the sources, in the order of their IDBs
+  uint32_t *sources;
+  size_t source_count;
+};
+
+struct capture *_Atomic capture_active;
+// Producers between their check of capture_active and the end of their copy
+static _Atomic int capture_users;
+
+static struct capture_slot *capture_slot(struct capture *cap, size_t pos) {
+  return (struct capture_slot *)(cap->slots + (pos & (cap->slot_count - 1)) * cap->slot_size);
+}
+
+static bool capture_match(const struct capture_filter *f, int fd, uint16_t vlan,
+                          const uint8_t *frame, size_t len) {
+  if (f->match_conn && f->conn_fd != fd)
+    return false;
+  if (f->match_vlan && f->vlan != vlan)
+    return false;
+  if (f->match_ethertype) {
+    if (len < ETHER_HDR_LEN)
+      return false;
+    uint16_t type = ether_type(frame);
+    if (type == ETHERTYPE_VLAN && len >= ETHER_HDR_LEN + VLAN_TAG_LEN)
+      type = ether_type(frame + VLAN_TAG_LEN);
+    if (type != f->ethertype)
+      return false;
+  }
+  return true;
+}
+
+void capture_frame_slow(uint32_t source, int fd, uint16_t vlan, const void *frame, size_t len) {
+  atomic_fetch_add(&capture_users, 1);
+  struct capture *cap = atomic_load(&capture_active);
+  if (cap == NULL || !capture_match(&cap->filter, fd, vlan, frame, len))
+    goto done;
+  size_t pos = atomic_load_explicit(&cap->head, memory_order_relaxed);
+  struct capture_slot *slot;
+  for (;;) {
+    slot = capture_slot(cap, pos);
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&cap->head, &pos, pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      atomic_fetch_add_explicit(&cap->dropped, 1, memory_order_relaxed);
+      goto done;
+    } else {
+      pos = atomic_load_explicit(&cap->head, memory_order_relaxed);
+    }
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  slot->source = source;
+  slot->fd = fd;
+  slot->vlan = vlan;
+  slot->len = (uint32_t)len;
+  slot->caplen = len < cap->snaplen ? (uint32_t)len : cap->snaplen;
+  slot->timestamp_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  memcpy(slot->data, frame, slot->caplen);
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+done:
+  atomic_fetch_sub(&capture_users, 1);
+}
+
+static void pcapng_write_option(FILE *fp, uint16_t code, const void *value, uint16_t len) {
+  static const uint8_t zeros[4];
+  uint16_t header[2] = {code, len};
+  fwrite(header, sizeof(header), 1, fp);
+  if (len > 0) {
+    fwrite(value, 1, len, fp);
+    fwrite(zeros, 1, (4 - len % 4) % 4, fp);
+  }
+}
+
+static uint32_t pcapng_option_len(size_t len) { return 4 + (uint32_t)((len + 3) & ~(size_t)3); }
+
+static void pcapng_write_shb(FILE *fp) {
+  const char *appl = "socket_vmnet " VERSION;
+  uint32_t total = 28 + pcapng_option_len(strlen(appl)) + 4;
+  struct {
+    uint32_t type;
+    uint32_t total;
+    uint32_t magic;
+    uint16_t major;
+    uint16_t minor;
+    int64_t section_len;
+  } __attribute__((packed)) shb = {PCAPNG_SHB, total, PCAPNG_BYTE_ORDER_MAGIC, 1, 0, -1};
+  fwrite(&shb, sizeof(shb), 1, fp);
+  pcapng_write_option(fp, PCAPNG_OPT_SHB_USERAPPL, appl, (uint16_t)strlen(appl));
+  pcapng_write_option(fp, PCAPNG_OPT_ENDOFOPT, NULL, 0);
+  fwrite(&total, sizeof(total), 1, fp);
+}
+
+static void pcapng_write_idb(FILE *fp, const char *name, uint32_t snaplen) {
+  uint32_t total = 20 + pcapng_option_len(strlen(name)) + 4;
+  struct {
+    uint32_t type;
+    uint32_t total;
+    uint16_t linktype;
+    uint16_t reserved;
+    uint32_t snaplen;
+  } idb = {PCAPNG_IDB, total, PCAPNG_LINKTYPE_ETHERNET, 0, snaplen};
+  fwrite(&idb, sizeof(idb), 1, fp);
+  pcapng_write_option(fp, PCAPNG_OPT_IF_NAME, name, (uint16_t)strlen(name));
+  pcapng_write_option(fp, PCAPNG_OPT_ENDOFOPT, NULL, 0);
+  fwrite(&total, sizeof(total), 1, fp);
+}
+
+// Returns the pcapng interface id of the source of slot, writing its IDB the
+// first time the source is seen.
+static uint32_t capture_interface(struct capture *cap, const struct capture_slot *slot) {
+  for (size_t i = cap->source_count; i > 0; i--) {
+    if (cap->sources[i - 1] == slot->source)
+      return (uint32_t)(i - 1);
+  }
+  uint32_t *sources = realloc(cap->sources, (cap->source_count + 1) * sizeof(*sources));
+  if (sources == NULL) {
+    ERRORN("realloc");
+    return UINT32_MAX;
+  }
+  cap->sources = sources;
+  cap->sources[cap->source_count] = slot->source;
+  char name[64];
+  if (slot->source == CAPTURE_SOURCE_VMNET)
+    snprintf(name, sizeof(name), "vmnet");
+  else if (slot->vlan != VLAN_NONE)
+    snprintf(name, sizeof(name), "fd %d, VLAN %d", slot->fd, slot->vlan);
+  else
+    snprintf(name, sizeof(name), "fd %d", slot->fd);
+  pcapng_write_idb(cap->fp, name, cap->snaplen);
+  return (uint32_t)cap->source_count++;
+}
+
+static void pcapng_write_epb(struct capture *cap, const struct capture_slot *slot) {
+  static const uint8_t zeros[4];
+  uint32_t interface = capture_interface(cap, slot);
+  if (interface == UINT32_MAX)
+    return;
+  uint32_t padded = (slot->caplen + 3) & ~3u;
+  uint32_t total = 28 + padded + 4;
+  uint32_t epb[7] = {
+      PCAPNG_EPB,
+      total,
+      interface,
+      (uint32_t)(slot->timestamp_us >> 32),
+      (uint32_t)slot->timestamp_us,
+      slot->caplen,
+      slot->len,
+  };
+  fwrite(epb, sizeof(epb), 1, cap->fp);
+  fwrite(slot->data, 1, slot->caplen, cap->fp);
+  fwrite(zeros, 1, padded - slot->caplen, cap->fp);
+  fwrite(&total, sizeof(total), 1, cap->fp);
+}
+
+static void *capture_writer(void *arg) {
+  struct capture *cap = arg;
+  for (;;) {
+    struct capture_slot *slot = capture_slot(cap, cap->tail);
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq == cap->tail + 1) {
+      pcapng_write_epb(cap, slot);
+      atomic_fetch_add_explicit(&cap->captured, 1, memory_order_relaxed);
+      atomic_store_explicit(&slot->seq, cap->tail + cap->slot_count, memory_order_release);
+      cap->tail++;
+      continue;
+    }
+    // Empty. The producers are gone once stopping is set, see capture_stop.
+    if (atomic_load(&cap->stopping))
+      break;
+    fflush(cap->fp);
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = 1000 * 1000};
+    nanosleep(&ts, NULL);
+  }
+  if (fflush(cap->fp) != 0)
+    ERRORN("capture: fflush");
+  return NULL;
+}
+
+static void capture_free(struct capture *cap) {
+  if (cap->fp != NULL)
+    fclose(cap->fp);
+  free(cap->slots);
+  free(cap->sources);
+  free(cap);
+}
+
+static int parse_uint(const char *s, unsigned long max, unsigned long *v) {
+  char *end = NULL;
+  errno = 0;
+  *v = strtoul(s, &end, 0);
+  return (errno != 0 || end == s || *end != '\0' || *v > max) ? -1 : 0;
+}
+
+int capture_parse_options(struct capture_options *opts, int argc, char *argv[]) {
+  memset(opts, 0, sizeof(*opts));
+  opts->snaplen = CAPTURE_DEFAULT_SNAPLEN;
+  if (argc < 1)
+    return -1;
+  opts->path = argv[0];
+  for (int i = 1; i < argc; i++) {
+    struct capture_filter *f = &opts->filter;
+    unsigned long v;
+    const char *value = strchr(argv[i], '=');
+    if (value == NULL)
+      return -1;
+    size_t key_len = value++ - argv[i];
+#define KEY_IS(key) (key_len == strlen(key) && strncmp(argv[i], key, key_len) == 0)
+    if (KEY_IS("snaplen") && parse_uint(value, 64 * 1024, &v) == 0 && v > 0) {
+      opts->snaplen = (uint32_t)v;
+    } else if (KEY_IS("conn") && strcmp(value, "vmnet") == 0) {
+      f->match_conn = true;
+      f->conn_fd = -1;
+    } else if (KEY_IS("conn") && parse_uint(value, INT32_MAX, &v) == 0) {
+      f->match_conn = true;
+      f->conn_fd = (int)v;
+    } else if (KEY_IS("vlan") && parse_uint(value, VLAN_MAX, &v) == 0) {
+      f->match_vlan = true;
+      f->vlan = (uint16_t)v;
+    } else if (KEY_IS("ethertype") && parse_uint(value, UINT16_MAX, &v) == 0) {
+      f->match_ethertype = true;
+      f->ethertype = (uint16_t)v;
+    } else {
+      return -1;
+    }
+#undef KEY_IS
+  }
+  return 0;
+}
+
+int capture_start(const struct capture_options *opts) {
+  if (atomic_load(&capture_active) != NULL) {
+    ERROR("capture: already running");
+    return -1;
+  }
+  struct capture *cap = calloc(1, sizeof(*cap));
+  if (cap == NULL) {
+    ERRORN("calloc");
+    return -1;
+  }
+  cap->filter = opts->filter;
+  cap->snaplen = opts->snaplen;
+  cap->slot_size = (sizeof(struct capture_slot) + cap->snaplen + 7) & ~(size_t)7;
+  cap->slot_count = CAPTURE_RING_MAX_SLOTS;
+  while (cap->slot_count > CAPTURE_RING_MIN_SLOTS &&
+         cap->slot_count * cap->slot_size > CAPTURE_RING_BYTES)
+    cap->slot_count /= 2;
+  cap->slots = malloc(cap->slot_count * cap->slot_size);
+  if (cap->slots == NULL) {
+    ERRORN("malloc");
+    goto err;
+  }
+  for (size_t i = 0; i < cap->slot_count; i++)
+    atomic_init(&capture_slot(cap, i)->seq, i);
+
+  int fd = open(opts->path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    ERRORF("capture: failed to open \"%s\": %s", opts->path, strerror(errno));
+    goto err;
+  }
+  cap->fp = fdopen(fd, "w");
+  if (cap->fp == NULL) {
+    ERRORN("fdopen");
+    close(fd);
+    goto err;
+  }
+  setvbuf(cap->fp, NULL, _IOFBF, 1024 * 1024);
+  pcapng_write_shb(cap->fp);
+
+  int ret = pthread_create(&cap->writer, NULL, capture_writer, cap);
+  if (ret != 0) {
+    ERRORF("pthread_create: %s", strerror(ret));
+    goto err;
+  }
+  atomic_store(&capture_active, cap);
+  INFOF("capture: writing to \"%s\" (snaplen %u, %zu slots)", opts->path, cap->snaplen,
+        cap->slot_count);
+  return 0;
+err:
+  capture_free(cap);
+  return -1;
+}
+
+int capture_stop(struct capture_stats *stats) {
+  struct capture *cap = atomic_exchange(&capture_active, NULL);
+  if (cap == NULL)
+    return -1;
+  // Wait for the producers that saw cap; later ones see NULL.
+  while (atomic_load(&capture_users) > 0)
+    sched_yield();
+  atomic_store(&cap->stopping, true);
+  pthread_join(cap->writer, NULL);
+  stats->captured = atomic_load(&cap->captured);
+  stats->dropped = atomic_load(&cap->dropped);
+  INFOF("capture: stopped, %llu frames captured, %llu dropped", stats->captured, stats->dropped);
+  capture_free(cap);
+  return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef SOCKET_VMNET_CAPTURE_H
+#define SOCKET_VMNET_CAPTURE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// On-demand packet capture to a pcapng file. The forwarding threads copy the
+// frames into a lock-free ring; a background thread writes them out, with one
+// pcapng interface per source (vmnet, or a connection). When no capture is
+// running, capture_frame costs a single relaxed load.
+
+// capture_frame source for the frames read from vmnet; connections use their
+// own nonzero id.
+#define CAPTURE_SOURCE_VMNET 0
+
+#define CAPTURE_DEFAULT_SNAPLEN 2048
+
+struct capture_filter {
+  bool match_conn;
+  int conn_fd; // -1 for vmnet
+  bool match_vlan;
+  uint16_t vlan;
+  bool match_ethertype;
+  uint16_t ethertype; // of the payload, after the VLAN tag if any
+};
+
+struct capture_options {
+  const char *path;
+  uint32_t snaplen;
+  struct capture_filter filter;
+};
+
+struct capture_stats {
+  uint64_t captured;
+  uint64_t dropped; // the ring was full
+};
+
+struct capture;
+extern struct capture *_Atomic capture_active;
+
+void capture_frame_slow(uint32_t source, int fd, uint16_t vlan, const void *frame, size_t len);
+
+// Records a frame read from source (file descriptor fd, VLAN vlan). Never
+// blocks; the frame is dropped from the capture if the writer falls behind.
+static inline void capture_frame(uint32_t source, int fd, uint16_t vlan, const void *frame,
+                                 size_t len) {
+  if (atomic_load_explicit(&capture_active, memory_order_relaxed) != NULL)
+    capture_frame_slow(source, fd, vlan, frame, len);
+}
+
+// Parses the arguments of "capture start", e.g., {"/tmp/a.pcapng",
+// "snaplen=128", "conn=5"}. Returns -1 on an invalid argument.
+int capture_parse_options(struct capture_options *opts, int argc, char *argv[]);
+
+// Starts writing the frames to opts->path. Only one capture runs at a time.
+int capture_start(const struct capture_options *opts);
+
+// Stops the capture, and waits until everything is written. Returns -1 if no
+// capture is running.
+int capture_stop(struct capture_stats *stats);
+
+#endif /* SOCKET_VMNET_CAPTURE_H */
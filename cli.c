@@ -5,12 +5,15 @@
 
 #include <arpa/inet.h>
 #include <getopt.h>
+#include <sys/socket.h>
 
 #include <Availability.h>
 #include <uuid/uuid.h>
 
 #include "cli.h"
+#include "ether.h"
 #include "log.h"
+#include "rss.h"
 
 #ifndef VERSION
 #define VERSION "UNKNOWN"
@@ -67,6 +70,86 @@ static void print_usage(const char *argv0) {
          "(requires macOS 26;\n");
   printf("                                    lets an external DHCP server own "
          "the subnet)\n");
+  printf("--vlan-socket=VLAN:SOCKET           also listen on SOCKET, for the VMs on the 802.1Q "
+         "VLAN\n");
+  printf("                                    (1-4094); their frames are tagged with VLAN on "
+         "the\n");
+  printf("                                    vmnet side (can be specified multiple times)\n");
+  printf("--control-socket=PATH               accept control commands (e.g., packet capture) "
+         "from root\n");
+  printf("                                    on PATH; send \"help\" for the list of commands\n");
+  printf("--egress-scheduler                  queue the frames toward vmnet per VM, and serve "
+         "the VMs\n");
+  printf("                                    in deficit round robin order; frames with DSCP "
+         "CS5 or\n");
+  printf("                                    above (e.g., EF) are served first\n");
+  printf("--egress-rate=[MAC=]RATE            limit the VM with MAC, or each VM, to RATE bits "
+         "per\n");
+  printf("                                    second toward vmnet, e.g., \"100M\" (implies "
+         "--egress-scheduler;\n");
+  printf("                                    can be specified multiple times)\n");
+  printf("--egress-priority=MAC               serve all the frames of the VM with MAC first "
+         "(implies\n");
+  printf("                                    --egress-scheduler; can be specified multiple "
+         "times)\n");
+  printf("--neighbor-proxy                    answer ARP requests and IPv6 Neighbor Solicitations "
+         "for\n");
+  printf("                                    the addresses of the VMs, instead of flooding "
+         "them\n");
+  printf("--multicast-snooping                send the multicast frames only to the VMs that "
+         "joined\n");
+  printf("                                    their group with IGMP or MLD; link-local groups "
+         "are\n");
+  printf("                                    still sent to every VM\n");
+  printf("--dhcp-server                       answer the DHCP requests of the VMs on the main "
+         "socket,\n");
+  printf("                                    from --vmnet-gateway + 1 to --vmnet-dhcp-end "
+         "(requires\n");
+  printf("                                    --vmnet-disable-dhcp or "
+         "--vmnet-network-identifier)\n");
+  printf("--dhcp-lease-file=PATH              keep the DHCP leases in PATH across restarts "
+         "(implies\n");
+  printf("                                    --dhcp-server)\n");
+  printf("--listen-backlog=N                  connections waiting to be accepted, per socket "
+         "(default: %d)\n",
+         SOMAXCONN);
+  printf("--vmnet-rx-queues=N                 deliver the frames from vmnet to the VMs with N "
+         "threads,\n");
+  printf("                                    spreading the flows over them (1-%d, default: "
+         "1)\n",
+         RSS_MAX_QUEUES);
+  printf("--buffer-memory=SIZE                carve the packet buffers from a region of SIZE "
+         "bytes,\n");
+  printf("                                    e.g., \"64M\", mapped at startup with superpages "
+         "if\n");
+  printf("                                    possible (default: allocated on demand)\n");
+  printf("--buffer-memory-lock                lock the --buffer-memory region in memory, "
+         "faulting it\n");
+  printf("                                    in at startup\n");
+  printf("--coalesce=USECS                    hold the frames to each VM for up to USECS "
+         "microseconds\n");
+  printf("                                    (1-%d), and write them at once\n",
+         CLI_COALESCE_MAX_USECS);
+  printf("--coalesce-bytes=SIZE               write the held frames once SIZE bytes are held "
+         "(requires\n");
+  printf("                                    --coalesce; up to %dK, default: %dK)\n",
+         CLI_COALESCE_MAX_BYTES / 1024, CLI_COALESCE_DEFAULT_BYTES / 1024);
+  printf("--coalesce-adaptive                 do not hold the isolated frames, nor the ones "
+         "with DSCP\n");
+  printf("                                    CS5 or above (requires --coalesce)\n");
+  printf("--generic-forwarding                always forward on the generic path, instead of the "
+         "paths\n");
+  printf("                                    specialized for the number of VMs (for "
+         "benchmarking)\n");
+  printf("--socket-buffer-min=SIZE            set the socket buffers of the VMs to SIZE bytes, "
+         "e.g.,\n");
+  printf("                                    \"256K\" (default: the system default)\n");
+  printf("--socket-buffer-max=SIZE            grow the socket buffers of the VMs up to SIZE "
+         "bytes as\n");
+  printf("                                    they fill up, and shrink them back as they drain "
+         "(up to\n");
+  printf("                                    %dM; default: fixed size)\n",
+         CLI_SOCKET_BUFFER_MAX_BYTES / (1024 * 1024));
   printf("-p, --pidfile=PIDFILE               save pid to PIDFILE\n");
   printf("-h, --help                          display this help and exit\n");
   printf("-v, --version                       display version information and "
@@ -88,8 +171,173 @@ enum {
   CLI_OPT_VMNET_NAT66_PREFIX,
   CLI_OPT_VMNET_NETWORK_IDENTIFIER,
   CLI_OPT_VMNET_DISABLE_DHCP,
+  CLI_OPT_VLAN_SOCKET,
+  CLI_OPT_CONTROL_SOCKET,
+  CLI_OPT_EGRESS_SCHEDULER,
+  CLI_OPT_EGRESS_RATE,
+  CLI_OPT_EGRESS_PRIORITY,
+  CLI_OPT_NEIGHBOR_PROXY,
+  CLI_OPT_MULTICAST_SNOOPING,
+  CLI_OPT_DHCP_SERVER,
+  CLI_OPT_DHCP_LEASE_FILE,
+  CLI_OPT_LISTEN_BACKLOG,
+  CLI_OPT_VMNET_RX_QUEUES,
+  CLI_OPT_BUFFER_MEMORY,
+  CLI_OPT_BUFFER_MEMORY_LOCK,
+  CLI_OPT_GENERIC_FORWARDING,
+  CLI_OPT_COALESCE,
+  CLI_OPT_COALESCE_BYTES,
+  CLI_OPT_COALESCE_ADAPTIVE,
+  CLI_OPT_SOCKET_BUFFER_MIN,
+  CLI_OPT_SOCKET_BUFFER_MAX,
 };
 
+// Parses VLAN:SOCKET
+static int parse_vlan_socket(struct cli_options *res, const char *arg) {
+  char *end = NULL;
+  unsigned long vlan = strtoul(arg, &end, 10);
+  if (end == arg || *end != ':' || end[1] == '\0' || vlan < VLAN_MIN || vlan > VLAN_MAX) {
+    ERRORF("Invalid --vlan-socket \"%s\", expected VLAN:SOCKET with VLAN in %d-%d", arg, VLAN_MIN,
+           VLAN_MAX);
+    return -1;
+  }
+  for (size_t i = 0; i < res->vlan_socket_count; i++) {
+    if (res->vlan_sockets[i].vlan == vlan) {
+      ERRORF("VLAN %lu is specified more than once for --vlan-socket", vlan);
+      return -1;
+    }
+  }
+  struct cli_vlan_socket *vlan_sockets =
+      realloc(res->vlan_sockets, (res->vlan_socket_count + 1) * sizeof(*vlan_sockets));
+  if (vlan_sockets == NULL) {
+    ERRORN("realloc");
+    return -1;
+  }
+  res->vlan_sockets = vlan_sockets;
+  res->vlan_sockets[res->vlan_socket_count].vlan = (uint16_t)vlan;
+  res->vlan_sockets[res->vlan_socket_count].socket_path = strdup(end + 1);
+  res->vlan_socket_count++;
+  return 0;
+}
+
+// Parses a MAC address, e.g., "52:55:55:12:34:56"
+static int parse_mac(uint8_t mac[6], const char *arg, const char **end) {
+  int n = 0;
+  if (sscanf(arg, "%2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx%n", &mac[0], &mac[1], &mac[2], &mac[3],
+             &mac[4], &mac[5], &n) != 6)
+    return -1;
+  *end = arg + n;
+  return 0;
+}
+
+// Parses a rate in bits per second, with an optional k, M, or G suffix
+static int parse_rate(uint64_t *rate, const char *arg) {
+  char *end = NULL;
+  unsigned long long v = strtoull(arg, &end, 10);
+  if (end == arg)
+    return -1;
+  switch (*end) {
+  case 'k':
+  case 'K':
+    v *= 1000;
+    end++;
+    break;
+  case 'M':
+    v *= 1000 * 1000;
+    end++;
+    break;
+  case 'G':
+    v *= 1000 * 1000 * 1000;
+    end++;
+    break;
+  }
+  if (*end != '\0' || v == 0)
+    return -1;
+  *rate = v;
+  return 0;
+}
+
+// Parses a size in bytes, with an optional K, M, or G suffix (powers of 1024)
+static int parse_size(size_t *size, const char *arg) {
+  char *end = NULL;
+  unsigned long long v = strtoull(arg, &end, 10);
+  if (end == arg)
+    return -1;
+  int shift = 0;
+  switch (*end) {
+  case 'K':
+    shift = 10;
+    end++;
+    break;
+  case 'M':
+    shift = 20;
+    end++;
+    break;
+  case 'G':
+    shift = 30;
+    end++;
+    break;
+  }
+  if (*end != '\0' || v == 0 || v > (SIZE_MAX >> shift))
+    return -1;
+  *size = (size_t)v << shift;
+  return 0;
+}
+
+static struct cli_egress_rule *egress_rule(struct cli_options *res, const uint8_t mac[6]) {
+  for (size_t i = 0; i < res->egress_rule_count; i++) {
+    if (memcmp(res->egress_rules[i].mac, mac, 6) == 0)
+      return &res->egress_rules[i];
+  }
+  struct cli_egress_rule *rules =
+      realloc(res->egress_rules, (res->egress_rule_count + 1) * sizeof(*rules));
+  if (rules == NULL) {
+    ERRORN("realloc");
+    return NULL;
+  }
+  res->egress_rules = rules;
+  struct cli_egress_rule *rule = &res->egress_rules[res->egress_rule_count++];
+  memset(rule, 0, sizeof(*rule));
+  memcpy(rule->mac, mac, 6);
+  return rule;
+}
+
+// Parses [MAC=]RATE
+static int parse_egress_rate(struct cli_options *res, const char *arg) {
+  uint8_t mac[6];
+  const char *end = NULL;
+  if (parse_mac(mac, arg, &end) == 0 && *end == '=') {
+    uint64_t rate;
+    if (parse_rate(&rate, end + 1) < 0)
+      goto invalid;
+    struct cli_egress_rule *rule = egress_rule(res, mac);
+    if (rule == NULL)
+      return -1;
+    rule->rate = rate;
+    return 0;
+  }
+  if (parse_rate(&res->egress_rate, arg) == 0)
+    return 0;
+invalid:
+  ERRORF("Invalid --egress-rate \"%s\", expected [MAC=]RATE, e.g., \"100M\"", arg);
+  return -1;
+}
+
+// Parses MAC
+static int parse_egress_priority(struct cli_options *res, const char *arg) {
+  uint8_t mac[6];
+  const char *end = NULL;
+  if (parse_mac(mac, arg, &end) < 0 || *end != '\0') {
+    ERRORF("Invalid --egress-priority \"%s\", expected a MAC address", arg);
+    return -1;
+  }
+  struct cli_egress_rule *rule = egress_rule(res, mac);
+  if (rule == NULL)
+    return -1;
+  rule->priority = true;
+  return 0;
+}
+
 struct cli_options *cli_options_parse(int argc, char *argv[]) {
   struct cli_options *res = calloc(1, sizeof(*res));
   if (res == NULL) {
@@ -108,6 +356,25 @@ struct cli_options *cli_options_parse(int argc, char *argv[]) {
       {"vmnet-nat66-prefix",       required_argument, NULL, CLI_OPT_VMNET_NAT66_PREFIX      },
       {"vmnet-network-identifier", required_argument, NULL, CLI_OPT_VMNET_NETWORK_IDENTIFIER},
       {"vmnet-disable-dhcp",       no_argument,       NULL, CLI_OPT_VMNET_DISABLE_DHCP      },
+      {"vlan-socket",              required_argument, NULL, CLI_OPT_VLAN_SOCKET             },
+      {"control-socket",           required_argument, NULL, CLI_OPT_CONTROL_SOCKET          },
+      {"egress-scheduler",         no_argument,       NULL, CLI_OPT_EGRESS_SCHEDULER        },
+      {"egress-rate",              required_argument, NULL, CLI_OPT_EGRESS_RATE             },
+      {"egress-priority",          required_argument, NULL, CLI_OPT_EGRESS_PRIORITY         },
+      {"neighbor-proxy",           no_argument,       NULL, CLI_OPT_NEIGHBOR_PROXY          },
+      {"multicast-snooping",       no_argument,       NULL, CLI_OPT_MULTICAST_SNOOPING      },
+      {"dhcp-server",              no_argument,       NULL, CLI_OPT_DHCP_SERVER             },
+      {"dhcp-lease-file",          required_argument, NULL, CLI_OPT_DHCP_LEASE_FILE         },
+      {"listen-backlog",           required_argument, NULL, CLI_OPT_LISTEN_BACKLOG          },
+      {"vmnet-rx-queues",          required_argument, NULL, CLI_OPT_VMNET_RX_QUEUES         },
+      {"buffer-memory",            required_argument, NULL, CLI_OPT_BUFFER_MEMORY           },
+      {"buffer-memory-lock",       no_argument,       NULL, CLI_OPT_BUFFER_MEMORY_LOCK      },
+      {"generic-forwarding",       no_argument,       NULL, CLI_OPT_GENERIC_FORWARDING      },
+      {"coalesce",                 required_argument, NULL, CLI_OPT_COALESCE                },
+      {"coalesce-bytes",           required_argument, NULL, CLI_OPT_COALESCE_BYTES          },
+      {"coalesce-adaptive",        no_argument,       NULL, CLI_OPT_COALESCE_ADAPTIVE       },
+      {"socket-buffer-min",        required_argument, NULL, CLI_OPT_SOCKET_BUFFER_MIN       },
+      {"socket-buffer-max",        required_argument, NULL, CLI_OPT_SOCKET_BUFFER_MAX       },
       {"pidfile",                  required_argument, NULL, 'p'                             },
       {"help",                     no_argument,       NULL, 'h'                             },
       {"version",                  no_argument,       NULL, 'v'                             },
@@ -161,6 +428,105 @@ struct cli_options *cli_options_parse(int argc, char *argv[]) {
     case CLI_OPT_VMNET_DISABLE_DHCP:
       res->vmnet_disable_dhcp = true;
       break;
+    case CLI_OPT_VLAN_SOCKET:
+      if (parse_vlan_socket(res, optarg) < 0)
+        goto error;
+      break;
+    case CLI_OPT_CONTROL_SOCKET:
+      res->control_socket = strdup(optarg);
+      break;
+    case CLI_OPT_EGRESS_SCHEDULER:
+      res->egress_scheduler = true;
+      break;
+    case CLI_OPT_EGRESS_RATE:
+      if (parse_egress_rate(res, optarg) < 0)
+        goto error;
+      res->egress_scheduler = true;
+      break;
+    case CLI_OPT_EGRESS_PRIORITY:
+      if (parse_egress_priority(res, optarg) < 0)
+        goto error;
+      res->egress_scheduler = true;
+      break;
+    case CLI_OPT_NEIGHBOR_PROXY:
+      res->neighbor_proxy = true;
+      break;
+    case CLI_OPT_MULTICAST_SNOOPING:
+      res->multicast_snooping = true;
+      break;
+    case CLI_OPT_DHCP_SERVER:
+      res->dhcp_server = true;
+      break;
+    case CLI_OPT_DHCP_LEASE_FILE:
+      free(res->dhcp_lease_file);
+      res->dhcp_lease_file = strdup(optarg);
+      res->dhcp_server = true;
+      break;
+    case CLI_OPT_LISTEN_BACKLOG: {
+      char *end = NULL;
+      long backlog = strtol(optarg, &end, 10);
+      if (end == optarg || *end != '\0' || backlog < 1 || backlog > INT_MAX) {
+        ERRORF("Invalid --listen-backlog \"%s\"", optarg);
+        goto error;
+      }
+      res->listen_backlog = (int)backlog;
+      break;
+    }
+    case CLI_OPT_VMNET_RX_QUEUES: {
+      char *end = NULL;
+      long queues = strtol(optarg, &end, 10);
+      if (end == optarg || *end != '\0' || queues < 1 || queues > RSS_MAX_QUEUES) {
+        ERRORF("Invalid --vmnet-rx-queues \"%s\", expected 1-%d", optarg, RSS_MAX_QUEUES);
+        goto error;
+      }
+      res->vmnet_rx_queues = (unsigned)queues;
+      break;
+    }
+    case CLI_OPT_BUFFER_MEMORY:
+      if (parse_size(&res->buffer_memory, optarg) < 0) {
+        ERRORF("Invalid --buffer-memory \"%s\", expected a size, e.g., \"64M\"", optarg);
+        goto error;
+      }
+      break;
+    case CLI_OPT_BUFFER_MEMORY_LOCK:
+      res->buffer_memory_lock = true;
+      break;
+    case CLI_OPT_GENERIC_FORWARDING:
+      res->generic_forwarding = true;
+      break;
+    case CLI_OPT_COALESCE: {
+      char *end = NULL;
+      long usecs = strtol(optarg, &end, 10);
+      if (end == optarg || *end != '\0' || usecs < 1 || usecs > CLI_COALESCE_MAX_USECS) {
+        ERRORF("Invalid --coalesce \"%s\", expected 1-%d microseconds", optarg,
+               CLI_COALESCE_MAX_USECS);
+        goto error;
+      }
+      res->coalesce_usecs = (unsigned)usecs;
+      break;
+    }
+    case CLI_OPT_COALESCE_BYTES:
+      if (parse_size(&res->coalesce_bytes, optarg) < 0 || res->coalesce_bytes == 0 ||
+          res->coalesce_bytes > CLI_COALESCE_MAX_BYTES) {
+        ERRORF("Invalid --coalesce-bytes \"%s\", expected a size up to %dK, e.g., \"16K\"",
+               optarg, CLI_COALESCE_MAX_BYTES / 1024);
+        goto error;
+      }
+      break;
+    case CLI_OPT_COALESCE_ADAPTIVE:
+      res->coalesce_adaptive = true;
+      break;
+    case CLI_OPT_SOCKET_BUFFER_MIN:
+    case CLI_OPT_SOCKET_BUFFER_MAX: {
+      bool min = opt == CLI_OPT_SOCKET_BUFFER_MIN;
+      size_t *size = min ? &res->socket_buffer_min : &res->socket_buffer_max;
+      if (parse_size(size, optarg) < 0 || *size > CLI_SOCKET_BUFFER_MAX_BYTES) {
+        ERRORF("Invalid --socket-buffer-%s \"%s\", expected a size up to %dM, e.g., \"1M\"",
+               min ? "min" : "max", optarg, CLI_SOCKET_BUFFER_MAX_BYTES / (1024 * 1024));
+        goto error;
+      }
+      break;
+    }
     case 'p':
       res->pidfile = strdup(optarg);
       break;
@@ -185,7 +551,7 @@ struct cli_options *cli_options_parse(int argc, char *argv[]) {
   /* warn before the defaults below are filled in, so that only explicitly
    * specified values match */
   if (res->vmnet_disable_dhcp) {
-    if (res->vmnet_dhcp_end != NULL)
+    if (res->vmnet_dhcp_end != NULL && !res->dhcp_server)
       WARN("--vmnet-dhcp-end is ignored with --vmnet-disable-dhcp: no DHCP server is started");
     if (!uuid_is_null(res->vmnet_interface_id))
       WARN("--vmnet-interface-id is ignored with --vmnet-disable-dhcp: "
@@ -200,6 +566,8 @@ struct cli_options *cli_options_parse(int argc, char *argv[]) {
     res->socket_group = strdup(CLI_DEFAULT_SOCKET_GROUP); /* use strdup to make it freeable */
   if (res->vmnet_mode == 0)
     res->vmnet_mode = VMNET_SHARED_MODE;
+  if (res->listen_backlog == 0)
+    res->listen_backlog = SOMAXCONN;
   if (res->vmnet_gateway != NULL && res->vmnet_dhcp_end == NULL) {
     /* Set default vmnet_dhcp_end to XXX.XXX.XXX.254 (only when --vmnet-gateway
      * is specified) */
@@ -226,6 +594,41 @@ struct cli_options *cli_options_parse(int argc, char *argv[]) {
   }
 
   /* validate */
+  if (res->control_socket != NULL && strcmp(res->control_socket, res->socket_path) == 0) {
+    ERRORF("--control-socket conflicts with the socket path \"%s\"", res->socket_path);
+    goto error;
+  }
+  for (size_t i = 0; i < res->vlan_socket_count; i++) {
+    if (strcmp(res->vlan_sockets[i].socket_path, res->socket_path) == 0) {
+      ERRORF("--vlan-socket conflicts with the socket path \"%s\"", res->socket_path);
+      goto error;
+    }
+  }
+  if (res->buffer_memory_lock && res->buffer_memory == 0) {
+    ERROR("--buffer-memory-lock requires --buffer-memory=SIZE");
+    goto error;
+  }
+  if (res->coalesce_usecs == 0 && (res->coalesce_bytes > 0 || res->coalesce_adaptive)) {
+    ERROR("--coalesce-bytes and --coalesce-adaptive require --coalesce=USECS");
+    goto error;
+  }
+  if (res->coalesce_usecs > 0 && res->coalesce_bytes == 0)
+    res->coalesce_bytes = CLI_COALESCE_DEFAULT_BYTES;
+  if (res->socket_buffer_max > 0 && res->socket_buffer_max < res->socket_buffer_min) {
+    ERROR("--socket-buffer-max must not be smaller than --socket-buffer-min");
+    goto error;
+  }
+  if (res->dhcp_server) {
+    if (!res->vmnet_disable_dhcp && uuid_is_null(res->vmnet_network_identifier)) {
+      ERROR("--dhcp-server requires --vmnet-disable-dhcp or --vmnet-network-identifier: "
+            "the vmnet DHCP server would conflict");
+      goto error;
+    }
+    if (res->vmnet_gateway == NULL) {
+      ERROR("--dhcp-server requires --vmnet-gateway=IP");
+      goto error;
+    }
+  }
   if (res->vmnet_mode == VMNET_BRIDGED_MODE && res->vmnet_interface == NULL) {
     ERROR("vmnet mode \"bridged\" require --vmnet-interface to be specified");
     goto error;
@@ -271,5 +674,11 @@ void cli_options_destroy(struct cli_options *x) {
   free(x->vmnet_mask);
   free(x->vmnet_nat66_prefix);
   free(x->pidfile);
+  free(x->control_socket);
+  free(x->dhcp_lease_file);
+  for (size_t i = 0; i < x->vlan_socket_count; i++)
+    free(x->vlan_sockets[i].socket_path);
+  free(x->vlan_sockets);
+  free(x->egress_rules);
   free(x);
 }
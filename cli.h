@@ -1,10 +1,37 @@
 #ifndef SOCKET_VMNET_CLI_H
 #define SOCKET_VMNET_CLI_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #include <uuid/uuid.h>
 
 #include <vmnet/vmnet.h>
 
+struct cli_vlan_socket {
+  uint16_t vlan;
+  char *socket_path;
+};
+
+// A VM, identified by the source MAC address of its frames, with its own
+// egress settings
+struct cli_egress_rule {
+  uint8_t mac[6];
+  uint64_t rate; // bits per second, 0 for the --egress-rate default
+  bool priority;
+};
+
+// --coalesce bounds. The held frames count against the send queue of the
+// connection, which fits a few maximum-size frames.
+#define CLI_COALESCE_MAX_USECS 10000
+#define CLI_COALESCE_DEFAULT_BYTES (32 * 1024)
+#define CLI_COALESCE_MAX_BYTES (128 * 1024)
+
+// --socket-buffer-min and --socket-buffer-max bound; the default
+// kern.ipc.maxsockbuf of macOS
+#define CLI_SOCKET_BUFFER_MAX_BYTES (8 * 1024 * 1024)
+
 struct cli_options {
   // --socket-group
   char *socket_group;
@@ -26,8 +53,56 @@ struct cli_options {
   char *vmnet_nat66_prefix;
   // --vmnet-disable-dhcp; disables the vmnet DHCP server (requires macOS 26)
   bool vmnet_disable_dhcp;
+  // --listen-backlog; connections waiting to be accepted, per socket
+  int listen_backlog;
+  // --vmnet-rx-queues; threads delivering the frames from vmnet, see rss.h
+  unsigned vmnet_rx_queues;
+  // --buffer-memory; bytes of the region the packet buffers are carved from,
+  // or 0 for malloc, see arena.h
+  size_t buffer_memory;
+  // --buffer-memory-lock; wires the region, faulting it in at startup
+  bool buffer_memory_lock;
+  // --coalesce; holds the frames to each VM for up to USECS microseconds, or 0
+  unsigned coalesce_usecs;
+  // --coalesce-bytes; writes the held frames once this many bytes are held
+  size_t coalesce_bytes;
+  // --coalesce-adaptive; does not hold the frames unlikely to be joined by
+  // others, nor the latency-sensitive ones
+  bool coalesce_adaptive;
+  // --generic-forwarding; never takes the specialized forwarding paths
+  bool generic_forwarding;
+  // --socket-buffer-min; SO_SNDBUF and SO_RCVBUF of the VM sockets, or 0 for
+  // the system default
+  size_t socket_buffer_min;
+  // --socket-buffer-max; tunes the buffers of the VM sockets up to this size,
+  // or 0 to keep their size
+  size_t socket_buffer_max;
   // -p, --pidfile; writes pidfile using permissions of socket_vmnet
   char *pidfile;
+  // --control-socket; accepts commands from root, see control.h
+  char *control_socket;
+  // --vlan-socket=VLAN:SOCKET, repeatable; the VMs connecting to SOCKET are on
+  // VLAN, and are isolated from the VMs connecting to the main socket path
+  struct cli_vlan_socket *vlan_sockets;
+  size_t vlan_socket_count;
+  // --egress-scheduler; queues the frames toward vmnet, and serves the VMs in
+  // deficit round robin order (see egress.h). Implied by the options below.
+  bool egress_scheduler;
+  // --egress-rate=RATE; limits each VM to RATE bits per second
+  uint64_t egress_rate;
+  // --egress-rate=MAC=RATE and --egress-priority=MAC, repeatable
+  struct cli_egress_rule *egress_rules;
+  size_t egress_rule_count;
+  // --neighbor-proxy; answers ARP and NDP requests for the VMs, see neigh.h
+  bool neighbor_proxy;
+  // --multicast-snooping; sends the multicast frames to the VMs that joined
+  // their group only, see mcast.h
+  bool multicast_snooping;
+  // --dhcp-server; answers the DHCP requests of the VMs on the main socket
+  // with the addresses from --vmnet-gateway + 1 to --vmnet-dhcp-end, see dhcp.h
+  bool dhcp_server;
+  // --dhcp-lease-file; keeps the leases of --dhcp-server across restarts
+  char *dhcp_lease_file;
   // arg
   char *socket_path;
 };
@@ -0,0 +1,161 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "log.h"
+
+#define CONTROL_MAX_LINE 1024
+#define CONTROL_MAX_ARGS 32
+#define CONTROL_TIMEOUT_SEC 1
+
+int control_bindlisten(const char *path) {
+  struct sockaddr_un addr = {0};
+  if (strlen(path) + 1 > sizeof(addr.sun_path)) {
+    ERRORF("the control socket path is too long: %s", path);
+    return -1;
+  }
+  int fd = socket(PF_LOCAL, SOCK_STREAM, 0);
+  if (fd < 0) {
+    ERRORN("socket");
+    return -1;
+  }
+  addr.sun_family = PF_LOCAL;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  unlink(path); /* avoid EADDRINUSE */
+  // Never accessible by others, not even for a moment.
+  mode_t old_umask = umask(0077);
+  int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(old_umask);
+  if (ret < 0) {
+    ERRORN("bind");
+    goto err;
+  }
+  if (listen(fd, SOMAXCONN) < 0) {
+    ERRORN("listen");
+    goto err;
+  }
+  return fd;
+err:
+  close(fd);
+  return -1;
+}
+
+static int control_read_line(int fd, char *line, size_t size) {
+  size_t len = 0;
+  while (len + 1 < size) {
+    ssize_t n = read(fd, line + len, size - 1 - len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    len += n;
+    if (memchr(line + len - n, '\n', n) != NULL)
+      break;
+  }
+  line[len] = '\0';
+  char *nl = strpbrk(line, "\r\n");
+  if (nl != NULL)
+    *nl = '\0';
+  else if (len + 1 >= size)
+    return -1; // too long
+  return len > 0 ? 0 : -1;
+}
+
+static void control_help(FILE *out, const struct control_command *commands, size_t count) {
+  fprintf(out, "commands:\n");
+  for (size_t i = 0; i < count; i++)
+    fprintf(out, "  %s\n", commands[i].usage);
+}
+
+// Returns the number of words of name matched by argv, or 0.
+static int control_match(const char *name, int argc, char *argv[]) {
+  int i = 0;
+  for (const char *p = name; *p != '\0'; i++) {
+    size_t len = strcspn(p, " ");
+    if (i >= argc || strlen(argv[i]) != len || strncmp(argv[i], p, len) != 0)
+      return 0;
+    p += len;
+    p += strspn(p, " ");
+  }
+  return i;
+}
+
+void control_serve(int listen_fd, const struct control_command *commands, size_t count,
+                   void *ctx) {
+  int fd = accept(listen_fd, NULL, NULL);
+  if (fd < 0) {
+    ERRORN("accept(control)");
+    return;
+  }
+  struct timeval timeout = {.tv_sec = CONTROL_TIMEOUT_SEC};
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+    ERRORN("setsockopt(SO_RCVTIMEO/SO_SNDTIMEO)");
+    close(fd);
+    return;
+  }
+  // Handlers write to memory, so that they never wait for the client while
+  // holding a lock.
+  char *reply = NULL;
+  size_t reply_len = 0;
+  FILE *out = open_memstream(&reply, &reply_len);
+  if (out == NULL) {
+    ERRORN("open_memstream");
+    close(fd);
+    return;
+  }
+  char line[CONTROL_MAX_LINE];
+  if (control_read_line(fd, line, sizeof(line)) < 0) {
+    fprintf(out, "error: expected a command line\n");
+    goto done;
+  }
+  char *argv[CONTROL_MAX_ARGS];
+  int argc = 0;
+  char *saveptr = NULL;
+  for (char *tok = strtok_r(line, " \t", &saveptr); tok != NULL;
+       tok = strtok_r(NULL, " \t", &saveptr)) {
+    if (argc == CONTROL_MAX_ARGS) {
+      fprintf(out, "error: too many arguments\n");
+      goto done;
+    }
+    argv[argc++] = tok;
+  }
+  DEBUGF("Control command: \"%s\"", argc > 0 ? argv[0] : "");
+  // Prefer the longest match, e.g., "stats reset" over "stats".
+  const struct control_command *best = NULL;
+  int best_words = 0;
+  for (size_t i = 0; i < count; i++) {
+    int words = control_match(commands[i].name, argc, argv);
+    if (words > best_words) {
+      best = &commands[i];
+      best_words = words;
+    }
+  }
+  if (best == NULL) {
+    if (argc == 0 || strcmp(argv[0], "help") != 0)
+      fprintf(out, "error: unknown command\n");
+    control_help(out, commands, count);
+    goto done;
+  }
+  best->handler(out, argc - best_words, argv + best_words, ctx);
+done:
+  fclose(out);
+  for (size_t off = 0; off < reply_len;) {
+    ssize_t n = write(fd, reply + off, reply_len - off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    off += n;
+  }
+  free(reply);
+  close(fd);
+}
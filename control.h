@@ -0,0 +1,27 @@
+#ifndef SOCKET_VMNET_CONTROL_H
+#define SOCKET_VMNET_CONTROL_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Control socket (--control-socket): a client connects, writes one command
+// line, e.g., "capture start /tmp/vm.pcapng", and reads the reply until EOF.
+//
+//   echo "help" | sudo nc -U /var/run/socket_vmnet.ctl
+
+struct control_command {
+  const char *name; // one or more words, e.g., "capture start"
+  const char *usage;
+  // Writes the reply to out; argv holds the words following name.
+  void (*handler)(FILE *out, int argc, char *argv[], void *ctx);
+};
+
+// Binds and listens on path, accessible only by the owner (root).
+int control_bindlisten(const char *path);
+
+// Accepts a client on listen_fd and serves its command. Gives up on clients
+// that do not send a full line quickly, so that it never stalls the caller.
+void control_serve(int listen_fd, const struct control_command *commands, size_t count,
+                   void *ctx);
+
+#endif /* SOCKET_VMNET_CONTROL_H */
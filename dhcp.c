@@ -0,0 +1,478 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dhcp.h"
+#include "ether.h"
+#include "log.h"
+
+#define IP_HDR_LEN 20
+#define UDP_HDR_LEN 8
+#define DHCP_SERVER_PORT 67
+#define DHCP_CLIENT_PORT 68
+// BOOTP message (RFC 2131): fixed fields up to the file name, then the magic
+// cookie and the options.
+#define BOOTP_OP_REQUEST 1
+#define BOOTP_OP_REPLY 2
+#define BOOTP_FLAGS 10
+#define BOOTP_CIADDR 12
+#define BOOTP_YIADDR 16
+#define BOOTP_GIADDR 24
+#define BOOTP_CHADDR 28
+#define BOOTP_COOKIE 236
+#define BOOTP_OPTIONS 240
+#define BOOTP_MIN_LEN 300
+#define BOOTP_FLAG_BROADCAST 0x8000
+static const uint8_t dhcp_cookie[4] = {99, 130, 83, 99};
+
+// Options (RFC 2132)
+#define OPT_PAD 0
+#define OPT_SUBNET_MASK 1
+#define OPT_ROUTER 3
+#define OPT_DNS 6
+#define OPT_REQUESTED_ADDRESS 50
+#define OPT_LEASE_TIME 51
+#define OPT_MESSAGE_TYPE 53
+#define OPT_SERVER_ID 54
+#define OPT_RENEWAL_TIME 58
+#define OPT_REBINDING_TIME 59
+#define OPT_END 255
+
+#define DHCPDISCOVER 1
+#define DHCPOFFER 2
+#define DHCPREQUEST 3
+#define DHCPDECLINE 4
+#define DHCPACK 5
+#define DHCPNAK 6
+#define DHCPRELEASE 7
+#define DHCPINFORM 8
+
+// Replies come from this locally administered address; the server is not a
+// VM, and has no address of its own on the network.
+static const uint8_t dhcp_server_mac[ETHER_ADDR_LEN] = {0x02, 0x00, 0x00, 0x44, 0x48, 0x43};
+
+// Lease file: a header, then one lease per address of the pool, in native byte
+// order. Leases are updated in place.
+#define LEASE_MAGIC "SVMDHCP"
+#define LEASE_VERSION 1
+
+struct lease_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  uint32_t first; // host byte order
+  uint32_t mask;
+};
+
+enum lease_state {
+  LEASE_FREE = 0,
+  LEASE_OFFERED = 1,
+  LEASE_BOUND = 2,
+  LEASE_DECLINED = 3, // in use by a host we do not know
+};
+
+struct lease {
+  uint8_t mac[ETHER_ADDR_LEN];
+  uint8_t state;
+  uint8_t reserved;
+  int64_t expires; // seconds since the epoch
+};
+
+_Static_assert(sizeof(struct lease) == 16, "leases are 16 bytes");
+
+struct dhcp {
+  pthread_mutex_t lock;
+  uint32_t server; // host byte order
+  uint32_t first;
+  uint32_t mask;
+  void *map;
+  size_t map_len;
+  struct lease_header *header;
+  struct lease *leases;
+  struct dhcp_stats stats;
+};
+
+// A parsed client message
+struct dhcp_message {
+  const uint8_t *bootp;
+  uint8_t type;
+  uint32_t requested; // 0 if none
+  uint32_t server_id; // 0 if none
+};
+
+static uint16_t get16(const uint8_t *p) { return (uint16_t)(p[0] << 8 | p[1]); }
+
+static uint32_t get32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v & 0xFF;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  put16(p, v >> 16);
+  put16(p + 2, v & 0xFFFF);
+}
+
+struct dhcp *dhcp_open(const struct dhcp_pool *pool, const char *lease_path) {
+  uint32_t first = ntohl(pool->first.s_addr);
+  uint32_t last = ntohl(pool->last.s_addr);
+  if (last < first || last - first >= DHCP_MAX_LEASES) {
+    ERRORF("Invalid DHCP pool: %u addresses", last - first + 1);
+    return NULL;
+  }
+  struct dhcp *d = calloc(1, sizeof(*d));
+  if (d == NULL) {
+    ERRORN("calloc");
+    return NULL;
+  }
+  pthread_mutex_init(&d->lock, NULL);
+  d->server = ntohl(pool->server.s_addr);
+  d->first = first;
+  d->mask = ntohl(pool->mask.s_addr);
+  uint32_t count = last - first + 1;
+  d->map_len = sizeof(struct lease_header) + count * sizeof(struct lease);
+
+  int fd = -1;
+  if (lease_path != NULL) {
+    fd = open(lease_path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      ERRORF("Failed to open DHCP lease file \"%s\": %s", lease_path, strerror(errno));
+      goto err;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (st.st_size != (off_t)d->map_len &&
+                                 ftruncate(fd, (off_t)d->map_len) == -1)) {
+      ERRORF("Failed to size DHCP lease file \"%s\": %s", lease_path, strerror(errno));
+      goto err;
+    }
+    d->map = mmap(NULL, d->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  } else {
+    d->map = mmap(NULL, d->map_len, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+  }
+  if (d->map == MAP_FAILED) {
+    ERRORN("mmap");
+    d->map = NULL;
+    goto err;
+  }
+  if (fd != -1)
+    close(fd);
+  fd = -1;
+
+  d->header = d->map;
+  d->leases = (struct lease *)(d->header + 1);
+  struct lease_header *h = d->header;
+  if (memcmp(h->magic, LEASE_MAGIC, sizeof(LEASE_MAGIC)) != 0 || h->version != LEASE_VERSION ||
+      h->count != count || h->first != first || h->mask != d->mask) {
+    if (lease_path != NULL && h->magic[0] != '\0')
+      INFOF("DHCP pool changed, discarding the leases in \"%s\"", lease_path);
+    memset(d->map, 0, d->map_len);
+    memcpy(h->magic, LEASE_MAGIC, sizeof(LEASE_MAGIC));
+    h->version = LEASE_VERSION;
+    h->count = count;
+    h->first = first;
+    h->mask = d->mask;
+  }
+  return d;
+err:
+  if (fd != -1)
+    close(fd);
+  dhcp_close(d);
+  return NULL;
+}
+
+void dhcp_close(struct dhcp *d) {
+  if (d == NULL)
+    return;
+  if (d->map != NULL) {
+    msync(d->map, d->map_len, MS_SYNC);
+    munmap(d->map, d->map_len);
+  }
+  pthread_mutex_destroy(&d->lock);
+  free(d);
+}
+
+// Returns the UDP payload of an untagged DHCP message to a server, or NULL.
+static const uint8_t *bootp_request(const uint8_t *frame, size_t len, size_t *bootp_len) {
+  if (len < ETHER_HDR_LEN + IP_HDR_LEN + UDP_HDR_LEN + BOOTP_OPTIONS ||
+      ether_type(frame) != ETHERTYPE_IP)
+    return NULL;
+  const uint8_t *ip = frame + ETHER_HDR_LEN;
+  size_t ihl = (size_t)(ip[0] & 0x0F) * 4;
+  // IPv4, UDP, not a fragment
+  if (ip[0] >> 4 != 4 || ihl < IP_HDR_LEN || ip[9] != IPPROTO_UDP || (get16(ip + 6) & 0x3FFF) != 0)
+    return NULL;
+  size_t ip_len = get16(ip + 2);
+  if (ip_len < ihl + UDP_HDR_LEN + BOOTP_OPTIONS || ETHER_HDR_LEN + ip_len > len)
+    return NULL;
+  const uint8_t *udp = ip + ihl;
+  if (get16(udp) != DHCP_CLIENT_PORT || get16(udp + 2) != DHCP_SERVER_PORT)
+    return NULL;
+  size_t udp_len = get16(udp + 4);
+  if (udp_len < UDP_HDR_LEN + BOOTP_OPTIONS || udp_len > ip_len - ihl)
+    return NULL;
+  *bootp_len = udp_len - UDP_HDR_LEN;
+  return udp + UDP_HDR_LEN;
+}
+
+bool dhcp_is_client_message(const uint8_t *frame, size_t len) {
+  size_t bootp_len;
+  return bootp_request(frame, len, &bootp_len) != NULL;
+}
+
+static bool dhcp_parse(const uint8_t *frame, size_t len, struct dhcp_message *m) {
+  size_t bootp_len;
+  const uint8_t *bootp = bootp_request(frame, len, &bootp_len);
+  if (bootp == NULL || bootp[0] != BOOTP_OP_REQUEST || bootp[1] != 1 ||
+      bootp[2] != ETHER_ADDR_LEN || memcmp(bootp + BOOTP_COOKIE, dhcp_cookie, 4) != 0)
+    return false;
+  memset(m, 0, sizeof(*m));
+  m->bootp = bootp;
+  size_t off = BOOTP_OPTIONS;
+  while (off < bootp_len && bootp[off] != OPT_END) {
+    if (bootp[off] == OPT_PAD) {
+      off++;
+      continue;
+    }
+    if (off + 2 > bootp_len || off + 2 + bootp[off + 1] > bootp_len)
+      return false;
+    const uint8_t *val = bootp + off + 2;
+    uint8_t opt_len = bootp[off + 1];
+    switch (bootp[off]) {
+    case OPT_MESSAGE_TYPE:
+      if (opt_len == 1)
+        m->type = val[0];
+      break;
+    case OPT_REQUESTED_ADDRESS:
+      if (opt_len == 4)
+        m->requested = get32(val);
+      break;
+    case OPT_SERVER_ID:
+      if (opt_len == 4)
+        m->server_id = get32(val);
+      break;
+    }
+    off += 2 + opt_len;
+  }
+  return m->type != 0; // plain BOOTP is not supported
+}
+
+static bool lease_expired(const struct lease *l, int64_t now) {
+  return l->state == LEASE_FREE || l->expires <= now;
+}
+
+static bool lease_owned(const struct lease *l, const uint8_t mac[ETHER_ADDR_LEN]) {
+  return (l->state == LEASE_OFFERED || l->state == LEASE_BOUND) &&
+         memcmp(l->mac, mac, ETHER_ADDR_LEN) == 0;
+}
+
+// Returns the lease of addr, or NULL if addr is not in the pool.
+static struct lease *dhcp_lease(struct dhcp *d, uint32_t addr) {
+  if (addr < d->first || addr - d->first >= d->header->count || addr == d->server)
+    return NULL;
+  return &d->leases[addr - d->first];
+}
+
+static uint32_t dhcp_lease_addr(const struct dhcp *d, const struct lease *l) {
+  return d->first + (uint32_t)(l - d->leases);
+}
+
+// Chooses the address to offer to mac: its previous one, the requested one, a
+// never used one, or the one expired for the longest time, in this order.
+static struct lease *dhcp_choose(struct dhcp *d, const uint8_t mac[ETHER_ADDR_LEN],
+                                 uint32_t requested, int64_t now) {
+  struct lease *fresh = NULL, *oldest = NULL;
+  for (uint32_t i = 0; i < d->header->count; i++) {
+    struct lease *l = &d->leases[i];
+    if (lease_owned(l, mac))
+      return l;
+    if (!lease_expired(l, now) || d->first + i == d->server)
+      continue;
+    if (l->state == LEASE_FREE) {
+      if (fresh == NULL)
+        fresh = l;
+    } else if (oldest == NULL || l->expires < oldest->expires) {
+      oldest = l;
+    }
+  }
+  struct lease *l = dhcp_lease(d, requested);
+  if (l != NULL && lease_expired(l, now))
+    return l;
+  return fresh != NULL ? fresh : oldest;
+}
+
+static void dhcp_commit(struct dhcp *d, struct lease *l, const uint8_t mac[ETHER_ADDR_LEN],
+                        enum lease_state state, int64_t expires) {
+  memcpy(l->mac, mac, ETHER_ADDR_LEN);
+  l->state = state;
+  l->expires = expires;
+  msync(d->map, d->map_len, MS_ASYNC);
+}
+
+static uint8_t *put_option32(uint8_t *p, uint8_t opt, uint32_t v) {
+  p[0] = opt;
+  p[1] = 4;
+  put32(p + 2, v);
+  return p + 6;
+}
+
+static uint16_t ip_checksum(const uint8_t *ip) {
+  uint32_t sum = 0;
+  for (size_t i = 0; i < IP_HDR_LEN; i += 2)
+    sum += get16(ip + i);
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return (uint16_t)~sum;
+}
+
+// Writes the reply of type to m, for the address yiaddr, and returns its
+// length.
+static size_t dhcp_build_reply(const struct dhcp *d, const struct dhcp_message *m, uint8_t type,
+                               uint32_t yiaddr, uint8_t reply[DHCP_REPLY_LEN]) {
+  const uint8_t *req = m->bootp;
+  uint32_t ciaddr = get32(req + BOOTP_CIADDR);
+  memset(reply, 0, DHCP_REPLY_LEN);
+
+  // Clients without an address yet cannot receive unicast before the ARP
+  // resolution, unless they say so (RFC 2131 4.1).
+  bool broadcast = type == DHCPNAK || (get16(req + BOOTP_FLAGS) & BOOTP_FLAG_BROADCAST) != 0;
+  uint32_t dst = broadcast ? INADDR_BROADCAST : (type == DHCPACK && ciaddr != 0 ? ciaddr : yiaddr);
+  if (broadcast)
+    memset(reply, 0xFF, ETHER_ADDR_LEN);
+  else
+    memcpy(reply, req + BOOTP_CHADDR, ETHER_ADDR_LEN);
+  memcpy(reply + ETHER_ADDR_LEN, dhcp_server_mac, ETHER_ADDR_LEN);
+  put16(reply + ETHER_TYPE_OFFSET, ETHERTYPE_IP);
+
+  uint8_t *ip = reply + ETHER_HDR_LEN;
+  uint8_t *udp = ip + IP_HDR_LEN;
+  uint8_t *bootp = udp + UDP_HDR_LEN;
+  bootp[0] = BOOTP_OP_REPLY;
+  memcpy(bootp + 1, req + 1, 3);                       // htype, hlen, hops
+  memcpy(bootp + 4, req + 4, 4);                       // xid
+  memcpy(bootp + BOOTP_FLAGS, req + BOOTP_FLAGS, 2);   // flags
+  memcpy(bootp + BOOTP_CIADDR, req + BOOTP_CIADDR, 4); // ciaddr
+  put32(bootp + BOOTP_YIADDR, yiaddr);
+  memcpy(bootp + BOOTP_GIADDR, req + BOOTP_GIADDR, 4 + 16); // giaddr, chaddr
+  memcpy(bootp + BOOTP_COOKIE, dhcp_cookie, 4);
+
+  uint8_t *opt = bootp + BOOTP_OPTIONS;
+  *opt++ = OPT_MESSAGE_TYPE;
+  *opt++ = 1;
+  *opt++ = type;
+  opt = put_option32(opt, OPT_SERVER_ID, d->server);
+  if (type != DHCPNAK) {
+    if (type != DHCPACK || m->type != DHCPINFORM) {
+      opt = put_option32(opt, OPT_LEASE_TIME, DHCP_LEASE_SECONDS);
+      opt = put_option32(opt, OPT_RENEWAL_TIME, DHCP_LEASE_SECONDS / 2);
+      opt = put_option32(opt, OPT_REBINDING_TIME, DHCP_LEASE_SECONDS / 8 * 7);
+    }
+    opt = put_option32(opt, OPT_SUBNET_MASK, d->mask);
+    opt = put_option32(opt, OPT_ROUTER, d->server);
+    opt = put_option32(opt, OPT_DNS, d->server);
+  }
+  *opt = OPT_END;
+
+  size_t udp_len = UDP_HDR_LEN + BOOTP_MIN_LEN;
+  ip[0] = 0x45;
+  put16(ip + 2, (uint16_t)(IP_HDR_LEN + udp_len));
+  ip[8] = 64; // TTL
+  ip[9] = IPPROTO_UDP;
+  put32(ip + 12, d->server);
+  put32(ip + 16, dst);
+  put16(ip + 10, ip_checksum(ip));
+  put16(udp, DHCP_SERVER_PORT);
+  put16(udp + 2, DHCP_CLIENT_PORT);
+  put16(udp + 4, (uint16_t)udp_len); // no UDP checksum, optional with IPv4
+  return DHCP_REPLY_LEN;
+}
+
+size_t dhcp_handle(struct dhcp *d, const uint8_t *frame, size_t len,
+                   uint8_t reply[DHCP_REPLY_LEN]) {
+  struct dhcp_message m;
+  if (!dhcp_parse(frame, len, &m))
+    return 0;
+  const uint8_t *mac = m.bootp + BOOTP_CHADDR;
+  int64_t now = time(NULL);
+  size_t reply_len = 0;
+  pthread_mutex_lock(&d->lock);
+  struct lease *l;
+  switch (m.type) {
+  case DHCPDISCOVER:
+    d->stats.discovers++;
+    l = dhcp_choose(d, mac, m.requested, now);
+    if (l == NULL) {
+      WARN("DHCP pool exhausted");
+      break;
+    }
+    if (!lease_owned(l, mac) || lease_expired(l, now))
+      dhcp_commit(d, l, mac, LEASE_OFFERED, now + DHCP_OFFER_SECONDS);
+    reply_len = dhcp_build_reply(d, &m, DHCPOFFER, dhcp_lease_addr(d, l), reply);
+    break;
+  case DHCPREQUEST: {
+    d->stats.requests++;
+    // Selecting another server
+    if (m.server_id != 0 && m.server_id != d->server)
+      break;
+    // SELECTING or INIT-REBOOT with the requested address; RENEWING or
+    // REBINDING with the client address.
+    uint32_t addr = m.requested != 0 ? m.requested : get32(m.bootp + BOOTP_CIADDR);
+    l = dhcp_lease(d, addr);
+    if (l == NULL || (!lease_owned(l, mac) && !lease_expired(l, now))) {
+      d->stats.naks++;
+      reply_len = dhcp_build_reply(d, &m, DHCPNAK, 0, reply);
+      break;
+    }
+    dhcp_commit(d, l, mac, LEASE_BOUND, now + DHCP_LEASE_SECONDS);
+    d->stats.acks++;
+    reply_len = dhcp_build_reply(d, &m, DHCPACK, addr, reply);
+    break;
+  }
+  case DHCPDECLINE:
+    l = dhcp_lease(d, m.requested);
+    if (l != NULL && lease_owned(l, mac)) {
+      WARNF("DHCP address %u.%u.%u.%u declined: in use", m.requested >> 24,
+            m.requested >> 16 & 0xFF, m.requested >> 8 & 0xFF, m.requested & 0xFF);
+      dhcp_commit(d, l, l->mac, LEASE_DECLINED, now + DHCP_LEASE_SECONDS);
+    }
+    break;
+  case DHCPRELEASE:
+    d->stats.releases++;
+    l = dhcp_lease(d, get32(m.bootp + BOOTP_CIADDR));
+    // Keep the address for the client, should it come back.
+    if (l != NULL && lease_owned(l, mac))
+      dhcp_commit(d, l, mac, LEASE_OFFERED, now);
+    break;
+  case DHCPINFORM:
+    d->stats.acks++;
+    reply_len = dhcp_build_reply(d, &m, DHCPACK, 0, reply);
+    break;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return reply_len;
+}
+
+void dhcp_get_stats(struct dhcp *d, bool reset, struct dhcp_stats *stats) {
+  int64_t now = time(NULL);
+  pthread_mutex_lock(&d->lock);
+  *stats = d->stats;
+  if (reset)
+    memset(&d->stats, 0, sizeof(d->stats));
+  stats->bound = 0;
+  for (uint32_t i = 0; i < d->header->count; i++) {
+    if (d->leases[i].state == LEASE_BOUND && !lease_expired(&d->leases[i], now))
+      stats->bound++;
+  }
+  pthread_mutex_unlock(&d->lock);
+}
@@ -0,0 +1,59 @@
+#ifndef SOCKET_VMNET_DHCP_H
+#define SOCKET_VMNET_DHCP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+// DHCPv4 server for the networks without the vmnet one (--vmnet-disable-dhcp).
+// The daemon answers the DHCP messages of the VMs before flooding them, from
+// a pool of addresses. The leases are kept in a file mapped in memory, so
+// that they survive a restart.
+
+#define DHCP_LEASE_SECONDS 3600
+// Offered addresses are reserved until the client requests them.
+#define DHCP_OFFER_SECONDS 60
+// The largest pool; a /16 network
+#define DHCP_MAX_LEASES 65536
+
+// Ethernet, IPv4, UDP, and a BOOTP message padded to 300 bytes (RFC 1542)
+#define DHCP_REPLY_LEN (14 + 20 + 8 + 300)
+
+struct dhcp_pool {
+  struct in_addr server; // the gateway; also the router and the DNS server
+  struct in_addr first;
+  struct in_addr last;
+  struct in_addr mask;
+};
+
+struct dhcp_stats {
+  uint64_t discovers;
+  uint64_t requests;
+  uint64_t acks;
+  uint64_t naks;
+  uint64_t releases;
+  uint32_t bound; // leases not expired
+};
+
+struct dhcp;
+
+// Starts serving pool, with the leases in lease_path, or in memory only if
+// NULL. The leases of another pool are discarded.
+struct dhcp *dhcp_open(const struct dhcp_pool *pool, const char *lease_path);
+
+void dhcp_close(struct dhcp *d);
+
+// Returns true if frame is an untagged DHCP message to a server.
+bool dhcp_is_client_message(const uint8_t *frame, size_t len);
+
+// Handles a DHCP message from a VM. Returns the length of the reply, or 0 if
+// there is none. Thread-safe.
+size_t dhcp_handle(struct dhcp *d, const uint8_t *frame, size_t len,
+                   uint8_t reply[DHCP_REPLY_LEN]);
+
+// Reads the counters, and zeroes them if reset.
+void dhcp_get_stats(struct dhcp *d, bool reset, struct dhcp_stats *stats);
+
+#endif /* SOCKET_VMNET_DHCP_H */
@@ -0,0 +1,380 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "arena.h"
+#include "log.h"
+#include "egress.h"
+
+#define EGRESS_MIN_BURST (132 * 1024)
+
+struct egress_record {
+  uint32_t len;
+  uint32_t reserved;
+  uint64_t queued_ns;
+};
+
+struct egress {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool waiting; // the thread waits for cond
+  bool stopping;
+  // FIFO of the queues with frames, per class
+  struct egress_queue *head[EGRESS_CLASS_COUNT];
+  struct egress_queue *tail[EGRESS_CLASS_COUNT];
+  size_t max_frame_len;
+  uint8_t *batch_buf;
+  struct iovec batch[EGRESS_BATCH];
+  egress_output_fn output;
+  void *ctx;
+  pthread_t thread;
+};
+
+static void ring_write(struct egress_queue *q, const void *src, size_t len) {
+  size_t tail = (q->head + q->len) % EGRESS_QUEUE_BYTES;
+  size_t first = len < EGRESS_QUEUE_BYTES - tail ? len : EGRESS_QUEUE_BYTES - tail;
+  memcpy(q->buf + tail, src, first);
+  memcpy(q->buf, (const uint8_t *)src + first, len - first);
+  q->len += len;
+}
+
+static void ring_peek(const struct egress_queue *q, void *dst, size_t len) {
+  size_t first = len < EGRESS_QUEUE_BYTES - q->head ? len : EGRESS_QUEUE_BYTES - q->head;
+  memcpy(dst, q->buf + q->head, first);
+  memcpy((uint8_t *)dst + first, q->buf, len - first);
+}
+
+static void ring_read(struct egress_queue *q, void *dst, size_t len) {
+  ring_peek(q, dst, len);
+  q->head = (q->head + len) % EGRESS_QUEUE_BYTES;
+  q->len -= len;
+}
+
+static void egress_push(struct egress *s, enum egress_class cls, struct egress_queue *q) {
+  q->next = NULL;
+  if (s->tail[cls] != NULL)
+    s->tail[cls]->next = q;
+  else
+    s->head[cls] = q;
+  s->tail[cls] = q;
+}
+
+static struct egress_queue *egress_pop(struct egress *s, enum egress_class cls) {
+  struct egress_queue *q = s->head[cls];
+  s->head[cls] = q->next;
+  if (s->head[cls] == NULL)
+    s->tail[cls] = NULL;
+  q->next = NULL;
+  return q;
+}
+
+static void flow_refill(struct egress_flow *flow, uint64_t now) {
+  if (flow->rate == 0)
+    return;
+  uint64_t elapsed = now - flow->refilled_ns;
+  if (elapsed > 1000000000)
+    elapsed = 1000000000; // avoids overflows; the bucket is full anyway
+  uint64_t tokens = flow->tokens + elapsed * flow->rate / 1000000000;
+  flow->tokens = tokens < flow->burst ? tokens : flow->burst;
+  flow->refilled_ns = now;
+}
+
+// Moves up to EGRESS_BATCH frames to the batch, visiting every active queue at
+// most once. Returns the number of frames; sets *short_deficit if a queue
+// needs more rounds for its next frame, and *wake_ns to when a rate limited
+// queue gets enough tokens.
+static int egress_round(struct egress *s, uint64_t now, uint64_t *wake_ns, bool *short_deficit) {
+  int n = 0;
+  for (int cls = 0; cls < EGRESS_CLASS_COUNT && n < EGRESS_BATCH; cls++) {
+    // Every queue is visited at most once per batch.
+    struct egress_queue *last = s->tail[cls];
+    while (s->head[cls] != NULL && n < EGRESS_BATCH) {
+      struct egress_queue *q = egress_pop(s, cls);
+      bool was_last = q == last;
+      struct egress_flow *flow = q->flow;
+      flow_refill(flow, now);
+      if (!q->visited) {
+        q->deficit += EGRESS_QUANTUM;
+        q->visited = true;
+      }
+      bool blocked = false, throttled = false;
+      while (q->len > 0 && n < EGRESS_BATCH) {
+        struct egress_record rec;
+        ring_peek(q, &rec, sizeof(rec));
+        if (rec.len > q->deficit) {
+          *short_deficit = true;
+          blocked = true;
+          break;
+        }
+        if (flow->rate != 0 && rec.len > flow->tokens) {
+          uint64_t wake = now + (rec.len - flow->tokens) * 1000000000 / flow->rate + 1;
+          if (*wake_ns == 0 || wake < *wake_ns)
+            *wake_ns = wake;
+          blocked = true;
+          throttled = true;
+          break;
+        }
+        ring_read(q, &rec, sizeof(rec));
+        uint8_t *dst = s->batch_buf + n * s->max_frame_len;
+        ring_read(q, dst, rec.len);
+        s->batch[n].iov_base = dst;
+        s->batch[n].iov_len = rec.len;
+        n++;
+        q->deficit -= rec.len;
+        if (flow->rate != 0)
+          flow->tokens -= rec.len;
+        flow->sent++;
+        if (flow->wait != NULL)
+          hist_record(flow->wait, now - rec.queued_ns);
+      }
+      if (q->len == 0) {
+        // Idle queues do not accumulate credit.
+        q->active = false;
+        q->visited = false;
+        q->deficit = 0;
+      } else if (!blocked) {
+        // The batch is full; carry on with this queue next time.
+        q->next = s->head[cls];
+        s->head[cls] = q;
+        if (s->tail[cls] == NULL)
+          s->tail[cls] = q;
+        break;
+      } else {
+        // A queue waiting for tokens keeps the deficit it has, without a new
+        // quantum each round: otherwise it would burst past the other queues
+        // of its class once the tokens are there.
+        q->visited = throttled;
+        egress_push(s, cls, q);
+      }
+      if (was_last)
+        break;
+    }
+  }
+  return n;
+}
+
+// Returns the number of frames moved to the batch; if 0, *wake_ns is when a
+// rate limited queue gets enough tokens, or 0 if every queue is empty.
+static int egress_collect(struct egress *s, uint64_t *wake_ns) {
+  uint64_t now = hist_now();
+  int n;
+  bool short_deficit;
+  do {
+    // Frames larger than the quantum take several rounds.
+    *wake_ns = 0;
+    short_deficit = false;
+    n = egress_round(s, now, wake_ns, &short_deficit);
+  } while (n == 0 && short_deficit);
+  return n;
+}
+
+// Moves up to EGRESS_BATCH frames to the batch, in class order, regardless of
+// the quanta and the rate limits. Returns the number of frames.
+static int egress_collect_all(struct egress *s) {
+  int n = 0;
+  for (int cls = 0; cls < EGRESS_CLASS_COUNT && n < EGRESS_BATCH; cls++) {
+    while (s->head[cls] != NULL && n < EGRESS_BATCH) {
+      struct egress_queue *q = s->head[cls];
+      while (q->len > 0 && n < EGRESS_BATCH) {
+        struct egress_record rec;
+        ring_read(q, &rec, sizeof(rec));
+        uint8_t *dst = s->batch_buf + n * s->max_frame_len;
+        ring_read(q, dst, rec.len);
+        s->batch[n].iov_base = dst;
+        s->batch[n].iov_len = rec.len;
+        n++;
+        q->flow->sent++;
+      }
+      if (q->len > 0)
+        break;
+      egress_pop(s, cls);
+      q->active = false;
+      q->visited = false;
+      q->deficit = 0;
+    }
+  }
+  return n;
+}
+
+static void *egress_main(void *arg) {
+  struct egress *s = arg;
+  pthread_mutex_lock(&s->lock);
+  while (!s->stopping) {
+    uint64_t wake_ns;
+    int n = egress_collect(s, &wake_ns);
+    if (n > 0) {
+      pthread_mutex_unlock(&s->lock);
+      s->output(s->ctx, s->batch, n);
+      pthread_mutex_lock(&s->lock);
+      continue;
+    }
+    s->waiting = true;
+    if (wake_ns == 0) {
+      pthread_cond_wait(&s->cond, &s->lock);
+    } else {
+      // pthread_cond_timedwait takes CLOCK_REALTIME.
+      uint64_t now = hist_now();
+      uint64_t delay = wake_ns > now ? wake_ns - now : 0;
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      uint64_t deadline = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec + delay;
+      ts.tv_sec = deadline / 1000000000;
+      ts.tv_nsec = deadline % 1000000000;
+      pthread_cond_timedwait(&s->cond, &s->lock, &ts);
+    }
+    s->waiting = false;
+  }
+  // Write the frames queued before egress_stop; no more can be queued.
+  int n;
+  while ((n = egress_collect_all(s)) > 0) {
+    pthread_mutex_unlock(&s->lock);
+    s->output(s->ctx, s->batch, n);
+    pthread_mutex_lock(&s->lock);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+struct egress *egress_create(size_t max_frame_len, egress_output_fn output, void *ctx) {
+  struct egress *s = calloc(1, sizeof(*s));
+  if (s == NULL) {
+    ERRORN("calloc");
+    return NULL;
+  }
+  s->max_frame_len = max_frame_len;
+  s->output = output;
+  s->ctx = ctx;
+  s->batch_buf = arena_alloc(EGRESS_BATCH * max_frame_len);
+  if (s->batch_buf == NULL) {
+    free(s);
+    return NULL;
+  }
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->cond, NULL);
+  int ret = pthread_create(&s->thread, NULL, egress_main, s);
+  if (ret != 0) {
+    ERRORF("pthread_create: %s", strerror(ret));
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    arena_free(s->batch_buf, EGRESS_BATCH * s->max_frame_len);
+    free(s);
+    return NULL;
+  }
+  return s;
+}
+
+void egress_stop(struct egress *s) {
+  pthread_mutex_lock(&s->lock);
+  bool stopped = s->stopping;
+  s->stopping = true;
+  pthread_cond_signal(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+  if (!stopped)
+    pthread_join(s->thread, NULL);
+}
+
+static void flow_set(struct egress_flow *flow, uint64_t rate, bool high_priority) {
+  flow->high_priority = high_priority;
+  flow->rate = rate / 8;
+  // Allow bursts of 20 ms, and at least two of the largest frames.
+  flow->burst = flow->rate / 50;
+  if (flow->burst < EGRESS_MIN_BURST)
+    flow->burst = EGRESS_MIN_BURST;
+  flow->tokens = flow->burst;
+  flow->refilled_ns = hist_now();
+}
+
+void egress_flow_init(struct egress *s, struct egress_flow *flow, uint64_t rate, bool high_priority,
+                      struct hist *wait) {
+  memset(flow, 0, sizeof(*flow));
+  for (int cls = 0; cls < EGRESS_CLASS_COUNT; cls++)
+    flow->queues[cls].flow = flow;
+  flow->wait = wait;
+  pthread_mutex_lock(&s->lock);
+  flow_set(flow, rate, high_priority);
+  pthread_mutex_unlock(&s->lock);
+}
+
+void egress_flow_configure(struct egress *s, struct egress_flow *flow, uint64_t rate,
+                           bool high_priority) {
+  pthread_mutex_lock(&s->lock);
+  flow_set(flow, rate, high_priority);
+  pthread_mutex_unlock(&s->lock);
+}
+
+void egress_flow_destroy(struct egress *s, struct egress_flow *flow) {
+  pthread_mutex_lock(&s->lock);
+  for (int cls = 0; cls < EGRESS_CLASS_COUNT; cls++) {
+    struct egress_queue *q = &flow->queues[cls];
+    if (q->active) {
+      struct egress_queue *prev = NULL;
+      for (struct egress_queue *p = s->head[cls]; p != NULL; prev = p, p = p->next) {
+        if (p != q)
+          continue;
+        if (prev != NULL)
+          prev->next = q->next;
+        else
+          s->head[cls] = q->next;
+        if (s->tail[cls] == q)
+          s->tail[cls] = prev;
+        break;
+      }
+    }
+    arena_free(q->buf, EGRESS_QUEUE_BYTES);
+    q->buf = NULL;
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+bool egress_enqueue(struct egress *s, struct egress_flow *flow, enum egress_class cls,
+                    const struct iovec *iov, int iovcnt) {
+  struct egress_record rec = {.queued_ns = hist_now()};
+  for (int i = 0; i < iovcnt; i++)
+    rec.len += (uint32_t)iov[i].iov_len;
+  if (rec.len > s->max_frame_len)
+    return false;
+  bool ok = false;
+  pthread_mutex_lock(&s->lock);
+  if (s->stopping) {
+    flow->dropped++;
+    goto done;
+  }
+  if (flow->high_priority)
+    cls = EGRESS_CLASS_HIGH;
+  struct egress_queue *q = &flow->queues[cls];
+  if (q->buf == NULL && (q->buf = arena_alloc(EGRESS_QUEUE_BYTES)) == NULL) {
+    flow->dropped++;
+    goto done;
+  }
+  if (q->len + sizeof(rec) + rec.len > EGRESS_QUEUE_BYTES) {
+    flow->dropped++;
+    goto done;
+  }
+  ring_write(q, &rec, sizeof(rec));
+  for (int i = 0; i < iovcnt; i++)
+    ring_write(q, iov[i].iov_base, iov[i].iov_len);
+  if (!q->active) {
+    q->active = true;
+    egress_push(s, cls, q);
+  }
+  if (s->waiting)
+    pthread_cond_signal(&s->cond);
+  ok = true;
+done:
+  pthread_mutex_unlock(&s->lock);
+  return ok;
+}
+
+void egress_flow_stats(struct egress *s, struct egress_flow *flow, bool reset, uint64_t *sent,
+                       uint64_t *dropped) {
+  pthread_mutex_lock(&s->lock);
+  *sent = flow->sent;
+  *dropped = flow->dropped;
+  if (reset) {
+    flow->sent = 0;
+    flow->dropped = 0;
+  }
+  pthread_mutex_unlock(&s->lock);
+}
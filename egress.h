@@ -0,0 +1,92 @@
+#ifndef SOCKET_VMNET_EGRESS_H
+#define SOCKET_VMNET_EGRESS_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "hist.h"
+
+// Egress scheduler in front of vmnet_write. The event loops queue the frames
+// of every connection; a dedicated thread writes them to vmnet in batches,
+// serving the connections in deficit round robin order, so that a VM pushing
+// a bulk transfer cannot hold back the small packets of the others. Frames of
+// the high priority class are always served first. A connection can also be
+// limited to a rate by a token bucket.
+
+enum egress_class {
+  EGRESS_CLASS_HIGH,
+  EGRESS_CLASS_NORMAL,
+  EGRESS_CLASS_COUNT,
+};
+
+// Bytes of frames queued per connection and class; frames beyond are dropped.
+#define EGRESS_QUEUE_BYTES (128 * 1024)
+// Bytes a connection may send per round; more than a full-sized frame.
+#define EGRESS_QUANTUM (2 * 1024)
+// Frames per call of the output function
+#define EGRESS_BATCH 32
+
+struct egress;
+struct egress_flow;
+
+// A connection of one class; a node of the active list of its class.
+struct egress_queue {
+  struct egress_flow *flow;
+  uint8_t *buf; // ring of [struct egress_record][frame], allocated on demand
+  size_t head;
+  size_t len;
+  size_t deficit;
+  bool active;  // in the active list
+  bool visited; // the quantum of the current round is granted, or waits for tokens
+  struct egress_queue *next;
+};
+
+// The egress state of a connection. Protected by the lock of the scheduler.
+struct egress_flow {
+  struct egress_queue queues[EGRESS_CLASS_COUNT];
+  bool high_priority; // every frame in EGRESS_CLASS_HIGH
+  // Token bucket; rate 0 means unlimited.
+  uint64_t rate;  // bytes per second
+  uint64_t burst; // bytes
+  uint64_t tokens;
+  uint64_t refilled_ns;
+  uint64_t sent;
+  uint64_t dropped;
+  struct hist *wait; // time spent in the queue, or NULL
+};
+
+// Writes count frames. Called by the scheduler thread only, without the lock.
+typedef void (*egress_output_fn)(void *ctx, const struct iovec *frames, int count);
+
+struct egress *egress_create(size_t max_frame_len, egress_output_fn output, void *ctx);
+
+// Writes the frames queued so far, regardless of the rate limits, and stops,
+// e.g., before stopping vmnet. The frames queued afterwards are dropped, so
+// the event loops can keep running until the process exits. Can be called
+// again.
+void egress_stop(struct egress *s);
+
+// Initializes flow. rate is in bits per second, 0 for unlimited.
+void egress_flow_init(struct egress *s, struct egress_flow *flow, uint64_t rate, bool high_priority,
+                      struct hist *wait);
+
+// Changes the rate limit and the priority of flow.
+void egress_flow_configure(struct egress *s, struct egress_flow *flow, uint64_t rate,
+                           bool high_priority);
+
+// Drops the queued frames of flow, and forgets it.
+void egress_flow_destroy(struct egress *s, struct egress_flow *flow);
+
+// Queues the frame made of iov for vmnet. Never blocks on the output; returns
+// false if the queue of flow is full and the frame was dropped.
+bool egress_enqueue(struct egress *s, struct egress_flow *flow, enum egress_class cls,
+                    const struct iovec *iov, int iovcnt);
+
+// Reads the counters of flow, and resets them if reset is true.
+void egress_flow_stats(struct egress *s, struct egress_flow *flow, bool reset, uint64_t *sent,
+                       uint64_t *dropped);
+
+#endif /* SOCKET_VMNET_EGRESS_H */
@@ -0,0 +1,55 @@
+#ifndef SOCKET_VMNET_ETHER_H
+#define SOCKET_VMNET_ETHER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include <net/ethernet.h>
+
+// Ethernet II header: destination, source, EtherType
+#define ETHER_TYPE_OFFSET (2 * ETHER_ADDR_LEN)
+
+// IEEE 802.1Q tag following the source address: ETHERTYPE_VLAN, then the TCI
+#define VLAN_TAG_LEN 4
+// VLAN of the connections on the main socket; their frames are not tagged on
+// the vmnet side.
+#define VLAN_NONE 0
+// VLAN IDs 0 and 4095 are reserved by 802.1Q.
+#define VLAN_MIN 1
+#define VLAN_MAX 4094
+
+static inline uint16_t ether_type(const uint8_t *frame) {
+  return (uint16_t)(frame[ETHER_TYPE_OFFSET] << 8 | frame[ETHER_TYPE_OFFSET + 1]);
+}
+
+// Returns the VLAN ID of an 802.1Q tagged frame, or VLAN_NONE if the frame is
+// not tagged.
+static inline uint16_t ether_vlan(const uint8_t *frame, size_t len) {
+  if (len < ETHER_HDR_LEN + VLAN_TAG_LEN || ether_type(frame) != ETHERTYPE_VLAN)
+    return VLAN_NONE;
+  return (uint16_t)((frame[ETHER_HDR_LEN] << 8 | frame[ETHER_HDR_LEN + 1]) & 0x0FFF);
+}
+
+// Returns the DSCP of an IPv4 or IPv6 frame, tagged or not, or 0.
+static inline uint8_t ether_dscp(const uint8_t *frame, size_t len) {
+  if (len < ETHER_HDR_LEN)
+    return 0;
+  size_t off = ETHER_HDR_LEN;
+  uint16_t type = ether_type(frame);
+  if (type == ETHERTYPE_VLAN && len >= ETHER_HDR_LEN + VLAN_TAG_LEN) {
+    type = (uint16_t)(frame[ETHER_HDR_LEN + 2] << 8 | frame[ETHER_HDR_LEN + 3]);
+    off += VLAN_TAG_LEN;
+  }
+  if (len < off + 2)
+    return 0;
+  if (type == ETHERTYPE_IP) // the TOS byte
+    return frame[off + 1] >> 2;
+  if (type == ETHERTYPE_IPV6) // the traffic class, after the version
+    return (uint8_t)(((frame[off] & 0x0F) << 4 | frame[off + 1] >> 4) >> 2);
+  return 0;
+}
+
+#endif /* SOCKET_VMNET_ETHER_H */
@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fault.h"
+#include "log.h"
+
+uint32_t fault_rates[FAULT_COUNT];
+
+static const char *const fault_names[FAULT_COUNT] = {
+    [FAULT_VMNET_READ] = "vmnet_read",
+    [FAULT_VMNET_WRITE] = "vmnet_write",
+    [FAULT_VMNET_RUNT] = "vmnet_runt",
+};
+
+int fault_init(const char *spec) {
+  char *copy = strdup(spec);
+  if (copy == NULL) {
+    ERRORN("strdup");
+    return -1;
+  }
+  int rc = -1;
+  char *saveptr = NULL;
+  for (char *item = strtok_r(copy, ",", &saveptr); item != NULL;
+       item = strtok_r(NULL, ",", &saveptr)) {
+    char *colon = strchr(item, ':');
+    if (colon == NULL)
+      goto done;
+    *colon = '\0';
+    char *end = NULL;
+    double percent = strtod(colon + 1, &end);
+    if (end == colon + 1 || *end != '\0' || !(percent >= 0 && percent <= 100))
+      goto done;
+    size_t i = 0;
+    while (i < FAULT_COUNT && strcmp(item, fault_names[i]) != 0)
+      i++;
+    if (i == FAULT_COUNT)
+      goto done;
+    fault_rates[i] = (uint32_t)(percent * 10000);
+    WARNF("Injecting faults into %s: %g%%", fault_names[i], percent);
+  }
+  rc = 0;
+done:
+  free(copy);
+  return rc;
+}
+
+bool fault_roll(uint32_t rate) { return arc4random_uniform(1000000) < rate; }
@@ -0,0 +1,31 @@
+#ifndef SOCKET_VMNET_FAULT_H
+#define SOCKET_VMNET_FAULT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Fault injection, to exercise the error handling without a misbehaving
+// vmnet: SOCKET_VMNET_FAULTS=POINT:PERCENT[,POINT:PERCENT]... makes PERCENT
+// (0-100, fractions allowed) of the operations at POINT fail. Off unless set.
+#define FAULT_ENV "SOCKET_VMNET_FAULTS"
+
+enum fault_point {
+  FAULT_VMNET_READ,  // "vmnet_read": fails with VMNET_BUFFER_EXHAUSTED
+  FAULT_VMNET_WRITE, // "vmnet_write": fails with VMNET_BUFFER_EXHAUSTED
+  FAULT_VMNET_RUNT,  // "vmnet_runt": a frame read from vmnet is truncated
+  FAULT_COUNT,
+};
+
+// Failures per million operations
+extern uint32_t fault_rates[FAULT_COUNT];
+
+// Parses spec. Returns -1 if invalid.
+int fault_init(const char *spec);
+
+bool fault_roll(uint32_t rate);
+
+static inline bool fault_inject(enum fault_point point) {
+  return fault_rates[point] != 0 && fault_roll(fault_rates[point]);
+}
+
+#endif /* SOCKET_VMNET_FAULT_H */
@@ -0,0 +1,88 @@
+#include <string.h>
+
+#include "fdb.h"
+
+static size_t fdb_hash(uint16_t vlan, const uint8_t mac[6]) {
+  // The low bytes carry most of the entropy (the high bytes are the OUI).
+  uint32_t h = ((uint32_t)mac[2] << 24 | (uint32_t)mac[3] << 16 | (uint32_t)mac[4] << 8 | mac[5]);
+  h ^= ((uint32_t)mac[0] << 8 | mac[1]) ^ (uint32_t)vlan << 16;
+  h *= 0x9E3779B1u; // Fibonacci hashing
+  return h >> (32 - 12) & (FDB_CAPACITY - 1);
+}
+
+_Static_assert(FDB_CAPACITY == 1 << 12, "fdb_hash assumes FDB_CAPACITY == 4096");
+
+static struct fdb_entry *fdb_find(const struct fdb *fdb, uint16_t vlan, const uint8_t mac[6]) {
+  size_t i = fdb_hash(vlan, mac);
+  for (size_t n = 0; n < FDB_CAPACITY; n++, i = (i + 1) & (FDB_CAPACITY - 1)) {
+    const struct fdb_entry *e = &fdb->entries[i];
+    if (!e->used)
+      return NULL;
+    if (e->vlan == vlan && memcmp(e->mac, mac, 6) == 0)
+      return (struct fdb_entry *)e;
+  }
+  return NULL;
+}
+
+bool fdb_learn(struct fdb *fdb, uint16_t vlan, const uint8_t mac[6], void *owner) {
+  if (mac_is_multicast(mac))
+    return true;
+  size_t i = fdb_hash(vlan, mac);
+  for (size_t n = 0; n < FDB_CAPACITY; n++, i = (i + 1) & (FDB_CAPACITY - 1)) {
+    struct fdb_entry *e = &fdb->entries[i];
+    if (!e->used) {
+      // Keep the load factor below 3/4 so that misses stay short.
+      if (fdb->count >= FDB_CAPACITY / 4 * 3)
+        return false;
+      memcpy(e->mac, mac, 6);
+      e->vlan = vlan;
+      e->owner = owner;
+      e->used = true;
+      fdb->count++;
+      return true;
+    }
+    if (e->vlan == vlan && memcmp(e->mac, mac, 6) == 0) {
+      e->owner = owner; // the address moved
+      return true;
+    }
+  }
+  return false;
+}
+
+void *fdb_lookup(const struct fdb *fdb, uint16_t vlan, const uint8_t mac[6]) {
+  const struct fdb_entry *e = fdb_find(fdb, vlan, mac);
+  return e != NULL ? e->owner : NULL;
+}
+
+// Backward shift deletion: move later entries of the same probe sequence into
+// the hole so that lookups never need tombstones.
+static void fdb_remove_at(struct fdb *fdb, size_t hole) {
+  size_t i = hole;
+  for (;;) {
+    i = (i + 1) & (FDB_CAPACITY - 1);
+    struct fdb_entry *e = &fdb->entries[i];
+    if (!e->used)
+      break;
+    size_t home = fdb_hash(e->vlan, e->mac);
+    // Move e only if its home slot is not cyclically within (hole, i].
+    bool in_range = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+    if (in_range)
+      continue;
+    fdb->entries[hole] = *e;
+    hole = i;
+  }
+  memset(&fdb->entries[hole], 0, sizeof(fdb->entries[hole]));
+  fdb->count--;
+}
+
+void fdb_forget(struct fdb *fdb, const void *owner) {
+  for (size_t i = 0; i < FDB_CAPACITY;) {
+    struct fdb_entry *e = &fdb->entries[i];
+    if (e->used && e->owner == owner) {
+      // The hole may have been filled by a shifted entry; check it again.
+      fdb_remove_at(fdb, i);
+      continue;
+    }
+    i++;
+  }
+}
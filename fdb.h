@@ -0,0 +1,38 @@
+#ifndef SOCKET_VMNET_FDB_H
+#define SOCKET_VMNET_FDB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Forwarding database: learned (VLAN, source MAC address) -> owner (a
+// connection, or the vmnet interface). Open addressing with linear probing;
+// the table is a fixed array so that it never allocates on the packet path.
+#define FDB_CAPACITY 4096
+
+struct fdb_entry {
+  uint8_t mac[6];
+  uint16_t vlan;
+  bool used;
+  void *owner;
+};
+
+struct fdb {
+  struct fdb_entry entries[FDB_CAPACITY];
+  size_t count;
+};
+
+static inline bool mac_is_multicast(const uint8_t mac[6]) { return (mac[0] & 0x01) != 0; }
+
+// Records that mac was seen on vlan behind owner. Multicast source addresses
+// are ignored. Returns false if the table is full and the address was not
+// learned.
+bool fdb_learn(struct fdb *fdb, uint16_t vlan, const uint8_t mac[6], void *owner);
+
+// Returns the owner of mac on vlan, or NULL if unknown.
+void *fdb_lookup(const struct fdb *fdb, uint16_t vlan, const uint8_t mac[6]);
+
+// Forgets all addresses learned behind owner.
+void fdb_forget(struct fdb *fdb, const void *owner);
+
+#endif /* SOCKET_VMNET_FDB_H */
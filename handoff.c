@@ -0,0 +1,346 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "handoff.h"
+#include "log.h"
+
+#define HANDOFF_MAGIC 0x56534f43 /* "COSV" in little endian */
+#define HANDOFF_VERSION 5
+
+// Stay well below the per-message limit of both Darwin and Linux (253).
+#define HANDOFF_FDS_PER_MSG 64
+
+// The listener VLANs, the queued bytes, the fdb and the neighbor bindings go
+// to an unlinked file whose descriptor follows the others: the socket buffers
+// only hold the descriptors, however much the VMs have queued.
+#define HANDOFF_DATA_TEMPLATE "/tmp/socket_vmnet.handoff.XXXXXX"
+
+struct handoff_wire_header {
+  uint32_t magic;
+  uint32_t version;
+  uuid_t vmnet_interface_id;
+  uint32_t listener_count;
+  uint32_t conn_count;
+  uint32_t fdb_count;
+  uint32_t neigh_count;
+};
+
+static size_t handoff_wire_size(const struct handoff *h) {
+  // One more descriptor for the data file
+  size_t fd_count = h->listener_count + h->conn_count + 1;
+  size_t chunks = (fd_count + HANDOFF_FDS_PER_MSG - 1) / HANDOFF_FDS_PER_MSG + 1;
+  return sizeof(struct handoff_wire_header) +
+         chunks * (sizeof(uint32_t) + CMSG_SPACE(HANDOFF_FDS_PER_MSG * sizeof(int)));
+}
+
+int handoff_socketpair(int sv[2], const struct handoff *h) {
+  if (socketpair(PF_LOCAL, SOCK_STREAM, 0, sv) < 0) {
+    ERRORN("socketpair");
+    return -1;
+  }
+  // The receiver only starts reading after exec, so the socket buffers have to
+  // hold the header and the descriptors. Leave room for the per-record overhead
+  // of the kernel.
+  int buf_size = (int)(2 * handoff_wire_size(h) + 64 * 1024);
+  for (int i = 0; i < 2; i++) {
+    if (setsockopt(sv[i], SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size)) < 0 ||
+        setsockopt(sv[i], SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size)) < 0) {
+      ERRORN("setsockopt(SO_SNDBUF/SO_RCVBUF)");
+      goto err;
+    }
+  }
+  if (fcntl(sv[0], F_SETFL, O_NONBLOCK) < 0) {
+    ERRORN("fcntl(O_NONBLOCK)");
+    goto err;
+  }
+  return 0;
+err:
+  close(sv[0]);
+  close(sv[1]);
+  return -1;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      ERRORN("write");
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      ERRORN("read");
+      return -1;
+    }
+    if (n == 0) {
+      ERROR("handoff: unexpected EOF");
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int send_fds(int sock, const int *fds, uint32_t count) {
+  union {
+    char buf[CMSG_SPACE(HANDOFF_FDS_PER_MSG * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct iovec iov = {
+      .iov_base = &count,
+      .iov_len = sizeof(count),
+  };
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = CMSG_SPACE(count * sizeof(int)),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+  ssize_t n = sendmsg(sock, &msg, 0);
+  if (n != sizeof(count)) {
+    ERRORN("sendmsg(SCM_RIGHTS)");
+    return -1;
+  }
+  return 0;
+}
+
+static int recv_fds(int sock, int *fds, uint32_t expected) {
+  union {
+    char buf[CMSG_SPACE(HANDOFF_FDS_PER_MSG * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  uint32_t count = 0;
+  struct iovec iov = {
+      .iov_base = &count,
+      .iov_len = sizeof(count),
+  };
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+  };
+  ssize_t n = recvmsg(sock, &msg, MSG_WAITALL);
+  if (n != sizeof(count)) {
+    ERRORN("recvmsg(SCM_RIGHTS)");
+    return -1;
+  }
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if ((msg.msg_flags & MSG_CTRUNC) != 0 || cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS || count != expected ||
+      cmsg->cmsg_len != CMSG_LEN(count * sizeof(int))) {
+    ERRORF("handoff: expected %u file descriptors", expected);
+    return -1;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+  return 0;
+}
+
+static int write_data(int fd, const struct handoff *h) {
+  for (uint32_t i = 0; i < h->listener_count; i++) {
+    uint32_t vlan = h->listeners[i].vlan;
+    if (write_all(fd, &vlan, sizeof(vlan)) < 0)
+      return -1;
+  }
+  for (uint32_t i = 0; i < h->conn_count; i++) {
+    const struct handoff_conn *c = &h->conns[i];
+    uint32_t meta[3] = {c->vlan, c->rx_len, c->tx_len};
+    if (write_all(fd, meta, sizeof(meta)) < 0 || write_all(fd, c->rx, c->rx_len) < 0 ||
+        write_all(fd, c->tx, c->tx_len) < 0)
+      return -1;
+  }
+  if (write_all(fd, h->fdb, h->fdb_count * sizeof(struct handoff_fdb_entry)) < 0)
+    return -1;
+  return write_all(fd, h->neigh, h->neigh_count * sizeof(struct handoff_neigh_entry));
+}
+
+int handoff_send(int sock, const struct handoff *h) {
+  char path[] = HANDOFF_DATA_TEMPLATE;
+  int data_fd = mkstemp(path);
+  if (data_fd < 0) {
+    ERRORF("handoff: failed to create \"%s\": %s", path, strerror(errno));
+    return -1;
+  }
+  unlink(path);
+  int rc = -1;
+  if (write_data(data_fd, h) < 0)
+    goto done;
+
+  struct handoff_wire_header hdr = {
+      .magic = HANDOFF_MAGIC,
+      .version = HANDOFF_VERSION,
+      .listener_count = h->listener_count,
+      .conn_count = h->conn_count,
+      .fdb_count = h->fdb_count,
+      .neigh_count = h->neigh_count,
+  };
+  uuid_copy(hdr.vmnet_interface_id, h->vmnet_interface_id);
+  if (write_all(sock, &hdr, sizeof(hdr)) < 0)
+    goto done;
+
+  uint32_t fd_count = h->listener_count + h->conn_count;
+  int *fds = malloc((fd_count + 1) * sizeof(int));
+  if (fds == NULL) {
+    ERRORN("malloc");
+    goto done;
+  }
+  for (uint32_t i = 0; i < h->listener_count; i++)
+    fds[i] = h->listeners[i].fd;
+  for (uint32_t i = 0; i < h->conn_count; i++)
+    fds[h->listener_count + i] = h->conns[i].fd;
+  for (uint32_t i = 0; i < fd_count; i += HANDOFF_FDS_PER_MSG) {
+    uint32_t chunk = fd_count - i < HANDOFF_FDS_PER_MSG ? fd_count - i : HANDOFF_FDS_PER_MSG;
+    if (send_fds(sock, fds + i, chunk) < 0) {
+      free(fds);
+      goto done;
+    }
+  }
+  free(fds);
+  rc = send_fds(sock, &data_fd, 1);
+done:
+  close(data_fd);
+  return rc;
+}
+
+int handoff_recv(int sock, struct handoff *h) {
+  memset(h, 0, sizeof(*h));
+  struct handoff_wire_header hdr;
+  if (read_all(sock, &hdr, sizeof(hdr)) < 0)
+    return -1;
+  if (hdr.magic != HANDOFF_MAGIC || hdr.version != HANDOFF_VERSION) {
+    ERRORF("handoff: unsupported state (magic 0x%x, version %u)", hdr.magic, hdr.version);
+    return -1;
+  }
+  uuid_copy(h->vmnet_interface_id, hdr.vmnet_interface_id);
+
+  int data_fd = -1;
+  uint32_t fd_count = hdr.listener_count + hdr.conn_count;
+  int *fds = calloc(fd_count + 1, sizeof(int));
+  h->listeners = calloc(hdr.listener_count + 1, sizeof(struct handoff_listener));
+  h->conns = calloc(hdr.conn_count + 1, sizeof(struct handoff_conn));
+  h->fdb = calloc(hdr.fdb_count + 1, sizeof(struct handoff_fdb_entry));
+  h->neigh = calloc(hdr.neigh_count + 1, sizeof(struct handoff_neigh_entry));
+  if (fds == NULL || h->listeners == NULL || h->conns == NULL || h->fdb == NULL ||
+      h->neigh == NULL) {
+    ERRORN("calloc");
+    free(fds);
+    goto err;
+  }
+  uint32_t received = 0;
+  while (received < fd_count) {
+    uint32_t chunk =
+        fd_count - received < HANDOFF_FDS_PER_MSG ? fd_count - received : HANDOFF_FDS_PER_MSG;
+    if (recv_fds(sock, fds + received, chunk) < 0)
+      break;
+    received += chunk;
+  }
+  // The listening sockets come first.
+  for (uint32_t i = 0; i < received; i++) {
+    if (i < hdr.listener_count)
+      h->listeners[h->listener_count++].fd = fds[i];
+    else
+      h->conns[h->conn_count++].fd = fds[i];
+  }
+  free(fds);
+  if (received < fd_count || recv_fds(sock, &data_fd, 1) < 0)
+    goto err;
+  // The offset is shared with the sender, which left it at the end.
+  if (lseek(data_fd, 0, SEEK_SET) < 0) {
+    ERRORN("lseek");
+    goto err;
+  }
+
+  for (uint32_t i = 0; i < h->listener_count; i++) {
+    uint32_t vlan;
+    if (read_all(data_fd, &vlan, sizeof(vlan)) < 0)
+      goto err;
+    h->listeners[i].vlan = (uint16_t)vlan;
+  }
+  for (uint32_t i = 0; i < h->conn_count; i++) {
+    struct handoff_conn *c = &h->conns[i];
+    uint32_t meta[3];
+    if (read_all(data_fd, meta, sizeof(meta)) < 0)
+      goto err;
+    c->vlan = (uint16_t)meta[0];
+    c->rx = malloc(meta[1] + 1);
+    c->tx = malloc(meta[2] + 1);
+    if (c->rx == NULL || c->tx == NULL) {
+      ERRORN("malloc");
+      goto err;
+    }
+    if (read_all(data_fd, c->rx, meta[1]) < 0 || read_all(data_fd, c->tx, meta[2]) < 0)
+      goto err;
+    c->rx_len = meta[1];
+    c->tx_len = meta[2];
+  }
+
+  if (read_all(data_fd, h->fdb, hdr.fdb_count * sizeof(struct handoff_fdb_entry)) < 0)
+    goto err;
+  h->fdb_count = hdr.fdb_count;
+  for (uint32_t i = 0; i < h->fdb_count; i++) {
+    if (h->fdb[i].conn != HANDOFF_CONN_HOST && h->fdb[i].conn >= h->conn_count) {
+      ERRORF("handoff: fdb entry %u refers to unknown connection %u", i, h->fdb[i].conn);
+      goto err;
+    }
+  }
+
+  if (read_all(data_fd, h->neigh, hdr.neigh_count * sizeof(struct handoff_neigh_entry)) < 0)
+    goto err;
+  h->neigh_count = hdr.neigh_count;
+  for (uint32_t i = 0; i < h->neigh_count; i++) {
+    if (h->neigh[i].conn >= h->conn_count) {
+      ERRORF("handoff: neighbor entry %u refers to unknown connection %u", i, h->neigh[i].conn);
+      goto err;
+    }
+  }
+  close(data_fd);
+  return 0;
+err:
+  if (data_fd >= 0)
+    close(data_fd);
+  for (uint32_t i = 0; i < h->listener_count; i++)
+    close(h->listeners[i].fd);
+  for (uint32_t i = 0; i < h->conn_count; i++)
+    close(h->conns[i].fd);
+  handoff_free(h);
+  return -1;
+}
+
+void handoff_free(struct handoff *h) {
+  for (uint32_t i = 0; i < h->conn_count; i++) {
+    free(h->conns[i].rx);
+    free(h->conns[i].tx);
+  }
+  free(h->listeners);
+  free(h->conns);
+  free(h->fdb);
+  free(h->neigh);
+  memset(h, 0, sizeof(*h));
+}
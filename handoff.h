@@ -0,0 +1,77 @@
+#ifndef SOCKET_VMNET_HANDOFF_H
+#define SOCKET_VMNET_HANDOFF_H
+
+#include <stdint.h>
+
+#include <uuid/uuid.h>
+
+// Live handoff of the listening sockets, the connected VM sockets, the
+// learned MAC addresses and the neighbor bindings to a freshly exec'd
+// socket_vmnet, so that a restart
+// does not disconnect the VMs. The file descriptors are passed with
+// SCM_RIGHTS over a UNIX socket pair whose receiving end is inherited by the
+// new process image; its number is passed in HANDOFF_ENV. The rest of the
+// state is written to an unlinked temporary file passed along with them.
+#define HANDOFF_ENV "SOCKET_VMNET_HANDOFF_FD"
+
+// handoff_fdb_entry.conn value for addresses learned from vmnet
+#define HANDOFF_CONN_HOST UINT32_MAX
+
+struct handoff_fdb_entry {
+  uint8_t mac[6];
+  uint16_t vlan;
+  uint32_t conn; // index into handoff.conns, or HANDOFF_CONN_HOST
+};
+
+struct handoff_neigh_entry {
+  uint8_t addr[16];
+  uint8_t mac[6];
+  uint16_t vlan;
+  uint32_t conn;   // index into handoff.conns
+  uint64_t age_ns; // since the binding was last seen
+};
+
+struct handoff_listener {
+  int fd;
+  uint16_t vlan;
+};
+
+struct handoff_conn {
+  int fd;
+  uint16_t vlan;
+  // Bytes read from fd that do not form a complete frame yet
+  uint8_t *rx;
+  uint32_t rx_len;
+  // Bytes of frames not written to fd yet
+  uint8_t *tx;
+  uint32_t tx_len;
+};
+
+struct handoff {
+  uuid_t vmnet_interface_id;
+  struct handoff_listener *listeners;
+  uint32_t listener_count;
+  struct handoff_conn *conns;
+  uint32_t conn_count;
+  struct handoff_fdb_entry *fdb;
+  uint32_t fdb_count;
+  struct handoff_neigh_entry *neigh;
+  uint32_t neigh_count;
+};
+
+// Creates the socket pair used for handing off h. sv[1] is the end to be
+// inherited by the new process.
+int handoff_socketpair(int sv[2], const struct handoff *h);
+
+// Writes h to sock. Never blocks on sock: the receiver is not running yet, so
+// only the descriptors go through the socket buffer, sized for them by
+// handoff_socketpair.
+int handoff_send(int sock, const struct handoff *h);
+
+// Reads the state written by handoff_send. The caller owns the received file
+// descriptors; handoff_free only releases the memory held by h.
+int handoff_recv(int sock, struct handoff *h);
+
+void handoff_free(struct handoff *h);
+
+#endif /* SOCKET_VMNET_HANDOFF_H */
@@ -0,0 +1,47 @@
+#include "hist.h"
+
+// Lowest value of the bucket
+static uint64_t hist_bucket_value(unsigned i) {
+  if (i < (1 << HIST_SUB_BITS))
+    return i;
+  unsigned shift = (i >> HIST_SUB_BITS) - 1;
+  return ((uint64_t)(1 << HIST_SUB_BITS) | (i & ((1 << HIST_SUB_BITS) - 1))) << shift;
+}
+
+void hist_summarize(struct hist *h, struct hist_summary *s) {
+  uint64_t counts[HIST_BUCKETS];
+  s->count = 0;
+  for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+    counts[i] = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+    s->count += counts[i];
+  }
+  s->max = atomic_load_explicit(&h->max, memory_order_relaxed);
+  struct {
+    uint64_t *value;
+    uint64_t per_mille;
+  } ranks[] = {
+      {&s->p50,  500},
+      {&s->p90,  900},
+      {&s->p99,  990},
+      {&s->p999, 999},
+  };
+  uint64_t seen = 0;
+  unsigned r = 0, n = sizeof(ranks) / sizeof(ranks[0]);
+  for (unsigned i = 0; i < HIST_BUCKETS && r < n; i++) {
+    seen += counts[i];
+    // The highest value of the first bucket that covers the rank, so that the
+    // percentiles are never underestimated.
+    while (r < n && seen > 0 && seen * 1000 >= s->count * ranks[r].per_mille) {
+      uint64_t v = i + 1 < HIST_BUCKETS ? hist_bucket_value(i + 1) - 1 : s->max;
+      *ranks[r++].value = v < s->max ? v : s->max;
+    }
+  }
+  for (; r < n; r++)
+    *ranks[r].value = 0;
+}
+
+void hist_reset(struct hist *h) {
+  for (unsigned i = 0; i < HIST_BUCKETS; i++)
+    atomic_store_explicit(&h->buckets[i], 0, memory_order_relaxed);
+  atomic_store_explicit(&h->max, 0, memory_order_relaxed);
+}
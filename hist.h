@@ -0,0 +1,63 @@
+#ifndef SOCKET_VMNET_HIST_H
+#define SOCKET_VMNET_HIST_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+// Log-linear latency histogram in nanoseconds, in the style of HdrHistogram:
+// every power of 2 is split into 2^HIST_SUB_BITS buckets, so a value is off by
+// at most 1/2^HIST_SUB_BITS (12.5%). Recording is a relaxed atomic increment,
+// so a histogram can be shared by threads without locks.
+#define HIST_SUB_BITS 3
+#define HIST_MAX_BITS 36 // ~69 seconds; larger values are clamped
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct hist {
+  _Atomic uint64_t buckets[HIST_BUCKETS];
+  _Atomic uint64_t max;
+};
+
+struct hist_summary {
+  uint64_t count;
+  uint64_t p50, p90, p99, p999, max; // nanoseconds
+};
+
+static inline uint64_t hist_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static inline unsigned hist_bucket(uint64_t ns) {
+  if (ns < (1 << HIST_SUB_BITS))
+    return (unsigned)ns;
+  unsigned msb = 63 - (unsigned)__builtin_clzll(ns);
+  if (msb >= HIST_MAX_BITS)
+    return HIST_BUCKETS - 1;
+  unsigned shift = msb - HIST_SUB_BITS;
+  return ((shift + 1) << HIST_SUB_BITS) | (unsigned)((ns >> shift) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+static inline void hist_record(struct hist *h, uint64_t ns) {
+  atomic_fetch_add_explicit(&h->buckets[hist_bucket(ns)], 1, memory_order_relaxed);
+  uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+  while (ns > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, ns,
+                                                            memory_order_relaxed,
+                                                            memory_order_relaxed))
+    ;
+}
+
+// Records the time elapsed since start, and returns the current time.
+static inline uint64_t hist_record_since(struct hist *h, uint64_t start) {
+  uint64_t now = hist_now();
+  hist_record(h, now - start);
+  return now;
+}
+
+void hist_summarize(struct hist *h, struct hist_summary *s);
+
+// Concurrent recordings may survive a reset, or be lost.
+void hist_reset(struct hist *h);
+
+#endif /* SOCKET_VMNET_HIST_H */
@@ -1,6 +1,9 @@
 #ifndef SOCKET_VMNET_LOG_H
 #define SOCKET_VMNET_LOG_H
 #include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
 
 extern bool debug;
 
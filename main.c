@@ -1,12 +1,17 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <grp.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sched.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/event.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -15,8 +20,24 @@
 #include <unistd.h>
 #include <vmnet/vmnet.h>
 
+#include "arena.h"
+#include "capture.h"
 #include "cli.h"
+#include "control.h"
+#include "dhcp.h"
+#include "egress.h"
+#include "ether.h"
+#include "fault.h"
+#include "fdb.h"
+#include "handoff.h"
+#include "hist.h"
 #include "log.h"
+#include "mcast.h"
+#include "neigh.h"
+#include "rss.h"
+#include "sockbuf.h"
+#include "statefile.h"
+#include "trace.h"
 
 #if __MAC_OS_X_VERSION_MAX_ALLOWED < 101500
 #error "Requires macOS 10.15 or later"
@@ -72,50 +93,835 @@ static void print_vmnet_start_param(xpc_object_t param) {
   });
 }
 
+// Maximum size of a frame, excluding the uint32be length header
+#define MAX_FRAME_LEN (64 * 1024)
+// A connection can buffer one frame being received...
+#define CONN_RX_BUF_LEN (4 + MAX_FRAME_LEN)
+// ... and a few frames that its VM is not ready to receive yet.
+#define CONN_TX_BUF_LEN (4 * CONN_RX_BUF_LEN)
+
+// Frames with this DSCP or above (CS5, EF, CS6, CS7) are latency-sensitive:
+// served first by the egress scheduler, and never held by --coalesce-adaptive.
+#define EGRESS_HIGH_DSCP 40
+
+struct loop;
+
+// Stages of the forwarding pipeline, timed into per-connection histograms
+enum stage {
+  STAGE_READ,        // read(2) of a VM socket, or vmnet_read of a batch
+  STAGE_LOCK,        // waiting for state->lock
+  STAGE_EGRESS,      // waiting in the egress scheduler, see egress.h
+  STAGE_VMNET_WRITE, // vmnet_write
+  STAGE_SEND,        // writev(2) or queueing of a frame to this VM
+  STAGE_HOLD,        // the oldest frame held by --coalesce, until written to this VM
+  STAGE_FORWARD,     // a frame, from the end of the read to the last send
+  STAGE_COUNT,
+};
+
+static const char *const stage_names[STAGE_COUNT] = {
+    [STAGE_READ] = "read",
+    [STAGE_LOCK] = "lock",
+    [STAGE_EGRESS] = "egress",
+    [STAGE_VMNET_WRITE] = "vmnet_write",
+    [STAGE_SEND] = "send",
+    [STAGE_HOLD] = "hold",
+    [STAGE_FORWARD] = "forward",
+};
+
 struct conn {
-  // TODO: uint8_t mac[6];
+  uint32_t id; // unique for the lifetime of the process, unlike socket_fd
   int socket_fd;
+  uint16_t vlan;     // VLAN_NONE for the main socket
+  struct loop *loop; // the event loop reading socket_fd
+  // Bytes read from socket_fd that do not form a complete frame yet; only
+  // touched by loop. Taken from the pool of loop while reading, and held only
+  // between the reads of a partial frame.
+  uint8_t *rx_buf;
+  size_t rx_len;
+  pthread_mutex_t tx_lock;
+  // Bytes not accepted by socket_fd yet, allocated on demand; protected by
+  // tx_lock
+  uint8_t *tx_buf;
+  size_t tx_len;
+  bool tx_disabled;    // protected by tx_lock; set once handed off
+  uint64_t tx_dropped; // protected by tx_lock
+  uint64_t tx_blocked; // protected by tx_lock; writes left for EVFILT_WRITE
+  // With --coalesce, frames are held in tx_buf until the oldest one is
+  // coalesce_ns old, or coalesce_bytes are held, then written at once: the VM
+  // wakes up once per batch rather than once per frame. Protected by tx_lock.
+  uint64_t coalesce_ns; // 0 without --coalesce
+  size_t coalesce_bytes;
+  bool coalesce_adaptive;
+  bool tx_held;       // tx_buf only holds frames, and the hold timer is armed
+  uint64_t tx_held_ns; // when the oldest held frame was queued
+  uint64_t tx_last_ns; // when the last frame was sent, for --coalesce-adaptive
+  uint64_t tx_held_writes;
+  uint64_t tx_held_frames;
+  // Malformed frames: runts, dropped, and oversized ones, which close the
+  // connection. Never the process.
+  _Atomic uint64_t rx_errors;
+  // Frames toward vmnet, with --egress-scheduler. Configured from the rules
+  // of the first source address; only touched by loop.
+  struct egress_flow egress;
+  bool egress_configured;
+  // Kernel buffers of socket_fd; only touched by the main thread
+  struct sockbuf sockbuf;
+  struct hist latency[STAGE_COUNT];
   struct conn *next;
 } _conn;
 
+// Event loop serving a subset of the connections, on its own kqueue. The
+// number of loops is bounded by the number of CPUs, not by the number of VMs.
+#define MAX_LOOPS 8
+#define LOOP_MAX_EVENTS 64
+// Idle receive buffers kept by each loop
+#define LOOP_POOL_LEN 8
+
+struct loop {
+  int kq;
+  struct state *state;
+  uint8_t *pool[LOOP_POOL_LEN];
+  size_t pool_len;
+};
+
+// A listening socket; the connections accepted from it are on vlan.
+struct listener {
+  int fd;
+  uint16_t vlan;
+};
+
+// Frames per vmnet_read
+#define MAX_PACKET_COUNT_AT_ONCE 32
+
+// Forwarding paths. Without any of the optional per-frame features (see
+// state_init_forwarding), the frames take a path specialized for the number of
+// connections; FORWARD_GENERIC serves every other configuration.
+enum forward_path {
+  FORWARD_GENERIC,
+  FORWARD_SINGLE, // a single connection: nothing to flood
+  FORWARD_SCAN,   // up to FORWARD_SCAN_MAX connections, looked up in state->ports
+  FORWARD_HASH,   // more connections, looked up in state->fdb
+};
+
+static const char *const forward_path_names[] = {
+    [FORWARD_GENERIC] = "generic",
+    [FORWARD_SINGLE] = "single",
+    [FORWARD_SCAN] = "scan",
+    [FORWARD_HASH] = "hash",
+};
+
+#define FORWARD_SCAN_MAX 8
+
+// A connection on the FORWARD_SINGLE and FORWARD_SCAN paths, with one of the
+// addresses learned behind it. Scanning these few entries is cheaper than
+// hashing into the fdb, and than chasing the list of connections.
+struct port {
+  struct conn *conn;
+  uint8_t mac[6];
+  bool mac_known;
+};
+
 struct state {
-  dispatch_semaphore_t sem;
+  // Protects conns, fdb, and neigh. Forwarding holds it for reading; only
+  // adding and removing connections, and learning new addresses, take it for
+  // writing.
+  pthread_rwlock_t lock;
   dispatch_queue_t vms_queue;
   dispatch_queue_t host_queue;
+  interface_ref iface;
   struct conn *conns; // TODO: avoid O(N) lookup
+  struct fdb fdb;
+  struct neigh neigh; // with --neighbor-proxy
+  struct mcast mcast; // with --multicast-snooping
+  struct hist vmnet_latency[STAGE_COUNT]; // the frames read from vmnet
+  struct egress *egress;                  // NULL without --egress-scheduler
+  struct dhcp *dhcp;                      // NULL without --dhcp-server
+  struct rss *rss;                        // NULL without --vmnet-rx-queues
+  bool specialized;                       // set once at startup, see state_init_forwarding
+  enum forward_path path;                 // protected by lock, see state_select_path
+  struct port ports[FORWARD_SCAN_MAX];    // protected by lock, on FORWARD_SINGLE and FORWARD_SCAN
+  size_t port_count;
+  // The batch of vmnet_read, allocated once; only touched by host_queue
+  struct vmpktdesc vmnet_pdv[MAX_PACKET_COUNT_AT_ONCE];
+  struct iovec vmnet_iov[MAX_PACKET_COUNT_AT_ONCE];
+  uint8_t *vmnet_buf;
+  size_t vmnet_buf_len; // per frame
+  struct statefile *statefile;            // NULL without --pidfile
+  uint64_t restored_ns;                   // when the state file was loaded, or 0
+  // vmnet errors, see state_vmnet_write
+  _Atomic uint64_t vmnet_retries;
+  _Atomic uint64_t vmnet_read_errors;
+  _Atomic uint64_t vmnet_write_errors; // in frames
+  _Atomic uint64_t vmnet_runts;
+  const struct cli_options *cliopt;
+  struct listener *listeners; // the main socket first
+  size_t listener_count;
+  bool vlans[VLAN_MAX + 1]; // the VLANs with a socket
+  struct loop loops[MAX_LOOPS];
+  size_t loop_count;
+  size_t next_loop;     // round robin assignment of new connections
+  uint32_t next_conn_id; // see conn.id
+  // A handoff parks every loop (see loop_park)
+  dispatch_semaphore_t parked;
+  dispatch_semaphore_t resume;
 } _state;
 
-static void state_add_socket_fd(struct state *state, int socket_fd) {
+// fdb owner of the addresses learned from vmnet
+static char vmnet_owner;
+#define VMNET_OWNER ((void *)&vmnet_owner)
+
+// fdb and neigh owner of the addresses of the VMs restored from the state
+// file, until they connect again. Frames to these addresses are flooded.
+static char restored_owner;
+#define RESTORED_OWNER ((void *)&restored_owner)
+// The addresses of the VMs not back by then are forgotten.
+#define RESTORED_GRACE_NS (300 * 1000000000ULL)
+
+// Returns the owner of the unicast address mac on vlan, or NULL if unknown.
+static void *state_lookup(struct state *state, uint16_t vlan, const uint8_t *mac) {
+  void *owner = fdb_lookup(&state->fdb, vlan, mac);
+  return owner == RESTORED_OWNER ? NULL : owner;
+}
+
+// Returns the owner of the unicast address mac on the FORWARD_SINGLE and
+// FORWARD_SCAN paths, where every frame is on VLAN_NONE.
+static void *state_port_lookup(struct state *state, const uint8_t *mac) {
+  for (size_t i = 0; i < state->port_count; i++) {
+    const struct port *port = &state->ports[i];
+    if (port->mac_known && memcmp(port->mac, mac, sizeof(port->mac)) == 0)
+      return port->conn;
+  }
+  return state_lookup(state, VLAN_NONE, mac);
+}
+
+// Selects the forwarding path for the current connections, and rebuilds
+// state->ports. Called with state->lock held for writing, whenever a
+// connection is added or removed, or addresses are forgotten.
+static void state_select_path(struct state *state) {
+  state->port_count = 0;
+  if (!state->specialized) {
+    state->path = FORWARD_GENERIC;
+    return;
+  }
+  size_t conn_count = 0;
+  for (struct conn *conn = state->conns; conn != NULL; conn = conn->next)
+    conn_count++;
+  if (conn_count > FORWARD_SCAN_MAX) {
+    state->path = FORWARD_HASH;
+    return;
+  }
+  state->path = conn_count == 1 ? FORWARD_SINGLE : FORWARD_SCAN;
+  for (struct conn *conn = state->conns; conn != NULL; conn = conn->next)
+    state->ports[state->port_count++] = (struct port){.conn = conn};
+  for (size_t i = 0; i < FDB_CAPACITY; i++) {
+    const struct fdb_entry *e = &state->fdb.entries[i];
+    if (!e->used)
+      continue;
+    for (size_t j = 0; j < state->port_count; j++) {
+      struct port *port = &state->ports[j];
+      if (port->conn == e->owner && !port->mac_known) {
+        memcpy(port->mac, e->mac, sizeof(port->mac));
+        port->mac_known = true;
+        break;
+      }
+    }
+  }
+}
+
+// Updates state->ports after mac moved to owner, without scanning the fdb like
+// state_select_path: the path only depends on the connections. Called with
+// state->lock held for writing.
+static void state_port_learn(struct state *state, const uint8_t *mac, void *owner) {
+  for (size_t i = 0; i < state->port_count; i++) {
+    struct port *port = &state->ports[i];
+    if (port->conn == owner) {
+      memcpy(port->mac, mac, sizeof(port->mac));
+      port->mac_known = true;
+    } else if (port->mac_known && memcmp(port->mac, mac, sizeof(port->mac)) == 0) {
+      // Moved away; state_port_lookup falls back to the fdb for the others.
+      port->mac_known = false;
+    }
+  }
+}
+
+static bool state_should_learn(struct state *state, uint16_t vlan, const uint8_t *src,
+                               void *owner) {
+  void *known = fdb_lookup(&state->fdb, vlan, src);
+  // Never take over an address that was learned from a VM.
+  return !mac_is_multicast(src) && known != owner && (owner != VMNET_OWNER || known == NULL);
+}
+
+// Records that src was seen on vlan behind owner. Called with state->lock held
+// for reading; takes it for writing only when the address is new or moved.
+static void state_learn(struct state *state, uint16_t vlan, const uint8_t *src, void *owner) {
+  if (!state_should_learn(state, vlan, src, owner))
+    return;
+  pthread_rwlock_unlock(&state->lock);
+  pthread_rwlock_wrlock(&state->lock);
+  if (state_should_learn(state, vlan, src, owner)) {
+    // The VM is back: so are its neighbor bindings.
+    if (fdb_lookup(&state->fdb, vlan, src) == RESTORED_OWNER)
+      neigh_adopt(&state->neigh, vlan, src, RESTORED_OWNER, owner);
+    if (fdb_learn(&state->fdb, vlan, src, owner))
+      state_port_learn(state, src, owner);
+  }
+  pthread_rwlock_unlock(&state->lock);
+  pthread_rwlock_rdlock(&state->lock);
+}
+
+// Learns the address announced by an ARP or NDP frame from owner. Called with
+// state->lock held for reading, like state_learn.
+static void state_learn_neigh(struct state *state, uint16_t vlan, const uint8_t *frame, size_t len,
+                              void *owner) {
+  struct neigh_binding b;
+  if (!neigh_parse_binding(frame, len, &b))
+    return;
+  uint64_t now = hist_now();
+  if (!neigh_should_learn(&state->neigh, vlan, &b, owner, now))
+    return;
+  pthread_rwlock_unlock(&state->lock);
+  pthread_rwlock_wrlock(&state->lock);
+  if (neigh_should_learn(&state->neigh, vlan, &b, owner, now))
+    neigh_learn(&state->neigh, vlan, &b, owner, now);
+  pthread_rwlock_unlock(&state->lock);
+  pthread_rwlock_rdlock(&state->lock);
+}
+
+// Records the groups joined and left by an IGMP or MLD report from owner.
+// Called with state->lock held for reading, like state_learn.
+static void state_snoop(struct state *state, uint16_t vlan, const uint8_t *frame, size_t len,
+                        void *owner) {
+  struct mcast_change changes[MCAST_REPORT_MAX];
+  size_t n = mcast_parse_report(frame, len, changes);
+  if (n == 0)
+    return;
+  atomic_fetch_add_explicit(&state->mcast.reports, 1, memory_order_relaxed);
+  bool changed = false;
+  for (size_t i = 0; i < n && !changed; i++)
+    changed = mcast_is_member(&state->mcast, vlan, changes[i].mac, owner) != changes[i].join;
+  if (!changed)
+    return;
+  pthread_rwlock_unlock(&state->lock);
+  pthread_rwlock_wrlock(&state->lock);
+  for (size_t i = 0; i < n; i++) {
+    if (!changes[i].join)
+      mcast_leave(&state->mcast, vlan, changes[i].mac, owner);
+    else if (!mcast_join(&state->mcast, vlan, changes[i].mac, owner))
+      WARN("Multicast group table is full: the frames to new groups are flooded");
+  }
+  pthread_rwlock_unlock(&state->lock);
+  pthread_rwlock_rdlock(&state->lock);
+}
+
+// Returns the group of a frame to the multicast address mac if it only goes
+// to the members of the group, or NULL if it is flooded. Called with
+// state->lock held for reading.
+static struct mcast_group *state_mcast_group(struct state *state, uint16_t vlan,
+                                             const uint8_t *mac, size_t len) {
+  if (!state->cliopt->multicast_snooping || !mac_is_multicast(mac))
+    return NULL;
+  struct mcast_group *g = mcast_is_flooded(mac) ? NULL : mcast_lookup(&state->mcast, vlan, mac);
+  if (g == NULL) {
+    atomic_fetch_add_explicit(&state->mcast.flooded, 1, memory_order_relaxed);
+    return NULL;
+  }
+  atomic_fetch_add_explicit(&g->frames, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&g->bytes, len, memory_order_relaxed);
+  return g;
+}
+
+// Answers an ARP request or a Neighbor Solicitation from requester, for the
+// address of a VM. Returns the length of the reply, or 0 if the request must
+// be forwarded. Called with state->lock held for reading.
+static size_t state_answer_neigh(struct state *state, uint16_t vlan, const uint8_t *frame,
+                                 size_t len, const void *requester,
+                                 uint8_t reply[NEIGH_REPLY_MAX_LEN]) {
+  struct neigh_query q;
+  if (!neigh_parse_query(frame, len, &q))
+    return 0;
+  const struct neigh_entry *e = neigh_lookup(&state->neigh, vlan, q.target, hist_now());
+  // Only for another VM, still connected with the same MAC address
+  bool hit = e != NULL && e->owner != requester && e->owner != RESTORED_OWNER &&
+             fdb_lookup(&state->fdb, vlan, e->mac) == e->owner;
+  neigh_count(&state->neigh, &q, hit);
+  return hit ? neigh_build_reply(&q, e->mac, reply) : 0;
+}
+
+// Describes frame as iov, with an 802.1Q tag for vlan pushed between the
+// source address and the EtherType unless vlan is VLAN_NONE. Returns the
+// number of iovecs.
+static int vlan_tag_iov(struct iovec iov[3], uint8_t tag[VLAN_TAG_LEN], uint16_t vlan,
+                        uint8_t *frame, size_t len) {
+  iov[0].iov_base = frame;
+  iov[0].iov_len = len;
+  if (vlan == VLAN_NONE)
+    return 1;
+  tag[0] = ETHERTYPE_VLAN >> 8;
+  tag[1] = ETHERTYPE_VLAN & 0xFF;
+  tag[2] = vlan >> 8;
+  tag[3] = vlan & 0xFF;
+  iov[0].iov_len = 2 * ETHER_ADDR_LEN;
+  iov[1].iov_base = tag;
+  iov[1].iov_len = VLAN_TAG_LEN;
+  iov[2].iov_base = frame + 2 * ETHER_ADDR_LEN;
+  iov[2].iov_len = len - 2 * ETHER_ADDR_LEN;
+  return 3;
+}
+
+// Called with conn->tx_lock held, or before conn is added.
+static void conn_arm_write(struct conn *conn) {
+  conn->tx_blocked++;
+  struct kevent change;
+  EV_SET(&change, conn->socket_fd, EVFILT_WRITE, EV_ADD | EV_ONESHOT, 0, 0, conn);
+  if (kevent(conn->loop->kq, &change, 1, NULL, 0, NULL) != 0)
+    ERRORN("kevent(EVFILT_WRITE)");
+}
+
+// Flushes the frames held by --coalesce after usecs, from the loop of conn.
+static void conn_arm_hold_timer(struct conn *conn, uint64_t usecs) {
+  struct kevent change;
+  EV_SET(&change, conn->socket_fd, EVFILT_TIMER, EV_ADD | EV_ONESHOT, NOTE_USECONDS, usecs, conn);
+  if (kevent(conn->loop->kq, &change, 1, NULL, 0, NULL) != 0)
+    ERRORN("kevent(EVFILT_TIMER)");
+}
+
+// Returns true if the frame sent at now should be held for the next ones, with
+// --coalesce. Called with conn->tx_lock held.
+static bool conn_should_hold(struct conn *conn, const uint8_t *frame, uint32_t len, uint64_t now) {
+  uint64_t last_ns = conn->tx_last_ns;
+  conn->tx_last_ns = now;
+  if (conn->coalesce_ns == 0 || 4 + len >= conn->coalesce_bytes)
+    return false;
+  // With --coalesce-adaptive, holding is not worth the latency for a frame
+  // that no other frame is likely to join, nor for a latency-sensitive one.
+  if (conn->coalesce_adaptive && ((!conn->tx_held && now - last_ns > conn->coalesce_ns) ||
+                                  ether_dscp(frame, len) >= EGRESS_HIGH_DSCP))
+    return false;
+  return true;
+}
+
+// Writes as much of tx_buf as the socket accepts, and waits for it to be
+// writable again for the rest. Called with conn->tx_lock held.
+static void conn_write_queued(struct conn *conn) {
+  if (conn->tx_held) {
+    conn->tx_held = false;
+    conn->tx_held_writes++;
+    hist_record_since(&conn->latency[STAGE_HOLD], conn->tx_held_ns);
+  }
+  ssize_t written = write(conn->socket_fd, conn->tx_buf, conn->tx_len);
+  DEBUGF("Sent to the socket %d: %ld of %zu queued bytes", conn->socket_fd, written, conn->tx_len);
+  if (written < 0 && errno != EAGAIN) {
+    ERRORN("write");
+    conn->tx_len = 0;
+  } else if (written > 0) {
+    memmove(conn->tx_buf, conn->tx_buf + written, conn->tx_len - written);
+    conn->tx_len -= written;
+  }
+  if (conn->tx_len > 0)
+    conn_arm_write(conn);
+}
+
+// Sends a frame to the VM behind conn. Never blocks: what the socket does not
+// accept is queued, and frames that do not fit in the queue are dropped, like
+// a switch port would. Called with state->lock held.
+static void conn_send(struct conn *conn, const void *frame, uint32_t len) {
+  uint32_t header_be = htonl(len);
+  struct iovec iov[2] = {
+      {
+       .iov_base = &header_be,
+       .iov_len = 4,
+       },
+      {
+       .iov_base = (void *)frame,
+       .iov_len = len,
+       },
+  };
+  size_t total = 4 + len;
+  uint64_t start = hist_now();
+  pthread_mutex_lock(&conn->tx_lock);
+  if (conn->tx_disabled)
+    goto done;
+  bool hold = conn_should_hold(conn, frame, len, start);
+  if (conn->tx_len > 0) {
+    // Preserve the order of frames: queue behind the pending ones.
+    if (conn->tx_len + total > CONN_TX_BUF_LEN) {
+      conn->tx_dropped++;
+      DEBUGF("Dropping a frame to the socket %d: %zu bytes pending", conn->socket_fd,
+             conn->tx_len);
+      goto done;
+    }
+    memcpy(conn->tx_buf + conn->tx_len, &header_be, 4);
+    memcpy(conn->tx_buf + conn->tx_len + 4, frame, len);
+    conn->tx_len += total;
+    if (conn->tx_held) {
+      conn->tx_held_frames++;
+      if (!hold || conn->tx_len >= conn->coalesce_bytes)
+        conn_write_queued(conn);
+    }
+    goto done;
+  }
+  if (hold) {
+    if (conn->tx_buf == NULL && (conn->tx_buf = arena_alloc(CONN_TX_BUF_LEN)) == NULL)
+      goto done;
+    memcpy(conn->tx_buf, &header_be, 4);
+    memcpy(conn->tx_buf + 4, frame, len);
+    conn->tx_len = total;
+    conn->tx_held = true;
+    conn->tx_held_ns = start;
+    conn->tx_held_frames++;
+    conn_arm_hold_timer(conn, conn->coalesce_ns / 1000);
+    goto done;
+  }
+  ssize_t written = writev(conn->socket_fd, iov, 2);
+  DEBUGF("Sent to the socket %d: %ld of %zu bytes (including uint32be header)", conn->socket_fd,
+         written, total);
+  if (written < 0) {
+    if (errno != EAGAIN) {
+      // The loop reading the socket notices the peer going away.
+      ERRORN("writev");
+      goto done;
+    }
+    written = 0;
+  }
+  if ((size_t)written == total)
+    goto done;
+  // The rest of the frame has to be sent before anything else.
+  if (conn->tx_buf == NULL && (conn->tx_buf = arena_alloc(CONN_TX_BUF_LEN)) == NULL)
+    goto done;
+  for (size_t off = written, i = 0; i < 2; i++) {
+    if (off >= iov[i].iov_len) {
+      off -= iov[i].iov_len;
+      continue;
+    }
+    memcpy(conn->tx_buf + conn->tx_len, (uint8_t *)iov[i].iov_base + off, iov[i].iov_len - off);
+    conn->tx_len += iov[i].iov_len - off;
+    off = 0;
+  }
+  conn_arm_write(conn);
+done:
+  pthread_mutex_unlock(&conn->tx_lock);
+  hist_record_since(&conn->latency[STAGE_SEND], start);
+}
+
+// Writes the queued frames once the socket is writable again, or once the
+// held ones are due.
+static void conn_flush(struct conn *conn) {
+  pthread_mutex_lock(&conn->tx_lock);
+  if (conn->tx_len > 0 && !conn->tx_disabled)
+    conn_write_queued(conn);
+  pthread_mutex_unlock(&conn->tx_lock);
+}
+
+// Adds a connection on vlan and starts reading it on one of the loops. pending
+// is the state of a connection taken over from the previous process, or NULL.
+static struct conn *state_add_socket_fd(struct state *state, int socket_fd, uint16_t vlan,
+                                        const struct handoff_conn *pending) {
+  if (fcntl(socket_fd, F_SETFL, O_NONBLOCK) < 0) {
+    ERRORN("fcntl(O_NONBLOCK)");
+    return NULL;
+  }
   struct conn *conn = calloc(1, sizeof(*conn));
+  if (conn == NULL) {
+    ERRORN("calloc");
+    return NULL;
+  }
+  conn->id = ++state->next_conn_id;
   conn->socket_fd = socket_fd;
-  dispatch_semaphore_wait(state->sem, DISPATCH_TIME_FOREVER);
-  if (state->conns == NULL) {
-    state->conns = conn;
-  } else {
-    struct conn *last;
-    for (last = state->conns; last->next != NULL; last = last->next)
-      ;
-    last->next = conn;
+  conn->vlan = vlan;
+  conn->loop = &state->loops[state->next_loop++ % state->loop_count];
+  pthread_mutex_init(&conn->tx_lock, NULL);
+  conn->coalesce_ns = state->cliopt->coalesce_usecs * 1000ULL;
+  conn->coalesce_bytes = state->cliopt->coalesce_bytes;
+  conn->coalesce_adaptive = state->cliopt->coalesce_adaptive;
+  sockbuf_init(&conn->sockbuf, socket_fd, (int)state->cliopt->socket_buffer_min);
+  if (state->egress != NULL)
+    egress_flow_init(state->egress, &conn->egress, state->cliopt->egress_rate, false,
+                     &conn->latency[STAGE_EGRESS]);
+  if (pending != NULL) {
+    if (pending->rx_len > CONN_RX_BUF_LEN || pending->tx_len > CONN_TX_BUF_LEN) {
+      ERRORF("handoff: too many pending bytes for the connection (fd %d)", socket_fd);
+      goto err;
+    }
+    if (pending->rx_len > 0) {
+      conn->rx_buf = arena_alloc(CONN_RX_BUF_LEN);
+      if (conn->rx_buf == NULL)
+        goto err;
+      memcpy(conn->rx_buf, pending->rx, pending->rx_len);
+      conn->rx_len = pending->rx_len;
+    }
+    if (pending->tx_len > 0) {
+      conn->tx_buf = arena_alloc(CONN_TX_BUF_LEN);
+      if (conn->tx_buf == NULL)
+        goto err;
+      memcpy(conn->tx_buf, pending->tx, pending->tx_len);
+      conn->tx_len = pending->tx_len;
+      conn_arm_write(conn);
+    }
   }
-  dispatch_semaphore_signal(state->sem);
+  pthread_rwlock_wrlock(&state->lock);
+  conn->next = state->conns;
+  state->conns = conn;
+  state_select_path(state);
+  if (state->cliopt->multicast_snooping) {
+    // The VM reports the groups it already joined, e.g., before a restart.
+    uint8_t query[MCAST_QUERY_MAX_LEN];
+    conn_send(conn, query, mcast_build_query(false, query));
+    conn_send(conn, query, mcast_build_query(true, query));
+  }
+  pthread_rwlock_unlock(&state->lock);
+
+  struct kevent change;
+  EV_SET(&change, socket_fd, EVFILT_READ, EV_ADD, 0, 0, conn);
+  if (kevent(conn->loop->kq, &change, 1, NULL, 0, NULL) != 0) {
+    // Unreachable in practice; the connection just stays idle.
+    ERRORN("kevent(EVFILT_READ)");
+  }
+  return conn;
+err:
+  if (state->egress != NULL)
+    egress_flow_destroy(state->egress, &conn->egress);
+  pthread_mutex_destroy(&conn->tx_lock);
+  arena_free(conn->rx_buf, CONN_RX_BUF_LEN);
+  arena_free(conn->tx_buf, CONN_TX_BUF_LEN);
+  free(conn);
+  return NULL;
 }
 
-static void state_remove_socket_fd(struct state *state, int socket_fd) {
-  dispatch_semaphore_wait(state->sem, DISPATCH_TIME_FOREVER);
-  if (state->conns != NULL) {
-    if (state->conns->socket_fd == socket_fd) {
-      state->conns = state->conns->next;
-    } else {
-      struct conn *conn;
-      for (conn = state->conns; conn->next != NULL; conn = conn->next) {
-        if (conn->next->socket_fd == socket_fd) {
-          conn->next = conn->next->next;
-          break;
-        }
-      }
+// Closes and frees conn. Only called by the loop of conn.
+static void state_remove_conn(struct state *state, struct conn *conn) {
+  INFOF("Closing a connection (fd %d)", conn->socket_fd);
+  // Once unlinked under the write lock, nothing else can reach conn.
+  pthread_rwlock_wrlock(&state->lock);
+  for (struct conn **p = &state->conns; *p != NULL; p = &(*p)->next) {
+    if (*p == conn) {
+      *p = conn->next;
+      break;
     }
   }
-  dispatch_semaphore_signal(state->sem);
+  fdb_forget(&state->fdb, conn);
+  neigh_forget(&state->neigh, conn);
+  mcast_forget(&state->mcast, conn);
+  state_select_path(state);
+  pthread_rwlock_unlock(&state->lock);
+  if (conn->coalesce_ns > 0) {
+    // Unlike the other filters, the timer outlives the socket.
+    struct kevent change;
+    EV_SET(&change, conn->socket_fd, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+    kevent(conn->loop->kq, &change, 1, NULL, 0, NULL);
+  }
+  if (conn->tx_dropped > 0)
+    INFOF("Dropped %llu frames to the connection (fd %d)", conn->tx_dropped, conn->socket_fd);
+  if (state->egress != NULL)
+    egress_flow_destroy(state->egress, &conn->egress);
+  close(conn->socket_fd);
+  pthread_mutex_destroy(&conn->tx_lock);
+  arena_free(conn->rx_buf, CONN_RX_BUF_LEN);
+  arena_free(conn->tx_buf, CONN_TX_BUF_LEN);
+  free(conn);
+}
+
+// vmnet reports a full queue with VMNET_BUFFER_EXHAUSTED. It drains within
+// microseconds: the operation is retried a few times, backing off, before
+// giving up on the frames.
+#define VMNET_RETRY_MAX 4
+#define VMNET_RETRY_DELAY_US 20
+
+// Returns true if the operation that failed with status should be retried,
+// after sleeping *delay_us.
+static bool state_vmnet_backoff(struct state *state, vmnet_return_t status, int attempt,
+                                useconds_t *delay_us) {
+  if (status != VMNET_BUFFER_EXHAUSTED || attempt >= VMNET_RETRY_MAX)
+    return false;
+  atomic_fetch_add_explicit(&state->vmnet_retries, 1, memory_order_relaxed);
+  usleep(*delay_us);
+  *delay_us *= 2;
+  return true;
+}
+
+static vmnet_return_t state_vmnet_write_once(struct state *state, struct vmpktdesc *pdv, int count,
+                                             int *written_count) {
+  *written_count = count;
+  return fault_inject(FAULT_VMNET_WRITE) ? VMNET_BUFFER_EXHAUSTED
+                                         : vmnet_write(state->iface, pdv, written_count);
+}
+
+// Counts the frames of a write to vmnet that were dropped: an overloaded vmnet
+// is not an error of the VM that sent them. Returns the number of frames
+// written.
+static int state_vmnet_written(struct state *state, vmnet_return_t status, int count,
+                               int written_count) {
+  if (status != VMNET_SUCCESS) {
+    atomic_fetch_add_explicit(&state->vmnet_write_errors, count, memory_order_relaxed);
+    if (status == VMNET_BUFFER_EXHAUSTED)
+      DEBUGF("vmnet_write: [%d] %s, %d frames dropped", status, vmnet_strerror(status), count);
+    else
+      ERRORF("vmnet_write: [%d] %s", status, vmnet_strerror(status));
+    return 0;
+  }
+  if (written_count < count)
+    DEBUGF("[Socket-to-VMNET] vmnet_write: %d of %d frames dropped", count - written_count, count);
+  return written_count;
+}
+
+// Writes count frames to vmnet, retrying while it is out of buffers. Sleeps,
+// so never called with state->lock held. Returns the number of frames
+// written.
+static int state_vmnet_write(struct state *state, struct vmpktdesc *pdv, int count) {
+  useconds_t delay_us = VMNET_RETRY_DELAY_US;
+  vmnet_return_t status;
+  int written_count;
+  int attempt = 0;
+  do {
+    status = state_vmnet_write_once(state, pdv, count, &written_count);
+  } while (status != VMNET_SUCCESS && state_vmnet_backoff(state, status, attempt++, &delay_us));
+  return state_vmnet_written(state, status, count, written_count);
+}
+
+// Writes count frames to vmnet once, with state->lock held. Returns false if
+// vmnet is out of buffers: the caller retries with state_vmnet_write once it
+// released the lock, rather than holding back the writers of the lock while
+// backing off.
+static bool state_vmnet_try_write(struct state *state, struct vmpktdesc *pdv, int count) {
+  int written_count;
+  vmnet_return_t status = state_vmnet_write_once(state, pdv, count, &written_count);
+  if (status == VMNET_BUFFER_EXHAUSTED)
+    return false;
+  state_vmnet_written(state, status, count, written_count);
+  return true;
+}
+
+// Writes a frame made by the daemon itself to vmnet, with state->lock held. Not
+// retried: the frame is an answer, which the requester will ask again.
+static void state_vmnet_inject(struct state *state, uint16_t vlan, uint8_t *frame, size_t len) {
+  uint8_t tag[VLAN_TAG_LEN];
+  struct iovec iov[3];
+  int iovcnt = vlan_tag_iov(iov, tag, vlan, frame, len);
+  struct vmpktdesc pd = {
+      .vm_pkt_size = len + (iovcnt > 1 ? VLAN_TAG_LEN : 0),
+      .vm_pkt_iov = iov,
+      .vm_pkt_iovcnt = iovcnt,
+      .vm_flags = 0,
+  };
+  int written_count;
+  vmnet_return_t status = state_vmnet_write_once(state, &pd, 1, &written_count);
+  state_vmnet_written(state, status, 1, written_count);
+}
+
+// Decides once whether the frames can take the specialized paths: none of the
+// features below looks at them, and no frame is on a VLAN.
+static void state_init_forwarding(struct state *state) {
+  const struct cli_options *cliopt = state->cliopt;
+  state->specialized = !debug && !cliopt->generic_forwarding && cliopt->vlan_socket_count == 0 &&
+                       !cliopt->egress_scheduler && !cliopt->neighbor_proxy &&
+                       !cliopt->multicast_snooping && !cliopt->dhcp_server;
+  pthread_rwlock_wrlock(&state->lock);
+  state_select_path(state);
+  pthread_rwlock_unlock(&state->lock);
+  INFOF("Using the %s forwarding path", state->specialized ? "specialized" : "generic");
+}
+
+// Delivers a frame from vmnet on the generic path. Called with state->lock
+// held for reading.
+static void forward_generic_from_vmnet(struct state *state, uint16_t vlan, uint8_t *packet,
+                                       size_t packet_size) {
+  uint8_t dest_mac[6], src_mac[6];
+  memcpy(dest_mac, packet, sizeof(dest_mac));
+  memcpy(src_mac, packet + 6, sizeof(src_mac));
+  DEBUGF("[Handler] Dest %02X:%02X:%02X:%02X:%02X:%02X, Src %02X:%02X:%02X:%02X:%02X:%02X,",
+         dest_mac[0], dest_mac[1], dest_mac[2], dest_mac[3], dest_mac[4], dest_mac[5], src_mac[0],
+         src_mac[1], src_mac[2], src_mac[3], src_mac[4], src_mac[5]);
+  void *dest_owner = mac_is_multicast(dest_mac) ? NULL : state_lookup(state, vlan, dest_mac);
+  struct mcast_group *group = state_mcast_group(state, vlan, dest_mac, packet_size);
+  uint8_t reply[NEIGH_REPLY_MAX_LEN];
+  size_t reply_len = 0;
+  if (state->cliopt->neighbor_proxy)
+    reply_len = state_answer_neigh(state, vlan, packet, packet_size, VMNET_OWNER, reply);
+  if (reply_len > 0) {
+    DEBUGF("[Handler] Answering a neighbor request from the vmnet side on VLAN %d", vlan);
+    state_vmnet_inject(state, vlan, reply, reply_len);
+  } else if (dest_owner == VMNET_OWNER) {
+    DEBUGF("[Handler] Dropping a packet destined to the vmnet side on VLAN %d", vlan);
+  } else {
+    for (struct conn *conn = state->conns; conn != NULL; conn = conn->next) {
+      // Flood only if the destination is unknown, and only within the VLAN.
+      if (conn->vlan != vlan || (dest_owner != NULL && conn != dest_owner))
+        continue;
+      if (group != NULL && !mcast_is_member(&state->mcast, vlan, dest_mac, conn))
+        continue;
+      DEBUGF("[Handler] Sending to the socket %d: 4 + %zu bytes [Dest "
+             "%02X:%02X:%02X:%02X:%02X:%02X]",
+             conn->socket_fd, packet_size, dest_mac[0], dest_mac[1], dest_mac[2], dest_mac[3],
+             dest_mac[4], dest_mac[5]);
+      conn_send(conn, packet, packet_size);
+    }
+  }
+}
+
+// Delivers a frame from vmnet on the specialized path, a constant: each call
+// compiles to a copy without the branches of the other paths. Called with
+// state->lock held for reading.
+static inline __attribute__((always_inline)) void
+forward_specialized_from_vmnet(struct state *state, uint8_t *packet, size_t packet_size,
+                               const enum forward_path path) {
+  void *dest_owner = NULL;
+  if (!mac_is_multicast(packet))
+    dest_owner = path == FORWARD_HASH ? state_lookup(state, VLAN_NONE, packet)
+                                      : state_port_lookup(state, packet);
+  if (dest_owner == VMNET_OWNER)
+    return;
+  if (dest_owner != NULL) {
+    conn_send(dest_owner, packet, packet_size);
+  } else if (path == FORWARD_HASH) {
+    for (struct conn *conn = state->conns; conn != NULL; conn = conn->next)
+      conn_send(conn, packet, packet_size);
+  } else {
+    for (size_t i = 0; i < (path == FORWARD_SINGLE ? 1 : state->port_count); i++)
+      conn_send(state->ports[i].conn, packet, packet_size);
+  }
+}
+
+// Delivers a frame read from vmnet at read_ns to the VMs. Called by the host
+// queue, or by the workers with --vmnet-rx-queues.
+static void state_forward_from_vmnet(struct state *state, uint8_t *packet, size_t packet_size,
+                                     uint64_t read_ns) {
+  capture_frame(CAPTURE_SOURCE_VMNET, -1, ether_vlan(packet, packet_size), packet, packet_size);
+  trace_frame(TRACE_SOURCE_VMNET, VLAN_NONE, packet, packet_size);
+  // Frames tagged with the VLAN of a socket go untagged to its VMs; the
+  // others go unchanged to the VMs on the main socket.
+  uint16_t vlan = ether_vlan(packet, packet_size);
+  if (vlan != VLAN_NONE && state->vlans[vlan]) {
+    memmove(packet + VLAN_TAG_LEN, packet, 2 * ETHER_ADDR_LEN);
+    packet += VLAN_TAG_LEN;
+    packet_size -= VLAN_TAG_LEN;
+  } else {
+    vlan = VLAN_NONE;
+  }
+  uint64_t lock_start = hist_now();
+  pthread_rwlock_rdlock(&state->lock);
+  hist_record_since(&state->vmnet_latency[STAGE_LOCK], lock_start);
+  state_learn(state, vlan, packet + 6, VMNET_OWNER);
+  // Learning may have changed the path.
+  switch (state->path) {
+  case FORWARD_GENERIC:
+    forward_generic_from_vmnet(state, vlan, packet, packet_size);
+    break;
+  case FORWARD_SINGLE:
+    forward_specialized_from_vmnet(state, packet, packet_size, FORWARD_SINGLE);
+    break;
+  case FORWARD_SCAN:
+    forward_specialized_from_vmnet(state, packet, packet_size, FORWARD_SCAN);
+    break;
+  case FORWARD_HASH:
+    forward_specialized_from_vmnet(state, packet, packet_size, FORWARD_HASH);
+    break;
+  }
+  pthread_rwlock_unlock(&state->lock);
+  // The frames of a batch wait for each other.
+  hist_record_since(&state->vmnet_latency[STAGE_FORWARD], read_ns);
+}
+
+static void state_rss_deliver(void *ctx, uint8_t *frame, size_t len, uint64_t read_ns) {
+  state_forward_from_vmnet(ctx, frame, len, read_ns);
 }
 
 static void _on_vmnet_packets_available(interface_ref iface, int64_t buf_count, int64_t max_bytes,
@@ -123,91 +929,61 @@ static void _on_vmnet_packets_available(interface_ref iface, int64_t buf_count,
   DEBUGF("Receiving from VMNET (buffer for %lld packets, max: %lld "
          "bytes)",
          buf_count, max_bytes);
-  // TODO: use prealloced pool
-  struct vmpktdesc *pdv = calloc(buf_count, sizeof(struct vmpktdesc));
-  if (pdv == NULL) {
-    ERRORN("calloc(estim_count, sizeof(struct vmpktdesc)");
-    goto done;
+  if (state->vmnet_buf_len != (size_t)max_bytes) {
+    arena_free(state->vmnet_buf, MAX_PACKET_COUNT_AT_ONCE * state->vmnet_buf_len);
+    state->vmnet_buf = arena_alloc(MAX_PACKET_COUNT_AT_ONCE * (size_t)max_bytes);
+    state->vmnet_buf_len = state->vmnet_buf != NULL ? (size_t)max_bytes : 0;
+    if (state->vmnet_buf == NULL)
+      return;
   }
+  struct vmpktdesc *pdv = state->vmnet_pdv;
   for (int i = 0; i < buf_count; i++) {
+    state->vmnet_iov[i].iov_base = state->vmnet_buf + i * state->vmnet_buf_len;
+    state->vmnet_iov[i].iov_len = max_bytes;
     pdv[i].vm_flags = 0;
     pdv[i].vm_pkt_size = max_bytes;
-    pdv[i].vm_pkt_iovcnt = 1, pdv[i].vm_pkt_iov = malloc(sizeof(struct iovec));
-    if (pdv[i].vm_pkt_iov == NULL) {
-      ERRORN("malloc(sizeof(struct iovec))");
-      goto done;
-    }
-    pdv[i].vm_pkt_iov->iov_base = malloc(max_bytes);
-    if (pdv[i].vm_pkt_iov->iov_base == NULL) {
-      ERRORN("malloc(max_bytes)");
-      goto done;
-    }
-    pdv[i].vm_pkt_iov->iov_len = max_bytes;
+    pdv[i].vm_pkt_iovcnt = 1;
+    pdv[i].vm_pkt_iov = &state->vmnet_iov[i];
   }
-  int received_count = buf_count;
-  vmnet_return_t read_status = vmnet_read(iface, pdv, &received_count);
+  int received_count;
+  uint64_t start = hist_now();
+  useconds_t delay_us = VMNET_RETRY_DELAY_US;
+  vmnet_return_t read_status;
+  int attempt = 0;
+  do {
+    received_count = buf_count;
+    read_status = fault_inject(FAULT_VMNET_READ) ? VMNET_BUFFER_EXHAUSTED
+                                                 : vmnet_read(iface, pdv, &received_count);
+  } while (read_status != VMNET_SUCCESS &&
+           state_vmnet_backoff(state, read_status, attempt++, &delay_us));
+  start = hist_record_since(&state->vmnet_latency[STAGE_READ], start);
   if (read_status != VMNET_SUCCESS) {
+    atomic_fetch_add_explicit(&state->vmnet_read_errors, 1, memory_order_relaxed);
     ERRORF("vmnet_read: [%d] %s", read_status, vmnet_strerror(read_status));
-    goto done;
+    return;
   }
 
   DEBUGF("Received from VMNET: %d packets (buffer was prepared for %lld packets)", received_count,
          buf_count);
   for (int i = 0; i < received_count; i++) {
-    uint8_t dest_mac[6], src_mac[6];
-    assert(pdv[i].vm_pkt_iov[0].iov_len > 12);
-    const char *packet = (const char *)pdv[i].vm_pkt_iov[0].iov_base;
-    memcpy(dest_mac, packet, sizeof(dest_mac));
-    memcpy(src_mac, packet + 6, sizeof(src_mac));
-    DEBUGF("[Handler i=%d] Dest %02X:%02X:%02X:%02X:%02X:%02X, Src "
-           "%02X:%02X:%02X:%02X:%02X:%02X,",
-           i, dest_mac[0], dest_mac[1], dest_mac[2], dest_mac[3], dest_mac[4], dest_mac[5],
-           src_mac[0], src_mac[1], src_mac[2], src_mac[3], src_mac[4], src_mac[5]);
-    dispatch_semaphore_wait(state->sem, DISPATCH_TIME_FOREVER);
-    struct conn *conns = state->conns;
-    dispatch_semaphore_signal(state->sem);
-    for (struct conn *conn = conns; conn != NULL; conn = conn->next) {
-      // FIXME: avoid flooding
-      DEBUGF("[Handler i=%d] Sending to the socket %d: 4 + %ld bytes [Dest "
-             "%02X:%02X:%02X:%02X:%02X:%02X]",
-             i, conn->socket_fd, pdv[i].vm_pkt_size, dest_mac[0], dest_mac[1], dest_mac[2],
-             dest_mac[3], dest_mac[4], dest_mac[5]);
-      uint32_t header_be = htonl(pdv[i].vm_pkt_size);
-      struct iovec iov[2] = {
-          {
-           .iov_base = &header_be,
-           .iov_len = 4,
-           },
-          {
-           .iov_base = pdv[i].vm_pkt_iov[0].iov_base,
-           .iov_len = pdv[i].vm_pkt_size, // not vm_pkt_iov[0].iov_len
-          },
-      };
-      ssize_t written = writev(conn->socket_fd, iov, 2);
-      DEBUGF("[Handler i=%d] Sent to the socket: %ld bytes (including uint32be "
-             "header)",
-             i, written);
-      if (written < 0) {
-        ERRORN("writev");
-        goto done;
-      }
+    uint8_t *packet = pdv[i].vm_pkt_iov[0].iov_base;
+    size_t packet_size = pdv[i].vm_pkt_size; // not vm_pkt_iov[0].iov_len
+    if (fault_inject(FAULT_VMNET_RUNT))
+      packet_size = ETHER_HDR_LEN - 1;
+    if (packet_size < ETHER_HDR_LEN) {
+      atomic_fetch_add_explicit(&state->vmnet_runts, 1, memory_order_relaxed);
+      DEBUGF("[Handler i=%d] Dropping a runt frame: %zu bytes", i, packet_size);
+      continue;
     }
+    if (state->rss == NULL)
+      state_forward_from_vmnet(state, packet, packet_size, start);
+    else if (!rss_enqueue(state->rss, packet, packet_size, start))
+      DEBUGF("[Handler i=%d] Dropping a frame: the receive queue is full", i);
   }
-done:
-  if (pdv != NULL) {
-    for (int i = 0; i < buf_count; i++) {
-      if (pdv[i].vm_pkt_iov != NULL) {
-        if (pdv[i].vm_pkt_iov->iov_base != NULL) {
-          free(pdv[i].vm_pkt_iov->iov_base);
-        }
-        free(pdv[i].vm_pkt_iov);
-      }
-    }
-    free(pdv);
-  }
+  if (state->rss != NULL)
+    rss_flush(state->rss);
 }
 
-#define MAX_PACKET_COUNT_AT_ONCE 32
 static void on_vmnet_packets_available(interface_ref iface, int64_t estim_count, int64_t max_bytes,
                                        struct state *state) {
   int64_t q = estim_count / MAX_PACKET_COUNT_AT_ONCE;
@@ -368,7 +1144,7 @@ static void stop(struct state *state, interface_ref iface) {
   }
 }
 
-static int socket_bindlisten(const char *socket_path, const char *socket_group) {
+static int socket_bindlisten(const char *socket_path, const char *socket_group, int backlog) {
   int fd = -1;
   struct sockaddr_un addr = {0};
 
@@ -388,7 +1164,7 @@ static int socket_bindlisten(const char *socket_path, const char *socket_group)
     ERRORN("bind");
     goto err;
   }
-  if (listen(fd, 0) < 0) {
+  if (listen(fd, backlog) < 0) {
     ERRORN("listen");
     goto err;
   }
@@ -454,11 +1230,59 @@ static int create_pidfile(const char *pidfile) {
   return fd;
 }
 
+// Returns the path of the state file, next to pidfile: "NAME.pid" becomes
+// "NAME.state", other names get ".state" appended.
+static char *state_file_path(const char *pidfile) {
+  size_t len = strlen(pidfile);
+  if (len > 4 && strcmp(pidfile + len - 4, ".pid") == 0)
+    len -= 4;
+  char *path = malloc(len + sizeof(".state"));
+  if (path == NULL) {
+    ERRORN("malloc");
+    return NULL;
+  }
+  memcpy(path, pidfile, len);
+  memcpy(path + len, ".state", sizeof(".state"));
+  return path;
+}
+
+// Saves the tables to the state file, and forgets the addresses of the VMs
+// that did not come back after a restart.
+static void state_save(struct state *state) {
+  uint64_t now = hist_now();
+  if (state->restored_ns != 0 && now - state->restored_ns > RESTORED_GRACE_NS) {
+    pthread_rwlock_wrlock(&state->lock);
+    fdb_forget(&state->fdb, RESTORED_OWNER);
+    neigh_forget(&state->neigh, RESTORED_OWNER);
+    pthread_rwlock_unlock(&state->lock);
+    state->restored_ns = 0;
+  }
+  pthread_rwlock_rdlock(&state->lock);
+  statefile_save(state->statefile, &state->fdb, &state->neigh, VMNET_OWNER, now);
+  pthread_rwlock_unlock(&state->lock);
+}
+
+// Samples the socket buffers of the connections, and resizes them with
+// --socket-buffer-max.
+static void state_sample_sockbufs(struct state *state) {
+  int min = (int)state->cliopt->socket_buffer_min;
+  int max = (int)state->cliopt->socket_buffer_max;
+  pthread_rwlock_rdlock(&state->lock);
+  for (struct conn *conn = state->conns; conn != NULL; conn = conn->next) {
+    pthread_mutex_lock(&conn->tx_lock);
+    uint64_t blocked = conn->tx_blocked;
+    pthread_mutex_unlock(&conn->tx_lock);
+    sockbuf_update(&conn->sockbuf, conn->socket_fd, blocked, min, max);
+  }
+  pthread_rwlock_unlock(&state->lock);
+}
+
 static int setup_signals(int kq) {
   struct kevent changes[] = {
       {.ident = SIGHUP,  .filter = EVFILT_SIGNAL, .flags = EV_ADD},
       {.ident = SIGINT,  .filter = EVFILT_SIGNAL, .flags = EV_ADD},
       {.ident = SIGTERM, .filter = EVFILT_SIGNAL, .flags = EV_ADD},
+      {.ident = SIGUSR1, .filter = EVFILT_SIGNAL, .flags = EV_ADD},
   };
 
   // Block signals we want to receive via kqueue.
@@ -482,9 +1306,99 @@ static int setup_signals(int kq) {
   return 0;
 }
 
-static int add_listen_fd(int kq, int fd) {
+static int add_listen_fd(int kq, int fd, void *udata) {
+  struct kevent changes[] = {
+      {.ident = fd, .filter = EVFILT_READ, .flags = EV_ADD, .udata = udata},
+  };
+  if (kevent(kq, changes, ARRAY_SIZE(changes), NULL, 0, NULL) != 0) {
+    ERRORN("kevent");
+    return -1;
+  }
+  return 0;
+}
+
+// Pause of a listener out of descriptors
+#define ACCEPT_RETRY_MS 100
+
+// Accepts all the pending connections of listener, as VMs often start
+// together. kq is the main loop, serving listener.
+static void state_accept(struct state *state, int kq, struct listener *listener) {
+  for (;;) {
+    int accept_fd = accept(listener->fd, NULL, NULL);
+    if (accept_fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      ERRORN("accept");
+      // Out of descriptors: the pending connections stay in the backlog, and
+      // would wake us up again at once. Stop listening for a while, without
+      // holding back the signals and the control socket.
+      if (errno == EMFILE || errno == ENFILE) {
+        struct kevent changes[2];
+        EV_SET(&changes[0], listener->fd, EVFILT_READ, EV_DISABLE, 0, 0, listener);
+        EV_SET(&changes[1], listener->fd, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, ACCEPT_RETRY_MS,
+               listener);
+        if (kevent(kq, changes, ARRAY_SIZE(changes), NULL, 0, NULL) != 0)
+          ERRORN("kevent");
+      }
+      return;
+    }
+    INFOF("Accepted a connection (fd %d, VLAN %d)", accept_fd, listener->vlan);
+    if (state_add_socket_fd(state, accept_fd, listener->vlan, NULL) == NULL)
+      close(accept_fd);
+  }
+}
+
+// Every VM needs a descriptor, and the default limit of macOS (256) is soon
+// reached.
+static void raise_nofile_limit(void) {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+    ERRORN("getrlimit");
+    return;
+  }
+  rlim_t want = rl.rlim_max;
+  if (want > OPEN_MAX) // setrlimit(2) rejects more on macOS
+    want = OPEN_MAX;
+  if (rl.rlim_cur >= want)
+    return;
+  rlim_t old = rl.rlim_cur;
+  rl.rlim_cur = want;
+  if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+    ERRORN("setrlimit");
+    return;
+  }
+  INFOF("Raised the limit of open files from %llu to %llu", (unsigned long long)old,
+        (unsigned long long)want);
+}
+
+// Idents of the timers of the main loop, besides the listeners backing off
+// from EMFILE (ident: their fd, udata: the listener)
+#define SAVE_TIMER 0
+#define SOCKBUF_TIMER 1
+
+static int add_save_timer(int kq) {
+  struct kevent changes[] = {
+      {.ident = SAVE_TIMER,
+       .filter = EVFILT_TIMER,
+       .flags = EV_ADD,
+       .fflags = NOTE_SECONDS,
+       .data = STATEFILE_SAVE_INTERVAL_SEC},
+  };
+  if (kevent(kq, changes, ARRAY_SIZE(changes), NULL, 0, NULL) != 0) {
+    ERRORN("kevent");
+    return -1;
+  }
+  return 0;
+}
+
+static int add_sockbuf_timer(int kq) {
   struct kevent changes[] = {
-      {.ident = fd, .filter = EVFILT_READ, .flags = EV_ADD},
+      {.ident = SOCKBUF_TIMER,
+       .filter = EVFILT_TIMER,
+       .flags = EV_ADD,
+       .data = SOCKBUF_SAMPLE_INTERVAL_MS}, // milliseconds by default
   };
   if (kevent(kq, changes, ARRAY_SIZE(changes), NULL, 0, NULL) != 0) {
     ERRORN("kevent");
@@ -493,15 +1407,874 @@ static int add_listen_fd(int kq, int fd) {
   return 0;
 }
 
-static void on_accept(struct state *state, int accept_fd, interface_ref iface);
+// Writes a batch of frames from the egress scheduler to vmnet.
+static void state_egress_output(void *ctx, const struct iovec *frames, int count) {
+  struct state *state = ctx;
+  struct vmpktdesc pdv[EGRESS_BATCH];
+  for (int i = 0; i < count; i++) {
+    pdv[i].vm_pkt_size = frames[i].iov_len;
+    pdv[i].vm_pkt_iov = (struct iovec *)&frames[i];
+    pdv[i].vm_pkt_iovcnt = 1;
+    pdv[i].vm_flags = 0;
+  }
+  state_vmnet_write(state, pdv, count);
+}
+
+// Applies the --egress-rate and --egress-priority rules for src, the address of
+// the VM behind conn.
+static void conn_configure_egress(struct state *state, struct conn *conn, const uint8_t *src) {
+  const struct cli_options *cliopt = state->cliopt;
+  conn->egress_configured = true;
+  for (size_t i = 0; i < cliopt->egress_rule_count; i++) {
+    const struct cli_egress_rule *rule = &cliopt->egress_rules[i];
+    if (memcmp(rule->mac, src, ETHER_ADDR_LEN) != 0)
+      continue;
+    uint64_t rate = rule->rate != 0 ? rule->rate : cliopt->egress_rate;
+    INFOF("Egress of the connection (fd %d): rate %llu bit/s, %s priority", conn->socket_fd,
+          rate, rule->priority ? "high" : "normal");
+    egress_flow_configure(state->egress, &conn->egress, rate, rule->priority);
+    return;
+  }
+}
+
+// Writes a frame from conn to vmnet, tagged with the VLAN of conn. If locked,
+// returns false if vmnet is out of buffers, see state_vmnet_try_write.
+static bool conn_vmnet_write(struct state *state, struct conn *conn, uint8_t *frame, uint32_t len,
+                             bool locked) {
+  uint8_t tag[VLAN_TAG_LEN];
+  struct iovec iov[3];
+  int iovcnt = vlan_tag_iov(iov, tag, conn->vlan, frame, len);
+  struct vmpktdesc pd = {
+      .vm_pkt_size = len + (iovcnt > 1 ? VLAN_TAG_LEN : 0),
+      .vm_pkt_iov = iov,
+      .vm_pkt_iovcnt = iovcnt,
+      .vm_flags = 0,
+  };
+  DEBUGF("[Socket-to-VMNET] Sending from the socket %d to VMNET: %ld bytes", conn->socket_fd,
+         pd.vm_pkt_size);
+  uint64_t write_start = hist_now();
+  if (!locked)
+    state_vmnet_write(state, &pd, 1);
+  else if (!state_vmnet_try_write(state, &pd, 1))
+    return false;
+  hist_record_since(&conn->latency[STAGE_VMNET_WRITE], write_start);
+  return true;
+}
+
+// Forwards a frame from conn on the generic path. Called with state->lock held
+// for reading. Returns false if the frame is still to be written to vmnet,
+// see conn_vmnet_write.
+static bool forward_generic_from_socket(struct state *state, struct conn *conn, uint8_t *frame,
+                                        uint32_t len) {
+  bool written = true;
+  void *dest_owner = NULL;
+  if (state->egress != NULL && !conn->egress_configured && !mac_is_multicast(frame + 6))
+    conn_configure_egress(state, conn, frame + 6);
+  state_learn(state, conn->vlan, frame + 6, conn);
+  if (state->cliopt->multicast_snooping)
+    state_snoop(state, conn->vlan, frame, len, conn);
+  if (!mac_is_multicast(frame))
+    dest_owner = state_lookup(state, conn->vlan, frame);
+  if (state->cliopt->neighbor_proxy) {
+    state_learn_neigh(state, conn->vlan, frame, len, conn);
+    uint8_t reply[NEIGH_REPLY_MAX_LEN];
+    size_t reply_len = state_answer_neigh(state, conn->vlan, frame, len, conn, reply);
+    if (reply_len > 0) {
+      DEBUGF("[Socket-to-Socket] Answering a neighbor request from the socket %d",
+             conn->socket_fd);
+      conn_send(conn, reply, reply_len);
+      return true;
+    }
+  }
+  if (dest_owner == conn) {
+    DEBUGF("[Socket-to-VMNET] Dropping a packet from the socket %d destined to itself",
+           conn->socket_fd);
+    return true;
+  }
+
+  if (dest_owner == NULL || dest_owner == VMNET_OWNER) {
+    if (state->egress != NULL) {
+      uint8_t tag[VLAN_TAG_LEN];
+      struct iovec iov[3];
+      int iovcnt = vlan_tag_iov(iov, tag, conn->vlan, frame, len);
+      enum egress_class cls = ether_dscp(frame, len) >= EGRESS_HIGH_DSCP ? EGRESS_CLASS_HIGH
+                                                                         : EGRESS_CLASS_NORMAL;
+      if (!egress_enqueue(state->egress, &conn->egress, cls, iov, iovcnt))
+        DEBUGF("[Socket-to-VMNET] Dropping a frame from the socket %d: egress queue is full",
+               conn->socket_fd);
+    } else {
+      // On failure the frame is dropped; the other VMs still get it.
+      written = conn_vmnet_write(state, conn, frame, len, true);
+    }
+  }
+
+  // Send the packet to the other VMs in the same network too, flooding it
+  // within the VLAN unless the destination is known. (Not handled by vmnet)
+  if (dest_owner != VMNET_OWNER) {
+    struct mcast_group *group = state_mcast_group(state, conn->vlan, frame, len);
+    for (struct conn *peer = state->conns; peer != NULL; peer = peer->next) {
+      if (peer == conn || peer->vlan != conn->vlan || (dest_owner != NULL && peer != dest_owner))
+        continue;
+      if (group != NULL && !mcast_is_member(&state->mcast, conn->vlan, frame, peer))
+        continue;
+      DEBUGF("[Socket-to-Socket] Sending from socket %d to socket %d: 4 + %d bytes",
+             conn->socket_fd, peer->socket_fd, len);
+      conn_send(peer, frame, len);
+    }
+  }
+  return written;
+}
+
+// Forwards a frame from conn on the specialized path, a constant, like
+// forward_specialized_from_vmnet. The source address is already learned.
+// Returns false if the frame is still to be written to vmnet.
+static inline __attribute__((always_inline)) bool
+forward_specialized_from_socket(struct state *state, struct conn *conn, uint8_t *frame,
+                                uint32_t len, const enum forward_path path) {
+  void *dest_owner = NULL;
+  bool written = true;
+  if (!mac_is_multicast(frame))
+    dest_owner = path == FORWARD_HASH ? state_lookup(state, VLAN_NONE, frame)
+                                      : state_port_lookup(state, frame);
+  if (dest_owner == conn)
+    return true;
+  if (dest_owner == NULL || dest_owner == VMNET_OWNER)
+    written = conn_vmnet_write(state, conn, frame, len, true);
+  // A single connection has no peer to send to.
+  if (path == FORWARD_SINGLE || dest_owner == VMNET_OWNER)
+    return written;
+  if (dest_owner != NULL) {
+    conn_send(dest_owner, frame, len);
+  } else if (path == FORWARD_HASH) {
+    for (struct conn *peer = state->conns; peer != NULL; peer = peer->next)
+      if (peer != conn)
+        conn_send(peer, frame, len);
+  } else {
+    for (size_t i = 0; i < state->port_count; i++)
+      if (state->ports[i].conn != conn)
+        conn_send(state->ports[i].conn, frame, len);
+  }
+  return written;
+}
+
+static void forward_from_socket(struct state *state, struct conn *conn, uint8_t *frame,
+                                uint32_t len) {
+  uint64_t start = hist_now();
+  capture_frame(conn->id, conn->socket_fd, conn->vlan, frame, len);
+  trace_frame(conn->id, conn->vlan, frame, len);
+  if (len < ETHER_HDR_LEN) {
+    atomic_fetch_add_explicit(&conn->rx_errors, 1, memory_order_relaxed);
+    DEBUGF("[Socket-to-VMNET] Dropping a runt frame from the socket %d: %u bytes",
+           conn->socket_fd, len);
+    return;
+  }
+  if (conn->vlan != VLAN_NONE && ether_type(frame) == ETHERTYPE_VLAN) {
+    // The VMs on a VLAN socket are on an access port: the tag is ours to add.
+    DEBUGF("[Socket-to-VMNET] Dropping a tagged frame from the socket %d on VLAN %d",
+           conn->socket_fd, conn->vlan);
+    return;
+  }
+  if (state->dhcp != NULL && conn->vlan == VLAN_NONE && dhcp_is_client_message(frame, len)) {
+    // Ours to answer: neither vmnet nor the other VMs serve DHCP.
+    uint8_t reply[DHCP_REPLY_LEN];
+    size_t reply_len = dhcp_handle(state->dhcp, frame, len, reply);
+    if (reply_len > 0) {
+      DEBUGF("[Socket-to-Socket] Answering a DHCP message from the socket %d", conn->socket_fd);
+      conn_send(conn, reply, reply_len);
+    }
+    hist_record_since(&conn->latency[STAGE_FORWARD], start);
+    return;
+  }
+  pthread_rwlock_rdlock(&state->lock);
+  hist_record_since(&conn->latency[STAGE_LOCK], start);
+  bool written;
+  if (state->path == FORWARD_GENERIC) {
+    written = forward_generic_from_socket(state, conn, frame, len);
+    goto done;
+  }
+  // The ports usually know the source already, saving the fdb lookup.
+  if (state->path == FORWARD_HASH || state_port_lookup(state, frame + 6) != conn)
+    state_learn(state, VLAN_NONE, frame + 6, conn);
+  // Learning may have changed the path, though not to FORWARD_GENERIC.
+  switch (state->path) {
+  case FORWARD_SINGLE:
+    written = forward_specialized_from_socket(state, conn, frame, len, FORWARD_SINGLE);
+    break;
+  case FORWARD_SCAN:
+    written = forward_specialized_from_socket(state, conn, frame, len, FORWARD_SCAN);
+    break;
+  default:
+    written = forward_specialized_from_socket(state, conn, frame, len, FORWARD_HASH);
+    break;
+  }
+done:
+  pthread_rwlock_unlock(&state->lock);
+  // vmnet was out of buffers: back off without holding the lock.
+  if (!written)
+    conn_vmnet_write(state, conn, frame, len, false);
+  hist_record_since(&conn->latency[STAGE_FORWARD], start);
+}
+
+static uint8_t *loop_get_buf(struct loop *loop) {
+  if (loop->pool_len > 0)
+    return loop->pool[--loop->pool_len];
+  return arena_alloc(CONN_RX_BUF_LEN);
+}
+
+static void loop_put_buf(struct loop *loop, uint8_t *buf) {
+  if (loop->pool_len < LOOP_POOL_LEN)
+    loop->pool[loop->pool_len++] = buf;
+  else
+    arena_free(buf, CONN_RX_BUF_LEN);
+}
+
+// Reads from conn and forwards every complete frame. Returns -1 when the
+// connection should be closed.
+static int conn_read(struct state *state, struct conn *conn) {
+  uint64_t start = hist_now();
+  ssize_t received =
+      read(conn->socket_fd, conn->rx_buf + conn->rx_len, CONN_RX_BUF_LEN - conn->rx_len);
+  hist_record_since(&conn->latency[STAGE_READ], start);
+  if (received < 0) {
+    if (errno == EAGAIN || errno == EINTR)
+      return 0;
+    ERRORN("read");
+    return -1;
+  }
+  if (received == 0) {
+    // EOF according to man page of read.
+    INFOF("Connection closed by peer (fd %d)", conn->socket_fd);
+    return -1;
+  }
+  DEBUGF("[Socket-to-VMNET] Received from the socket %d: %ld bytes", conn->socket_fd, received);
+  conn->rx_len += received;
+
+  size_t off = 0;
+  while (conn->rx_len - off >= 4) {
+    uint32_t header_be;
+    memcpy(&header_be, conn->rx_buf + off, 4);
+    uint32_t header = ntohl(header_be);
+    if (header > MAX_FRAME_LEN) {
+      // The stream cannot be resynchronized: close this connection only.
+      atomic_fetch_add_explicit(&conn->rx_errors, 1, memory_order_relaxed);
+      ERRORF("Frame too large from the socket %d: %u bytes", conn->socket_fd, header);
+      return -1;
+    }
+    if (conn->rx_len - off - 4 < header)
+      break;
+    forward_from_socket(state, conn, conn->rx_buf + off + 4, header);
+    off += 4 + header;
+  }
+  // Keep the partial frame for the next read.
+  memmove(conn->rx_buf, conn->rx_buf + off, conn->rx_len - off);
+  conn->rx_len -= off;
+  return 0;
+}
+
+// Reads conn with a buffer of its loop, kept only while a frame is partial, so
+// that the memory of the idle connections does not grow with their number.
+static int conn_on_readable(struct state *state, struct conn *conn) {
+  if (conn->rx_buf == NULL && (conn->rx_buf = loop_get_buf(conn->loop)) == NULL)
+    return -1;
+  int rc = conn_read(state, conn);
+  if (rc == 0 && conn->rx_len == 0) {
+    loop_put_buf(conn->loop, conn->rx_buf);
+    conn->rx_buf = NULL;
+  }
+  return rc;
+}
+
+// Parks the calling loop until a cancelled handoff resumes it.
+static void loop_park(struct state *state) {
+  dispatch_semaphore_signal(state->parked);
+  dispatch_semaphore_wait(state->resume, DISPATCH_TIME_FOREVER);
+}
+
+static void loop_run(struct loop *loop) {
+  struct state *state = loop->state;
+  struct kevent events[LOOP_MAX_EVENTS];
+  for (;;) {
+    int n = kevent(loop->kq, NULL, 0, events, LOOP_MAX_EVENTS, NULL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      ERRORN("kevent");
+      exit(EXIT_FAILURE);
+    }
+    bool park = false;
+    for (int i = 0; i < n; i++) {
+      if (events[i].filter == EVFILT_USER) {
+        park = true;
+        continue;
+      }
+      struct conn *conn = events[i].udata;
+      if (conn == NULL)
+        continue; // closed earlier in this batch
+      if (events[i].filter == EVFILT_WRITE || events[i].filter == EVFILT_TIMER) {
+        conn_flush(conn);
+        continue;
+      }
+      if (conn_on_readable(state, conn) < 0) {
+        for (int j = i + 1; j < n; j++) {
+          if (events[j].udata == conn)
+            events[j].udata = NULL;
+        }
+        state_remove_conn(state, conn);
+      }
+    }
+    // Only between two batches, so that no frame is half forwarded.
+    if (park)
+      loop_park(state);
+  }
+}
+
+static int state_init_loops(struct state *state) {
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t count = ncpu < 1 ? 1 : ncpu > MAX_LOOPS ? MAX_LOOPS : (size_t)ncpu;
+  for (state->loop_count = 0; state->loop_count < count; state->loop_count++) {
+    struct loop *loop = &state->loops[state->loop_count];
+    loop->state = state;
+    loop->kq = kqueue();
+    if (loop->kq == -1) {
+      ERRORN("kqueue");
+      return -1;
+    }
+    // Triggered to park the loop, see state_pause_loops.
+    struct kevent change;
+    EV_SET(&change, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    if (kevent(loop->kq, &change, 1, NULL, 0, NULL) != 0) {
+      ERRORN("kevent(EVFILT_USER)");
+      close(loop->kq);
+      return -1;
+    }
+  }
+  DEBUGF("Using %zu event loops", state->loop_count);
+  return 0;
+}
+
+static void state_start_loops(struct state *state) {
+  for (size_t i = 0; i < state->loop_count; i++) {
+    struct loop *loop = &state->loops[i];
+    dispatch_async(state->vms_queue, ^{
+      loop_run(loop);
+    });
+  }
+}
+
+// Stops forwarding from the VMs: returns once every loop is parked.
+static void state_pause_loops(struct state *state) {
+  for (size_t i = 0; i < state->loop_count; i++) {
+    struct kevent change;
+    EV_SET(&change, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    if (kevent(state->loops[i].kq, &change, 1, NULL, 0, NULL) != 0)
+      ERRORN("kevent(NOTE_TRIGGER)");
+  }
+  for (size_t i = 0; i < state->loop_count; i++)
+    dispatch_semaphore_wait(state->parked, DISPATCH_TIME_FOREVER);
+}
+
+static void state_resume_loops(struct state *state) {
+  for (size_t i = 0; i < state->loop_count; i++)
+    dispatch_semaphore_signal(state->resume);
+}
+
+// Finds the position of owner in state->conns, the index of its connection
+// in the handoff. Returns false if owner is not a connection.
+static bool state_conn_index(const struct state *state, const void *owner, uint32_t *index) {
+  uint32_t i = 0;
+  for (const struct conn *conn = state->conns; conn != NULL; conn = conn->next, i++) {
+    if (conn == owner) {
+      *index = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Hands off the listening sockets, the VM connections, the fdb and the
+// neighbor bindings to a new process image of socket_vmnet, see handoff.h.
+// Only returns on failure: 1 if the handoff was cancelled and this process
+// should keep serving, -1 if vmnet has already been stopped.
+static int handoff_exec(struct state *state, const uuid_t vmnet_interface_id, char *argv[]) {
+  int rc = 1;
+  struct handoff h = {0};
+  uuid_copy(h.vmnet_interface_id, vmnet_interface_id);
+  int sv[2] = {-1, -1};
+
+  // Stop forwarding at a frame boundary, in both directions. No connection can
+  // be added meanwhile, as only this thread accepts them. The workers of
+  // --vmnet-rx-queues deliver what the host queue gave them before it was
+  // suspended, then nothing until resumed.
+  state_pause_loops(state);
+  dispatch_sync(state->host_queue, ^{
+    dispatch_suspend(state->host_queue);
+  });
+  if (state->rss != NULL)
+    rss_pause(state->rss);
+
+  pthread_rwlock_rdlock(&state->lock);
+  size_t conn_count = 0;
+  for (struct conn *conn = state->conns; conn != NULL; conn = conn->next)
+    conn_count++;
+  h.listeners = calloc(state->listener_count + 1, sizeof(*h.listeners));
+  h.conns = calloc(conn_count + 1, sizeof(*h.conns));
+  h.fdb = calloc(state->fdb.count + 1, sizeof(*h.fdb));
+  h.neigh = calloc(state->neigh.count + 1, sizeof(*h.neigh));
+  if (h.listeners != NULL && h.conns != NULL && h.fdb != NULL && h.neigh != NULL) {
+    for (size_t i = 0; i < state->listener_count; i++) {
+      h.listeners[h.listener_count].fd = state->listeners[i].fd;
+      h.listeners[h.listener_count++].vlan = state->listeners[i].vlan;
+    }
+    for (struct conn *conn = state->conns; conn != NULL; conn = conn->next) {
+      struct handoff_conn *c = &h.conns[h.conn_count++];
+      c->fd = conn->socket_fd;
+      c->vlan = conn->vlan;
+      c->rx = conn->rx_buf;
+      c->rx_len = conn->rx_len;
+      pthread_mutex_lock(&conn->tx_lock);
+      c->tx = conn->tx_buf;
+      c->tx_len = conn->tx_len;
+      pthread_mutex_unlock(&conn->tx_lock);
+    }
+    for (size_t i = 0; i < FDB_CAPACITY; i++) {
+      const struct fdb_entry *e = &state->fdb.entries[i];
+      if (!e->used)
+        continue;
+      uint32_t index = HANDOFF_CONN_HOST;
+      if (e->owner != VMNET_OWNER && !state_conn_index(state, e->owner, &index))
+        continue;
+      memcpy(h.fdb[h.fdb_count].mac, e->mac, sizeof(e->mac));
+      h.fdb[h.fdb_count].vlan = e->vlan;
+      h.fdb[h.fdb_count++].conn = index;
+    }
+    uint64_t now = hist_now();
+    for (size_t i = 0; i < NEIGH_CAPACITY; i++) {
+      const struct neigh_entry *e = &state->neigh.entries[i];
+      uint32_t index;
+      if (!e->used || !state_conn_index(state, e->owner, &index))
+        continue;
+      struct handoff_neigh_entry *n = &h.neigh[h.neigh_count++];
+      memcpy(n->addr, e->addr, sizeof(e->addr));
+      memcpy(n->mac, e->mac, sizeof(e->mac));
+      n->vlan = e->vlan;
+      n->conn = index;
+      n->age_ns = now > e->seen_ns ? now - e->seen_ns : 0;
+    }
+  }
+  pthread_rwlock_unlock(&state->lock);
+  if (h.listeners == NULL || h.conns == NULL || h.fdb == NULL || h.neigh == NULL) {
+    ERRORN("calloc");
+    goto cancel;
+  }
+
+  if (handoff_socketpair(sv, &h) < 0 || handoff_send(sv[0], &h) < 0)
+    goto cancel;
+  close(sv[0]);
+  sv[0] = -1;
+
+  INFOF("Handing off %u connections, %u MAC addresses and %u neighbor bindings to a new process",
+        h.conn_count, h.fdb_count, h.neigh_count);
+  // The sockets and their queued frames belong to the new process now.
+  pthread_rwlock_rdlock(&state->lock);
+  for (struct conn *conn = state->conns; conn != NULL; conn = conn->next) {
+    pthread_mutex_lock(&conn->tx_lock);
+    conn->tx_disabled = true;
+    pthread_mutex_unlock(&conn->tx_lock);
+  }
+  pthread_rwlock_unlock(&state->lock);
+  dispatch_resume(state->host_queue);
+  // The frames queued for vmnet are written before it goes away.
+  if (state->egress != NULL)
+    egress_stop(state->egress);
+  stop(state, state->iface);
+  state->iface = NULL;
+  rc = -1;
+  // The capture writer does not survive exec; flush the file now.
+  struct capture_stats capture_stats;
+  capture_stop(&capture_stats);
+  struct trace_stats trace_stats;
+  trace_stop(&trace_stats);
+  // Everything else is either in flight in sv or must not leak into the new
+  // process image.
+  for (int fd = 3; fd < getdtablesize(); fd++) {
+    if (fd != sv[1])
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  char sv_str[16];
+  snprintf(sv_str, sizeof(sv_str), "%d", sv[1]);
+  setenv(HANDOFF_ENV, sv_str, 1);
+  execvp(argv[0], argv);
+  ERRORF("Failed to exec \"%s\": %s", argv[0], strerror(errno));
+  unsetenv(HANDOFF_ENV);
+  goto done;
+cancel:
+  WARN("handoff: cancelled, continuing to serve the connections");
+  if (state->rss != NULL)
+    rss_resume(state->rss);
+  dispatch_resume(state->host_queue);
+  state_resume_loops(state);
+done:
+  for (int i = 0; i < 2; i++) {
+    if (sv[i] != -1)
+      close(sv[i]);
+  }
+  free(h.listeners);
+  free(h.conns);
+  free(h.fdb);
+  free(h.neigh);
+  return rc;
+}
+
+// Adds the connections taken over from the previous process.
+static void state_restore_handoff(struct state *state, const struct handoff *h) {
+  struct conn **conns = calloc(h->conn_count + 1, sizeof(*conns));
+  if (conns == NULL) {
+    ERRORN("calloc");
+    for (uint32_t i = 0; i < h->conn_count; i++)
+      close(h->conns[i].fd);
+    return;
+  }
+  for (uint32_t i = 0; i < h->conn_count; i++) {
+    conns[i] = state_add_socket_fd(state, h->conns[i].fd, h->conns[i].vlan, &h->conns[i]);
+    if (conns[i] == NULL)
+      close(h->conns[i].fd);
+    else
+      INFOF("Resumed a connection (fd %d, VLAN %d)", h->conns[i].fd, h->conns[i].vlan);
+  }
+  pthread_rwlock_wrlock(&state->lock);
+  for (uint32_t i = 0; i < h->fdb_count; i++) {
+    const struct handoff_fdb_entry *e = &h->fdb[i];
+    void *owner = e->conn == HANDOFF_CONN_HOST ? VMNET_OWNER : conns[e->conn];
+    if (owner != NULL)
+      fdb_learn(&state->fdb, e->vlan, e->mac, owner);
+  }
+  uint64_t now = hist_now();
+  for (uint32_t i = 0; i < h->neigh_count; i++) {
+    const struct handoff_neigh_entry *e = &h->neigh[i];
+    if (conns[e->conn] == NULL)
+      continue;
+    struct neigh_binding b;
+    memcpy(b.addr, e->addr, sizeof(b.addr));
+    memcpy(b.mac, e->mac, sizeof(b.mac));
+    uint64_t seen_ns = now > e->age_ns ? now - e->age_ns : 0;
+    neigh_learn(&state->neigh, e->vlan, &b, conns[e->conn], seen_ns);
+  }
+  state_select_path(state);
+  pthread_rwlock_unlock(&state->lock);
+  free(conns);
+}
+
+// Opens the main socket and the VLAN sockets, taking over the ones of the
+// previous process if h is not NULL.
+static int state_open_listeners(struct state *state, const struct cli_options *cliopt,
+                                struct handoff *h) {
+  state->listeners = calloc(1 + cliopt->vlan_socket_count, sizeof(*state->listeners));
+  if (state->listeners == NULL) {
+    ERRORN("calloc");
+    return -1;
+  }
+  for (size_t i = 0; i < 1 + cliopt->vlan_socket_count; i++) {
+    struct listener *listener = &state->listeners[state->listener_count];
+    const char *socket_path = cliopt->socket_path;
+    listener->fd = -1;
+    listener->vlan = VLAN_NONE;
+    if (i > 0) {
+      socket_path = cliopt->vlan_sockets[i - 1].socket_path;
+      listener->vlan = cliopt->vlan_sockets[i - 1].vlan;
+      state->vlans[listener->vlan] = true;
+    }
+    for (uint32_t j = 0; h != NULL && j < h->listener_count; j++) {
+      if (h->listeners[j].fd != -1 && h->listeners[j].vlan == listener->vlan) {
+        listener->fd = h->listeners[j].fd;
+        h->listeners[j].fd = -1;
+        // Apply --listen-backlog, which may have changed.
+        if (listen(listener->fd, cliopt->listen_backlog) < 0)
+          ERRORN("listen");
+        break;
+      }
+    }
+    if (listener->fd == -1) {
+      DEBUGF("Opening socket \"%s\" (for UNIX group \"%s\")", socket_path, cliopt->socket_group);
+      listener->fd =
+          socket_bindlisten(socket_path, cliopt->socket_group, cliopt->listen_backlog);
+      if (listener->fd < 0) {
+        ERRORN("socket_bindlisten");
+        return -1;
+      }
+    }
+    // See state_accept.
+    if (fcntl(listener->fd, F_SETFL, O_NONBLOCK) < 0) {
+      ERRORN("fcntl(O_NONBLOCK)");
+      return -1;
+    }
+    state->listener_count++;
+    if (listener->vlan != VLAN_NONE)
+      INFOF("Serving VLAN %d on socket \"%s\"", listener->vlan, socket_path);
+  }
+  for (uint32_t j = 0; h != NULL && j < h->listener_count; j++) {
+    if (h->listeners[j].fd != -1) {
+      INFOF("VLAN %d is no longer served, closing its socket", h->listeners[j].vlan);
+      close(h->listeners[j].fd);
+      h->listeners[j].fd = -1;
+    }
+  }
+  return 0;
+}
+
+// Serves the addresses from the gateway + 1 to --vmnet-dhcp-end.
+static struct dhcp *open_dhcp(const struct cli_options *cliopt) {
+  struct dhcp_pool pool;
+  if (!inet_aton(cliopt->vmnet_gateway, &pool.server) ||
+      !inet_aton(cliopt->vmnet_dhcp_end, &pool.last) ||
+      !inet_aton(cliopt->vmnet_mask, &pool.mask)) {
+    ERROR("--dhcp-server: invalid --vmnet-gateway, --vmnet-dhcp-end, or --vmnet-mask");
+    return NULL;
+  }
+  pool.first.s_addr = htonl(ntohl(pool.server.s_addr) + 1);
+  uint32_t mask = ntohl(pool.mask.s_addr);
+  if ((ntohl(pool.first.s_addr) & mask) != (ntohl(pool.server.s_addr) & mask) ||
+      (ntohl(pool.last.s_addr) & mask) != (ntohl(pool.server.s_addr) & mask)) {
+    ERRORF("--dhcp-server: --vmnet-dhcp-end \"%s\" is not in the subnet of the gateway",
+           cliopt->vmnet_dhcp_end);
+    return NULL;
+  }
+  struct dhcp *d = dhcp_open(&pool, cliopt->dhcp_lease_file);
+  if (d != NULL)
+    INFOF("Serving DHCP from %s to %s", inet_ntoa(pool.first), cliopt->vmnet_dhcp_end);
+  return d;
+}
+
+static void control_capture_start(FILE *out, int argc, char *argv[],
+                                  void __attribute__((unused)) * ctx) {
+  struct capture_options opts;
+  if (capture_parse_options(&opts, argc, argv) < 0) {
+    fprintf(out, "error: invalid arguments\n");
+    return;
+  }
+  if (capture_start(&opts) < 0) {
+    fprintf(out, "error: failed to start the capture, see the log\n");
+    return;
+  }
+  fprintf(out, "capturing to %s\n", opts.path);
+}
+
+static void control_capture_stop(FILE *out, int __attribute__((unused)) argc,
+                                 char __attribute__((unused)) * argv[],
+                                 void __attribute__((unused)) * ctx) {
+  struct capture_stats stats;
+  if (capture_stop(&stats) < 0) {
+    fprintf(out, "error: no capture is running\n");
+    return;
+  }
+  fprintf(out, "captured %llu frames, dropped %llu\n", stats.captured, stats.dropped);
+}
+
+static void control_trace_start(FILE *out, int argc, char *argv[],
+                                void __attribute__((unused)) * ctx) {
+  struct trace_options opts;
+  if (trace_parse_options(&opts, argc, argv) < 0) {
+    fprintf(out, "error: invalid arguments\n");
+    return;
+  }
+  if (trace_start(&opts) < 0) {
+    fprintf(out, "error: failed to start the trace, see the log\n");
+    return;
+  }
+  fprintf(out, "tracing to %s\n", opts.path);
+}
+
+static void control_trace_stop(FILE *out, int __attribute__((unused)) argc,
+                               char __attribute__((unused)) * argv[],
+                               void __attribute__((unused)) * ctx) {
+  struct trace_stats stats;
+  if (trace_stop(&stats) < 0) {
+    fprintf(out, "error: no trace is running\n");
+    return;
+  }
+  fprintf(out, "recorded %llu frames (%llu bytes), dropped %llu\n", stats.records, stats.bytes,
+          stats.dropped);
+}
+
+static void print_latency(FILE *out, const char *prefix, struct hist latency[STAGE_COUNT]) {
+  for (int i = 0; i < STAGE_COUNT; i++) {
+    struct hist_summary sum;
+    hist_summarize(&latency[i], &sum);
+    if (sum.count == 0)
+      continue;
+    fprintf(out,
+            "%s stage=%s count=%llu p50_us=%.1f p90_us=%.1f p99_us=%.1f p999_us=%.1f "
+            "max_us=%.1f\n",
+            prefix, stage_names[i], sum.count, sum.p50 / 1e3, sum.p90 / 1e3, sum.p99 / 1e3,
+            sum.p999 / 1e3, sum.max / 1e3);
+  }
+}
+
+static void control_stats(FILE *out, int __attribute__((unused)) argc,
+                          char __attribute__((unused)) * argv[], void *ctx) {
+  struct state *state = ctx;
+  print_latency(out, "vmnet", state->vmnet_latency);
+  fprintf(out, "vmnet retries=%llu read_errors=%llu write_errors=%llu runts=%llu\n",
+          atomic_load_explicit(&state->vmnet_retries, memory_order_relaxed),
+          atomic_load_explicit(&state->vmnet_read_errors, memory_order_relaxed),
+          atomic_load_explicit(&state->vmnet_write_errors, memory_order_relaxed),
+          atomic_load_explicit(&state->vmnet_runts, memory_order_relaxed));
+  pthread_rwlock_rdlock(&state->lock);
+  fprintf(out, "forwarding path=%s ports=%zu\n", forward_path_names[state->path],
+          state->port_count);
+  pthread_rwlock_unlock(&state->lock);
+  for (unsigned i = 0; state->rss != NULL && i < rss_queue_count(state->rss); i++) {
+    struct rss_queue_stats rss;
+    rss_queue_stats(state->rss, i, false, &rss);
+    fprintf(out, "rss queue=%u frames=%llu bytes=%llu dropped=%llu max_queued_kib=%zu\n", i,
+            rss.frames, rss.bytes, rss.dropped, rss.max_len / 1024);
+  }
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  fprintf(out, "memory minor_faults=%ld major_faults=%ld\n", usage.ru_minflt, usage.ru_majflt);
+  struct arena_stats arena;
+  arena_get_stats(&arena);
+  if (arena.size > 0) {
+    fprintf(out,
+            "buffers size_kib=%zu used_kib=%zu in_use_kib=%zu fallbacks=%llu superpages=%d "
+            "locked=%d\n",
+            arena.size / 1024, arena.used / 1024, arena.in_use / 1024, arena.fallbacks,
+            arena.superpages, arena.locked);
+  }
+  pthread_rwlock_rdlock(&state->lock);
+  if (state->cliopt->neighbor_proxy) {
+    struct neigh *neigh = &state->neigh;
+    fprintf(out, "neigh bindings=%zu arp_hits=%llu arp_misses=%llu nd_hits=%llu nd_misses=%llu\n",
+            neigh->count, neigh->arp_hits, neigh->arp_misses, neigh->nd_hits, neigh->nd_misses);
+  }
+  if (state->cliopt->multicast_snooping) {
+    struct mcast *mcast = &state->mcast;
+    fprintf(out, "mcast groups=%zu memberships=%zu reports=%llu flooded=%llu\n",
+            mcast->group_count, mcast->member_count,
+            atomic_load_explicit(&mcast->reports, memory_order_relaxed),
+            atomic_load_explicit(&mcast->flooded, memory_order_relaxed));
+    for (size_t i = 0; i < MCAST_GROUP_CAPACITY; i++) {
+      const struct mcast_group *g = &mcast->groups[i];
+      if (!g->used)
+        continue;
+      fprintf(out,
+              "mcast group=%02X:%02X:%02X:%02X:%02X:%02X vlan=%d members=%u frames=%llu "
+              "bytes=%llu\n",
+              g->mac[0], g->mac[1], g->mac[2], g->mac[3], g->mac[4], g->mac[5], g->vlan,
+              g->members, atomic_load_explicit(&g->frames, memory_order_relaxed),
+              atomic_load_explicit(&g->bytes, memory_order_relaxed));
+    }
+  }
+  if (state->dhcp != NULL) {
+    struct dhcp_stats dhcp;
+    dhcp_get_stats(state->dhcp, false, &dhcp);
+    fprintf(out, "dhcp bound=%u discovers=%llu requests=%llu acks=%llu naks=%llu releases=%llu\n",
+            dhcp.bound, dhcp.discovers, dhcp.requests, dhcp.acks, dhcp.naks, dhcp.releases);
+  }
+  for (struct conn *conn = state->conns; conn != NULL; conn = conn->next) {
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "conn=%u fd=%d vlan=%d", conn->id, conn->socket_fd,
+             conn->vlan);
+    pthread_mutex_lock(&conn->tx_lock);
+    uint64_t tx_dropped = conn->tx_dropped;
+    uint64_t tx_held_writes = conn->tx_held_writes;
+    uint64_t tx_held_frames = conn->tx_held_frames;
+    uint64_t tx_blocked = conn->tx_blocked;
+    pthread_mutex_unlock(&conn->tx_lock);
+    uint64_t rx_errors = atomic_load_explicit(&conn->rx_errors, memory_order_relaxed);
+    if (state->egress != NULL) {
+      uint64_t egress_sent, egress_dropped;
+      egress_flow_stats(state->egress, &conn->egress, false, &egress_sent, &egress_dropped);
+      fprintf(out, "%s rx_errors=%llu tx_dropped=%llu egress_sent=%llu egress_dropped=%llu\n",
+              prefix, rx_errors, tx_dropped, egress_sent, egress_dropped);
+    } else {
+      fprintf(out, "%s rx_errors=%llu tx_dropped=%llu\n", prefix, rx_errors, tx_dropped);
+    }
+    if (conn->coalesce_ns > 0)
+      fprintf(out, "%s held_writes=%llu held_frames=%llu\n", prefix, tx_held_writes,
+              tx_held_frames);
+    const struct sockbuf *sb = &conn->sockbuf;
+    fprintf(out,
+            "%s sockbuf snd_size=%d snd_queued=%d snd_peak=%d rcv_size=%d rcv_queued=%d "
+            "rcv_peak=%d blocked=%llu resizes=%llu\n",
+            prefix, sb->snd.size, sb->snd.queued, sb->snd.peak, sb->rcv.size, sb->rcv.queued,
+            sb->rcv.peak, tx_blocked, sb->resizes);
+    print_latency(out, prefix, conn->latency);
+  }
+  pthread_rwlock_unlock(&state->lock);
+}
+
+static void control_stats_reset(FILE *out, int __attribute__((unused)) argc,
+                                char __attribute__((unused)) * argv[], void *ctx) {
+  struct state *state = ctx;
+  for (int i = 0; i < STAGE_COUNT; i++)
+    hist_reset(&state->vmnet_latency[i]);
+  atomic_store_explicit(&state->vmnet_retries, 0, memory_order_relaxed);
+  atomic_store_explicit(&state->vmnet_read_errors, 0, memory_order_relaxed);
+  atomic_store_explicit(&state->vmnet_write_errors, 0, memory_order_relaxed);
+  atomic_store_explicit(&state->vmnet_runts, 0, memory_order_relaxed);
+  for (unsigned i = 0; state->rss != NULL && i < rss_queue_count(state->rss); i++) {
+    struct rss_queue_stats rss;
+    rss_queue_stats(state->rss, i, true, &rss);
+  }
+  state->neigh.arp_hits = 0;
+  state->neigh.arp_misses = 0;
+  state->neigh.nd_hits = 0;
+  state->neigh.nd_misses = 0;
+  if (state->dhcp != NULL) {
+    struct dhcp_stats dhcp;
+    dhcp_get_stats(state->dhcp, true, &dhcp);
+  }
+  pthread_rwlock_rdlock(&state->lock);
+  atomic_store_explicit(&state->mcast.reports, 0, memory_order_relaxed);
+  atomic_store_explicit(&state->mcast.flooded, 0, memory_order_relaxed);
+  for (size_t i = 0; i < MCAST_GROUP_CAPACITY; i++) {
+    atomic_store_explicit(&state->mcast.groups[i].frames, 0, memory_order_relaxed);
+    atomic_store_explicit(&state->mcast.groups[i].bytes, 0, memory_order_relaxed);
+  }
+  for (struct conn *conn = state->conns; conn != NULL; conn = conn->next) {
+    pthread_mutex_lock(&conn->tx_lock);
+    conn->tx_dropped = 0;
+    conn->tx_held_writes = 0;
+    conn->tx_held_frames = 0;
+    conn->tx_blocked = 0;
+    conn->sockbuf.blocked = 0;
+    pthread_mutex_unlock(&conn->tx_lock);
+    conn->sockbuf.snd.peak = 0;
+    conn->sockbuf.rcv.peak = 0;
+    conn->sockbuf.resizes = 0;
+    atomic_store_explicit(&conn->rx_errors, 0, memory_order_relaxed);
+    if (state->egress != NULL) {
+      uint64_t egress_sent, egress_dropped;
+      egress_flow_stats(state->egress, &conn->egress, true, &egress_sent, &egress_dropped);
+    }
+    for (int i = 0; i < STAGE_COUNT; i++)
+      hist_reset(&conn->latency[i]);
+  }
+  pthread_rwlock_unlock(&state->lock);
+  fprintf(out, "ok\n");
+}
+
+#define CAPTURE_START_USAGE                                                                       \
+  "capture start FILE [snaplen=BYTES] [conn=FD|vmnet] [vlan=VLAN] [ethertype=TYPE]"
+#define TRACE_START_USAGE "trace start FILE [size=BYTES] [snaplen=BYTES]"
+
+static const struct control_command control_commands[] = {
+    {"stats",         "stats",             control_stats        },
+    {"stats reset",   "stats reset",       control_stats_reset  },
+    {"capture start", CAPTURE_START_USAGE, control_capture_start},
+    {"capture stop",  "capture stop",      control_capture_stop },
+    {"trace start",   TRACE_START_USAGE,   control_trace_start  },
+    {"trace stop",    "trace stop",        control_trace_stop   },
+};
 
 int main(int argc, char *argv[]) {
   debug = getenv("DEBUG") != NULL;
   int rc = 1;
-  int listen_fd = -1;
   int pidfile_fd = -1;
+  int control_fd = -1;
   int kq = -1;
-  __block interface_ref iface = NULL;
+  struct handoff handoff = {0};
+  bool handed_off = false;
 
   struct state state = {0};
 
@@ -514,6 +2287,19 @@ int main(int argc, char *argv[]) {
     WARN("Seems running with SETUID. This is insecure and highly discouraged: See README.md");
   }
 
+  raise_nofile_limit();
+
+  // Before the first buffer is allocated
+  if (cliopt->buffer_memory > 0 && arena_init(cliopt->buffer_memory, cliopt->buffer_memory_lock)) {
+    goto done;
+  }
+
+  const char *faults = getenv(FAULT_ENV);
+  if (faults != NULL && fault_init(faults) < 0) {
+    ERRORF("Invalid %s: \"%s\"", FAULT_ENV, faults);
+    goto done;
+  }
+
   kq = kqueue();
   if (kq == -1) {
     ERRORN("kqueue");
@@ -526,24 +2312,43 @@ int main(int argc, char *argv[]) {
     goto done;
   }
 
+  const char *handoff_fd_str = getenv(HANDOFF_ENV);
+  if (handoff_fd_str != NULL) {
+    int handoff_fd = atoi(handoff_fd_str);
+    unsetenv(HANDOFF_ENV);
+    int ret = handoff_recv(handoff_fd, &handoff);
+    close(handoff_fd);
+    if (ret < 0) {
+      goto done; // error already logged.
+    }
+    INFOF("Taking over %u connections and %u MAC addresses from the previous process",
+          handoff.conn_count, handoff.fdb_count);
+    // Keep the MAC address of the vmnet interface stable.
+    uuid_copy(cliopt->vmnet_interface_id, handoff.vmnet_interface_id);
+    handed_off = true;
+  }
+
   if (cliopt->pidfile != NULL) {
     pidfile_fd = create_pidfile(cliopt->pidfile);
     if (pidfile_fd == -1) {
       goto done; // error already logged.
     }
+    // Not fatal: the addresses are learned again.
+    char *state_path = state_file_path(cliopt->pidfile);
+    if (state_path != NULL)
+      state.statefile = statefile_open(state_path);
+    free(state_path);
   }
 
-  DEBUGF("Opening socket \"%s\" (for UNIX group \"%s\")", cliopt->socket_path,
-         cliopt->socket_group);
-  listen_fd = socket_bindlisten(cliopt->socket_path, cliopt->socket_group);
-  if (listen_fd < 0) {
-    ERRORN("socket_bindlisten");
+  if (state_open_listeners(&state, cliopt, handed_off ? &handoff : NULL)) {
     goto done;
   }
 
-  state.sem = dispatch_semaphore_create(1);
+  pthread_rwlock_init(&state.lock, NULL);
+  state.parked = dispatch_semaphore_create(0);
+  state.resume = dispatch_semaphore_create(0);
 
-  // Queue for vm connections, allowing processing vms requests in parallel.
+  // Queue for the event loops serving the vm connections in parallel.
   state.vms_queue =
       dispatch_queue_create("io.github.lima-vm.socket_vmnet.vms", DISPATCH_QUEUE_CONCURRENT);
 
@@ -551,16 +2356,76 @@ int main(int argc, char *argv[]) {
   state.host_queue =
       dispatch_queue_create("io.github.lima-vm.socket_vmnet.host", DISPATCH_QUEUE_SERIAL);
 
-  iface = start(&state, cliopt);
-  if (iface == NULL) {
+  if (state_init_loops(&state)) {
+    goto done;
+  }
+
+  if (cliopt->dhcp_server) {
+    state.dhcp = open_dhcp(cliopt);
+    if (state.dhcp == NULL) {
+      goto done;
+    }
+  }
+
+  // After a handoff, the fdb and the neighbor bindings came from the previous
+  // process.
+  if (state.statefile != NULL && !handed_off &&
+      statefile_load(state.statefile, &state.fdb, &state.neigh, VMNET_OWNER, RESTORED_OWNER,
+                     hist_now()))
+    state.restored_ns = hist_now();
+
+  state.cliopt = cliopt;
+  state_init_forwarding(&state);
+  if (cliopt->vmnet_rx_queues > 1) {
+    state.rss = rss_create(cliopt->vmnet_rx_queues, MAX_FRAME_LEN + VLAN_TAG_LEN, state_rss_deliver,
+                           &state);
+    if (state.rss == NULL) {
+      goto done;
+    }
+  }
+  state.iface = start(&state, cliopt);
+  if (state.iface == NULL) {
     // Error already logged.
     goto done;
   }
 
-  if (add_listen_fd(kq, listen_fd)) {
+  if (cliopt->egress_scheduler) {
+    state.egress = egress_create(MAX_FRAME_LEN + VLAN_TAG_LEN, state_egress_output, &state);
+    if (state.egress == NULL) {
+      goto done;
+    }
+  }
+
+  for (size_t i = 0; i < state.listener_count; i++) {
+    if (add_listen_fd(kq, state.listeners[i].fd, &state.listeners[i])) {
+      goto done;
+    }
+  }
+
+  if (state.statefile != NULL && add_save_timer(kq)) {
     goto done;
   }
 
+  // The occupancy is only reported on the control socket.
+  if ((cliopt->control_socket != NULL || cliopt->socket_buffer_max > 0) &&
+      add_sockbuf_timer(kq)) {
+    goto done;
+  }
+
+  if (cliopt->control_socket != NULL) {
+    control_fd = control_bindlisten(cliopt->control_socket);
+    if (control_fd < 0 || add_listen_fd(kq, control_fd, NULL)) {
+      goto done;
+    }
+  }
+
+  if (handed_off) {
+    state_restore_handoff(&state, &handoff);
+    handoff_free(&handoff);
+    handed_off = false;
+  }
+  state_start_loops(&state);
+
   while (1) {
     struct kevent events[1];
     int n = kevent(kq, NULL, 0, events, 1, NULL);
@@ -571,34 +2436,83 @@ int main(int argc, char *argv[]) {
 
     if (events[0].filter == EVFILT_SIGNAL) {
       INFOF("Received signal %s", strsignal(events[0].ident));
+      if (events[0].ident == SIGUSR1) {
+        if (handoff_exec(&state, cliopt->vmnet_interface_id, argv) > 0)
+          continue;
+        goto done;
+      }
       break;
     }
 
-    if (events[0].filter == EVFILT_READ) {
-      int accept_fd = accept(listen_fd, NULL, NULL);
-      if (accept_fd < 0) {
-        ERRORN("accept");
-        goto done;
+    if (events[0].filter == EVFILT_TIMER) {
+      if (events[0].udata != NULL) {
+        // A listener out of descriptors, see state_accept
+        struct kevent change;
+        EV_SET(&change, events[0].ident, EVFILT_READ, EV_ENABLE, 0, 0, events[0].udata);
+        if (kevent(kq, &change, 1, NULL, 0, NULL) != 0)
+          ERRORN("kevent(EV_ENABLE)");
+      } else if (events[0].ident == SOCKBUF_TIMER) {
+        state_sample_sockbufs(&state);
+      } else {
+        state_save(&state);
       }
-      struct state *state_p = &state;
-      dispatch_async(state.vms_queue, ^{
-        on_accept(state_p, accept_fd, iface);
-      });
+      continue;
+    }
+
+    if (events[0].filter == EVFILT_READ && (int)events[0].ident == control_fd) {
+      control_serve(control_fd, control_commands, ARRAY_SIZE(control_commands), &state);
+      continue;
+    }
+
+    if (events[0].filter == EVFILT_READ) {
+      state_accept(&state, kq, events[0].udata);
     }
   }
   rc = 0;
 done:
   DEBUGF("shutting down with rc=%d", rc);
-  if (iface != NULL) {
-    stop(&state, iface);
+  if (state.egress != NULL) {
+    egress_stop(state.egress);
+  }
+  if (state.iface != NULL) {
+    stop(&state, state.iface);
   }
-  if (listen_fd != -1) {
-    close(listen_fd);
+  if (state.rss != NULL) {
+    rss_stop(state.rss);
+  }
+  struct capture_stats capture_stats;
+  capture_stop(&capture_stats);
+  struct trace_stats trace_stats;
+  trace_stop(&trace_stats);
+  if (control_fd != -1) {
+    close(control_fd);
+  }
+  for (size_t i = 0; i < state.listener_count; i++) {
+    close(state.listeners[i].fd);
+  }
+  free(state.listeners);
+  if (handed_off) {
+    // Not resumed: the VMs will see their connections closed.
+    for (uint32_t i = 0; i < handoff.listener_count; i++) {
+      if (handoff.listeners[i].fd != -1)
+        close(handoff.listeners[i].fd);
+    }
+    for (uint32_t i = 0; i < handoff.conn_count; i++)
+      close(handoff.conns[i].fd);
+    handoff_free(&handoff);
+  }
+  if (state.statefile != NULL) {
+    // Keep the previous snapshot if vmnet never started.
+    if (state.iface != NULL)
+      state_save(&state);
+    statefile_close(state.statefile);
   }
   if (pidfile_fd != -1) {
     remove_pidfile(cliopt->pidfile);
     close(pidfile_fd);
   }
+  // The loops may still be running, so their kqueues are left to exit, and
+  // the DHCP leases to be written back by the kernel.
   if (state.vms_queue != NULL)
     dispatch_release(state.vms_queue);
   if (state.host_queue != NULL)
@@ -609,100 +2523,3 @@ done:
   cli_options_destroy(cliopt);
   return rc;
 }
-
-static void on_accept(struct state *state, int accept_fd, interface_ref iface) {
-  INFOF("Accepted a connection (fd %d)", accept_fd);
-  state_add_socket_fd(state, accept_fd);
-  size_t buf_len = 64 * 1024;
-  void *buf = malloc(buf_len);
-  if (buf == NULL) {
-    ERRORN("malloc");
-    goto done;
-  }
-  for (uint64_t i = 0;; i++) {
-    DEBUGF("[Socket-to-VMNET i=%lld] Receiving from the socket %d", i, accept_fd);
-    uint32_t header_be = 0;
-    ssize_t header_received = read(accept_fd, &header_be, 4);
-    if (header_received < 0) {
-      ERRORN("read[header]");
-      goto done;
-    }
-    if (header_received == 0) {
-      // EOF according to man page of read.
-      INFOF("Connection closed by peer (fd %d)", accept_fd);
-      goto done;
-    }
-    uint32_t header = ntohl(header_be);
-    assert(header <= buf_len);
-    ssize_t received = read(accept_fd, buf, header);
-    if (received < 0) {
-      ERRORN("read[body]");
-      goto done;
-    }
-    if (received == 0) {
-      // EOF according to man page of read.
-      INFOF("Connection closed by peer (fd %d)", accept_fd);
-      goto done;
-    }
-    assert(received == header);
-    DEBUGF("[Socket-to-VMNET i=%lld] Received from the socket %d: %ld bytes", i, accept_fd,
-           received);
-    struct iovec iov = {
-        .iov_base = buf,
-        .iov_len = header,
-    };
-    struct vmpktdesc pd = {
-        .vm_pkt_size = header,
-        .vm_pkt_iov = &iov,
-        .vm_pkt_iovcnt = 1,
-        .vm_flags = 0,
-    };
-    int written_count = pd.vm_pkt_iovcnt;
-    DEBUGF("[Socket-to-VMNET i=%lld] Sending to VMNET: %ld bytes", i, pd.vm_pkt_size);
-    vmnet_return_t write_status = vmnet_write(iface, &pd, &written_count);
-    if (write_status != VMNET_SUCCESS) {
-      ERRORF("vmnet_write: [%d] %s", write_status, vmnet_strerror(write_status));
-      goto done;
-    }
-    DEBUGF("[Socket-to-VMNET i=%lld] Sent to VMNET: %ld bytes", i, pd.vm_pkt_size);
-
-    // Flood the packet to other VMs in the same network too.
-    // (Not handled by vmnet)
-    // FIXME: avoid flooding
-    dispatch_semaphore_wait(state->sem, DISPATCH_TIME_FOREVER);
-    struct conn *conns = state->conns;
-    dispatch_semaphore_signal(state->sem);
-    for (struct conn *conn = conns; conn != NULL; conn = conn->next) {
-      if (conn->socket_fd == accept_fd)
-        continue;
-      DEBUGF("[Socket-to-Socket i=%lld] Sending from socket %d to socket %d: "
-             "4 + %d bytes",
-             i, accept_fd, conn->socket_fd, header);
-      struct iovec iov[2] = {
-          {
-           .iov_base = &header_be,
-           .iov_len = 4,
-           },
-          {
-           .iov_base = buf,
-           .iov_len = header,
-           },
-      };
-      ssize_t written = writev(conn->socket_fd, iov, 2);
-      DEBUGF("[Socket-to-Socket i=%lld] Sent from socket %d to socket %d: %ld "
-             "bytes (including uint32be header)",
-             i, accept_fd, conn->socket_fd, written);
-      if (written < 0) {
-        ERRORN("writev");
-        continue;
-      }
-    }
-  }
-done:
-  INFOF("Closing a connection (fd %d)", accept_fd);
-  state_remove_socket_fd(state, accept_fd);
-  close(accept_fd);
-  if (buf != NULL) {
-    free(buf);
-  }
-}
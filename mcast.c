@@ -0,0 +1,374 @@
+#include <string.h>
+
+#include <netinet/in.h>
+
+#include "ether.h"
+#include "mcast.h"
+
+#define IP_HDR_LEN 20
+#define IP6_HDR_LEN 40
+#define IP6_NEXT_HOP_BY_HOP 0
+
+// IGMP (RFC 2236, RFC 3376)
+#define IGMP_QUERY 0x11
+#define IGMP_V1_REPORT 0x12
+#define IGMP_V2_REPORT 0x16
+#define IGMP_V2_LEAVE 0x17
+#define IGMP_V3_REPORT 0x22
+
+// MLD (RFC 2710, RFC 3810)
+#define MLD_QUERY 130
+#define MLD_V1_REPORT 131
+#define MLD_V1_DONE 132
+#define MLD_V2_REPORT 143
+
+// Group records of IGMPv3 and MLDv2 reports
+#define RECORD_IS_INCLUDE 1
+#define RECORD_IS_EXCLUDE 2
+#define RECORD_TO_INCLUDE 3
+#define RECORD_TO_EXCLUDE 4
+#define RECORD_ALLOW 5
+#define RECORD_BLOCK 6
+
+// Source of the queries, locally administered
+static const uint8_t querier_mac[6] = {0x02, 0x00, 0x00, 0x4D, 0x43, 0x51};
+
+static uint16_t get16(const uint8_t *p) { return (uint16_t)(p[0] << 8 | p[1]); }
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v & 0xFF;
+}
+
+static uint16_t checksum_fold(uint32_t sum, const uint8_t *p, size_t len) {
+  for (size_t i = 0; i + 1 < len; i += 2)
+    sum += get16(p + i);
+  if (len % 2 != 0)
+    sum += (uint32_t)(p[len - 1] << 8);
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return (uint16_t)~sum;
+}
+
+static size_t mcast_hash(uint16_t vlan, const uint8_t mac[6], const void *owner, size_t capacity) {
+  uint32_t h = 2166136261u ^ vlan; // FNV-1a
+  for (size_t i = 2; i < 6; i++)   // the prefix is the same for all IP groups
+    h = (h ^ mac[i]) * 16777619u;
+  uintptr_t p = (uintptr_t)owner;
+  h ^= (uint32_t)(p >> 4) ^ (uint32_t)((uint64_t)p >> 32);
+  h *= 0x9E3779B1u; // Fibonacci hashing
+  return (size_t)((uint64_t)h * capacity >> 32);
+}
+
+// Adds the change of the group of an IPv4 or IPv6 address, unless flooded.
+static size_t add_change(struct mcast_change changes[MCAST_REPORT_MAX], size_t n,
+                         const uint8_t *group, bool ipv6, bool join) {
+  uint8_t mac[6];
+  if (ipv6) {
+    if (group[0] != 0xFF)
+      return n;
+    mac[0] = 0x33;
+    mac[1] = 0x33;
+    memcpy(mac + 2, group + 12, 4);
+  } else {
+    if ((group[0] & 0xF0) != 0xE0)
+      return n;
+    mac[0] = 0x01;
+    mac[1] = 0x00;
+    mac[2] = 0x5E;
+    mac[3] = group[1] & 0x7F;
+    mac[4] = group[2];
+    mac[5] = group[3];
+  }
+  if (n == MCAST_REPORT_MAX || mcast_is_flooded(mac))
+    return n;
+  memcpy(changes[n].mac, mac, 6);
+  changes[n].join = join;
+  return n + 1;
+}
+
+// Parses the group records of an IGMPv3 or MLDv2 report.
+static size_t parse_records(const uint8_t *p, size_t len, size_t count, bool ipv6,
+                            struct mcast_change changes[MCAST_REPORT_MAX]) {
+  size_t addr_len = ipv6 ? 16 : 4;
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (len < 4 + addr_len)
+      break;
+    uint8_t type = p[0];
+    size_t sources = get16(p + 2);
+    size_t record_len = 4 + addr_len + sources * addr_len + (size_t)p[1] * 4;
+    if (len < record_len)
+      break;
+    // Sources are not tracked: any interest in the group is a join.
+    if (type == RECORD_IS_EXCLUDE || type == RECORD_TO_EXCLUDE || type == RECORD_ALLOW ||
+        ((type == RECORD_IS_INCLUDE || type == RECORD_TO_INCLUDE) && sources > 0))
+      n = add_change(changes, n, p + 4, ipv6, true);
+    else if ((type == RECORD_IS_INCLUDE || type == RECORD_TO_INCLUDE) && sources == 0)
+      n = add_change(changes, n, p + 4, ipv6, false);
+    p += record_len;
+    len -= record_len;
+  }
+  return n;
+}
+
+static size_t parse_igmp(const uint8_t *ip, size_t len,
+                         struct mcast_change changes[MCAST_REPORT_MAX]) {
+  size_t ihl = (size_t)(ip[0] & 0x0F) * 4;
+  if (ip[9] != IPPROTO_IGMP || ihl < IP_HDR_LEN || len < ihl + 8)
+    return 0;
+  const uint8_t *igmp = ip + ihl;
+  size_t igmp_len = len - ihl;
+  switch (igmp[0]) {
+  case IGMP_V1_REPORT:
+  case IGMP_V2_REPORT:
+    return add_change(changes, 0, igmp + 4, false, true);
+  case IGMP_V2_LEAVE:
+    return add_change(changes, 0, igmp + 4, false, false);
+  case IGMP_V3_REPORT:
+    return parse_records(igmp + 8, igmp_len - 8, get16(igmp + 6), false, changes);
+  }
+  return 0;
+}
+
+static size_t parse_mld(const uint8_t *ip6, size_t len,
+                        struct mcast_change changes[MCAST_REPORT_MAX]) {
+  if (len < IP6_HDR_LEN)
+    return 0;
+  uint8_t next = ip6[6];
+  size_t off = IP6_HDR_LEN;
+  // MLD messages carry a Router Alert option.
+  if (next == IP6_NEXT_HOP_BY_HOP) {
+    if (len < off + 8)
+      return 0;
+    next = ip6[off];
+    off += ((size_t)ip6[off + 1] + 1) * 8;
+  }
+  if (next != IPPROTO_ICMPV6 || len < off + 8)
+    return 0;
+  const uint8_t *mld = ip6 + off;
+  size_t mld_len = len - off;
+  switch (mld[0]) {
+  case MLD_V1_REPORT:
+  case MLD_V1_DONE:
+    if (mld_len < 24)
+      return 0;
+    return add_change(changes, 0, mld + 8, true, mld[0] == MLD_V1_REPORT);
+  case MLD_V2_REPORT:
+    return parse_records(mld + 8, mld_len - 8, get16(mld + 6), true, changes);
+  }
+  return 0;
+}
+
+size_t mcast_parse_report(const uint8_t *frame, size_t len,
+                          struct mcast_change changes[MCAST_REPORT_MAX]) {
+  if (len < ETHER_HDR_LEN + IP_HDR_LEN)
+    return 0;
+  uint16_t type = ether_type(frame);
+  if (type == ETHERTYPE_IP)
+    return parse_igmp(frame + ETHER_HDR_LEN, len - ETHER_HDR_LEN, changes);
+  if (type == ETHERTYPE_IPV6)
+    return parse_mld(frame + ETHER_HDR_LEN, len - ETHER_HDR_LEN, changes);
+  return 0;
+}
+
+static struct mcast_member *member_find(const struct mcast *m, uint16_t vlan,
+                                        const uint8_t mac[6], const void *owner) {
+  size_t i = mcast_hash(vlan, mac, owner, MCAST_MEMBER_CAPACITY);
+  for (size_t n = 0; n < MCAST_MEMBER_CAPACITY; n++, i = (i + 1) % MCAST_MEMBER_CAPACITY) {
+    const struct mcast_member *e = &m->members[i];
+    if (!e->used)
+      return NULL;
+    if (e->owner == owner && e->vlan == vlan && memcmp(e->mac, mac, 6) == 0)
+      return (struct mcast_member *)e;
+  }
+  return NULL;
+}
+
+bool mcast_is_member(const struct mcast *m, uint16_t vlan, const uint8_t mac[6],
+                     const void *owner) {
+  return member_find(m, vlan, mac, owner) != NULL;
+}
+
+struct mcast_group *mcast_lookup(struct mcast *m, uint16_t vlan, const uint8_t mac[6]) {
+  size_t i = mcast_hash(vlan, mac, NULL, MCAST_GROUP_CAPACITY);
+  for (size_t n = 0; n < MCAST_GROUP_CAPACITY; n++, i = (i + 1) % MCAST_GROUP_CAPACITY) {
+    struct mcast_group *g = &m->groups[i];
+    if (!g->used)
+      return NULL;
+    if (g->vlan == vlan && memcmp(g->mac, mac, 6) == 0)
+      return g;
+  }
+  return NULL;
+}
+
+bool mcast_join(struct mcast *m, uint16_t vlan, const uint8_t mac[6], void *owner) {
+  if (mcast_is_member(m, vlan, mac, owner))
+    return true;
+  // Keep the load factors below 3/4 so that misses stay short.
+  if (m->member_count >= MCAST_MEMBER_CAPACITY / 4 * 3)
+    return false;
+  struct mcast_group *g = mcast_lookup(m, vlan, mac);
+  if (g == NULL) {
+    if (m->group_count >= MCAST_GROUP_CAPACITY / 4 * 3)
+      return false;
+    size_t i = mcast_hash(vlan, mac, NULL, MCAST_GROUP_CAPACITY);
+    while (m->groups[i].used)
+      i = (i + 1) % MCAST_GROUP_CAPACITY;
+    g = &m->groups[i];
+    memcpy(g->mac, mac, 6);
+    g->vlan = vlan;
+    g->used = true;
+    m->group_count++;
+  }
+  size_t i = mcast_hash(vlan, mac, owner, MCAST_MEMBER_CAPACITY);
+  while (m->members[i].used)
+    i = (i + 1) % MCAST_MEMBER_CAPACITY;
+  struct mcast_member *e = &m->members[i];
+  memcpy(e->mac, mac, 6);
+  e->vlan = vlan;
+  e->owner = owner;
+  e->used = true;
+  m->member_count++;
+  g->members++;
+  return true;
+}
+
+// Backward shift deletion, like fdb_remove_at.
+static void group_remove_at(struct mcast *m, size_t hole) {
+  size_t i = hole;
+  for (;;) {
+    i = (i + 1) % MCAST_GROUP_CAPACITY;
+    struct mcast_group *g = &m->groups[i];
+    if (!g->used)
+      break;
+    size_t home = mcast_hash(g->vlan, g->mac, NULL, MCAST_GROUP_CAPACITY);
+    bool in_range = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+    if (in_range)
+      continue;
+    // The counters are atomic: copied one by one.
+    struct mcast_group *h = &m->groups[hole];
+    memcpy(h->mac, g->mac, 6);
+    h->vlan = g->vlan;
+    h->used = true;
+    h->members = g->members;
+    atomic_store_explicit(&h->frames, atomic_load_explicit(&g->frames, memory_order_relaxed),
+                          memory_order_relaxed);
+    atomic_store_explicit(&h->bytes, atomic_load_explicit(&g->bytes, memory_order_relaxed),
+                          memory_order_relaxed);
+    hole = i;
+  }
+  struct mcast_group *h = &m->groups[hole];
+  h->used = false;
+  h->members = 0;
+  atomic_store_explicit(&h->frames, 0, memory_order_relaxed);
+  atomic_store_explicit(&h->bytes, 0, memory_order_relaxed);
+  m->group_count--;
+}
+
+static void member_remove_at(struct mcast *m, size_t hole) {
+  struct mcast_member *e = &m->members[hole];
+  struct mcast_group *group = mcast_lookup(m, e->vlan, e->mac);
+  if (group != NULL && --group->members == 0)
+    group_remove_at(m, (size_t)(group - m->groups));
+  size_t i = hole;
+  for (;;) {
+    i = (i + 1) % MCAST_MEMBER_CAPACITY;
+    e = &m->members[i];
+    if (!e->used)
+      break;
+    size_t home = mcast_hash(e->vlan, e->mac, e->owner, MCAST_MEMBER_CAPACITY);
+    bool in_range = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+    if (in_range)
+      continue;
+    m->members[hole] = *e;
+    hole = i;
+  }
+  memset(&m->members[hole], 0, sizeof(m->members[hole]));
+  m->member_count--;
+}
+
+void mcast_leave(struct mcast *m, uint16_t vlan, const uint8_t mac[6], const void *owner) {
+  struct mcast_member *e = member_find(m, vlan, mac, owner);
+  if (e != NULL)
+    member_remove_at(m, (size_t)(e - m->members));
+}
+
+void mcast_forget(struct mcast *m, const void *owner) {
+  for (size_t i = 0; i < MCAST_MEMBER_CAPACITY;) {
+    struct mcast_member *e = &m->members[i];
+    if (e->used && e->owner == owner) {
+      // The hole may have been filled by a shifted entry; check it again.
+      member_remove_at(m, i);
+      continue;
+    }
+    i++;
+  }
+}
+
+size_t mcast_build_query(bool mld, uint8_t frame[MCAST_QUERY_MAX_LEN]) {
+  memset(frame, 0, MCAST_QUERY_MAX_LEN);
+  memcpy(frame + ETHER_ADDR_LEN, querier_mac, ETHER_ADDR_LEN);
+  if (!mld) {
+    static const uint8_t all_hosts_mac[6] = {0x01, 0x00, 0x5E, 0x00, 0x00, 0x01};
+    memcpy(frame, all_hosts_mac, ETHER_ADDR_LEN);
+    put16(frame + ETHER_TYPE_OFFSET, ETHERTYPE_IP);
+    uint8_t *ip = frame + ETHER_HDR_LEN;
+    size_t ihl = IP_HDR_LEN + 4;
+    uint8_t *igmp = ip + ihl;
+    ip[0] = 0x40 | (uint8_t)(ihl / 4);
+    ip[1] = 0xC0; // CS6, network control
+    put16(ip + 2, (uint16_t)(ihl + 12));
+    ip[8] = 1; // TTL
+    ip[9] = IPPROTO_IGMP;
+    // From 0.0.0.0, as a snooping switch does (RFC 4541), to 224.0.0.1
+    ip[16] = 224;
+    ip[19] = 1;
+    ip[20] = 0x94; // Router Alert
+    ip[21] = 4;
+    put16(ip + 10, checksum_fold(0, ip, ihl));
+    igmp[0] = IGMP_QUERY;
+    igmp[1] = 10; // answer within 1 second
+    igmp[8] = 2;  // robustness
+    igmp[9] = 125; // query interval, in seconds
+    put16(igmp + 2, checksum_fold(0, igmp, 12));
+    return ETHER_MIN_LEN - ETHER_CRC_LEN; // padded
+  }
+  static const uint8_t all_nodes_mac[6] = {0x33, 0x33, 0x00, 0x00, 0x00, 0x01};
+  memcpy(frame, all_nodes_mac, ETHER_ADDR_LEN);
+  put16(frame + ETHER_TYPE_OFFSET, ETHERTYPE_IPV6);
+  uint8_t *ip6 = frame + ETHER_HDR_LEN;
+  uint8_t *hbh = ip6 + IP6_HDR_LEN;
+  uint8_t *query = hbh + 8;
+  size_t query_len = 28;
+  ip6[0] = 0x60;
+  put16(ip6 + 4, (uint16_t)(8 + query_len));
+  ip6[6] = IP6_NEXT_HOP_BY_HOP;
+  ip6[7] = 1; // hop limit
+  // From the link-local address of querier_mac (modified EUI-64), to ff02::1
+  ip6[8] = 0xFE;
+  ip6[9] = 0x80;
+  ip6[16] = querier_mac[0] ^ 0x02;
+  ip6[17] = querier_mac[1];
+  ip6[18] = querier_mac[2];
+  ip6[19] = 0xFF;
+  ip6[20] = 0xFE;
+  memcpy(ip6 + 21, querier_mac + 3, 3);
+  ip6[24] = 0xFF;
+  ip6[25] = 0x02;
+  ip6[39] = 1;
+  hbh[0] = IPPROTO_ICMPV6;
+  hbh[2] = 5; // Router Alert: MLD
+  hbh[3] = 2;
+  hbh[6] = 1; // PadN
+  query[0] = MLD_QUERY;
+  put16(query + 4, 1000); // answer within 1 second
+  query[24] = 2;          // robustness
+  query[25] = 125;        // query interval, in seconds
+  // Pseudo-header: source and destination addresses, length, next header
+  uint32_t sum = (uint32_t)query_len + IPPROTO_ICMPV6;
+  for (size_t i = 8; i < IP6_HDR_LEN; i += 2)
+    sum += get16(ip6 + i);
+  put16(query + 2, checksum_fold(sum, query, query_len));
+  return ETHER_HDR_LEN + IP6_HDR_LEN + 8 + query_len;
+}
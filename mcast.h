@@ -0,0 +1,98 @@
+#ifndef SOCKET_VMNET_MCAST_H
+#define SOCKET_VMNET_MCAST_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Multicast snooping: the IGMP and MLD reports of the VMs tell which
+// connections joined which groups, so that the frames to a group go to its
+// members only instead of to every VM. Groups are tracked by MAC address: the
+// IP groups mapped to the same MAC address share their members. Open
+// addressing with linear probing, like fdb.h.
+//
+// The link-local control groups and the non-IP multicast addresses are always
+// flooded (see mcast_is_flooded), as are the groups no VM joined: a VM that
+// joined before socket_vmnet started is only known once it answers a query.
+#define MCAST_GROUP_CAPACITY 1024
+#define MCAST_MEMBER_CAPACITY 4096
+
+// Groups changed by one report, at most; the others are ignored.
+#define MCAST_REPORT_MAX 32
+
+// Ethernet, IPv6, hop-by-hop options, and an MLDv2 query; the IGMPv3 query is
+// shorter.
+#define MCAST_QUERY_MAX_LEN (14 + 40 + 8 + 28)
+
+struct mcast_group {
+  uint8_t mac[6];
+  uint16_t vlan;
+  bool used;
+  uint32_t members;
+  _Atomic uint64_t frames;
+  _Atomic uint64_t bytes;
+};
+
+struct mcast_member {
+  uint8_t mac[6];
+  uint16_t vlan;
+  bool used;
+  void *owner;
+};
+
+struct mcast {
+  struct mcast_group groups[MCAST_GROUP_CAPACITY];
+  struct mcast_member members[MCAST_MEMBER_CAPACITY];
+  size_t group_count;
+  size_t member_count;
+  _Atomic uint64_t reports;
+  // Multicast and broadcast frames sent to every VM
+  _Atomic uint64_t flooded;
+};
+
+// A group joined or left by a report
+struct mcast_change {
+  uint8_t mac[6];
+  bool join;
+};
+
+// Returns true if the frames to the multicast address mac go to every VM:
+// 224.0.0.0/24, the IPv6 groups ff0X::1 to ff0X::ff (all nodes, all routers,
+// MLDv2 reports, mDNS...), and the addresses of the other protocols.
+// Solicited-node groups are snooped.
+static inline bool mcast_is_flooded(const uint8_t mac[6]) {
+  if (mac[0] == 0x01 && mac[1] == 0x00 && mac[2] == 0x5E)
+    return (mac[3] & 0x7F) == 0 && mac[4] == 0;
+  if (mac[0] == 0x33 && mac[1] == 0x33)
+    return mac[2] == 0 && mac[3] == 0 && mac[4] == 0;
+  return true;
+}
+
+// Parses an untagged IGMP (v1, v2, v3) or MLD (v1, v2) report or leave, and
+// returns the number of changes, for the groups that are not flooded anyway.
+size_t mcast_parse_report(const uint8_t *frame, size_t len,
+                          struct mcast_change changes[MCAST_REPORT_MAX]);
+
+// Returns true if owner joined the group mac on vlan.
+bool mcast_is_member(const struct mcast *m, uint16_t vlan, const uint8_t mac[6],
+                     const void *owner);
+
+// Records that owner joined the group mac on vlan. Returns false if the table
+// is full.
+bool mcast_join(struct mcast *m, uint16_t vlan, const uint8_t mac[6], void *owner);
+
+// Records that owner left the group mac on vlan.
+void mcast_leave(struct mcast *m, uint16_t vlan, const uint8_t mac[6], const void *owner);
+
+// Forgets all groups joined by owner.
+void mcast_forget(struct mcast *m, const void *owner);
+
+// Returns the group mac on vlan, or NULL if no VM joined it.
+struct mcast_group *mcast_lookup(struct mcast *m, uint16_t vlan, const uint8_t mac[6]);
+
+// Writes a general query, IGMPv3 or MLDv2, and returns its length. The VMs
+// answer with a report of all their groups.
+size_t mcast_build_query(bool mld, uint8_t frame[MCAST_QUERY_MAX_LEN]);
+
+#endif /* SOCKET_VMNET_MCAST_H */
@@ -0,0 +1,310 @@
+#include <string.h>
+
+#include <netinet/in.h>
+
+#include "ether.h"
+#include "neigh.h"
+
+#define ARP_LEN 28
+#define ARP_OP_REQUEST 1
+#define ARP_OP_REPLY 2
+#define IP6_HDR_LEN 40
+// ICMPv6 Neighbor Discovery (RFC 4861)
+#define ND_TYPE_SOLICIT 135
+#define ND_TYPE_ADVERT 136
+#define ND_HDR_LEN 24 // type, code, checksum, reserved or flags, target
+#define ND_OPT_SLLA 1 // source link-layer address
+#define ND_OPT_TLLA 2 // target link-layer address
+// Advertisements answer a solicitation, and override cached addresses.
+#define ND_FLAG_SOLICITED 0x40
+#define ND_FLAG_OVERRIDE 0x20
+
+static const uint8_t ipv4_mapped_prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+
+static size_t neigh_hash(uint16_t vlan, const uint8_t addr[16]) {
+  uint32_t h = 2166136261u ^ vlan; // FNV-1a
+  // IPv4-mapped addresses only differ in the last bytes.
+  for (size_t i = 0; i < 16; i++)
+    h = (h ^ addr[i]) * 16777619u;
+  h *= 0x9E3779B1u; // Fibonacci hashing
+  return h >> (32 - 12) & (NEIGH_CAPACITY - 1);
+}
+
+_Static_assert(NEIGH_CAPACITY == 1 << 12, "neigh_hash assumes NEIGH_CAPACITY == 4096");
+
+static uint16_t get16(const uint8_t *p) { return (uint16_t)(p[0] << 8 | p[1]); }
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v & 0xFF;
+}
+
+static bool is_zero(const uint8_t *p, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (p[i] != 0)
+      return false;
+  }
+  return true;
+}
+
+// Returns the ARP payload of an Ethernet/IPv4 ARP frame, or NULL.
+static const uint8_t *arp_payload(const uint8_t *frame, size_t len) {
+  if (len < ETHER_HDR_LEN + ARP_LEN || ether_type(frame) != ETHERTYPE_ARP)
+    return NULL;
+  const uint8_t *arp = frame + ETHER_HDR_LEN;
+  if (get16(arp) != 1 || get16(arp + 2) != ETHERTYPE_IP || arp[4] != ETHER_ADDR_LEN || arp[5] != 4)
+    return NULL;
+  return arp;
+}
+
+// Returns the ICMPv6 message of a Neighbor Solicitation or Advertisement, and
+// its length, or NULL.
+static const uint8_t *nd_message(const uint8_t *frame, size_t len, size_t *nd_len) {
+  if (len < ETHER_HDR_LEN + IP6_HDR_LEN + ND_HDR_LEN || ether_type(frame) != ETHERTYPE_IPV6)
+    return NULL;
+  const uint8_t *ip6 = frame + ETHER_HDR_LEN;
+  // Neighbor Discovery messages never carry extension headers, and are
+  // never forwarded by routers (hop limit 255).
+  if (ip6[0] >> 4 != 6 || ip6[6] != IPPROTO_ICMPV6 || ip6[7] != 255)
+    return NULL;
+  size_t payload_len = get16(ip6 + 4);
+  if (payload_len < ND_HDR_LEN || payload_len > len - ETHER_HDR_LEN - IP6_HDR_LEN)
+    return NULL;
+  const uint8_t *nd = ip6 + IP6_HDR_LEN;
+  if ((nd[0] != ND_TYPE_SOLICIT && nd[0] != ND_TYPE_ADVERT) || nd[1] != 0)
+    return NULL;
+  *nd_len = payload_len;
+  return nd;
+}
+
+// Returns the link-layer address in the option of type opt_type, or NULL.
+static const uint8_t *nd_option(const uint8_t *nd, size_t nd_len, uint8_t opt_type) {
+  for (size_t off = ND_HDR_LEN; off + 8 <= nd_len;) {
+    size_t opt_len = nd[off + 1] * 8;
+    if (opt_len == 0 || off + opt_len > nd_len)
+      return NULL;
+    if (nd[off] == opt_type && opt_len == 8)
+      return nd + off + 2;
+    off += opt_len;
+  }
+  return NULL;
+}
+
+bool neigh_parse_binding(const uint8_t *frame, size_t len, struct neigh_binding *b) {
+  const uint8_t *arp = arp_payload(frame, len);
+  if (arp != NULL) {
+    // Only the sender is known to be where the frame comes from.
+    if (is_zero(arp + 14, 4) || memcmp(arp + 8, frame + ETHER_ADDR_LEN, ETHER_ADDR_LEN) != 0)
+      return false;
+    memcpy(b->addr, ipv4_mapped_prefix, 12);
+    memcpy(b->addr + 12, arp + 14, 4);
+    memcpy(b->mac, arp + 8, ETHER_ADDR_LEN);
+    return true;
+  }
+  size_t nd_len;
+  const uint8_t *nd = nd_message(frame, len, &nd_len);
+  if (nd == NULL)
+    return false;
+  const uint8_t *ip6 = frame + ETHER_HDR_LEN;
+  const uint8_t *mac;
+  const uint8_t *addr;
+  if (nd[0] == ND_TYPE_SOLICIT) {
+    mac = nd_option(nd, nd_len, ND_OPT_SLLA);
+    addr = ip6 + 8; // the source address; unspecified for duplicate address detection
+  } else {
+    mac = nd_option(nd, nd_len, ND_OPT_TLLA);
+    addr = nd + 8; // the target address
+  }
+  if (mac == NULL || is_zero(addr, 16) || addr[0] == 0xFF ||
+      memcmp(mac, frame + ETHER_ADDR_LEN, ETHER_ADDR_LEN) != 0)
+    return false;
+  memcpy(b->addr, addr, 16);
+  memcpy(b->mac, mac, ETHER_ADDR_LEN);
+  return true;
+}
+
+bool neigh_parse_query(const uint8_t *frame, size_t len, struct neigh_query *q) {
+  const uint8_t *arp = arp_payload(frame, len);
+  if (arp != NULL) {
+    if (get16(arp + 6) != ARP_OP_REQUEST || is_zero(arp + 14, 4) ||
+        memcmp(arp + 14, arp + 24, 4) == 0)
+      return false;
+    q->nd = false;
+    memcpy(q->target, ipv4_mapped_prefix, 12);
+    memcpy(q->target + 12, arp + 24, 4);
+    memcpy(q->requester_mac, arp + 8, ETHER_ADDR_LEN);
+    memcpy(q->requester_addr, ipv4_mapped_prefix, 12);
+    memcpy(q->requester_addr + 12, arp + 14, 4);
+    return true;
+  }
+  size_t nd_len;
+  const uint8_t *nd = nd_message(frame, len, &nd_len);
+  if (nd == NULL || nd[0] != ND_TYPE_SOLICIT)
+    return false;
+  const uint8_t *ip6 = frame + ETHER_HDR_LEN;
+  if (is_zero(ip6 + 8, 16) || nd[8] == 0xFF)
+    return false;
+  q->nd = true;
+  memcpy(q->target, nd + 8, 16);
+  memcpy(q->requester_mac, frame + ETHER_ADDR_LEN, ETHER_ADDR_LEN);
+  memcpy(q->requester_addr, ip6 + 8, 16);
+  return true;
+}
+
+static uint16_t icmp6_checksum(const uint8_t *ip6, const uint8_t *msg, size_t len) {
+  uint32_t sum = 0;
+  // Pseudo-header: source and destination addresses, length, next header
+  for (size_t i = 8; i < IP6_HDR_LEN; i += 2)
+    sum += get16(ip6 + i);
+  sum += (uint32_t)len + IPPROTO_ICMPV6;
+  for (size_t i = 0; i + 1 < len; i += 2)
+    sum += get16(msg + i);
+  if (len % 2 != 0)
+    sum += (uint32_t)(msg[len - 1] << 8);
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return (uint16_t)~sum;
+}
+
+size_t neigh_build_reply(const struct neigh_query *q, const uint8_t mac[6],
+                         uint8_t reply[NEIGH_REPLY_MAX_LEN]) {
+  memset(reply, 0, NEIGH_REPLY_MAX_LEN);
+  memcpy(reply, q->requester_mac, ETHER_ADDR_LEN);
+  memcpy(reply + ETHER_ADDR_LEN, mac, ETHER_ADDR_LEN);
+  if (!q->nd) {
+    put16(reply + ETHER_TYPE_OFFSET, ETHERTYPE_ARP);
+    uint8_t *arp = reply + ETHER_HDR_LEN;
+    put16(arp, 1);
+    put16(arp + 2, ETHERTYPE_IP);
+    arp[4] = ETHER_ADDR_LEN;
+    arp[5] = 4;
+    put16(arp + 6, ARP_OP_REPLY);
+    memcpy(arp + 8, mac, ETHER_ADDR_LEN);
+    memcpy(arp + 14, q->target + 12, 4);
+    memcpy(arp + 18, q->requester_mac, ETHER_ADDR_LEN);
+    memcpy(arp + 24, q->requester_addr + 12, 4);
+    // Padded to the minimum frame length
+    return ETHER_MIN_LEN - ETHER_CRC_LEN;
+  }
+  put16(reply + ETHER_TYPE_OFFSET, ETHERTYPE_IPV6);
+  uint8_t *ip6 = reply + ETHER_HDR_LEN;
+  uint8_t *nd = ip6 + IP6_HDR_LEN;
+  size_t nd_len = ND_HDR_LEN + 8;
+  ip6[0] = 0x60;
+  put16(ip6 + 4, (uint16_t)nd_len);
+  ip6[6] = IPPROTO_ICMPV6;
+  ip6[7] = 255;
+  memcpy(ip6 + 8, q->target, 16);
+  memcpy(ip6 + 24, q->requester_addr, 16);
+  nd[0] = ND_TYPE_ADVERT;
+  nd[4] = ND_FLAG_SOLICITED | ND_FLAG_OVERRIDE;
+  memcpy(nd + 8, q->target, 16);
+  nd[ND_HDR_LEN] = ND_OPT_TLLA;
+  nd[ND_HDR_LEN + 1] = 1; // in units of 8 bytes
+  memcpy(nd + ND_HDR_LEN + 2, mac, ETHER_ADDR_LEN);
+  put16(nd + 2, icmp6_checksum(ip6, nd, nd_len));
+  return ETHER_HDR_LEN + IP6_HDR_LEN + nd_len;
+}
+
+static struct neigh_entry *neigh_find(const struct neigh *neigh, uint16_t vlan,
+                                      const uint8_t addr[16]) {
+  size_t i = neigh_hash(vlan, addr);
+  for (size_t n = 0; n < NEIGH_CAPACITY; n++, i = (i + 1) & (NEIGH_CAPACITY - 1)) {
+    const struct neigh_entry *e = &neigh->entries[i];
+    if (!e->used)
+      return NULL;
+    if (e->vlan == vlan && memcmp(e->addr, addr, 16) == 0)
+      return (struct neigh_entry *)e;
+  }
+  return NULL;
+}
+
+bool neigh_should_learn(const struct neigh *neigh, uint16_t vlan, const struct neigh_binding *b,
+                        const void *owner, uint64_t now) {
+  const struct neigh_entry *e = neigh_find(neigh, vlan, b->addr);
+  // Refreshing takes the table for writing; do it once in a while only.
+  return e == NULL || e->owner != owner || memcmp(e->mac, b->mac, ETHER_ADDR_LEN) != 0 ||
+         now - e->seen_ns > NEIGH_TTL_NS / 4;
+}
+
+bool neigh_learn(struct neigh *neigh, uint16_t vlan, const struct neigh_binding *b, void *owner,
+                 uint64_t now) {
+  size_t i = neigh_hash(vlan, b->addr);
+  for (size_t n = 0; n < NEIGH_CAPACITY; n++, i = (i + 1) & (NEIGH_CAPACITY - 1)) {
+    struct neigh_entry *e = &neigh->entries[i];
+    if (!e->used) {
+      // Keep the load factor below 3/4 so that misses stay short.
+      if (neigh->count >= NEIGH_CAPACITY / 4 * 3)
+        return false;
+      memcpy(e->addr, b->addr, 16);
+      e->vlan = vlan;
+      e->used = true;
+      neigh->count++;
+    } else if (e->vlan != vlan || memcmp(e->addr, b->addr, 16) != 0) {
+      continue;
+    }
+    // The last VM to announce the address wins, like in an ARP cache.
+    memcpy(e->mac, b->mac, ETHER_ADDR_LEN);
+    e->owner = owner;
+    e->seen_ns = now;
+    return true;
+  }
+  return false;
+}
+
+const struct neigh_entry *neigh_lookup(const struct neigh *neigh, uint16_t vlan,
+                                       const uint8_t addr[16], uint64_t now) {
+  const struct neigh_entry *e = neigh_find(neigh, vlan, addr);
+  if (e == NULL || now - e->seen_ns > NEIGH_TTL_NS)
+    return NULL;
+  return e;
+}
+
+// Backward shift deletion, see fdb_remove_at.
+static void neigh_remove_at(struct neigh *neigh, size_t hole) {
+  size_t i = hole;
+  for (;;) {
+    i = (i + 1) & (NEIGH_CAPACITY - 1);
+    struct neigh_entry *e = &neigh->entries[i];
+    if (!e->used)
+      break;
+    size_t home = neigh_hash(e->vlan, e->addr);
+    bool in_range = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+    if (in_range)
+      continue;
+    neigh->entries[hole] = *e;
+    hole = i;
+  }
+  memset(&neigh->entries[hole], 0, sizeof(neigh->entries[hole]));
+  neigh->count--;
+}
+
+void neigh_forget(struct neigh *neigh, const void *owner) {
+  for (size_t i = 0; i < NEIGH_CAPACITY;) {
+    struct neigh_entry *e = &neigh->entries[i];
+    if (e->used && e->owner == owner) {
+      neigh_remove_at(neigh, i);
+      continue;
+    }
+    i++;
+  }
+}
+
+void neigh_adopt(struct neigh *neigh, uint16_t vlan, const uint8_t mac[6], const void *from,
+                 void *to) {
+  for (size_t i = 0; i < NEIGH_CAPACITY; i++) {
+    struct neigh_entry *e = &neigh->entries[i];
+    if (e->used && e->owner == from && e->vlan == vlan &&
+        memcmp(e->mac, mac, ETHER_ADDR_LEN) == 0)
+      e->owner = to;
+  }
+}
+
+void neigh_count(struct neigh *neigh, const struct neigh_query *q, bool hit) {
+  _Atomic uint64_t *counter;
+  if (q->nd)
+    counter = hit ? &neigh->nd_hits : &neigh->nd_misses;
+  else
+    counter = hit ? &neigh->arp_hits : &neigh->arp_misses;
+  atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
@@ -0,0 +1,91 @@
+#ifndef SOCKET_VMNET_NEIGH_H
+#define SOCKET_VMNET_NEIGH_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Neighbor table: (VLAN, IP address) -> MAC address of a VM, learned from the
+// ARP and NDP messages of the VMs, so that the daemon can answer the ARP
+// requests and Neighbor Solicitations for them instead of flooding. Open
+// addressing with linear probing, like fdb.h.
+#define NEIGH_CAPACITY 4096
+
+// A binding not refreshed by its VM for this long is not used anymore; VMs
+// refresh their own caches well within this time.
+#define NEIGH_TTL_NS (300 * 1000000000ULL)
+
+// Ethernet, IPv6, and a Neighbor Advertisement with the target link-layer
+// address; ARP replies are shorter.
+#define NEIGH_REPLY_MAX_LEN (14 + 40 + 32)
+
+struct neigh_entry {
+  uint8_t addr[16]; // IPv4 addresses are IPv4-mapped (::ffff:a.b.c.d)
+  uint16_t vlan;
+  bool used;
+  uint8_t mac[6];
+  void *owner;
+  uint64_t seen_ns;
+};
+
+struct neigh {
+  struct neigh_entry entries[NEIGH_CAPACITY];
+  size_t count;
+  // Requests for an address, answered (hits) or forwarded (misses)
+  _Atomic uint64_t arp_hits;
+  _Atomic uint64_t arp_misses;
+  _Atomic uint64_t nd_hits;
+  _Atomic uint64_t nd_misses;
+};
+
+// An address announced by a frame: the sender of an ARP message, the source
+// of a Neighbor Solicitation, or the target of a Neighbor Advertisement.
+struct neigh_binding {
+  uint8_t addr[16];
+  uint8_t mac[6];
+};
+
+// An ARP request or a Neighbor Solicitation that may be answered.
+struct neigh_query {
+  bool nd;
+  uint8_t target[16];
+  uint8_t requester_mac[6];
+  uint8_t requester_addr[16];
+};
+
+// Parses the binding announced by an untagged frame. Returns false if none.
+bool neigh_parse_binding(const uint8_t *frame, size_t len, struct neigh_binding *b);
+
+// Parses an untagged ARP request or Neighbor Solicitation. Probes for
+// duplicate addresses and gratuitous ARP are not queries: they must reach the
+// VMs.
+bool neigh_parse_query(const uint8_t *frame, size_t len, struct neigh_query *q);
+
+// Writes the answer to q for the address at mac, and returns its length.
+size_t neigh_build_reply(const struct neigh_query *q, const uint8_t mac[6],
+                         uint8_t reply[NEIGH_REPLY_MAX_LEN]);
+
+// Returns true if b is new, changed, or due for a refresh.
+bool neigh_should_learn(const struct neigh *neigh, uint16_t vlan, const struct neigh_binding *b,
+                        const void *owner, uint64_t now);
+
+// Records b on vlan behind owner. Returns false if the table is full.
+bool neigh_learn(struct neigh *neigh, uint16_t vlan, const struct neigh_binding *b, void *owner,
+                 uint64_t now);
+
+// Returns the binding of addr on vlan, or NULL if unknown or expired.
+const struct neigh_entry *neigh_lookup(const struct neigh *neigh, uint16_t vlan,
+                                       const uint8_t addr[16], uint64_t now);
+
+// Forgets all bindings learned behind owner.
+void neigh_forget(struct neigh *neigh, const void *owner);
+
+// Moves the bindings of mac on vlan from the owner from to the owner to.
+void neigh_adopt(struct neigh *neigh, uint16_t vlan, const uint8_t mac[6], const void *from,
+                 void *to);
+
+// Counts a query of q, answered or not.
+void neigh_count(struct neigh *neigh, const struct neigh_query *q, bool hit);
+
+#endif /* SOCKET_VMNET_NEIGH_H */
@@ -0,0 +1,438 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../tools/common.h"
+#include "../trace.h"
+
+// Replays a trace recorded by the "trace start" control command of
+// socket_vmnet: every connection of the trace is replayed by a connection to
+// SOCKET, sending the frames its VM sent, at the recorded time or as fast as
+// possible. The frames read from vmnet cannot be injected from a client, and
+// are skipped; run the daemon on a network of its own (e.g., --vmnet-mode=host)
+// so that the host adds as little traffic as possible.
+//
+// The unicast frames to the address of another replayed connection are
+// expected there exactly once: they are matched by a hash of their content,
+// which gives their latency, and the ones missing are counted as dropped.
+
+#define ETHERTYPE_ANNOUNCE 0x88B5 // IEEE 802 local experimental
+
+// The frames sent and not received yet, by hash. Open addressing with linear
+// probing, at most 3/4 full; the frames beyond are not tracked.
+#define INFLIGHT_BITS 20
+#define INFLIGHT_CAPACITY (1u << INFLIGHT_BITS)
+
+struct inflight {
+  uint64_t hash; // 0 for an empty slot
+  uint64_t sent_ns;
+};
+
+struct address {
+  uint8_t mac[6];
+  int conn;
+};
+
+struct conn {
+  uint32_t source; // the connection id in the trace
+  int fd;
+  uint64_t *records; // offsets in the trace
+  size_t record_count;
+  pthread_t sender, receiver;
+  uint64_t sent;
+  uint64_t sent_bytes;
+  _Atomic uint64_t received;
+};
+
+static struct {
+  const uint8_t *trace;
+  size_t trace_len;
+  uint64_t first_ns; // of the first frame replayed
+  bool fast;
+  int wait_seconds;
+  struct conn *conns;
+  size_t conn_count;
+  // the source addresses of the connections, sorted
+  struct address *addresses;
+  size_t address_count;
+  pthread_mutex_t inflight_lock;
+  struct inflight *inflight;
+  size_t inflight_count;
+  uint64_t untracked; // the in-flight table was full
+  _Atomic uint64_t expected;
+  _Atomic uint64_t matched;
+  uint64_t start_ns;
+  struct hist latency;
+} replay = {
+    .wait_seconds = 1,
+    .inflight_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// FNV-1a of the frame, and of the connection it is expected on. Never 0.
+static uint64_t frame_hash(int conn, const uint8_t *frame, size_t len) {
+  uint64_t h = 0xCBF29CE484222325ULL ^ (uint64_t)conn;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ frame[i]) * 0x100000001B3ULL;
+  return h == 0 ? 1 : h;
+}
+
+static void inflight_add(uint64_t hash, uint64_t sent_ns) {
+  pthread_mutex_lock(&replay.inflight_lock);
+  if (replay.inflight_count >= INFLIGHT_CAPACITY / 4 * 3) {
+    replay.untracked++;
+    goto done;
+  }
+  size_t i = hash & (INFLIGHT_CAPACITY - 1);
+  while (replay.inflight[i].hash != 0)
+    i = (i + 1) & (INFLIGHT_CAPACITY - 1);
+  replay.inflight[i] = (struct inflight){.hash = hash, .sent_ns = sent_ns};
+  replay.inflight_count++;
+  atomic_fetch_add(&replay.expected, 1);
+done:
+  pthread_mutex_unlock(&replay.inflight_lock);
+}
+
+// Removes an entry of hash, and returns the time it was sent, or 0.
+static uint64_t inflight_take(uint64_t hash) {
+  uint64_t sent_ns = 0;
+  pthread_mutex_lock(&replay.inflight_lock);
+  size_t i = hash & (INFLIGHT_CAPACITY - 1);
+  for (; replay.inflight[i].hash != 0; i = (i + 1) & (INFLIGHT_CAPACITY - 1)) {
+    if (replay.inflight[i].hash == hash)
+      break;
+  }
+  if (replay.inflight[i].hash == 0)
+    goto done;
+  sent_ns = replay.inflight[i].sent_ns;
+  // Backward shift deletion: move up the entries that probed past i.
+  for (size_t j = (i + 1) & (INFLIGHT_CAPACITY - 1); replay.inflight[j].hash != 0;
+       j = (j + 1) & (INFLIGHT_CAPACITY - 1)) {
+    size_t home = replay.inflight[j].hash & (INFLIGHT_CAPACITY - 1);
+    if (((j - home) & (INFLIGHT_CAPACITY - 1)) >= ((j - i) & (INFLIGHT_CAPACITY - 1))) {
+      replay.inflight[i] = replay.inflight[j];
+      i = j;
+    }
+  }
+  replay.inflight[i].hash = 0;
+  replay.inflight_count--;
+done:
+  pthread_mutex_unlock(&replay.inflight_lock);
+  return sent_ns;
+}
+
+static const struct trace_record *record_at(uint64_t off) {
+  return (const struct trace_record *)(replay.trace + off);
+}
+
+static int compare_address(const void *a, const void *b) {
+  return memcmp(((const struct address *)a)->mac, ((const struct address *)b)->mac, 6);
+}
+
+// Returns the replayed connection owning the unicast address mac, or -1.
+static int address_owner(const uint8_t *mac) {
+  struct address key;
+  memcpy(key.mac, mac, 6);
+  const struct address *a = bsearch(&key, replay.addresses, replay.address_count,
+                                    sizeof(*replay.addresses), compare_address);
+  return a == NULL ? -1 : a->conn;
+}
+
+static void *sender_main(void *arg) {
+  struct conn *conn = arg;
+  int self = (int)(conn - replay.conns);
+  for (size_t i = 0; i < conn->record_count; i++) {
+    const struct trace_record *rec = record_at(conn->records[i]);
+    const uint8_t *frame = (const uint8_t *)(rec + 1);
+    if (!replay.fast) {
+      uint64_t due = replay.start_ns + (rec->time_ns - replay.first_ns);
+      uint64_t now = hist_now();
+      if (now < due) {
+        struct timespec ts = {.tv_sec = (due - now) / 1000000000,
+                              .tv_nsec = (due - now) % 1000000000};
+        nanosleep(&ts, NULL);
+      }
+    }
+    int dest = (frame[0] & 0x01) == 0 ? address_owner(frame) : -1;
+    uint64_t sent_ns = hist_now();
+    if (dest >= 0 && dest != self)
+      inflight_add(frame_hash(dest, frame, rec->len), sent_ns);
+    if (write_frame(conn->fd, frame, rec->len) < 0) {
+      perror("write");
+      break;
+    }
+    conn->sent++;
+    conn->sent_bytes += rec->len;
+  }
+  return NULL;
+}
+
+static void *receiver_main(void *arg) {
+  struct conn *conn = arg;
+  int self = (int)(conn - replay.conns);
+  uint8_t frame[MAX_FRAME_LEN];
+  for (;;) {
+    uint32_t header_be;
+    if (read_all(conn->fd, &header_be, 4) < 0)
+      break;
+    uint32_t len = ntohl(header_be);
+    if (len > MAX_FRAME_LEN || read_all(conn->fd, frame, len) < 0)
+      break;
+    atomic_fetch_add_explicit(&conn->received, 1, memory_order_relaxed);
+    if ((frame[0] & 0x01) != 0)
+      continue;
+    uint64_t sent_ns = inflight_take(frame_hash(self, frame, len));
+    if (sent_ns == 0)
+      continue; // from the host, or not tracked
+    atomic_fetch_add(&replay.matched, 1);
+    hist_record(&replay.latency, hist_now() - sent_ns);
+  }
+  return NULL;
+}
+
+// Maps the trace at path, and checks its header.
+static int open_trace(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open \"%s\": %s\n", path, strerror(errno));
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct trace_header)) {
+    fprintf(stderr, "\"%s\" is not a trace\n", path);
+    close(fd);
+    return -1;
+  }
+  replay.trace_len = st.st_size;
+  replay.trace = mmap(NULL, replay.trace_len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (replay.trace == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  const struct trace_header *h = (const struct trace_header *)replay.trace;
+  if (h->magic != TRACE_MAGIC || h->version != TRACE_VERSION) {
+    fprintf(stderr, "\"%s\" is not a trace of this version\n", path);
+    return -1;
+  }
+  if (h->end == 0 || h->end > replay.trace_len) {
+    fprintf(stderr, "\"%s\" is incomplete; stop the trace first\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+static struct conn *conn_of_source(uint32_t source) {
+  for (size_t i = 0; i < replay.conn_count; i++) {
+    if (replay.conns[i].source == source)
+      return &replay.conns[i];
+  }
+  struct conn *conns = realloc(replay.conns, (replay.conn_count + 1) * sizeof(*conns));
+  if (conns == NULL) {
+    perror("realloc");
+    exit(EXIT_FAILURE);
+  }
+  replay.conns = conns;
+  struct conn *conn = &replay.conns[replay.conn_count++];
+  memset(conn, 0, sizeof(*conn));
+  conn->source = source;
+  conn->fd = -1;
+  return conn;
+}
+
+static void add_address(const uint8_t *mac, int conn) {
+  for (size_t i = 0; i < replay.address_count; i++) {
+    if (memcmp(replay.addresses[i].mac, mac, 6) == 0)
+      return; // moved: the first owner keeps it
+  }
+  struct address *addresses =
+      realloc(replay.addresses, (replay.address_count + 1) * sizeof(*addresses));
+  if (addresses == NULL) {
+    perror("realloc");
+    exit(EXIT_FAILURE);
+  }
+  replay.addresses = addresses;
+  memcpy(replay.addresses[replay.address_count].mac, mac, 6);
+  replay.addresses[replay.address_count++].conn = conn;
+}
+
+// Splits the records of the VMs by connection. Returns the duration of the
+// trace, in nanoseconds. The records larger than a frame are skipped; the
+// trace is cut at the first one that overruns it.
+static uint64_t index_trace(uint64_t *vmnet_frames, uint64_t *truncated_frames,
+                            uint64_t *invalid_frames) {
+  const struct trace_header *h = (const struct trace_header *)replay.trace;
+  uint64_t first_ns = UINT64_MAX, last_ns = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    for (uint64_t off = sizeof(*h);;) {
+      uint64_t this_off = off;
+      bool invalid;
+      const struct trace_record *rec = trace_next(replay.trace, &off, MAX_FRAME_LEN, &invalid);
+      if (invalid && pass == 0)
+        (*invalid_frames)++;
+      if (rec == NULL)
+        break;
+      if (invalid)
+        continue;
+      if (rec->source == TRACE_SOURCE_VMNET || rec->caplen < rec->len || rec->len < 14) {
+        if (pass == 0 && rec->source == TRACE_SOURCE_VMNET)
+          (*vmnet_frames)++;
+        else if (pass == 0)
+          (*truncated_frames)++;
+        continue;
+      }
+      struct conn *conn = conn_of_source(rec->source);
+      if (pass == 0) {
+        conn->record_count++;
+        if (rec->time_ns < first_ns)
+          first_ns = rec->time_ns;
+        if (rec->time_ns > last_ns)
+          last_ns = rec->time_ns;
+        const uint8_t *src = (const uint8_t *)(rec + 1) + 6;
+        if ((src[0] & 0x01) == 0)
+          add_address(src, (int)(conn - replay.conns));
+      } else {
+        conn->records[conn->sent++] = this_off;
+      }
+    }
+    if (pass == 0) {
+      for (size_t i = 0; i < replay.conn_count; i++) {
+        replay.conns[i].records = calloc(replay.conns[i].record_count, sizeof(uint64_t));
+        if (replay.conns[i].records == NULL) {
+          perror("calloc");
+          exit(EXIT_FAILURE);
+        }
+      }
+    }
+  }
+  for (size_t i = 0; i < replay.conn_count; i++)
+    replay.conns[i].sent = 0;
+  if (replay.address_count > 0)
+    qsort(replay.addresses, replay.address_count, sizeof(*replay.addresses), compare_address);
+  replay.first_ns = first_ns;
+  return first_ns == UINT64_MAX ? 0 : last_ns - first_ns;
+}
+
+static void print_usage(const char *argv0) {
+  printf("Usage: %s [OPTION]... TRACE SOCKET\n", argv0);
+  printf("Replays the frames of the VMs recorded by \"trace start\" to socket_vmnet.\n");
+  printf("\n");
+  printf("-f          send the frames as fast as possible, instead of at their recorded time\n");
+  printf("-w SECONDS  time to wait for the frames in flight at the end (default: 1)\n");
+  printf("-h          display this help and exit\n");
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "fw:h")) != -1) {
+    switch (opt) {
+    case 'f':
+      replay.fast = true;
+      break;
+    case 'w':
+      replay.wait_seconds = atoi(optarg);
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      exit(EXIT_SUCCESS);
+    default:
+      print_usage(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (argc - optind != 2 || replay.wait_seconds < 0) {
+    print_usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  const char *socket_path = argv[optind + 1];
+  if (open_trace(argv[optind]) < 0)
+    exit(EXIT_FAILURE);
+  uint64_t vmnet_frames = 0, truncated_frames = 0, invalid_frames = 0;
+  uint64_t duration_ns = index_trace(&vmnet_frames, &truncated_frames, &invalid_frames);
+  const struct trace_header *h = (const struct trace_header *)replay.trace;
+  printf("trace:    %llu frames in %.1f s, %llu dropped while recording\n",
+         (unsigned long long)h->records, duration_ns / 1e9, (unsigned long long)h->dropped);
+  printf("skipped:  %llu frames from vmnet, %llu truncated, %llu invalid\n",
+         (unsigned long long)vmnet_frames, (unsigned long long)truncated_frames,
+         (unsigned long long)invalid_frames);
+  if (replay.conn_count == 0) {
+    fprintf(stderr, "No frame from a VM to replay\n");
+    exit(EXIT_FAILURE);
+  }
+  replay.inflight = calloc(INFLIGHT_CAPACITY, sizeof(*replay.inflight));
+  if (replay.inflight == NULL) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t i = 0; i < replay.conn_count; i++) {
+    replay.conns[i].fd = connect_socket(socket_path);
+    if (replay.conns[i].fd < 0)
+      exit(EXIT_FAILURE);
+  }
+  // Announce the addresses so that the daemon does not flood.
+  for (size_t i = 0; i < replay.address_count; i++) {
+    uint8_t frame[60] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    memcpy(frame + 6, replay.addresses[i].mac, 6);
+    frame[12] = ETHERTYPE_ANNOUNCE >> 8;
+    frame[13] = ETHERTYPE_ANNOUNCE & 0xFF;
+    if (write_frame(replay.conns[replay.addresses[i].conn].fd, frame, sizeof(frame)) < 0) {
+      perror("write");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (size_t i = 0; i < replay.conn_count; i++)
+    pthread_create(&replay.conns[i].receiver, NULL, receiver_main, &replay.conns[i]);
+  usleep(200 * 1000);
+
+  replay.start_ns = hist_now();
+  for (size_t i = 0; i < replay.conn_count; i++)
+    pthread_create(&replay.conns[i].sender, NULL, sender_main, &replay.conns[i]);
+  for (size_t i = 0; i < replay.conn_count; i++)
+    pthread_join(replay.conns[i].sender, NULL);
+  double elapsed = (hist_now() - replay.start_ns) / 1e9;
+  // Let the frames in flight arrive.
+  sleep(replay.wait_seconds);
+  for (size_t i = 0; i < replay.conn_count; i++) {
+    shutdown(replay.conns[i].fd, SHUT_RDWR);
+    pthread_join(replay.conns[i].receiver, NULL);
+    close(replay.conns[i].fd);
+  }
+
+  uint64_t sent = 0, sent_bytes = 0, received = 0;
+  for (size_t i = 0; i < replay.conn_count; i++) {
+    sent += replay.conns[i].sent;
+    sent_bytes += replay.conns[i].sent_bytes;
+    received += replay.conns[i].received;
+  }
+  uint64_t expected = atomic_load(&replay.expected), matched = atomic_load(&replay.matched);
+  printf("replayed: %llu frames from %zu connections in %.1f s (%s), %.0f frames/s, "
+         "%.2f Gbits/s\n",
+         (unsigned long long)sent, replay.conn_count, elapsed,
+         replay.fast ? "as fast as possible" : "recorded timing", sent / elapsed,
+         sent_bytes * 8.0 / elapsed / 1e9);
+  printf("received: %llu frames, including floods and the traffic of the host\n",
+         (unsigned long long)received);
+  printf("unicast:  %llu expected, %llu received, %llu dropped, %llu not tracked\n",
+         (unsigned long long)expected, (unsigned long long)matched,
+         (unsigned long long)(expected - matched), (unsigned long long)replay.untracked);
+  print_latency("latency:", &replay.latency);
+  for (size_t i = 0; i < replay.conn_count; i++)
+    free(replay.conns[i].records);
+  free(replay.conns);
+  free(replay.addresses);
+  free(replay.inflight);
+  return expected == matched ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,257 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <netinet/in.h>
+
+#include "arena.h"
+#include "ether.h"
+#include "log.h"
+#include "rss.h"
+
+struct rss_record {
+  uint32_t len;
+  uint32_t reserved;
+  uint64_t read_ns;
+};
+
+struct rss_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_cond_t idle; // signaled when the worker starts waiting
+  bool waiting;        // the worker waits for cond
+  bool pending;        // frames queued since the last rss_flush
+  bool paused;
+  bool stopping;
+  uint8_t *buf; // ring of [struct rss_record][frame]
+  size_t head;
+  size_t len;
+  struct rss_queue_stats stats;
+  struct rss *rss;
+  uint8_t *batch_buf; // RSS_BATCH frames, only touched by the worker
+  pthread_t thread;
+  bool started;
+};
+
+struct rss {
+  size_t max_frame_len;
+  rss_deliver_fn deliver;
+  void *ctx;
+  unsigned queue_count;
+  struct rss_queue queues[RSS_MAX_QUEUES];
+};
+
+static void ring_write(struct rss_queue *q, const void *src, size_t len) {
+  size_t tail = (q->head + q->len) % RSS_QUEUE_BYTES;
+  size_t first = len < RSS_QUEUE_BYTES - tail ? len : RSS_QUEUE_BYTES - tail;
+  memcpy(q->buf + tail, src, first);
+  memcpy(q->buf, (const uint8_t *)src + first, len - first);
+  q->len += len;
+}
+
+static void ring_read(struct rss_queue *q, void *dst, size_t len) {
+  size_t first = len < RSS_QUEUE_BYTES - q->head ? len : RSS_QUEUE_BYTES - q->head;
+  memcpy(dst, q->buf + q->head, first);
+  memcpy((uint8_t *)dst + first, q->buf, len - first);
+  q->head = (q->head + len) % RSS_QUEUE_BYTES;
+  q->len -= len;
+}
+
+static uint32_t load32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Unlike a plain XOR of the words, equal words do not cancel out, e.g., an
+// address and a port made of the same bytes.
+static uint32_t mix(uint32_t h, uint32_t w) {
+  h = (h ^ w) * 0x9E3779B1u; // Fibonacci hashing
+  return h ^ h >> 16;
+}
+
+uint32_t rss_hash(const uint8_t *frame, size_t len) {
+  uint32_t h = 0;
+  size_t off = ETHER_HDR_LEN;
+  uint16_t type = ether_type(frame);
+  if (type == ETHERTYPE_VLAN && len >= ETHER_HDR_LEN + VLAN_TAG_LEN) {
+    type = (uint16_t)(frame[ETHER_HDR_LEN + 2] << 8 | frame[ETHER_HDR_LEN + 3]);
+    off += VLAN_TAG_LEN;
+  }
+  const uint8_t *ip = frame + off;
+  if (type == ETHERTYPE_IP && len >= off + 20) {
+    size_t ihl = (size_t)(ip[0] & 0x0F) * 4;
+    uint8_t proto = ip[9];
+    bool fragment = ((ip[6] & 0x3F) | ip[7]) != 0; // MF, or an offset
+    h = mix(mix(proto, load32(ip + 12)), load32(ip + 16));
+    if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP) && !fragment && ihl >= 20 &&
+        len >= off + ihl + 4)
+      h = mix(h, load32(ip + ihl));
+  } else if (type == ETHERTYPE_IPV6 && len >= off + 40) {
+    uint8_t next = ip[6];
+    h = next;
+    for (size_t i = 8; i < 40; i += 4)
+      h = mix(h, load32(ip + i));
+    if ((next == IPPROTO_TCP || next == IPPROTO_UDP) && len >= off + 44)
+      h = mix(h, load32(ip + 40));
+  } else {
+    h = mix((uint32_t)frame[0] << 8 | frame[1], load32(frame + 2));
+  }
+  return h;
+}
+
+static void *rss_main(void *arg) {
+  struct rss_queue *q = arg;
+  struct rss *r = q->rss;
+  struct rss_record recs[RSS_BATCH];
+  pthread_mutex_lock(&q->lock);
+  while (!q->stopping) {
+    int n = 0;
+    while (!q->paused && q->len > 0 && n < RSS_BATCH) {
+      ring_read(q, &recs[n], sizeof(recs[n]));
+      ring_read(q, q->batch_buf + n * r->max_frame_len, recs[n].len);
+      n++;
+    }
+    if (n == 0) {
+      q->waiting = true;
+      pthread_cond_broadcast(&q->idle);
+      pthread_cond_wait(&q->cond, &q->lock);
+      q->waiting = false;
+      continue;
+    }
+    pthread_mutex_unlock(&q->lock);
+    uint64_t bytes = 0;
+    for (int i = 0; i < n; i++) {
+      r->deliver(r->ctx, q->batch_buf + i * r->max_frame_len, recs[i].len, recs[i].read_ns);
+      bytes += recs[i].len;
+    }
+    pthread_mutex_lock(&q->lock);
+    q->stats.frames += n;
+    q->stats.bytes += bytes;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+struct rss *rss_create(unsigned queue_count, size_t max_frame_len, rss_deliver_fn deliver,
+                       void *ctx) {
+  struct rss *r = calloc(1, sizeof(*r));
+  if (r == NULL) {
+    ERRORN("calloc");
+    return NULL;
+  }
+  r->max_frame_len = max_frame_len;
+  r->deliver = deliver;
+  r->ctx = ctx;
+  for (unsigned i = 0; i < queue_count; i++) {
+    struct rss_queue *q = &r->queues[i];
+    q->rss = r;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    pthread_cond_init(&q->idle, NULL);
+    r->queue_count++;
+    q->buf = arena_alloc(RSS_QUEUE_BYTES);
+    q->batch_buf = arena_alloc(RSS_BATCH * max_frame_len);
+    if (q->buf == NULL || q->batch_buf == NULL)
+      goto err;
+    int ret = pthread_create(&q->thread, NULL, rss_main, q);
+    if (ret != 0) {
+      ERRORF("pthread_create: %s", strerror(ret));
+      goto err;
+    }
+    q->started = true;
+  }
+  return r;
+err:
+  rss_stop(r);
+  return NULL;
+}
+
+void rss_stop(struct rss *r) {
+  for (unsigned i = 0; i < r->queue_count; i++) {
+    struct rss_queue *q = &r->queues[i];
+    if (q->started) {
+      pthread_mutex_lock(&q->lock);
+      q->stopping = true;
+      pthread_cond_signal(&q->cond);
+      pthread_mutex_unlock(&q->lock);
+      pthread_join(q->thread, NULL);
+    }
+    pthread_cond_destroy(&q->cond);
+    pthread_cond_destroy(&q->idle);
+    pthread_mutex_destroy(&q->lock);
+    arena_free(q->buf, RSS_QUEUE_BYTES);
+    arena_free(q->batch_buf, RSS_BATCH * r->max_frame_len);
+  }
+  free(r);
+}
+
+void rss_pause(struct rss *r) {
+  for (unsigned i = 0; i < r->queue_count; i++) {
+    struct rss_queue *q = &r->queues[i];
+    pthread_mutex_lock(&q->lock);
+    if (q->len > 0)
+      pthread_cond_signal(&q->cond);
+    while (q->len > 0 || !q->waiting)
+      pthread_cond_wait(&q->idle, &q->lock);
+    q->paused = true;
+    pthread_mutex_unlock(&q->lock);
+  }
+}
+
+void rss_resume(struct rss *r) {
+  for (unsigned i = 0; i < r->queue_count; i++) {
+    struct rss_queue *q = &r->queues[i];
+    pthread_mutex_lock(&q->lock);
+    q->paused = false;
+    if (q->len > 0)
+      pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+  }
+}
+
+bool rss_enqueue(struct rss *r, const uint8_t *frame, size_t len, uint64_t read_ns) {
+  if (len > r->max_frame_len)
+    return false;
+  // Multiply-shift maps the hash to a queue without a division.
+  struct rss_queue *q = &r->queues[(uint64_t)rss_hash(frame, len) * r->queue_count >> 32];
+  struct rss_record rec = {.len = (uint32_t)len, .read_ns = read_ns};
+  bool ok = false;
+  pthread_mutex_lock(&q->lock);
+  if (q->len + sizeof(rec) + len > RSS_QUEUE_BYTES) {
+    q->stats.dropped++;
+    goto done;
+  }
+  ring_write(q, &rec, sizeof(rec));
+  ring_write(q, frame, len);
+  if (q->len > q->stats.max_len)
+    q->stats.max_len = q->len;
+  q->pending = true;
+  ok = true;
+done:
+  pthread_mutex_unlock(&q->lock);
+  return ok;
+}
+
+void rss_flush(struct rss *r) {
+  for (unsigned i = 0; i < r->queue_count; i++) {
+    struct rss_queue *q = &r->queues[i];
+    pthread_mutex_lock(&q->lock);
+    if (q->pending && q->waiting)
+      pthread_cond_signal(&q->cond);
+    q->pending = false;
+    pthread_mutex_unlock(&q->lock);
+  }
+}
+
+unsigned rss_queue_count(const struct rss *r) { return r->queue_count; }
+
+void rss_queue_stats(struct rss *r, unsigned i, bool reset, struct rss_queue_stats *stats) {
+  struct rss_queue *q = &r->queues[i];
+  pthread_mutex_lock(&q->lock);
+  *stats = q->stats;
+  if (reset)
+    memset(&q->stats, 0, sizeof(q->stats));
+  pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,64 @@
+#ifndef SOCKET_VMNET_RSS_H
+#define SOCKET_VMNET_RSS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Receive side scaling for the frames read from vmnet (--vmnet-rx-queues): the
+// host queue hashes every frame on its flow, and hands it to one of N worker
+// threads, which deliver it to the VMs. The frames of a flow always go to the
+// same worker, so they stay in order, while the flows spread over the cores.
+
+#define RSS_MAX_QUEUES 16
+// Bytes of frames queued per worker; frames beyond are dropped.
+#define RSS_QUEUE_BYTES (512 * 1024)
+// Frames a worker takes per lock
+#define RSS_BATCH 32
+
+// Delivers a frame. Called by the workers, without any lock; frame may be
+// modified. read_ns is the time passed to rss_enqueue.
+typedef void (*rss_deliver_fn)(void *ctx, uint8_t *frame, size_t len, uint64_t read_ns);
+
+struct rss_queue_stats {
+  uint64_t frames; // delivered
+  uint64_t bytes;
+  uint64_t dropped; // the queue was full
+  size_t max_len;   // bytes queued, at most
+};
+
+struct rss;
+
+struct rss *rss_create(unsigned queue_count, size_t max_frame_len, rss_deliver_fn deliver,
+                       void *ctx);
+
+// Stops the workers. The frames still queued are dropped.
+void rss_stop(struct rss *r);
+
+// Delivers the frames queued so far, and returns once every worker is idle.
+// The frames queued afterwards wait for rss_resume. Called by the thread that
+// queues the frames, or while it is suspended.
+void rss_pause(struct rss *r);
+
+void rss_resume(struct rss *r);
+
+// Returns the hash of the flow of frame, tagged or not: the addresses, the
+// protocol, and the ports of TCP and UDP, for IPv4 and IPv6, or the
+// destination address for the other frames. IPv4 fragments are hashed without
+// the ports, which they may not carry.
+uint32_t rss_hash(const uint8_t *frame, size_t len);
+
+// Queues frame for the worker of its flow. The frame is copied. Returns false
+// if the queue is full and the frame was dropped. Called by a single thread.
+bool rss_enqueue(struct rss *r, const uint8_t *frame, size_t len, uint64_t read_ns);
+
+// Wakes the workers of the frames queued since the last call, e.g., after a
+// batch read from vmnet.
+void rss_flush(struct rss *r);
+
+unsigned rss_queue_count(const struct rss *r);
+
+// Reads the counters of queue i, and resets them if reset is true.
+void rss_queue_stats(struct rss *r, unsigned i, bool reset, struct rss_queue_stats *stats);
+
+#endif /* SOCKET_VMNET_RSS_H */
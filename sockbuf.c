@@ -0,0 +1,99 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "sockbuf.h"
+
+static int sockbuf_get(int fd, int opt) {
+  int v = 0;
+  socklen_t len = sizeof(v);
+  if (getsockopt(fd, SOL_SOCKET, opt, &v, &len) < 0)
+    return 0;
+  return v;
+}
+
+// Sets a buffer of fd to size; the kernel may round it. Returns the actual
+// size.
+static int sockbuf_set(int fd, int opt, int size) {
+  if (setsockopt(fd, SOL_SOCKET, opt, &size, sizeof(size)) < 0)
+    DEBUGF("setsockopt(%s, %d) on the socket %d: %s", opt == SO_SNDBUF ? "SO_SNDBUF" : "SO_RCVBUF",
+           size, fd, strerror(errno));
+  return sockbuf_get(fd, opt);
+}
+
+void sockbuf_init(struct sockbuf *sb, int fd, int min) {
+  memset(sb, 0, sizeof(*sb));
+  sb->snd.size = min > 0 ? sockbuf_set(fd, SO_SNDBUF, min) : sockbuf_get(fd, SO_SNDBUF);
+  sb->rcv.size = min > 0 ? sockbuf_set(fd, SO_RCVBUF, min) : sockbuf_get(fd, SO_RCVBUF);
+  sb->snd.initial = sb->snd.size;
+  sb->rcv.initial = sb->rcv.size;
+  sb->snd_empty = sb->snd.size;
+}
+
+static void sockbuf_sample(struct sockbuf_dir *dir, int queued) {
+  dir->queued = queued;
+  if (queued > dir->peak)
+    dir->peak = queued;
+}
+
+// Returns the size the buffer should have, given its last sample.
+static int sockbuf_target(struct sockbuf_dir *dir, bool full, int min, int max) {
+  if (!full && (int64_t)dir->queued * 100 >= (int64_t)dir->size * SOCKBUF_HIGH_PERCENT)
+    full = true;
+  bool low = !full && (int64_t)dir->queued * 100 < (int64_t)dir->size * SOCKBUF_LOW_PERCENT;
+  dir->quiet = low ? dir->quiet + 1 : 0;
+  if (min == 0)
+    min = dir->initial;
+  int size = dir->size;
+  if (full && size < max) {
+    size = size > max / 2 ? max : size * 2;
+  } else if (dir->quiet >= SOCKBUF_SHRINK_SAMPLES && size > min) {
+    size = size / 2 < min ? min : size / 2;
+    dir->quiet = 0;
+  }
+  return size;
+}
+
+static void sockbuf_tune(struct sockbuf *sb, struct sockbuf_dir *dir, int fd, int opt, bool full,
+                         int min, int max) {
+  int size = sockbuf_target(dir, full, min, max);
+  if (size == dir->size)
+    return;
+  DEBUGF("Resizing %s of the socket %d from %d to %d bytes (%d queued)",
+         opt == SO_SNDBUF ? "SO_SNDBUF" : "SO_RCVBUF", fd, dir->size, size, dir->queued);
+  int actual = sockbuf_set(fd, opt, size);
+  // The new size does not count the bytes queued so far.
+  if (opt == SO_SNDBUF)
+    sb->snd_empty = actual + dir->queued;
+  if (actual != dir->size) {
+    dir->size = actual;
+    sb->resizes++;
+  }
+}
+
+// SO_NWRITE stays 0 on a UNIX socket: the bytes written go straight to the
+// receive buffer of the peer, and the kernel takes them off SO_SNDBUF instead
+// until the peer reads them.
+static int sockbuf_snd_queued(struct sockbuf *sb, int fd) {
+  int queued = sb->snd_empty - sockbuf_get(fd, SO_SNDBUF);
+  if (queued < 0) {
+    // The kernel gave back more than it took, e.g., after a resize that it
+    // rounded; this is the new empty size.
+    sb->snd_empty -= queued;
+    queued = 0;
+  }
+  return queued < sb->snd.size ? queued : sb->snd.size;
+}
+
+void sockbuf_update(struct sockbuf *sb, int fd, uint64_t blocked, int min, int max) {
+  sockbuf_sample(&sb->snd, sockbuf_snd_queued(sb, fd));
+  sockbuf_sample(&sb->rcv, sockbuf_get(fd, SO_NREAD));
+  bool snd_full = blocked != sb->blocked;
+  sb->blocked = blocked;
+  if (max == 0)
+    return;
+  sockbuf_tune(sb, &sb->snd, fd, SO_SNDBUF, snd_full, min, max);
+  sockbuf_tune(sb, &sb->rcv, fd, SO_RCVBUF, false, min, max);
+}
@@ -0,0 +1,43 @@
+#ifndef SOCKET_VMNET_SOCKBUF_H
+#define SOCKET_VMNET_SOCKBUF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Kernel buffers of a VM socket: their occupancy, sampled every
+// SOCKBUF_SAMPLE_INTERVAL_MS, and with
+// --socket-buffer-max, their sizes (SO_SNDBUF, SO_RCVBUF) tuned to it. A buffer
+// is doubled as soon as it is found SOCKBUF_HIGH_PERCENT full, or for the send
+// buffer, as soon as a frame did not fit; it is halved once it stayed under
+// SOCKBUF_LOW_PERCENT for SOCKBUF_SHRINK_SAMPLES samples in a row.
+#define SOCKBUF_SAMPLE_INTERVAL_MS 200
+#define SOCKBUF_HIGH_PERCENT 75
+#define SOCKBUF_LOW_PERCENT 25
+#define SOCKBUF_SHRINK_SAMPLES 25 // 5 seconds
+
+struct sockbuf_dir {
+  int size;       // SO_SNDBUF or SO_RCVBUF
+  int initial;    // size after sockbuf_init, the floor without a min
+  int queued;     // bytes, at the last sample
+  int peak;       // bytes, since the stats were reset
+  unsigned quiet; // samples in a row under SOCKBUF_LOW_PERCENT
+};
+
+struct sockbuf {
+  struct sockbuf_dir snd;
+  struct sockbuf_dir rcv;
+  int snd_empty; // SO_SNDBUF with nothing queued, see sockbuf_update
+  uint64_t blocked; // the blocked count of the last sample
+  uint64_t resizes;
+};
+
+// Reads the sizes of the buffers of fd, after setting them to min if it is
+// not 0.
+void sockbuf_init(struct sockbuf *sb, int fd, int min);
+
+// Samples the buffers of fd. blocked counts the times a frame did not fit in
+// the send buffer so far. If max is not 0, resizes the buffers within min (0
+// for the initial size) and max.
+void sockbuf_update(struct sockbuf *sb, int fd, uint64_t blocked, int min, int max);
+
+#endif /* SOCKET_VMNET_SOCKBUF_H */
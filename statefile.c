@@ -0,0 +1,194 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "log.h"
+#include "statefile.h"
+
+#define STATEFILE_MAGIC "SVMSTATE"
+// Bump when the layout below, or fdb_hash or neigh_hash, changes: the slots
+// are restored as they are.
+#define STATEFILE_VERSION 1
+
+#define OWNER_VMNET 1
+#define OWNER_VM 2
+
+struct statefile_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t fdb_capacity;
+  uint32_t neigh_capacity;
+  uint32_t complete; // 0 while a save is in progress
+  int64_t saved_at;  // wall clock, in nanoseconds
+};
+
+struct statefile_fdb_entry {
+  uint8_t mac[6];
+  uint16_t vlan;
+  uint8_t owner; // 0 if the slot is free
+  uint8_t reserved[7];
+};
+
+struct statefile_neigh_entry {
+  uint8_t addr[16];
+  uint8_t mac[6];
+  uint16_t vlan;
+  uint8_t owner; // 0 if the slot is free
+  uint8_t reserved[7];
+  uint64_t age_ns; // when saved
+};
+
+_Static_assert(sizeof(struct statefile_header) == 32, "unexpected padding");
+_Static_assert(sizeof(struct statefile_fdb_entry) == 16, "unexpected padding");
+_Static_assert(sizeof(struct statefile_neigh_entry) == 40, "unexpected padding");
+
+struct statefile_layout {
+  struct statefile_header header;
+  struct statefile_fdb_entry fdb[FDB_CAPACITY];
+  struct statefile_neigh_entry neigh[NEIGH_CAPACITY];
+};
+
+struct statefile {
+  struct statefile_layout *map;
+};
+
+static int64_t wall_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct statefile *statefile_open(const char *path) {
+  int fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    ERRORF("Failed to open state file \"%s\": %s", path, strerror(errno));
+    return NULL;
+  }
+  struct statefile *sf = NULL;
+  if (ftruncate(fd, sizeof(struct statefile_layout)) == -1) {
+    ERRORF("Failed to size state file \"%s\": %s", path, strerror(errno));
+    goto done;
+  }
+  void *map = mmap(NULL, sizeof(struct statefile_layout), PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                   0);
+  if (map == MAP_FAILED) {
+    ERRORN("mmap");
+    goto done;
+  }
+  sf = calloc(1, sizeof(*sf));
+  if (sf == NULL) {
+    ERRORN("calloc");
+    munmap(map, sizeof(struct statefile_layout));
+    goto done;
+  }
+  sf->map = map;
+done:
+  close(fd);
+  return sf;
+}
+
+void statefile_close(struct statefile *sf) {
+  if (sf == NULL)
+    return;
+  msync(sf->map, sizeof(*sf->map), MS_SYNC);
+  munmap(sf->map, sizeof(*sf->map));
+  free(sf);
+}
+
+bool statefile_load(struct statefile *sf, struct fdb *fdb, struct neigh *neigh, void *vmnet_owner,
+                    void *vm_owner, uint64_t now_ns) {
+  const struct statefile_layout *m = sf->map;
+  const struct statefile_header *h = &m->header;
+  if (memcmp(h->magic, STATEFILE_MAGIC, sizeof(h->magic)) != 0)
+    return false;
+  if (h->version != STATEFILE_VERSION || h->fdb_capacity != FDB_CAPACITY ||
+      h->neigh_capacity != NEIGH_CAPACITY || !h->complete) {
+    INFOF("Ignoring the state file: version %u, complete=%u", h->version, h->complete);
+    return false;
+  }
+  for (size_t i = 0; i < FDB_CAPACITY; i++) {
+    const struct statefile_fdb_entry *s = &m->fdb[i];
+    if (s->owner == 0)
+      continue;
+    struct fdb_entry *e = &fdb->entries[i];
+    memcpy(e->mac, s->mac, sizeof(e->mac));
+    e->vlan = s->vlan;
+    e->used = true;
+    e->owner = s->owner == OWNER_VMNET ? vmnet_owner : vm_owner;
+    fdb->count++;
+  }
+
+  int64_t elapsed = wall_now() - h->saved_at;
+  if (elapsed < 0)
+    elapsed = 0;
+  // Removed once the probe sequences are complete, see neigh_forget.
+  static char expired;
+  for (size_t i = 0; i < NEIGH_CAPACITY; i++) {
+    const struct statefile_neigh_entry *s = &m->neigh[i];
+    if (s->owner == 0)
+      continue;
+    struct neigh_entry *e = &neigh->entries[i];
+    uint64_t age = s->age_ns + (uint64_t)elapsed;
+    memcpy(e->addr, s->addr, sizeof(e->addr));
+    memcpy(e->mac, s->mac, sizeof(e->mac));
+    e->vlan = s->vlan;
+    e->used = true;
+    e->owner = s->owner == OWNER_VMNET ? vmnet_owner : vm_owner;
+    e->seen_ns = now_ns > age ? now_ns - age : 0;
+    if (age >= NEIGH_TTL_NS)
+      e->owner = &expired;
+    neigh->count++;
+  }
+  neigh_forget(neigh, &expired);
+  INFOF("Restored %zu MAC addresses and %zu neighbor bindings from the state file", fdb->count,
+        neigh->count);
+  return true;
+}
+
+void statefile_save(struct statefile *sf, const struct fdb *fdb, const struct neigh *neigh,
+                    const void *vmnet_owner, uint64_t now_ns) {
+  struct statefile_layout *m = sf->map;
+  struct statefile_header *h = &m->header;
+  // An exit while saving leaves an incomplete snapshot, which is not loaded.
+  // The pages are shared with the kernel: they are written back even then.
+  h->complete = 0;
+  for (size_t i = 0; i < FDB_CAPACITY; i++) {
+    const struct fdb_entry *e = &fdb->entries[i];
+    struct statefile_fdb_entry *s = &m->fdb[i];
+    if (!e->used) {
+      if (s->owner != 0) // keep the clean pages clean
+        memset(s, 0, sizeof(*s));
+      continue;
+    }
+    memcpy(s->mac, e->mac, sizeof(s->mac));
+    s->vlan = e->vlan;
+    s->owner = e->owner == vmnet_owner ? OWNER_VMNET : OWNER_VM;
+  }
+  for (size_t i = 0; i < NEIGH_CAPACITY; i++) {
+    const struct neigh_entry *e = &neigh->entries[i];
+    struct statefile_neigh_entry *s = &m->neigh[i];
+    if (!e->used) {
+      if (s->owner != 0)
+        memset(s, 0, sizeof(*s));
+      continue;
+    }
+    memcpy(s->addr, e->addr, sizeof(s->addr));
+    memcpy(s->mac, e->mac, sizeof(s->mac));
+    s->vlan = e->vlan;
+    s->owner = e->owner == vmnet_owner ? OWNER_VMNET : OWNER_VM;
+    s->age_ns = now_ns > e->seen_ns ? now_ns - e->seen_ns : 0;
+  }
+  memcpy(h->magic, STATEFILE_MAGIC, sizeof(h->magic));
+  h->version = STATEFILE_VERSION;
+  h->fdb_capacity = FDB_CAPACITY;
+  h->neigh_capacity = NEIGH_CAPACITY;
+  h->saved_at = wall_now();
+  h->complete = 1;
+  msync(m, sizeof(*m), MS_ASYNC);
+}
@@ -0,0 +1,34 @@
+#ifndef SOCKET_VMNET_STATEFILE_H
+#define SOCKET_VMNET_STATEFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fdb.h"
+#include "neigh.h"
+
+// State file: a snapshot of the fdb and of the neighbor table, kept next to
+// the pidfile, so that a restarted socket_vmnet knows the addresses at once
+// instead of flooding until it learns them again. The tables are stored slot
+// for slot in a fixed layout: restoring them is a copy, not a rehash.
+#define STATEFILE_SAVE_INTERVAL_SEC 10
+
+struct statefile;
+
+// Maps path, creating it if needed. Returns NULL on error.
+struct statefile *statefile_open(const char *path);
+
+void statefile_close(struct statefile *sf);
+
+// Restores the saved tables into the empty fdb and neigh: the addresses
+// learned from vmnet behind vmnet_owner, the ones of the VMs behind vm_owner.
+// Expired neighbor bindings are dropped. now_ns is on the clock of neigh
+// (hist_now). Returns false if the file holds no compatible snapshot.
+bool statefile_load(struct statefile *sf, struct fdb *fdb, struct neigh *neigh, void *vmnet_owner,
+                    void *vm_owner, uint64_t now_ns);
+
+// Saves fdb and neigh. Called with the tables locked for reading.
+void statefile_save(struct statefile *sf, const struct fdb *fdb, const struct neigh *neigh,
+                    const void *vmnet_owner, uint64_t now_ns);
+
+#endif /* SOCKET_VMNET_STATEFILE_H */
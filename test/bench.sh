@@ -0,0 +1,231 @@
+#!/bin/bash
+
+set -e
+set -o pipefail
+
+cd "$(dirname "$0")/.."
+
+socket=/var/run/socket_vmnet.bench
+
+# Starts socket_vmnet ($1) on $socket, on a network of its own, with the
+# remaining arguments.
+start_daemon() {
+    local binary=$1
+    shift
+    sudo rm -f "$socket" "$out_dir/socket_vmnet.pid"
+    sudo "$binary" --vmnet-gateway=$gateway --pidfile="$out_dir/socket_vmnet.pid" "$@" \
+        "$socket" >>"$out_dir/socket_vmnet.log" 2>&1 &
+    for _ in $(seq 100); do
+        if [ -S "$socket" ] && [ -s "$out_dir/socket_vmnet.pid" ]; then
+            pid=$(cat "$out_dir/socket_vmnet.pid")
+            return
+        fi
+        sleep 0.1
+    done
+    echo "[bench] $binary did not start, see $out_dir/socket_vmnet.log"
+    exit 1
+}
+
+stop_daemon() {
+    sudo kill $pid
+    while sudo kill -0 $pid 2>/dev/null; do
+        sleep 0.1
+    done
+}
+
+# Runs socket_vmnet_bench with the arguments after $1, saving its output in
+# $out_dir/$1.txt.
+run_bench() {
+    local name=$1
+    shift
+    sudo ./socket_vmnet_bench "$@" "$socket" | tee "$out_dir/$name.txt"
+}
+
+# The binaries to compare: socket_vmnet, and the baseline if set.
+binaries() {
+    echo "current:$socket_vmnet"
+    if [ -n "$baseline" ]; then
+        echo "baseline:$baseline"
+    fi
+}
+
+switching() {
+    for entry in $(binaries); do
+        label=${entry%%:*}
+        start_daemon "${entry#*:}"
+        for count in 1 8 64; do
+            echo "[bench] Running $label with $count connections"
+            run_bench "switching-$label-$count" -c $count -t $time &
+            # The threads of socket_vmnet while the connections are open
+            sleep $((time / 2))
+            threads=$(($(ps -M -p $pid | wc -l) - 1))
+            wait $!
+            echo "threads:  $threads" | tee -a "$out_dir/switching-$label-$count.txt"
+        done
+        stop_daemon
+    done
+    summary switching received threads
+}
+
+# The round trip of pings to the gateway while 3 other connections load the
+# path to vmnet: without the scheduler, with it, and with it and the pings
+# marked EF.
+egress() {
+    for run in "none::0" "scheduler:--egress-scheduler:0" "scheduler-ef:--egress-scheduler:46"; do
+        IFS=: read -r label option dscp <<<"$run"
+        start_daemon "$socket_vmnet" $option
+        for i in 1 2 3; do
+            echo "[bench] Running $label, round $i"
+            run_bench "egress-$label-$i" -g $gateway -c 4 -t $time -d $dscp
+        done
+        stop_daemon
+    done
+    summary egress rtt
+}
+
+# 1000 connections opened at once, as when many VMs start together
+scaling() {
+    for entry in $(binaries); do
+        label=${entry%%:*}
+        start_daemon "${entry#*:}"
+        echo "[bench] Running $label with 1000 connections"
+        run_bench "scaling-$label" -C -c 1000 -p $pid
+        stop_daemon
+    done
+    summary scaling connections accept memory
+}
+
+# The page faults of socket_vmnet forwarding between 8 connections, with the
+# packet buffers allocated on demand, carved from a region, and locked.
+faults() {
+    for run in "on-demand:" "region:--buffer-memory=64M" \
+        "locked:--buffer-memory=64M --buffer-memory-lock"; do
+        label=${run%%:*}
+        start_daemon "$socket_vmnet" ${run#*:}
+        echo "[bench] Running $label"
+        run_bench "faults-$label" -c 8 -t $time -p $pid
+        stop_daemon
+    done
+    summary faults received faults
+}
+
+# The specialized forwarding paths (single, scan and hash, by connection count)
+# against the generic one
+forwarding() {
+    for run in "specialized:" "generic:--generic-forwarding"; do
+        label=${run%%:*}
+        start_daemon "$socket_vmnet" ${run#*:}
+        for count in 1 8 64; do
+            echo "[bench] Running $label with $count connections"
+            run_bench "forwarding-$label-$count" -c $count -t $time
+        done
+        stop_daemon
+    done
+    summary forwarding received
+}
+
+# Frames per second against latency of 128 byte frames, without coalescing,
+# with it, and with its adaptive mode
+coalescing() {
+    for run in "none:" "coalesce:--coalesce=100" "adaptive:--coalesce=100 --coalesce-adaptive"; do
+        label=${run%%:*}
+        start_daemon "$socket_vmnet" ${run#*:}
+        echo "[bench] Running $label"
+        run_bench "coalescing-$label" -c 2 -t $time -s 128 -R 1000,10000,100000,0
+        stop_daemon
+    done
+    echo "[bench] Summary"
+    for result in "$out_dir"/coalescing-*.txt; do
+        echo "$(basename "$result" .txt):"
+        tail -n +2 "$result"
+    done
+}
+
+# Prints the lines starting with the given words of the results of $1.
+summary() {
+    local command=$1
+    shift
+    echo "[bench] Summary"
+    for result in "$out_dir/$command"-*.txt; do
+        for word in "$@"; do
+            echo "$(basename "$result" .txt): $(grep "^$word:" "$result")"
+        done
+    done
+}
+
+usage() {
+    echo "Usage $0 command [options]"
+    echo
+    echo "Commands:"
+    echo "  switching       VM-to-VM throughput with 1, 8 and 64 connections"
+    echo "  egress          latency of pings under load, with and without the egress scheduler"
+    echo "  scaling         accept latency and memory with 1000 connections"
+    echo "  faults          page faults with and without --buffer-memory"
+    echo "  forwarding      throughput of the specialized forwarding paths and the generic one"
+    echo "  coalescing      frames per second against latency, with and without --coalesce"
+    echo
+    echo "Options:"
+    echo "  -s BINARY       socket_vmnet to measure (default ./socket_vmnet)"
+    echo "  -B BINARY       socket_vmnet to compare with, e.g., built from a release"
+    echo "  -t SECONDS      time in seconds to transmit for (default 10)"
+    echo "  -g GATEWAY      gateway of the network of the benchmark (default 192.168.200.1)"
+    echo "  -o OUT_DIR      output directory (default bench.out)"
+}
+
+# Defaults
+socket_vmnet=./socket_vmnet
+baseline=
+time=10
+gateway=192.168.200.1
+out_dir=bench.out
+
+case $1 in
+switching|egress|scaling|faults|forwarding|coalescing)
+    command=$1
+    shift
+    ;;
+*)
+    usage
+    exit 1
+    ;;
+esac
+
+args=$(getopt s:B:t:g:o: $*)
+if [ $? -ne 0 ]; then
+    usage
+    exit 1
+fi
+
+set -- $args
+
+while :; do
+    case $1 in
+    -s)
+        socket_vmnet="$2"
+        shift; shift
+        ;;
+    -B)
+        baseline="$2"
+        shift; shift
+        ;;
+    -t)
+        time=$2
+        shift; shift
+        ;;
+    -g)
+        gateway="$2"
+        shift; shift
+        ;;
+    -o)
+        out_dir="$2"
+        shift; shift
+        ;;
+    --)
+        shift; break;
+        ;;
+    esac
+done
+
+mkdir -p "$out_dir"
+make socket_vmnet_bench >/dev/null
+$command
@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../capture.h"
+#include "../../ether.h"
+#include "test.h"
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+
+static char path[] = "/tmp/socket_vmnet_capture_test.XXXXXX";
+
+// The blocks of a capture file
+static struct {
+  uint8_t *data;
+  size_t len;
+  unsigned interfaces;
+  unsigned packets;
+  const uint32_t *epb[16]; // the first packets
+} file;
+
+static void read_file(void) {
+  free(file.data);
+  memset(&file, 0, sizeof(file));
+  FILE *fp = fopen(path, "rb");
+  CHECK(fp != NULL);
+  file.data = malloc(1024 * 1024);
+  CHECK(file.data != NULL);
+  file.len = fread(file.data, 1, 1024 * 1024, fp);
+  fclose(fp);
+  // Every block starts and ends with its total length, a multiple of 4.
+  for (size_t off = 0; off < file.len;) {
+    const uint32_t *block = (const uint32_t *)(file.data + off);
+    CHECK(off + 12 <= file.len);
+    uint32_t total = block[1];
+    CHECK(total % 4 == 0 && total >= 12 && off + total <= file.len);
+    CHECK(*(const uint32_t *)(file.data + off + total - 4) == total);
+    if (off == 0)
+      CHECK(block[0] == PCAPNG_SHB && block[2] == 0x1A2B3C4D);
+    else if (block[0] == PCAPNG_IDB)
+      file.interfaces++;
+    else if (block[0] == PCAPNG_EPB && file.packets < 16)
+      file.epb[file.packets++] = block;
+    else
+      CHECK(block[0] == PCAPNG_EPB);
+    off += total;
+  }
+}
+
+static void test_parse_options(void) {
+  struct capture_options opts;
+  char *ok[] = {"/tmp/a.pcapng", "snaplen=128", "conn=5", "vlan=10", "ethertype=0x86dd"};
+  CHECK(capture_parse_options(&opts, 5, ok) == 0);
+  CHECK(strcmp(opts.path, "/tmp/a.pcapng") == 0 && opts.snaplen == 128);
+  CHECK(opts.filter.match_conn && opts.filter.conn_fd == 5);
+  CHECK(opts.filter.match_vlan && opts.filter.vlan == 10);
+  CHECK(opts.filter.match_ethertype && opts.filter.ethertype == ETHERTYPE_IPV6);
+  char *vmnet[] = {"/tmp/a.pcapng", "conn=vmnet"};
+  CHECK(capture_parse_options(&opts, 2, vmnet) == 0);
+  CHECK(opts.snaplen == CAPTURE_DEFAULT_SNAPLEN && opts.filter.conn_fd == -1);
+
+  CHECK(capture_parse_options(&opts, 0, NULL) < 0);
+  char *bad[] = {"snaplen=0", "snaplen=1M", "vlan=4095", "conn", "color=red"};
+  for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+    char *argv[] = {"/tmp/a.pcapng", bad[i]};
+    CHECK(capture_parse_options(&opts, 2, argv) < 0);
+  }
+}
+
+static void test_capture(void) {
+  struct capture_stats stats;
+  CHECK(capture_stop(&stats) < 0);
+  struct capture_options opts = {.path = path, .snaplen = 100};
+  CHECK(capture_start(&opts) == 0);
+  CHECK(capture_start(&opts) < 0);
+  uint8_t frame[200];
+  for (size_t i = 0; i < sizeof(frame); i++)
+    frame[i] = (uint8_t)i;
+  capture_frame(CAPTURE_SOURCE_VMNET, -1, VLAN_NONE, frame, 60);
+  capture_frame(7, 5, VLAN_NONE, frame, 200);
+  capture_frame(CAPTURE_SOURCE_VMNET, -1, VLAN_NONE, frame, 61);
+  CHECK(capture_stop(&stats) == 0);
+  CHECK(stats.captured == 3 && stats.dropped == 0);
+  // Not captured anymore
+  capture_frame(CAPTURE_SOURCE_VMNET, -1, VLAN_NONE, frame, 60);
+
+  read_file();
+  CHECK(file.interfaces == 2 && file.packets == 3);
+  // interface, timestamp (2), caplen, len, data
+  CHECK(file.epb[0][2] == 0 && file.epb[0][5] == 60 && file.epb[0][6] == 60);
+  CHECK(file.epb[1][2] == 1 && file.epb[1][5] == 100 && file.epb[1][6] == 200);
+  CHECK(file.epb[2][2] == 0 && file.epb[2][5] == 61 && file.epb[2][6] == 61);
+  CHECK(memcmp(file.epb[1] + 7, frame, 100) == 0);
+  CHECK(memcmp(file.epb[2] + 7, frame, 61) == 0);
+}
+
+static void test_filter(void) {
+  uint8_t ipv4[60] = {[12] = 0x08, [13] = 0x00};
+  uint8_t tagged_ipv6[64] = {[12] = 0x81, [13] = 0x00, [15] = 10, [16] = 0x86, [17] = 0xDD};
+  struct capture_options opts = {
+      .path = path,
+      .snaplen = 100,
+      .filter = {.match_ethertype = true, .ethertype = ETHERTYPE_IPV6},
+  };
+  struct capture_stats stats;
+  CHECK(capture_start(&opts) == 0);
+  capture_frame(7, 5, VLAN_NONE, ipv4, sizeof(ipv4));
+  capture_frame(8, 6, 10, tagged_ipv6, sizeof(tagged_ipv6));
+  capture_frame(8, 6, 10, tagged_ipv6, 10); // too short to match
+  CHECK(capture_stop(&stats) == 0);
+  CHECK(stats.captured == 1);
+  read_file();
+  CHECK(file.interfaces == 1 && file.packets == 1 && file.epb[0][6] == sizeof(tagged_ipv6));
+
+  opts.filter = (struct capture_filter){.match_conn = true, .conn_fd = 5};
+  CHECK(capture_start(&opts) == 0);
+  capture_frame(7, 5, VLAN_NONE, ipv4, sizeof(ipv4));
+  capture_frame(8, 6, 10, tagged_ipv6, sizeof(tagged_ipv6));
+  capture_frame(CAPTURE_SOURCE_VMNET, -1, VLAN_NONE, ipv4, sizeof(ipv4));
+  CHECK(capture_stop(&stats) == 0);
+  CHECK(stats.captured == 1);
+}
+
+int main(void) {
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  close(fd);
+  RUN(test_parse_options);
+  RUN(test_capture);
+  RUN(test_filter);
+  unlink(path);
+  free(file.data);
+  return 0;
+}
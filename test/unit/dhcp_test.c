@@ -0,0 +1,261 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+
+#include "../../dhcp.h"
+#include "../../ether.h"
+#include "test.h"
+
+#define DISCOVER 1
+#define OFFER 2
+#define REQUEST 3
+#define ACK 5
+#define NAK 6
+#define RELEASE 7
+
+#define BOOTP_OFF (14 + 20 + 8)
+#define CLIENT_LEN (BOOTP_OFF + 300)
+
+static struct dhcp_pool pool;
+
+static uint32_t ip(const char *s) {
+  struct in_addr a;
+  CHECK(inet_aton(s, &a) == 1);
+  return ntohl(a.s_addr);
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)(v >> 24);
+  p[1] = (uint8_t)(v >> 16);
+  p[2] = (uint8_t)(v >> 8);
+  p[3] = (uint8_t)v;
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// Writes a broadcast message of type from the client n, and returns its
+// length. requested, server_id and ciaddr are omitted when 0.
+static size_t client_message(uint8_t *frame, uint8_t type, uint8_t n, uint32_t requested,
+                             uint32_t server_id, uint32_t ciaddr) {
+  const uint8_t mac[6] = {0x52, 0x55, 0, 0, 0, n};
+  memset(frame, 0, CLIENT_LEN);
+  memset(frame, 0xFF, 6);
+  memcpy(frame + 6, mac, 6);
+  frame[12] = ETHERTYPE_IP >> 8;
+  uint8_t *ipv4 = frame + 14;
+  ipv4[0] = 0x45;
+  ipv4[2] = (20 + 8 + 300) >> 8;
+  ipv4[3] = (20 + 8 + 300) & 0xFF;
+  ipv4[8] = 64;
+  ipv4[9] = IPPROTO_UDP;
+  put32(ipv4 + 16, INADDR_BROADCAST);
+  uint8_t *udp = ipv4 + 20;
+  udp[1] = 68;
+  udp[3] = 67;
+  udp[4] = (8 + 300) >> 8;
+  udp[5] = (8 + 300) & 0xFF;
+  uint8_t *bootp = udp + 8;
+  bootp[0] = 1; // request
+  bootp[1] = 1; // Ethernet
+  bootp[2] = 6;
+  put32(bootp + 4, 0x1234u + n); // xid
+  put32(bootp + 12, ciaddr);
+  memcpy(bootp + 28, mac, 6);
+  const uint8_t cookie[4] = {99, 130, 83, 99};
+  memcpy(bootp + 236, cookie, 4);
+  uint8_t *opt = bootp + 240;
+  *opt++ = 53;
+  *opt++ = 1;
+  *opt++ = type;
+  if (requested != 0) {
+    *opt++ = 50;
+    *opt++ = 4;
+    put32(opt, requested);
+    opt += 4;
+  }
+  if (server_id != 0) {
+    *opt++ = 54;
+    *opt++ = 4;
+    put32(opt, server_id);
+    opt += 4;
+  }
+  *opt = 255;
+  return CLIENT_LEN;
+}
+
+// Returns the value of option code in a reply, or NULL.
+static const uint8_t *reply_option(const uint8_t *reply, uint8_t code) {
+  const uint8_t *bootp = reply + BOOTP_OFF;
+  for (size_t off = 240; off + 2 <= 300 && bootp[off] != 255; off += 2 + bootp[off + 1]) {
+    if (bootp[off] == code)
+      return bootp + off + 2;
+  }
+  return NULL;
+}
+
+static uint8_t reply_type(const uint8_t *reply) {
+  const uint8_t *type = reply_option(reply, 53);
+  CHECK(type != NULL);
+  return type[0];
+}
+
+static uint32_t yiaddr(const uint8_t *reply) { return get32(reply + BOOTP_OFF + 16); }
+
+static bool ip_checksum_ok(const uint8_t *reply) {
+  uint32_t sum = 0;
+  for (size_t i = 0; i < 20; i += 2)
+    sum += (uint32_t)(reply[14 + i] << 8 | reply[14 + i + 1]);
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return sum == 0xFFFF;
+}
+
+// Runs DISCOVER and REQUEST for client n, and returns the address it got, or
+// 0.
+static uint32_t lease(struct dhcp *d, uint8_t n) {
+  uint8_t frame[CLIENT_LEN], reply[DHCP_REPLY_LEN];
+  size_t len = client_message(frame, DISCOVER, n, 0, 0, 0);
+  if (dhcp_handle(d, frame, len, reply) == 0)
+    return 0;
+  CHECK(reply_type(reply) == OFFER);
+  uint32_t offered = yiaddr(reply);
+  len = client_message(frame, REQUEST, n, offered, ip("192.168.105.1"), 0);
+  CHECK(dhcp_handle(d, frame, len, reply) == DHCP_REPLY_LEN);
+  CHECK(reply_type(reply) == ACK);
+  CHECK(yiaddr(reply) == offered);
+  return offered;
+}
+
+static void test_dora(void) {
+  struct dhcp *d = dhcp_open(&pool, NULL);
+  CHECK(d != NULL);
+  uint8_t frame[CLIENT_LEN], reply[DHCP_REPLY_LEN];
+  size_t len = client_message(frame, DISCOVER, 1, 0, 0, 0);
+  CHECK(dhcp_is_client_message(frame, len));
+  CHECK(dhcp_handle(d, frame, len, reply) == DHCP_REPLY_LEN);
+  CHECK(reply_type(reply) == OFFER);
+  CHECK(yiaddr(reply) == ip("192.168.105.2"));
+  CHECK(ip_checksum_ok(reply));
+  CHECK(get32(reply_option(reply, 54)) == ip("192.168.105.1"));
+  CHECK(get32(reply_option(reply, 1)) == ip("255.255.255.0"));
+  CHECK(get32(reply_option(reply, 3)) == ip("192.168.105.1"));
+  CHECK(get32(reply_option(reply, 51)) == DHCP_LEASE_SECONDS);
+  // Offered again to the same client
+  CHECK(dhcp_handle(d, frame, len, reply) == DHCP_REPLY_LEN);
+  CHECK(yiaddr(reply) == ip("192.168.105.2"));
+
+  len = client_message(frame, REQUEST, 1, ip("192.168.105.2"), ip("192.168.105.1"), 0);
+  CHECK(dhcp_handle(d, frame, len, reply) == DHCP_REPLY_LEN);
+  CHECK(reply_type(reply) == ACK);
+  CHECK(yiaddr(reply) == ip("192.168.105.2"));
+  // Selecting another server
+  len = client_message(frame, REQUEST, 1, ip("192.168.105.2"), ip("192.168.105.254"), 0);
+  CHECK(dhcp_handle(d, frame, len, reply) == 0);
+  // Another client asking for the same address
+  len = client_message(frame, REQUEST, 2, ip("192.168.105.2"), 0, 0);
+  CHECK(dhcp_handle(d, frame, len, reply) == DHCP_REPLY_LEN);
+  CHECK(reply_type(reply) == NAK);
+  CHECK(get32(reply + 14 + 16) == INADDR_BROADCAST);
+
+  struct dhcp_stats stats;
+  dhcp_get_stats(d, true, &stats);
+  CHECK(stats.discovers == 2 && stats.requests == 3 && stats.acks == 1 && stats.naks == 1);
+  CHECK(stats.bound == 1);
+  dhcp_get_stats(d, false, &stats);
+  CHECK(stats.discovers == 0 && stats.bound == 1);
+  dhcp_close(d);
+}
+
+static void test_exhausted(void) {
+  struct dhcp *d = dhcp_open(&pool, NULL);
+  CHECK(d != NULL);
+  CHECK(lease(d, 1) == ip("192.168.105.2"));
+  CHECK(lease(d, 2) == ip("192.168.105.3"));
+  CHECK(lease(d, 3) == ip("192.168.105.4"));
+  CHECK(lease(d, 4) == 0);
+  // A released address is kept for its client, and given away last.
+  uint8_t frame[CLIENT_LEN], reply[DHCP_REPLY_LEN];
+  size_t len = client_message(frame, RELEASE, 2, 0, ip("192.168.105.1"), ip("192.168.105.3"));
+  CHECK(dhcp_handle(d, frame, len, reply) == 0);
+  CHECK(lease(d, 2) == ip("192.168.105.3"));
+  CHECK(dhcp_handle(d, frame, len, reply) == 0);
+  CHECK(lease(d, 4) == ip("192.168.105.3"));
+  dhcp_close(d);
+}
+
+// The leases survive a restart, unless the pool changed.
+static void test_persistence(void) {
+  char path[] = "/tmp/socket_vmnet_dhcp_test.XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  close(fd);
+  struct dhcp *d = dhcp_open(&pool, path);
+  CHECK(d != NULL);
+  CHECK(lease(d, 1) == ip("192.168.105.2"));
+  CHECK(lease(d, 2) == ip("192.168.105.3"));
+  dhcp_close(d);
+
+  d = dhcp_open(&pool, path);
+  CHECK(d != NULL);
+  struct dhcp_stats stats;
+  dhcp_get_stats(d, false, &stats);
+  CHECK(stats.bound == 2);
+  CHECK(lease(d, 2) == ip("192.168.105.3"));
+  CHECK(lease(d, 3) == ip("192.168.105.4"));
+  dhcp_close(d);
+
+  struct dhcp_pool other = pool;
+  other.last.s_addr = htonl(ip("192.168.105.10"));
+  d = dhcp_open(&other, path);
+  CHECK(d != NULL);
+  dhcp_get_stats(d, false, &stats);
+  CHECK(stats.bound == 0);
+  CHECK(lease(d, 3) == ip("192.168.105.2"));
+  dhcp_close(d);
+  unlink(path);
+}
+
+static void test_malformed(void) {
+  struct dhcp *d = dhcp_open(&pool, NULL);
+  CHECK(d != NULL);
+  uint8_t frame[CLIENT_LEN], reply[DHCP_REPLY_LEN];
+  size_t len = client_message(frame, DISCOVER, 1, 0, 0, 0);
+  for (size_t n = 0; n < BOOTP_OFF + 240; n++) {
+    CHECK(!dhcp_is_client_message(frame, n));
+    CHECK(dhcp_handle(d, frame, n, reply) == 0);
+  }
+  // An option overrunning the message
+  frame[BOOTP_OFF + 243] = 50;
+  frame[BOOTP_OFF + 244] = 255;
+  CHECK(dhcp_handle(d, frame, len, reply) == 0);
+  // A fragment
+  client_message(frame, DISCOVER, 1, 0, 0, 0);
+  frame[14 + 6] = 0x20;
+  CHECK(!dhcp_is_client_message(frame, len));
+  // To a client
+  client_message(frame, DISCOVER, 1, 0, 0, 0);
+  frame[14 + 20 + 3] = 68;
+  CHECK(!dhcp_is_client_message(frame, len));
+  // Plain BOOTP
+  client_message(frame, DISCOVER, 1, 0, 0, 0);
+  frame[BOOTP_OFF + 240] = 255;
+  CHECK(dhcp_is_client_message(frame, len));
+  CHECK(dhcp_handle(d, frame, len, reply) == 0);
+  dhcp_close(d);
+}
+
+int main(void) {
+  pool.server.s_addr = htonl(ip("192.168.105.1"));
+  pool.first.s_addr = htonl(ip("192.168.105.2"));
+  pool.last.s_addr = htonl(ip("192.168.105.4"));
+  pool.mask.s_addr = htonl(ip("255.255.255.0"));
+  RUN(test_dora);
+  RUN(test_exhausted);
+  RUN(test_persistence);
+  RUN(test_malformed);
+  return 0;
+}
@@ -0,0 +1,45 @@
+#include <string.h>
+
+#include "../../fault.h"
+#include "test.h"
+
+static void test_init(void) {
+  memset(fault_rates, 0, sizeof(fault_rates));
+  CHECK(fault_init("vmnet_write:20,vmnet_runt:0.5") == 0);
+  CHECK(fault_rates[FAULT_VMNET_READ] == 0);
+  CHECK(fault_rates[FAULT_VMNET_WRITE] == 200000);
+  CHECK(fault_rates[FAULT_VMNET_RUNT] == 5000);
+  CHECK(fault_init("vmnet_read:100") == 0);
+  CHECK(fault_rates[FAULT_VMNET_READ] == 1000000);
+  CHECK(fault_init("") == 0);
+
+  CHECK(fault_init("vmnet_read") < 0);
+  CHECK(fault_init("vmnet_read:") < 0);
+  CHECK(fault_init("vmnet_read:5%") < 0);
+  CHECK(fault_init("vmnet_read:101") < 0);
+  CHECK(fault_init("vmnet_read:-1") < 0);
+  CHECK(fault_init("vmnet_read:nan") < 0);
+  CHECK(fault_init("vmnet_close:1") < 0);
+  memset(fault_rates, 0, sizeof(fault_rates));
+}
+
+static void test_inject(void) {
+  memset(fault_rates, 0, sizeof(fault_rates));
+  CHECK(fault_init("vmnet_read:100,vmnet_write:50") == 0);
+  int failed = 0;
+  for (int i = 0; i < 10000; i++) {
+    CHECK(fault_inject(FAULT_VMNET_READ));
+    CHECK(!fault_inject(FAULT_VMNET_RUNT));
+    if (fault_inject(FAULT_VMNET_WRITE))
+      failed++;
+  }
+  // 5000 expected; the standard deviation is 50.
+  CHECK(failed > 4500 && failed < 5500);
+  memset(fault_rates, 0, sizeof(fault_rates));
+}
+
+int main(void) {
+  RUN(test_init);
+  RUN(test_inject);
+  return 0;
+}
@@ -0,0 +1,86 @@
+#include <string.h>
+
+#include "../../fdb.h"
+#include "test.h"
+
+static struct fdb fdb;
+static char vm1, vm2;
+
+static void mac_of(uint32_t i, uint8_t mac[6]) {
+  const uint8_t m[6] = {0x52, 0x55, (uint8_t)(i >> 24), (uint8_t)(i >> 16), (uint8_t)(i >> 8),
+                        (uint8_t)i};
+  memcpy(mac, m, 6);
+}
+
+static void test_learn(void) {
+  memset(&fdb, 0, sizeof(fdb));
+  uint8_t mac[6];
+  mac_of(1, mac);
+  CHECK(fdb_lookup(&fdb, 0, mac) == NULL);
+  CHECK(fdb_learn(&fdb, 0, mac, &vm1));
+  CHECK(fdb_lookup(&fdb, 0, mac) == &vm1);
+  // The same address on another VLAN is another entry.
+  CHECK(fdb_lookup(&fdb, 10, mac) == NULL);
+  CHECK(fdb_learn(&fdb, 10, mac, &vm2));
+  CHECK(fdb_lookup(&fdb, 0, mac) == &vm1);
+  CHECK(fdb_lookup(&fdb, 10, mac) == &vm2);
+  // The address moved.
+  CHECK(fdb_learn(&fdb, 0, mac, &vm2));
+  CHECK(fdb_lookup(&fdb, 0, mac) == &vm2);
+  CHECK(fdb.count == 2);
+}
+
+static void test_multicast(void) {
+  memset(&fdb, 0, sizeof(fdb));
+  const uint8_t mac[6] = {0x01, 0x00, 0x5E, 0x00, 0x00, 0xFB};
+  CHECK(fdb_learn(&fdb, 0, mac, &vm1));
+  CHECK(fdb_lookup(&fdb, 0, mac) == NULL);
+  CHECK(fdb.count == 0);
+}
+
+static void test_full(void) {
+  memset(&fdb, 0, sizeof(fdb));
+  uint8_t mac[6];
+  uint32_t learned = 0;
+  for (uint32_t i = 0; i < FDB_CAPACITY; i++) {
+    mac_of(i, mac);
+    if (fdb_learn(&fdb, 0, mac, &vm1))
+      learned++;
+  }
+  CHECK(learned == FDB_CAPACITY / 4 * 3);
+  CHECK(fdb.count == learned);
+  // Known addresses can still move.
+  mac_of(0, mac);
+  CHECK(fdb_learn(&fdb, 0, mac, &vm2));
+  CHECK(fdb_lookup(&fdb, 0, mac) == &vm2);
+}
+
+// Removing entries shifts the others back into their probe sequence; none of
+// them may get lost.
+static void test_forget(void) {
+  memset(&fdb, 0, sizeof(fdb));
+  uint8_t mac[6];
+  const uint32_t n = FDB_CAPACITY / 4 * 3;
+  for (uint32_t i = 0; i < n; i++) {
+    mac_of(i, mac);
+    CHECK(fdb_learn(&fdb, 0, mac, i % 3 == 0 ? &vm1 : &vm2));
+  }
+  fdb_forget(&fdb, &vm1);
+  for (uint32_t i = 0; i < n; i++) {
+    mac_of(i, mac);
+    CHECK(fdb_lookup(&fdb, 0, mac) == (i % 3 == 0 ? NULL : &vm2));
+  }
+  CHECK(fdb.count == n - (n + 2) / 3);
+  fdb_forget(&fdb, &vm2);
+  CHECK(fdb.count == 0);
+  for (size_t i = 0; i < FDB_CAPACITY; i++)
+    CHECK(!fdb.entries[i].used);
+}
+
+int main(void) {
+  RUN(test_learn);
+  RUN(test_multicast);
+  RUN(test_full);
+  RUN(test_forget);
+  return 0;
+}
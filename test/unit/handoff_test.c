@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../../handoff.h"
+#include "test.h"
+
+// More connections than fit in one SCM_RIGHTS message
+#define CONN_COUNT 70
+
+// Returns true if fd and peer are the two ends of a socket pair.
+static bool connected(int fd, int peer) {
+  char c = 'x';
+  return write(fd, &c, 1) == 1 && read(peer, &c, 1) == 1 && c == 'x';
+}
+
+static void test_round_trip(void) {
+  int listener[2], conns[CONN_COUNT][2];
+  CHECK(socketpair(PF_LOCAL, SOCK_STREAM, 0, listener) == 0);
+  struct handoff_listener listeners[] = {{.fd = listener[0], .vlan = 10}};
+  struct handoff_conn hconns[CONN_COUNT];
+  memset(hconns, 0, sizeof(hconns));
+  uint8_t rx[] = {1, 2, 3}, tx[] = {4, 5, 6, 7};
+  for (int i = 0; i < CONN_COUNT; i++) {
+    CHECK(socketpair(PF_LOCAL, SOCK_STREAM, 0, conns[i]) == 0);
+    hconns[i].fd = conns[i][0];
+    hconns[i].vlan = (uint16_t)i;
+  }
+  hconns[1].rx = rx;
+  hconns[1].rx_len = sizeof(rx);
+  hconns[2].tx = tx;
+  hconns[2].tx_len = sizeof(tx);
+  struct handoff_fdb_entry fdb[] = {
+      {.mac = {0x52, 0x55, 0, 0, 0, 1}, .vlan = 0, .conn = 1},
+      {.mac = {0x52, 0x55, 0, 0, 0, 2}, .vlan = 0, .conn = HANDOFF_CONN_HOST},
+  };
+  struct handoff_neigh_entry neigh[] = {
+      {.addr = {[10] = 0xFF, [11] = 0xFF, 192, 168, 105, 2},
+       .mac = {0x52, 0x55, 0, 0, 0, 1},
+       .conn = 1,
+       .age_ns = 42},
+  };
+  struct handoff h = {
+      .vmnet_interface_id = {0xAB, [15] = 0xCD},
+      .listeners = listeners,
+      .listener_count = 1,
+      .conns = hconns,
+      .conn_count = CONN_COUNT,
+      .fdb = fdb,
+      .fdb_count = 2,
+      .neigh = neigh,
+      .neigh_count = 1,
+  };
+
+  int sv[2];
+  CHECK(handoff_socketpair(sv, &h) == 0);
+  CHECK(handoff_send(sv[0], &h) == 0);
+  close(sv[0]);
+  struct handoff r;
+  CHECK(handoff_recv(sv[1], &r) == 0);
+  close(sv[1]);
+
+  CHECK(memcmp(r.vmnet_interface_id, h.vmnet_interface_id, sizeof(uuid_t)) == 0);
+  CHECK(r.listener_count == 1);
+  CHECK(r.listeners[0].vlan == 10);
+  CHECK(connected(r.listeners[0].fd, listener[1]));
+  CHECK(r.conn_count == CONN_COUNT);
+  for (int i = 0; i < CONN_COUNT; i++) {
+    CHECK(r.conns[i].vlan == i);
+    CHECK(connected(r.conns[i].fd, conns[i][1]));
+  }
+  CHECK(r.conns[1].rx_len == sizeof(rx) && memcmp(r.conns[1].rx, rx, sizeof(rx)) == 0);
+  CHECK(r.conns[1].tx_len == 0);
+  CHECK(r.conns[2].tx_len == sizeof(tx) && memcmp(r.conns[2].tx, tx, sizeof(tx)) == 0);
+  CHECK(r.fdb_count == 2 && memcmp(r.fdb, fdb, sizeof(fdb)) == 0);
+  CHECK(r.neigh_count == 1 && memcmp(r.neigh, neigh, sizeof(neigh)) == 0);
+
+  close(r.listeners[0].fd);
+  close(listener[0]);
+  close(listener[1]);
+  for (int i = 0; i < CONN_COUNT; i++) {
+    close(r.conns[i].fd);
+    close(conns[i][0]);
+    close(conns[i][1]);
+  }
+  handoff_free(&r);
+}
+
+// Busy VMs queue far more than a socket buffer can hold.
+static void test_large_queues(void) {
+  enum { COUNT = 64, RX_LEN = 16 * 1024, TX_LEN = 256 * 1024 };
+  int conns[COUNT][2];
+  struct handoff_conn hconns[COUNT];
+  memset(hconns, 0, sizeof(hconns));
+  uint8_t *rx = malloc(RX_LEN), *tx = malloc(TX_LEN);
+  CHECK(rx != NULL && tx != NULL);
+  for (int i = 0; i < TX_LEN; i++)
+    tx[i] = (uint8_t)(i * 7);
+  for (int i = 0; i < RX_LEN; i++)
+    rx[i] = (uint8_t)(i * 13);
+  for (int i = 0; i < COUNT; i++) {
+    CHECK(socketpair(PF_LOCAL, SOCK_STREAM, 0, conns[i]) == 0);
+    hconns[i].fd = conns[i][0];
+    hconns[i].rx = rx;
+    hconns[i].rx_len = RX_LEN;
+    hconns[i].tx = tx;
+    hconns[i].tx_len = TX_LEN;
+  }
+  struct handoff h = {.conns = hconns, .conn_count = COUNT};
+
+  int sv[2];
+  CHECK(handoff_socketpair(sv, &h) == 0);
+  CHECK(handoff_send(sv[0], &h) == 0);
+  close(sv[0]);
+  struct handoff r;
+  CHECK(handoff_recv(sv[1], &r) == 0);
+  close(sv[1]);
+
+  CHECK(r.conn_count == COUNT);
+  for (int i = 0; i < COUNT; i++) {
+    CHECK(r.conns[i].rx_len == RX_LEN && memcmp(r.conns[i].rx, rx, RX_LEN) == 0);
+    CHECK(r.conns[i].tx_len == TX_LEN && memcmp(r.conns[i].tx, tx, TX_LEN) == 0);
+    CHECK(connected(r.conns[i].fd, conns[i][1]));
+    close(r.conns[i].fd);
+    close(conns[i][0]);
+    close(conns[i][1]);
+  }
+  handoff_free(&r);
+  free(rx);
+  free(tx);
+}
+
+// An entry that refers to a connection that was not handed off is rejected.
+static void test_unknown_conn(void) {
+  int conn[2];
+  CHECK(socketpair(PF_LOCAL, SOCK_STREAM, 0, conn) == 0);
+  struct handoff_conn hconns[] = {{.fd = conn[0]}};
+  struct handoff_fdb_entry fdb[] = {{.mac = {0x52, 0x55, 0, 0, 0, 1}, .conn = 1}};
+  struct handoff h = {.conns = hconns, .conn_count = 1, .fdb = fdb, .fdb_count = 1};
+  int sv[2];
+  CHECK(handoff_socketpair(sv, &h) == 0);
+  CHECK(handoff_send(sv[0], &h) == 0);
+  close(sv[0]);
+  struct handoff r;
+  CHECK(handoff_recv(sv[1], &r) < 0);
+  CHECK(r.conns == NULL && r.conn_count == 0);
+  close(sv[1]);
+  close(conn[0]);
+  close(conn[1]);
+}
+
+// A truncated state, e.g., from a process that died while sending it
+static void test_truncated(void) {
+  int sv[2];
+  CHECK(socketpair(PF_LOCAL, SOCK_STREAM, 0, sv) == 0);
+  uint32_t magic = 0x56534f43;
+  CHECK(write(sv[0], &magic, sizeof(magic)) == sizeof(magic));
+  close(sv[0]);
+  struct handoff r;
+  CHECK(handoff_recv(sv[1], &r) < 0);
+  close(sv[1]);
+}
+
+int main(void) {
+  RUN(test_round_trip);
+  RUN(test_large_queues);
+  RUN(test_unknown_conn);
+  RUN(test_truncated);
+  return 0;
+}
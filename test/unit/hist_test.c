@@ -0,0 +1,59 @@
+#include <string.h>
+
+#include "../../hist.h"
+#include "test.h"
+
+static struct hist hist;
+
+static void test_bucket(void) {
+  for (uint64_t v = 0; v < (1 << HIST_SUB_BITS); v++)
+    CHECK(hist_bucket(v) == v);
+  unsigned prev = 0;
+  for (uint64_t v = 1; v < (1ULL << HIST_MAX_BITS); v += v / 7 + 1) {
+    unsigned b = hist_bucket(v);
+    CHECK(b >= prev && b < HIST_BUCKETS);
+    prev = b;
+  }
+  // Every bucket holds values within 1/2^HIST_SUB_BITS of each other.
+  for (unsigned shift = 0; shift < HIST_MAX_BITS - HIST_SUB_BITS; shift++) {
+    uint64_t low = 1ULL << (shift + HIST_SUB_BITS);
+    CHECK(hist_bucket(low) != hist_bucket(low - 1));
+    CHECK(hist_bucket(low + (1ULL << shift) - 1) == hist_bucket(low));
+    CHECK(hist_bucket(low + (1ULL << shift)) == hist_bucket(low) + 1);
+  }
+  CHECK(hist_bucket(1ULL << HIST_MAX_BITS) == HIST_BUCKETS - 1);
+  CHECK(hist_bucket(UINT64_MAX) == HIST_BUCKETS - 1);
+}
+
+static void test_summarize(void) {
+  hist_reset(&hist);
+  struct hist_summary s;
+  hist_summarize(&hist, &s);
+  CHECK(s.count == 0 && s.p50 == 0 && s.p999 == 0 && s.max == 0);
+
+  for (uint64_t v = 1; v <= 10000; v++)
+    hist_record(&hist, v * 1000);
+  hist_summarize(&hist, &s);
+  CHECK(s.count == 10000);
+  CHECK(s.max == 10000000);
+  // Never underestimated, and off by 1/2^HIST_SUB_BITS at most
+  CHECK(s.p50 >= 5000000 && s.p50 <= 5000000 + 5000000 / 8);
+  CHECK(s.p90 >= 9000000 && s.p90 <= 9000000 + 9000000 / 8);
+  CHECK(s.p99 >= 9900000 && s.p99 <= s.max);
+  CHECK(s.p999 >= 9990000 && s.p999 <= s.max);
+
+  hist_reset(&hist);
+  hist_record(&hist, 42);
+  hist_summarize(&hist, &s);
+  CHECK(s.count == 1 && s.p50 == 42 && s.p999 == 42 && s.max == 42);
+  // Clamped into the last bucket, but the maximum is exact
+  hist_record(&hist, 1ULL << 40);
+  hist_summarize(&hist, &s);
+  CHECK(s.count == 2 && s.p999 == 1ULL << 40 && s.max == 1ULL << 40);
+}
+
+int main(void) {
+  RUN(test_bucket);
+  RUN(test_summarize);
+  return 0;
+}
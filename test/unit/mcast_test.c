@@ -0,0 +1,225 @@
+#include <string.h>
+
+#include <netinet/in.h>
+
+#include "../../ether.h"
+#include "../../mcast.h"
+#include "test.h"
+
+static struct mcast mcast;
+static char vm1, vm2;
+
+static const uint8_t group1_mac[6] = {0x01, 0x00, 0x5E, 0x01, 0x02, 0x03}; // 239.1.2.3
+static const uint8_t group2_mac[6] = {0x33, 0x33, 0x00, 0x01, 0x00, 0x03}; // ff05::1:3
+
+static uint16_t checksum(uint32_t sum, const uint8_t *p, size_t len) {
+  for (size_t i = 0; i + 1 < len; i += 2)
+    sum += (uint32_t)(p[i] << 8 | p[i + 1]);
+  if (len % 2 != 0)
+    sum += (uint32_t)(p[len - 1] << 8);
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return (uint16_t)~sum;
+}
+
+// Writes the headers of an IGMP message of igmp_len bytes, and returns the
+// IGMP message.
+static uint8_t *igmp_frame(uint8_t *frame, size_t igmp_len) {
+  memset(frame, 0, 14 + 24 + igmp_len);
+  frame[12] = ETHERTYPE_IP >> 8;
+  uint8_t *ip = frame + 14;
+  ip[0] = 0x46; // with Router Alert
+  ip[3] = (uint8_t)(24 + igmp_len);
+  ip[8] = 1;
+  ip[9] = IPPROTO_IGMP;
+  return ip + 24;
+}
+
+// Writes the headers of an MLD message of mld_len bytes, with a hop-by-hop
+// Router Alert, and returns the MLD message.
+static uint8_t *mld_frame(uint8_t *frame, size_t mld_len) {
+  memset(frame, 0, 14 + 40 + 8 + mld_len);
+  frame[12] = ETHERTYPE_IPV6 >> 8;
+  frame[13] = ETHERTYPE_IPV6 & 0xFF;
+  uint8_t *ip6 = frame + 14;
+  ip6[0] = 0x60;
+  ip6[5] = (uint8_t)(8 + mld_len);
+  ip6[6] = 0; // hop-by-hop
+  ip6[7] = 1;
+  uint8_t *hbh = ip6 + 40;
+  hbh[0] = IPPROTO_ICMPV6;
+  hbh[2] = 5;
+  hbh[3] = 2;
+  return hbh + 8;
+}
+
+static void test_igmp(void) {
+  uint8_t frame[128];
+  struct mcast_change changes[MCAST_REPORT_MAX];
+  uint8_t *igmp = igmp_frame(frame, 8);
+  const uint8_t group[4] = {239, 1, 2, 3};
+  igmp[0] = 0x16; // v2 report
+  memcpy(igmp + 4, group, 4);
+  size_t len = 14 + 24 + 8;
+  CHECK(mcast_parse_report(frame, len, changes) == 1);
+  CHECK(memcmp(changes[0].mac, group1_mac, 6) == 0 && changes[0].join);
+  igmp[0] = 0x17; // leave
+  CHECK(mcast_parse_report(frame, len, changes) == 1);
+  CHECK(!changes[0].join);
+  // mDNS is flooded anyway.
+  const uint8_t mdns[4] = {224, 0, 0, 251};
+  igmp[0] = 0x16;
+  memcpy(igmp + 4, mdns, 4);
+  CHECK(mcast_parse_report(frame, len, changes) == 0);
+
+  // v3: a join, a leave, and a record claiming more sources than the frame has
+  igmp = igmp_frame(frame, 8 + 3 * 8);
+  igmp[0] = 0x22;
+  igmp[7] = 3;
+  uint8_t *rec = igmp + 8;
+  const uint8_t records[2][8] = {
+      {2, 0, 0, 0, 239, 1, 2, 3}, // IS_EXCLUDE {}
+      {3, 0, 0, 0, 239, 1, 2, 4}, // TO_INCLUDE {}
+  };
+  memcpy(rec, records, sizeof(records));
+  const uint8_t overrun[8] = {5, 0, 0, 9, 239, 1, 2, 5}; // ALLOW, 9 sources
+  memcpy(rec + 16, overrun, 8);
+  len = 14 + 24 + 8 + 3 * 8;
+  CHECK(mcast_parse_report(frame, len, changes) == 2);
+  CHECK(memcmp(changes[0].mac, group1_mac, 6) == 0 && changes[0].join);
+  CHECK(changes[1].mac[5] == 4 && !changes[1].join);
+}
+
+static void test_mld(void) {
+  uint8_t frame[128];
+  struct mcast_change changes[MCAST_REPORT_MAX];
+  uint8_t *mld = mld_frame(frame, 8 + 20);
+  const uint8_t group[16] = {0xFF, 0x05, [13] = 0x01, [15] = 0x03};
+  mld[0] = 143; // v2 report
+  mld[7] = 1;
+  mld[8] = 4; // TO_EXCLUDE {}
+  memcpy(mld + 12, group, 16);
+  size_t len = 14 + 40 + 8 + 8 + 20;
+  CHECK(mcast_parse_report(frame, len, changes) == 1);
+  CHECK(memcmp(changes[0].mac, group2_mac, 6) == 0 && changes[0].join);
+  // All nodes is flooded anyway.
+  const uint8_t all_nodes[16] = {0xFF, 0x02, [15] = 0x01};
+  memcpy(mld + 12, all_nodes, 16);
+  CHECK(mcast_parse_report(frame, len, changes) == 0);
+
+  mld = mld_frame(frame, 24);
+  mld[0] = 132; // v1 done
+  memcpy(mld + 8, group, 16);
+  len = 14 + 40 + 8 + 24;
+  CHECK(mcast_parse_report(frame, len, changes) == 1);
+  CHECK(memcmp(changes[0].mac, group2_mac, 6) == 0 && !changes[0].join);
+  // A hop-by-hop header overrunning the frame
+  frame[14 + 40 + 1] = 200;
+  CHECK(mcast_parse_report(frame, len, changes) == 0);
+}
+
+// No prefix of a report is parsed past its end.
+static void test_truncated(void) {
+  uint8_t igmp[128], mld[128];
+  struct mcast_change changes[MCAST_REPORT_MAX];
+  uint8_t *p = igmp_frame(igmp, 8 + 8);
+  p[0] = 0x22;
+  p[7] = 1;
+  p[8] = 2;
+  p[12] = 239;
+  p[13] = 1;
+  p[15] = 1;
+  p = mld_frame(mld, 8 + 20);
+  p[0] = 143;
+  p[7] = 1;
+  p[8] = 2;
+  p[12] = 0xFF;
+  p[13] = 0x05;
+  p[25] = 1;
+  p[27] = 1;
+  for (size_t len = 0; len < 14 + 24 + 8 + 8; len++)
+    CHECK(mcast_parse_report(igmp, len, changes) == 0);
+  for (size_t len = 0; len < 14 + 40 + 8 + 8 + 20; len++)
+    CHECK(mcast_parse_report(mld, len, changes) == 0);
+  CHECK(mcast_parse_report(igmp, 14 + 24 + 8 + 8, changes) == 1);
+  CHECK(mcast_parse_report(mld, 14 + 40 + 8 + 8 + 20, changes) == 1);
+}
+
+static void test_query(void) {
+  uint8_t frame[MCAST_QUERY_MAX_LEN];
+  struct mcast_change changes[MCAST_REPORT_MAX];
+  size_t len = mcast_build_query(false, frame);
+  CHECK(len == 60);
+  const uint8_t *ip = frame + 14;
+  size_t ihl = (size_t)(ip[0] & 0x0F) * 4;
+  CHECK(checksum(0, ip, ihl) == 0);
+  CHECK(checksum(0, ip + ihl, 12) == 0);
+  CHECK(mcast_parse_report(frame, len, changes) == 0);
+
+  len = mcast_build_query(true, frame);
+  CHECK(len == MCAST_QUERY_MAX_LEN);
+  const uint8_t *ip6 = frame + 14;
+  uint32_t sum = 28 + IPPROTO_ICMPV6;
+  for (size_t i = 8; i < 40; i += 2)
+    sum += (uint32_t)(ip6[i] << 8 | ip6[i + 1]);
+  CHECK(checksum(sum, ip6 + 48, 28) == 0);
+  CHECK(mcast_parse_report(frame, len, changes) == 0);
+}
+
+static void test_table(void) {
+  memset(&mcast, 0, sizeof(mcast));
+  CHECK(mcast_lookup(&mcast, 0, group1_mac) == NULL);
+  CHECK(mcast_join(&mcast, 0, group1_mac, &vm1));
+  CHECK(mcast_join(&mcast, 0, group1_mac, &vm1));
+  CHECK(mcast_join(&mcast, 0, group1_mac, &vm2));
+  CHECK(mcast_join(&mcast, 0, group2_mac, &vm2));
+  CHECK(mcast_join(&mcast, 10, group1_mac, &vm1));
+  CHECK(mcast.group_count == 3 && mcast.member_count == 4);
+  CHECK(mcast_lookup(&mcast, 0, group1_mac)->members == 2);
+  CHECK(mcast_is_member(&mcast, 0, group1_mac, &vm1));
+  CHECK(!mcast_is_member(&mcast, 0, group2_mac, &vm1));
+
+  mcast_leave(&mcast, 0, group1_mac, &vm1);
+  CHECK(!mcast_is_member(&mcast, 0, group1_mac, &vm1));
+  CHECK(mcast_lookup(&mcast, 0, group1_mac)->members == 1);
+  mcast_leave(&mcast, 0, group1_mac, &vm2);
+  CHECK(mcast_lookup(&mcast, 0, group1_mac) == NULL);
+  CHECK(mcast_lookup(&mcast, 10, group1_mac) != NULL);
+
+  mcast_forget(&mcast, &vm2);
+  mcast_forget(&mcast, &vm1);
+  CHECK(mcast.group_count == 0 && mcast.member_count == 0);
+}
+
+// Removing entries shifts the others back into their probe sequence; none of
+// them may get lost.
+static void test_forget(void) {
+  memset(&mcast, 0, sizeof(mcast));
+  const size_t n = MCAST_GROUP_CAPACITY / 4 * 3;
+  for (size_t i = 0; i < n; i++) {
+    const uint8_t mac[6] = {0x01, 0x00, 0x5E, 0x01, (uint8_t)(i >> 8), (uint8_t)i};
+    CHECK(mcast_join(&mcast, 0, mac, &vm1));
+    if (i % 2 == 0)
+      CHECK(mcast_join(&mcast, 0, mac, &vm2));
+  }
+  const uint8_t full[6] = {0x01, 0x00, 0x5E, 0x02, 0, 0};
+  CHECK(!mcast_join(&mcast, 0, full, &vm1));
+  mcast_forget(&mcast, &vm1);
+  for (size_t i = 0; i < n; i++) {
+    const uint8_t mac[6] = {0x01, 0x00, 0x5E, 0x01, (uint8_t)(i >> 8), (uint8_t)i};
+    CHECK(!mcast_is_member(&mcast, 0, mac, &vm1));
+    CHECK(mcast_is_member(&mcast, 0, mac, &vm2) == (i % 2 == 0));
+    CHECK((mcast_lookup(&mcast, 0, mac) != NULL) == (i % 2 == 0));
+  }
+  CHECK(mcast.group_count == (n + 1) / 2);
+}
+
+int main(void) {
+  RUN(test_igmp);
+  RUN(test_mld);
+  RUN(test_truncated);
+  RUN(test_query);
+  RUN(test_table);
+  RUN(test_forget);
+  return 0;
+}
@@ -0,0 +1,212 @@
+#include <string.h>
+
+#include <netinet/in.h>
+
+#include "../../ether.h"
+#include "../../neigh.h"
+#include "test.h"
+
+static struct neigh neigh;
+static char vm1, vm2;
+
+static const uint8_t vm1_mac[6] = {0x52, 0x55, 0, 0, 0, 1};
+static const uint8_t vm2_mac[6] = {0x52, 0x55, 0, 0, 0, 2};
+static const uint8_t vm1_ip[4] = {192, 168, 105, 2};
+static const uint8_t vm2_ip[4] = {192, 168, 105, 3};
+static const uint8_t vm1_ip6[16] = {0xFE, 0x80, [8] = 0x50, 0x55, 0, 0xFF, 0xFE, 0, 0, 1};
+static const uint8_t vm2_ip6[16] = {0xFE, 0x80, [8] = 0x50, 0x55, 0, 0xFF, 0xFE, 0, 0, 2};
+
+static void mapped(const uint8_t ip[4], uint8_t addr[16]) {
+  memset(addr, 0, 16);
+  addr[10] = 0xFF;
+  addr[11] = 0xFF;
+  memcpy(addr + 12, ip, 4);
+}
+
+// Writes a broadcast ARP request from vm1 for target, and returns its length.
+static size_t arp_request(uint8_t *frame, const uint8_t sender_ip[4], const uint8_t target[4]) {
+  memset(frame, 0, 60);
+  memset(frame, 0xFF, 6);
+  memcpy(frame + 6, vm1_mac, 6);
+  frame[12] = ETHERTYPE_ARP >> 8;
+  frame[13] = ETHERTYPE_ARP & 0xFF;
+  uint8_t *arp = frame + 14;
+  const uint8_t hdr[8] = {0, 1, 0x08, 0x00, 6, 4, 0, 1};
+  memcpy(arp, hdr, sizeof(hdr));
+  memcpy(arp + 8, vm1_mac, 6);
+  memcpy(arp + 14, sender_ip, 4);
+  memcpy(arp + 24, target, 4);
+  return 60;
+}
+
+// Writes a Neighbor Solicitation from vm1 for target, with its source
+// link-layer address, and returns its length.
+static size_t nd_solicit(uint8_t *frame, const uint8_t target[16]) {
+  memset(frame, 0, 14 + 40 + 32);
+  const uint8_t dst[6] = {0x33, 0x33, 0xFF, target[13], target[14], target[15]};
+  memcpy(frame, dst, 6);
+  memcpy(frame + 6, vm1_mac, 6);
+  frame[12] = ETHERTYPE_IPV6 >> 8;
+  frame[13] = ETHERTYPE_IPV6 & 0xFF;
+  uint8_t *ip6 = frame + 14;
+  ip6[0] = 0x60;
+  ip6[5] = 32;
+  ip6[6] = IPPROTO_ICMPV6;
+  ip6[7] = 255;
+  memcpy(ip6 + 8, vm1_ip6, 16);
+  uint8_t *nd = ip6 + 40;
+  nd[0] = 135;
+  memcpy(nd + 8, target, 16);
+  nd[24] = 1; // source link-layer address
+  nd[25] = 1;
+  memcpy(nd + 26, vm1_mac, 6);
+  return 14 + 40 + 32;
+}
+
+// Returns the ICMPv6 checksum of the message in an IPv6 frame, including its
+// own checksum field: 0 if valid.
+static uint16_t icmp6_verify(const uint8_t *frame) {
+  const uint8_t *ip6 = frame + 14;
+  size_t len = (size_t)(ip6[4] << 8 | ip6[5]);
+  uint32_t sum = (uint32_t)len + IPPROTO_ICMPV6;
+  for (size_t i = 8; i < 40; i += 2)
+    sum += (uint32_t)(ip6[i] << 8 | ip6[i + 1]);
+  for (size_t i = 0; i + 1 < len; i += 2)
+    sum += (uint32_t)(ip6[40 + i] << 8 | ip6[40 + i + 1]);
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  return (uint16_t)~sum;
+}
+
+static void test_arp(void) {
+  uint8_t frame[60], addr[16];
+  size_t len = arp_request(frame, vm1_ip, vm2_ip);
+  struct neigh_binding b;
+  CHECK(neigh_parse_binding(frame, len, &b));
+  mapped(vm1_ip, addr);
+  CHECK(memcmp(b.addr, addr, 16) == 0 && memcmp(b.mac, vm1_mac, 6) == 0);
+  struct neigh_query q;
+  CHECK(neigh_parse_query(frame, len, &q));
+  mapped(vm2_ip, addr);
+  CHECK(!q.nd && memcmp(q.target, addr, 16) == 0);
+
+  // The reply announces vm2 to vm1.
+  uint8_t reply[NEIGH_REPLY_MAX_LEN];
+  size_t reply_len = neigh_build_reply(&q, vm2_mac, reply);
+  CHECK(reply_len == 60);
+  CHECK(memcmp(reply, vm1_mac, 6) == 0 && memcmp(reply + 6, vm2_mac, 6) == 0);
+  CHECK(reply[14 + 7] == 2); // ARP reply
+  CHECK(memcmp(reply + 14 + 18, vm1_mac, 6) == 0 && memcmp(reply + 14 + 24, vm1_ip, 4) == 0);
+  CHECK(neigh_parse_binding(reply, reply_len, &b));
+  CHECK(memcmp(b.addr, addr, 16) == 0 && memcmp(b.mac, vm2_mac, 6) == 0);
+  CHECK(!neigh_parse_query(reply, reply_len, &q));
+
+  // Gratuitous ARP announces vm1 to everyone: not a query.
+  len = arp_request(frame, vm1_ip, vm1_ip);
+  CHECK(neigh_parse_binding(frame, len, &b));
+  CHECK(!neigh_parse_query(frame, len, &q));
+  // A probe for a duplicate address binds nothing, and must reach the VMs.
+  const uint8_t any[4] = {0};
+  len = arp_request(frame, any, vm1_ip);
+  CHECK(!neigh_parse_binding(frame, len, &b));
+  CHECK(!neigh_parse_query(frame, len, &q));
+  // A sender address that is not the source of the frame is not trusted.
+  len = arp_request(frame, vm1_ip, vm2_ip);
+  frame[11] = 9;
+  CHECK(!neigh_parse_binding(frame, len, &b));
+}
+
+static void test_nd(void) {
+  uint8_t frame[14 + 40 + 32];
+  size_t len = nd_solicit(frame, vm2_ip6);
+  struct neigh_binding b;
+  CHECK(neigh_parse_binding(frame, len, &b));
+  CHECK(memcmp(b.addr, vm1_ip6, 16) == 0 && memcmp(b.mac, vm1_mac, 6) == 0);
+  struct neigh_query q;
+  CHECK(neigh_parse_query(frame, len, &q));
+  CHECK(q.nd && memcmp(q.target, vm2_ip6, 16) == 0 && memcmp(q.requester_addr, vm1_ip6, 16) == 0);
+
+  // The advertisement announces vm2 to vm1, with a valid checksum.
+  uint8_t reply[NEIGH_REPLY_MAX_LEN];
+  size_t reply_len = neigh_build_reply(&q, vm2_mac, reply);
+  CHECK(reply_len == NEIGH_REPLY_MAX_LEN);
+  CHECK(memcmp(reply, vm1_mac, 6) == 0 && memcmp(reply + 6, vm2_mac, 6) == 0);
+  CHECK(icmp6_verify(reply) == 0);
+  CHECK(neigh_parse_binding(reply, reply_len, &b));
+  CHECK(memcmp(b.addr, vm2_ip6, 16) == 0 && memcmp(b.mac, vm2_mac, 6) == 0);
+  CHECK(!neigh_parse_query(reply, reply_len, &q));
+
+  // Duplicate address detection: from the unspecified address
+  len = nd_solicit(frame, vm1_ip6);
+  memset(frame + 14 + 8, 0, 16);
+  CHECK(!neigh_parse_binding(frame, len, &b));
+  CHECK(!neigh_parse_query(frame, len, &q));
+  // Forwarded by a router
+  len = nd_solicit(frame, vm2_ip6);
+  frame[14 + 7] = 64;
+  CHECK(!neigh_parse_binding(frame, len, &b));
+  CHECK(!neigh_parse_query(frame, len, &q));
+  // An option overrunning the message
+  len = nd_solicit(frame, vm2_ip6);
+  frame[14 + 40 + 25] = 2;
+  CHECK(!neigh_parse_binding(frame, len, &b));
+}
+
+// No prefix of a frame is parsed past its end.
+static void test_truncated(void) {
+  uint8_t arp[60], nd[14 + 40 + 32];
+  size_t arp_len = arp_request(arp, vm1_ip, vm2_ip);
+  size_t nd_len = nd_solicit(nd, vm2_ip6);
+  struct neigh_binding b;
+  struct neigh_query q;
+  for (size_t len = 0; len < 14 + 28; len++) {
+    CHECK(!neigh_parse_binding(arp, len, &b));
+    CHECK(!neigh_parse_query(arp, len, &q));
+  }
+  for (size_t len = 0; len < nd_len; len++) {
+    CHECK(!neigh_parse_binding(nd, len, &b));
+    CHECK(!neigh_parse_query(nd, len, &q));
+  }
+  CHECK(neigh_parse_query(arp, arp_len, &q));
+}
+
+static void test_table(void) {
+  memset(&neigh, 0, sizeof(neigh));
+  struct neigh_binding b1 = {.mac = {0x52, 0x55, 0, 0, 0, 1}};
+  struct neigh_binding b2 = {.mac = {0x52, 0x55, 0, 0, 0, 2}};
+  mapped(vm1_ip, b1.addr);
+  memcpy(b2.addr, vm2_ip6, 16);
+  uint64_t now = 1000;
+  CHECK(neigh_should_learn(&neigh, 0, &b1, &vm1, now));
+  CHECK(neigh_learn(&neigh, 0, &b1, &vm1, now));
+  CHECK(neigh_learn(&neigh, 0, &b2, &vm2, now));
+  CHECK(!neigh_should_learn(&neigh, 0, &b1, &vm1, now + 1));
+  CHECK(neigh_should_learn(&neigh, 0, &b1, &vm2, now + 1));
+  CHECK(neigh_should_learn(&neigh, 0, &b1, &vm1, now + NEIGH_TTL_NS / 2));
+  const struct neigh_entry *e = neigh_lookup(&neigh, 0, b1.addr, now);
+  CHECK(e != NULL && e->owner == &vm1 && memcmp(e->mac, b1.mac, 6) == 0);
+  CHECK(neigh_lookup(&neigh, 10, b1.addr, now) == NULL);
+  // Expired, but still in the table until its VM leaves
+  CHECK(neigh_lookup(&neigh, 0, b1.addr, now + NEIGH_TTL_NS + 1) == NULL);
+  CHECK(neigh.count == 2);
+
+  // vm1 is restored under another owner, then adopted back.
+  neigh_adopt(&neigh, 0, b1.mac, &vm1, &vm2);
+  CHECK(neigh_lookup(&neigh, 0, b1.addr, now)->owner == &vm2);
+  neigh_adopt(&neigh, 0, b1.mac, &vm2, &vm1);
+  CHECK(neigh_lookup(&neigh, 0, b1.addr, now)->owner == &vm1);
+  CHECK(neigh_lookup(&neigh, 0, b2.addr, now)->owner == &vm2);
+
+  neigh_forget(&neigh, &vm1);
+  CHECK(neigh_lookup(&neigh, 0, b1.addr, now) == NULL);
+  CHECK(neigh_lookup(&neigh, 0, b2.addr, now) != NULL);
+  CHECK(neigh.count == 1);
+}
+
+int main(void) {
+  RUN(test_arp);
+  RUN(test_nd);
+  RUN(test_truncated);
+  RUN(test_table);
+  return 0;
+}
@@ -0,0 +1,159 @@
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+
+#include "../../ether.h"
+#include "../../rss.h"
+#include "test.h"
+
+#define QUEUES 4
+#define FLOWS 16
+#define FRAMES_PER_FLOW 200
+#define FRAME_LEN 64
+
+// Writes an untagged UDP/IPv4 frame of flow, carrying seq, and returns its
+// length. With vlan, the frame is tagged.
+static size_t udp_frame(uint8_t *frame, uint16_t flow, uint32_t seq, uint16_t vlan) {
+  memset(frame, 0, FRAME_LEN + 4);
+  size_t off = 12;
+  if (vlan != 0) {
+    frame[off++] = ETHERTYPE_VLAN >> 8;
+    frame[off++] = ETHERTYPE_VLAN & 0xFF;
+    frame[off++] = (uint8_t)(vlan >> 8);
+    frame[off++] = (uint8_t)vlan;
+  }
+  frame[off++] = ETHERTYPE_IP >> 8;
+  frame[off++] = ETHERTYPE_IP & 0xFF;
+  uint8_t *ip = frame + off;
+  const uint8_t addrs[8] = {192, 168, 105, 2, 192, 168, 105, 3};
+  ip[0] = 0x45;
+  ip[3] = FRAME_LEN - 14;
+  ip[8] = 64;
+  ip[9] = IPPROTO_UDP;
+  memcpy(ip + 12, addrs, sizeof(addrs));
+  uint8_t *udp = ip + 20;
+  udp[0] = (uint8_t)((40000 + flow) >> 8);
+  udp[1] = (uint8_t)(40000 + flow);
+  udp[3] = 53;
+  memcpy(udp + 8, &flow, sizeof(flow));
+  memcpy(udp + 10, &seq, sizeof(seq));
+  return FRAME_LEN + (vlan != 0 ? 4 : 0);
+}
+
+static void test_hash(void) {
+  uint8_t a[FRAME_LEN + 4], b[FRAME_LEN + 4];
+  size_t a_len = udp_frame(a, 1, 0, 0);
+  size_t b_len = udp_frame(b, 1, 1, 0);
+  // The payload is not part of the flow.
+  CHECK(rss_hash(a, a_len) == rss_hash(b, b_len));
+  // Nor is the VLAN tag.
+  b_len = udp_frame(b, 1, 0, 10);
+  CHECK(rss_hash(a, a_len) == rss_hash(b, b_len));
+  b_len = udp_frame(b, 2, 0, 0);
+  CHECK(rss_hash(a, a_len) != rss_hash(b, b_len));
+
+  // Fragments are hashed without the ports, which only the first one carries.
+  a[14 + 6] = 0x20; // more fragments
+  b[14 + 6] = 0x20;
+  CHECK(rss_hash(a, a_len) == rss_hash(b, b_len));
+  b[14 + 6] = 0;
+  b[14 + 7] = 8; // offset
+  memset(b + 14 + 20, 0xAA, 8);
+  CHECK(rss_hash(a, a_len) == rss_hash(b, b_len));
+
+  // Other frames by destination
+  uint8_t arp[60] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x52, 0x55, 0, 0, 0, 1, 0x08, 0x06};
+  uint32_t h = rss_hash(arp, sizeof(arp));
+  arp[11] = 2;
+  CHECK(rss_hash(arp, sizeof(arp)) == h);
+
+  // Truncated frames are hashed on what they have.
+  udp_frame(a, 1, 0, 0);
+  for (size_t len = 14; len < a_len; len++)
+    rss_hash(a, len);
+}
+
+// The flows spread over the queues, in order within each flow.
+static struct {
+  pthread_mutex_t lock;
+  uint32_t next[FLOWS];
+  pthread_t worker[FLOWS];
+  size_t delivered;
+  bool out_of_order;
+} flows = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void deliver(void *ctx, uint8_t *frame, size_t len, uint64_t read_ns) {
+  (void)ctx;
+  uint16_t flow;
+  uint32_t seq;
+  CHECK(len == FRAME_LEN && read_ns == 42);
+  memcpy(&flow, frame + 14 + 20 + 8, sizeof(flow));
+  memcpy(&seq, frame + 14 + 20 + 10, sizeof(seq));
+  CHECK(flow < FLOWS);
+  pthread_mutex_lock(&flows.lock);
+  if (seq != flows.next[flow])
+    flows.out_of_order = true;
+  if (seq == 0)
+    flows.worker[flow] = pthread_self();
+  else if (!pthread_equal(flows.worker[flow], pthread_self()))
+    flows.out_of_order = true;
+  flows.next[flow] = seq + 1;
+  flows.delivered++;
+  pthread_mutex_unlock(&flows.lock);
+}
+
+static size_t delivered(void) {
+  pthread_mutex_lock(&flows.lock);
+  size_t n = flows.delivered;
+  pthread_mutex_unlock(&flows.lock);
+  return n;
+}
+
+static void test_queues(void) {
+  struct rss *r = rss_create(QUEUES, FRAME_LEN, deliver, NULL);
+  CHECK(r != NULL);
+  CHECK(rss_queue_count(r) == QUEUES);
+  uint8_t frame[FRAME_LEN + 4];
+  for (uint32_t seq = 0; seq < FRAMES_PER_FLOW; seq++) {
+    for (uint16_t flow = 0; flow < FLOWS; flow++)
+      CHECK(rss_enqueue(r, frame, udp_frame(frame, flow, seq, 0), 42));
+    rss_flush(r);
+  }
+  // Frames larger than announced are dropped.
+  CHECK(!rss_enqueue(r, frame, FRAME_LEN + 1, 42));
+
+  // Everything queued so far is delivered by rss_pause; nothing afterwards.
+  rss_pause(r);
+  CHECK(delivered() == FLOWS * FRAMES_PER_FLOW);
+  for (uint16_t flow = 0; flow < FLOWS; flow++)
+    CHECK(rss_enqueue(r, frame, udp_frame(frame, flow, FRAMES_PER_FLOW, 0), 42));
+  rss_flush(r);
+  usleep(50 * 1000);
+  CHECK(delivered() == FLOWS * FRAMES_PER_FLOW);
+  rss_resume(r);
+  while (delivered() < FLOWS * (FRAMES_PER_FLOW + 1))
+    usleep(1000);
+  CHECK(!flows.out_of_order);
+
+  unsigned busy = 0;
+  uint64_t frames = 0;
+  for (unsigned i = 0; i < QUEUES; i++) {
+    struct rss_queue_stats stats;
+    rss_queue_stats(r, i, true, &stats);
+    CHECK(stats.dropped == 0);
+    frames += stats.frames;
+    if (stats.frames > 0)
+      busy++;
+  }
+  CHECK(frames == FLOWS * (FRAMES_PER_FLOW + 1));
+  CHECK(busy > 1);
+  rss_stop(r);
+}
+
+int main(void) {
+  RUN(test_hash);
+  RUN(test_queues);
+  return 0;
+}
@@ -0,0 +1,4 @@
+#include <stdbool.h>
+
+// See log.h; main.c defines it for socket_vmnet.
+bool debug = false;
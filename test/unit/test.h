@@ -0,0 +1,26 @@
+#ifndef SOCKET_VMNET_TEST_UNIT_TEST_H
+#define SOCKET_VMNET_TEST_UNIT_TEST_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Unit tests of the modules that do not need vmnet, run by `make test.unit`.
+// Every test is a program of its own, which exits with a failure at the first
+// check that does not hold.
+
+#define CHECK(cond)                                                                                \
+  do {                                                                                             \
+    if (!(cond)) {                                                                                 \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond);                     \
+      exit(EXIT_FAILURE);                                                                          \
+    }                                                                                              \
+  } while (0)
+
+#define RUN(test)                                                                                  \
+  do {                                                                                             \
+    test();                                                                                        \
+    printf("ok   %s\n", #test);                                                                    \
+  } while (0)
+
+#endif /* SOCKET_VMNET_TEST_UNIT_TEST_H */
@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../trace.h"
+#include "test.h"
+
+static char path[] = "/tmp/socket_vmnet_trace_test.XXXXXX";
+
+// The trace file, aligned for its records
+static uint64_t trace[64 * 1024 / sizeof(uint64_t)];
+static size_t trace_len;
+
+static void read_file(void) {
+  FILE *fp = fopen(path, "rb");
+  CHECK(fp != NULL);
+  trace_len = fread(trace, 1, sizeof(trace), fp);
+  fclose(fp);
+}
+
+static void test_parse_options(void) {
+  struct trace_options opts;
+  char *ok[] = {"/tmp/a.trace", "size=1G", "snaplen=128"};
+  CHECK(trace_parse_options(&opts, 3, ok) == 0);
+  CHECK(strcmp(opts.path, "/tmp/a.trace") == 0);
+  CHECK(opts.size == 1024 * 1024 * 1024 && opts.snaplen == 128);
+  CHECK(trace_parse_options(&opts, 1, ok) == 0);
+  CHECK(opts.size == TRACE_DEFAULT_SIZE && opts.snaplen == 0);
+
+  CHECK(trace_parse_options(&opts, 0, NULL) < 0);
+  char *bad[] = {"size=1T", "size=16", "size=1KB", "size=", "snaplen=0", "color=red"};
+  for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+    char *argv[] = {"/tmp/a.trace", bad[i]};
+    CHECK(trace_parse_options(&opts, 2, argv) < 0);
+  }
+}
+
+static void test_record(void) {
+  struct trace_stats stats;
+  CHECK(trace_stop(&stats) < 0);
+  struct trace_options opts = {.path = path, .size = 1024, .snaplen = 100};
+  CHECK(trace_start(&opts) == 0);
+  CHECK(trace_start(&opts) < 0);
+  uint8_t frame[200];
+  for (size_t i = 0; i < sizeof(frame); i++)
+    frame[i] = (uint8_t)i;
+  trace_frame(TRACE_SOURCE_VMNET, 0, frame, 60);
+  trace_frame(7, 10, frame, 200);
+  // Fills the file: dropped
+  for (int i = 0; i < 8; i++)
+    trace_frame(7, 10, frame, 200);
+  CHECK(trace_stop(&stats) == 0);
+  trace_frame(TRACE_SOURCE_VMNET, 0, frame, 60);
+
+  read_file();
+  const struct trace_header *h = (const struct trace_header *)trace;
+  CHECK(h->magic == TRACE_MAGIC && h->version == TRACE_VERSION);
+  CHECK(h->records == stats.records && h->dropped == stats.dropped);
+  CHECK(h->end == stats.bytes && trace_len == stats.bytes);
+  CHECK(stats.records + stats.dropped == 10 && stats.dropped > 0);
+
+  uint64_t off = sizeof(*h);
+  bool invalid;
+  const struct trace_record *rec = trace_next(trace, &off, 1514, &invalid);
+  CHECK(rec != NULL && !invalid);
+  CHECK(rec->source == TRACE_SOURCE_VMNET && rec->len == 60 && rec->caplen == 60);
+  CHECK(memcmp(rec + 1, frame, 60) == 0);
+  uint64_t records = 1;
+  while ((rec = trace_next(trace, &off, 1514, &invalid)) != NULL) {
+    CHECK(!invalid);
+    CHECK(rec->source == 7 && rec->vlan == 10 && rec->len == 200 && rec->caplen == 100);
+    CHECK(memcmp(rec + 1, frame, 100) == 0);
+    records++;
+  }
+  CHECK(!invalid && records == stats.records && off == h->end);
+}
+
+// Writes a trace of three records of 60 bytes, and returns its header.
+static struct trace_header *make_trace(void) {
+  memset(trace, 0, sizeof(trace));
+  struct trace_header *h = (struct trace_header *)trace;
+  *h = (struct trace_header){.magic = TRACE_MAGIC, .version = TRACE_VERSION, .records = 3};
+  uint64_t off = sizeof(*h);
+  for (uint32_t i = 0; i < 3; i++) {
+    struct trace_record *rec = (struct trace_record *)((uint8_t *)trace + off);
+    *rec = (struct trace_record){.time_ns = i, .source = 1, .len = 60, .caplen = 60};
+    off += TRACE_RECORD_SIZE(60);
+  }
+  h->end = off;
+  return h;
+}
+
+// Returns the record i of make_trace.
+static struct trace_record *record(uint32_t i) {
+  return (struct trace_record *)((uint8_t *)trace + sizeof(struct trace_header) +
+                                 i * TRACE_RECORD_SIZE(60));
+}
+
+static void test_corrupted(void) {
+  // Larger than a frame, or than captured: skipped
+  make_trace();
+  record(1)->len = 100000;
+  record(2)->caplen = 50;
+  record(2)->len = 40;
+  uint64_t off = sizeof(struct trace_header);
+  bool invalid;
+  CHECK(trace_next(trace, &off, 1514, &invalid) == record(0) && !invalid);
+  CHECK(trace_next(trace, &off, 1514, &invalid) == record(1) && invalid);
+  CHECK(trace_next(trace, &off, 1514, &invalid) == record(2) && invalid);
+  CHECK(trace_next(trace, &off, 1514, &invalid) == NULL && !invalid);
+
+  // Overrunning the end: the rest is lost
+  make_trace();
+  record(1)->caplen = UINT32_MAX;
+  off = sizeof(struct trace_header);
+  CHECK(trace_next(trace, &off, 1514, &invalid) == record(0) && !invalid);
+  CHECK(trace_next(trace, &off, 1514, &invalid) == NULL && invalid);
+
+  // Cut in the middle of a record header
+  struct trace_header *h = make_trace();
+  h->end -= TRACE_RECORD_SIZE(60) - 8;
+  off = sizeof(struct trace_header);
+  CHECK(trace_next(trace, &off, 1514, &invalid) == record(0) && !invalid);
+  CHECK(trace_next(trace, &off, 1514, &invalid) == record(1) && !invalid);
+  CHECK(trace_next(trace, &off, 1514, &invalid) == NULL && !invalid);
+}
+
+int main(void) {
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  close(fd);
+  RUN(test_parse_options);
+  RUN(test_record);
+  RUN(test_corrupted);
+  unlink(path);
+  return 0;
+}
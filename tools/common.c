@@ -0,0 +1,74 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common.h"
+
+int write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int read_all(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int connect_socket(const char *socket_path) {
+  struct sockaddr_un addr = {0};
+  int fd = socket(PF_LOCAL, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  addr.sun_family = PF_LOCAL;
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "Failed to connect to \"%s\": %s\n", socket_path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int write_frame(int fd, const uint8_t *frame, size_t len) {
+  if (len > MAX_FRAME_LEN) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  uint32_t header_be = htonl(len);
+  uint8_t buf[4 + MAX_FRAME_LEN];
+  memcpy(buf, &header_be, 4);
+  memcpy(buf + 4, frame, len);
+  return write_all(fd, buf, 4 + len);
+}
+
+void print_latency(const char *label, struct hist *h) {
+  struct hist_summary s;
+  hist_summarize(h, &s);
+  printf("%-10sp50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n", label, s.p50 / 1e3,
+         s.p90 / 1e3, s.p99 / 1e3, s.max / 1e3);
+}
@@ -0,0 +1,28 @@
+#ifndef SOCKET_VMNET_TOOLS_COMMON_H
+#define SOCKET_VMNET_TOOLS_COMMON_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../hist.h"
+
+// Helpers of socket_vmnet_bench and socket_vmnet_replay, which connect to
+// socket_vmnet like VMs do. The latencies are recorded in a struct hist, as in
+// the daemon.
+
+#define MAX_FRAME_LEN (64 * 1024)
+
+// Returns -1 on an error, or at the end of the stream for read_all.
+int write_all(int fd, const void *buf, size_t len);
+int read_all(int fd, void *buf, size_t len);
+
+// Connects to the socket of socket_vmnet, and prints the error if any.
+int connect_socket(const char *socket_path);
+
+// Writes frame with its uint32be length header, in a single write.
+int write_frame(int fd, const uint8_t *frame, size_t len);
+
+// Prints the percentiles of h in microseconds, after label, e.g., "latency:".
+void print_latency(const char *label, struct hist *h);
+
+#endif /* SOCKET_VMNET_TOOLS_COMMON_H */
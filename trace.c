@@ -0,0 +1,199 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "trace.h"
+
+struct trace {
+  int fd;
+  uint8_t *base; // the mapping of the whole file
+  size_t size;
+  uint32_t snaplen;
+  uint64_t start_ns; // CLOCK_MONOTONIC
+  _Atomic uint64_t used; // offset of the next record
+  _Atomic uint64_t records;
+  _Atomic uint64_t dropped;
+};
+
+struct trace *_Atomic trace_active;
+// Producers between their check of trace_active and the end of their copy
+static _Atomic int trace_users;
+
+static uint64_t trace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_frame_slow(uint32_t source, uint16_t vlan, const void *frame, size_t len) {
+  atomic_fetch_add(&trace_users, 1);
+  struct trace *tr = atomic_load(&trace_active);
+  if (tr == NULL)
+    goto done;
+  uint32_t caplen = tr->snaplen > 0 && len > tr->snaplen ? tr->snaplen : (uint32_t)len;
+  size_t size = TRACE_RECORD_SIZE(caplen);
+  uint64_t off = atomic_load_explicit(&tr->used, memory_order_relaxed);
+  do {
+    if (off + size > tr->size) {
+      atomic_fetch_add_explicit(&tr->dropped, 1, memory_order_relaxed);
+      goto done;
+    }
+  } while (!atomic_compare_exchange_weak_explicit(&tr->used, &off, off + size,
+                                                  memory_order_relaxed, memory_order_relaxed));
+  struct trace_record *rec = (struct trace_record *)(tr->base + off);
+  *rec = (struct trace_record){
+      .time_ns = trace_now() - tr->start_ns,
+      .source = source,
+      .vlan = vlan,
+      .len = (uint32_t)len,
+      .caplen = caplen,
+  };
+  memcpy(rec + 1, frame, caplen);
+  atomic_fetch_add_explicit(&tr->records, 1, memory_order_relaxed);
+done:
+  atomic_fetch_sub(&trace_users, 1);
+}
+
+// Parses a size in bytes, with an optional K, M, or G suffix.
+static int parse_size(const char *s, size_t *v) {
+  char *end = NULL;
+  errno = 0;
+  unsigned long long n = strtoull(s, &end, 10);
+  if (errno != 0 || end == s)
+    return -1;
+  int shift = 0;
+  switch (*end) {
+  case 'K':
+    shift = 10;
+    break;
+  case 'M':
+    shift = 20;
+    break;
+  case 'G':
+    shift = 30;
+    break;
+  case '\0':
+    break;
+  default:
+    return -1;
+  }
+  if (shift > 0 && *++end != '\0')
+    return -1;
+  if (n > (SIZE_MAX >> shift))
+    return -1;
+  *v = (size_t)n << shift;
+  return 0;
+}
+
+int trace_parse_options(struct trace_options *opts, int argc, char *argv[]) {
+  memset(opts, 0, sizeof(*opts));
+  opts->size = TRACE_DEFAULT_SIZE;
+  if (argc < 1)
+    return -1;
+  opts->path = argv[0];
+  for (int i = 1; i < argc; i++) {
+    size_t v;
+    if (strncmp(argv[i], "size=", 5) == 0 && parse_size(argv[i] + 5, &v) == 0 &&
+        v > sizeof(struct trace_header)) {
+      opts->size = v;
+    } else if (strncmp(argv[i], "snaplen=", 8) == 0 && parse_size(argv[i] + 8, &v) == 0 &&
+               v > 0 && v <= UINT32_MAX) {
+      opts->snaplen = (uint32_t)v;
+    } else {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int trace_start(const struct trace_options *opts) {
+  if (atomic_load(&trace_active) != NULL) {
+    ERROR("trace: already running");
+    return -1;
+  }
+  struct trace *tr = calloc(1, sizeof(*tr));
+  if (tr == NULL) {
+    ERRORN("calloc");
+    return -1;
+  }
+  tr->size = opts->size;
+  tr->snaplen = opts->snaplen;
+  tr->fd = open(opts->path, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (tr->fd < 0) {
+    ERRORF("trace: failed to open \"%s\": %s", opts->path, strerror(errno));
+    goto err;
+  }
+  // Allocate every block now: the forwarding threads write through the
+  // mapping, and a page that the volume has no room for would kill them with
+  // SIGBUS.
+  fstore_t store = {
+      .fst_flags = F_ALLOCATECONTIG | F_ALLOCATEALL,
+      .fst_posmode = F_PEOFPOSMODE,
+      .fst_length = (off_t)tr->size,
+  };
+  if (fcntl(tr->fd, F_PREALLOCATE, &store) < 0) {
+    store.fst_flags = F_ALLOCATEALL;
+    if (fcntl(tr->fd, F_PREALLOCATE, &store) < 0) {
+      ERRORF("trace: failed to allocate %zu bytes for \"%s\": %s", tr->size, opts->path,
+             strerror(errno));
+      goto err;
+    }
+  }
+  if (ftruncate(tr->fd, (off_t)tr->size) < 0) {
+    ERRORN("trace: ftruncate");
+    goto err;
+  }
+  tr->base = mmap(NULL, tr->size, PROT_READ | PROT_WRITE, MAP_SHARED, tr->fd, 0);
+  if (tr->base == MAP_FAILED) {
+    tr->base = NULL;
+    ERRORN("trace: mmap");
+    goto err;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  *(struct trace_header *)tr->base = (struct trace_header){
+      .magic = TRACE_MAGIC,
+      .version = TRACE_VERSION,
+      .start_unix_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec,
+  };
+  tr->start_ns = trace_now();
+  atomic_init(&tr->used, sizeof(struct trace_header));
+  atomic_store(&trace_active, tr);
+  INFOF("trace: recording to \"%s\" (%zu bytes, snaplen %u)", opts->path, tr->size, tr->snaplen);
+  return 0;
+err:
+  if (tr->fd >= 0)
+    close(tr->fd);
+  free(tr);
+  return -1;
+}
+
+int trace_stop(struct trace_stats *stats) {
+  struct trace *tr = atomic_exchange(&trace_active, NULL);
+  if (tr == NULL)
+    return -1;
+  // Wait for the producers that saw tr; later ones see NULL.
+  while (atomic_load(&trace_users) > 0)
+    sched_yield();
+  struct trace_header *h = (struct trace_header *)tr->base;
+  h->end = atomic_load(&tr->used);
+  h->records = atomic_load(&tr->records);
+  h->dropped = atomic_load(&tr->dropped);
+  *stats = (struct trace_stats){.records = h->records, .dropped = h->dropped, .bytes = h->end};
+  if (msync(tr->base, h->end, MS_SYNC) < 0)
+    ERRORN("trace: msync");
+  munmap(tr->base, tr->size);
+  if (ftruncate(tr->fd, (off_t)stats->bytes) < 0)
+    ERRORN("trace: ftruncate");
+  close(tr->fd);
+  free(tr);
+  INFOF("trace: stopped, %llu frames recorded, %llu dropped", stats->records, stats->dropped);
+  return 0;
+}
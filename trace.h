@@ -0,0 +1,107 @@
+#ifndef SOCKET_VMNET_TRACE_H
+#define SOCKET_VMNET_TRACE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// On-demand traffic trace, for socket_vmnet_replay: the frames forwarded, with
+// their source and the time they were read, in a memory-mapped file of a
+// fixed size. Unlike a capture (capture.h), there is no writer thread: the
+// forwarding threads reserve their record with an atomic add, and copy the
+// frame into the mapping. The blocks of the file are allocated up front, so a
+// full volume fails trace_start instead of the copies. When the file is full,
+// the frames are dropped from the trace. When no trace is running, trace_frame
+// costs a single relaxed load.
+
+#define TRACE_MAGIC 0x52545653 // "SVTR"
+#define TRACE_VERSION 1
+#define TRACE_DEFAULT_SIZE (256 * 1024 * 1024)
+
+// trace_record source for the frames read from vmnet; connections use their
+// own nonzero id.
+#define TRACE_SOURCE_VMNET 0
+
+// The file starts with this header, in host byte order, followed by the
+// records up to end.
+struct trace_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t start_unix_ns; // wall clock time of the start of the trace
+  uint64_t end;           // offset of the end of the last record, set when stopped
+  uint64_t records;
+  uint64_t dropped; // the file was full
+};
+
+// A frame, followed by its first caplen bytes, padded to TRACE_ALIGN
+struct trace_record {
+  uint64_t time_ns; // since the start of the trace
+  uint32_t source;
+  uint16_t vlan;
+  uint16_t reserved;
+  uint32_t len;
+  uint32_t caplen;
+};
+
+#define TRACE_ALIGN 8
+#define TRACE_RECORD_SIZE(caplen)                                                                  \
+  ((sizeof(struct trace_record) + (caplen) + TRACE_ALIGN - 1) & ~(size_t)(TRACE_ALIGN - 1))
+
+// Returns the record at *off in the trace at base, and moves *off to the next
+// one, or returns NULL at the end of the records. A record overrunning them
+// ends the trace, and sets *invalid; so does a record larger than max_len, or
+// longer than its frame, which is returned for the caller to skip it.
+static inline const struct trace_record *trace_next(const void *base, uint64_t *off,
+                                                    size_t max_len, bool *invalid) {
+  const struct trace_header *h = (const struct trace_header *)base;
+  *invalid = false;
+  if (*off + sizeof(struct trace_record) > h->end)
+    return NULL;
+  const struct trace_record *rec = (const struct trace_record *)((const uint8_t *)base + *off);
+  *off += TRACE_RECORD_SIZE(rec->caplen);
+  if (*off > h->end) {
+    *invalid = true;
+    return NULL;
+  }
+  *invalid = rec->len > max_len || rec->caplen > rec->len;
+  return rec;
+}
+
+struct trace_options {
+  const char *path;
+  size_t size;      // of the file
+  uint32_t snaplen; // 0 for the whole frames
+};
+
+struct trace_stats {
+  uint64_t records;
+  uint64_t dropped;
+  uint64_t bytes; // of the file
+};
+
+struct trace;
+extern struct trace *_Atomic trace_active;
+
+void trace_frame_slow(uint32_t source, uint16_t vlan, const void *frame, size_t len);
+
+// Records a frame read from source on vlan. Takes no lock, but the copy may
+// fault in a page of the file.
+static inline void trace_frame(uint32_t source, uint16_t vlan, const void *frame, size_t len) {
+  if (atomic_load_explicit(&trace_active, memory_order_relaxed) != NULL)
+    trace_frame_slow(source, vlan, frame, len);
+}
+
+// Parses the arguments of "trace start", e.g., {"/tmp/a.trace", "size=1G"}.
+// Returns -1 on an invalid argument.
+int trace_parse_options(struct trace_options *opts, int argc, char *argv[]);
+
+// Creates opts->path and starts recording to it. Only one trace runs at a
+// time.
+int trace_start(const struct trace_options *opts);
+
+// Stops the trace, and truncates the file to the records. Returns -1 if no
+// trace is running.
+int trace_stop(struct trace_stats *stats);
+
+#endif /* SOCKET_VMNET_TRACE_H */